@@ -0,0 +1,391 @@
+/**
+ * @file BenchmarkKernels.cpp
+ * @brief プラグインの重い処理のマイクロベンチマーク（ブロック転送・画素変換・拡大縮小・バッファプール・BMP 入出力・テンプレートの置換・ヒストリーの解析・ログ）
+ *
+ * プラグイン本体（ComfyUIPlugin.cpp）をリンクし、内部の関数（ImageBuffer や CopyImageToRgba など）は ComfyUIPluginInternal.h の宣言で呼ぶ。
+ * 結果は JSON で出力する。2つの結果の比較は compare_bench.py で行う。
+ */
+#include "pch.h"
+
+#include "ComfyUIPluginInternal.h"
+#include "Logger.h"
+#include "ResizeImage.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+using ComfyUIPlugin::Logger;
+using ComfyUIPlugin::LogLevel;
+
+namespace Bench {
+
+using Clock = std::chrono::steady_clock;
+
+/// 1つのベンチマークの結果
+struct Result {
+	std::string name;
+	std::string params;
+	long long iterations = 0;
+	double nsPerOp = 0.0;		///< サンプルの中央値
+	double nsPerOpMin = 0.0;	///< サンプルの最小値
+	double bytesPerOp = 0.0;	///< 0 なら MB/s を出さない
+};
+
+class Runner {
+public:
+	Runner(double minSeconds, std::string filter) : minSeconds_(minSeconds), filter_(std::move(filter)) {}
+
+	/// @brief body を繰り返し実行し、1回あたりの時間を測る
+	/// @param bytesPerOp 1回で処理するバイト数（スループットの計算に使う）
+	/// @note 1回実行してから回数を決め、kSamples 回のサンプルの中央値を結果とする
+	template <class Body>
+	void Run(const std::string& name, const std::string& params, double bytesPerOp, Body&& body) {
+		if (!filter_.empty() && name.find(filter_) == std::string::npos) return;
+		const auto warmStart = Clock::now();
+		body();
+		const double once = std::max(Seconds(warmStart), 1e-9);
+		const long long iterations = std::max(1LL, static_cast<long long>(minSeconds_ / kSamples / once));
+		std::array<double, kSamples> samples{};
+		for (auto& sample : samples) {
+			const auto start = Clock::now();
+			for (long long i = 0; i < iterations; ++i) body();
+			sample = Seconds(start) * 1e9 / static_cast<double>(iterations);
+		}
+		std::sort(samples.begin(), samples.end());
+		results_.push_back({ name, params, iterations * kSamples, samples[kSamples / 2], samples.front(), bytesPerOp });
+		const auto& result = results_.back();
+		std::fprintf(stderr, "%-64s %12.0f ns/op", name.c_str(), result.nsPerOp);
+		if (bytesPerOp > 0.0) std::fprintf(stderr, " %10.1f MB/s", bytesPerOp / result.nsPerOp * 1e3);
+		std::fprintf(stderr, "\n");
+	}
+
+	/// 結果を JSON で書き出す
+	void Write(std::FILE* file, const std::string& configuration) const {
+		char timestamp[32];
+		const std::time_t now = std::time(nullptr);
+		std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+		std::fprintf(file, "{\"schema\":1,\"timestamp\":\"%s\",\"compiler\":\"%s\",\"configuration\":\"%s\",\"benchmarks\":[\n",
+			timestamp, Trace::Escape(__VERSION__).c_str(), Trace::Escape(configuration).c_str());
+		for (size_t i = 0; i < results_.size(); ++i) {
+			const auto& result = results_[i];
+			std::fprintf(file, "%s{\"name\":\"%s\",\"params\":\"%s\",\"iterations\":%lld,\"ns_per_op\":%.1f,\"ns_per_op_min\":%.1f,\"ops_per_s\":%.3f",
+				i ? ",\n" : "", Trace::Escape(result.name).c_str(), Trace::Escape(result.params).c_str(), result.iterations, result.nsPerOp, result.nsPerOpMin, 1e9 / result.nsPerOp);
+			if (result.bytesPerOp > 0.0) std::fprintf(file, ",\"bytes_per_op\":%.0f,\"mb_per_s\":%.3f", result.bytesPerOp, result.bytesPerOp / result.nsPerOp * 1e3);
+			std::fprintf(file, "}");
+		}
+		std::fprintf(file, "\n]}\n");
+	}
+
+private:
+	static constexpr int kSamples = 5;
+	static double Seconds(Clock::time_point start) { return std::chrono::duration<double>(Clock::now() - start).count(); }
+
+	double minSeconds_;
+	std::string filter_;
+	std::vector<Result> results_;
+};
+
+/// 最適化で計算が消えないよう、結果を書き込む先
+volatile size_t g_Sink = 0;
+
+/// ホストのレイヤーと同じく、ブロック毎に別々のメモリを持つ画像
+struct Layer {
+	std::vector<std::vector<unsigned char>> images;
+	std::vector<std::vector<unsigned char>> alphas;
+	std::vector<FilterPlugIn::Rect> rects;
+
+	Layer(int width, int height, int blockSize) {
+		for (int y = 0; y < height; y += blockSize) {
+			for (int x = 0; x < width; x += blockSize) {
+				const FilterPlugIn::Rect rect = { x, y, std::min(x + blockSize, width), std::min(y + blockSize, height) };
+				const size_t pixels = static_cast<size_t>(rect.right - rect.left) * (rect.bottom - rect.top);
+				rects.push_back(rect);
+				images.emplace_back(pixels * 4);
+				alphas.emplace_back(pixels, 255);
+				auto& image = images.back();
+				for (size_t i = 0; i < image.size(); ++i) image[i] = static_cast<unsigned char>(i * 7 + x + y);
+			}
+		}
+	}
+	/// getBlockImage で返るブロックと同じ（BGRA、ブロックの左上を指す）
+	FilterPlugIn::Block Image(size_t index) {
+		const auto& rect = rects[index];
+		return { rect, images[index].data(), (rect.right - rect.left) * 4, 4, 2, 1, 0, true };
+	}
+	FilterPlugIn::Block Alpha(size_t index) {
+		const auto& rect = rects[index];
+		return { rect, alphas[index].data(), rect.right - rect.left, 1, 0, 0, 0, true };
+	}
+	/// アルファを 64 画素毎に透明・不透明の縞にする（ClassifyAlpha が Mixed になる）
+	void StripeAlpha() {
+		for (size_t index = 0; index < rects.size(); ++index) {
+			const int width = rects[index].right - rects[index].left;
+			auto& alpha = alphas[index];
+			for (size_t i = 0; i < alpha.size(); ++i) alpha[i] = ((rects[index].left + static_cast<int>(i % width)) / 64) % 2 ? 255 : 0;
+		}
+	}
+};
+
+/// 画素を模様で埋めた ImageBuffer を作る
+void FillImage(ImageBuffer& image, int width, int height) {
+	image.allocate(width, height, false);
+	image.rect = { 0, 0, width, height };
+	unsigned char* data = image.get_data_pointer();
+	for (size_t i = 0; i < static_cast<size_t>(width) * height * 3; ++i) data[i] = static_cast<unsigned char>(i * 13);
+}
+
+/// ComfyUI の /history/<prompt_id> の応答と同じ形の JSON（送ったワークフローがそのまま入る）を作る
+std::string MakeHistory(const std::string& workflow) {
+	return "{\"a1b2c3d4-0000-4000-8000-000000000000\": {\"prompt\": [1, \"a1b2c3d4-0000-4000-8000-000000000000\", " + workflow +
+		", {\"client_id\": \"clip-studio\"}, [\"9\"]], \"outputs\": {\"9\": {\"images\": [{\"filename\": \"CCPImage_00042_.png\", \"subfolder\": \"CLIPSTUDIO_ComfyUI_PLUGIN\", \"type\": \"output\"}]}}, "
+		"\"status\": {\"status_str\": \"success\", \"completed\": true, \"messages\": [[\"execution_start\", {\"prompt_id\": \"a1b2c3d4\", \"timestamp\": 1760000000000}], "
+		"[\"execution_cached\", {\"nodes\": [], \"prompt_id\": \"a1b2c3d4\", \"timestamp\": 1760000000001}], [\"execution_success\", {\"prompt_id\": \"a1b2c3d4\", \"timestamp\": 1760000012345}]]}, \"meta\": {}}}";
+}
+
+/// RunFilter と同じ順序で、テンプレートのマーカーを全て置換する
+std::string RenderTemplate(const std::string& workflow) {
+	std::string prompt = replace_all(workflow, MARKER_PROMPT, "a watercolor painting of a lighthouse at dusk, soft light, detailed");
+	prompt = replace_all(prompt, MARKER_NPROMPT, "blurry, low quality");
+	for (size_t i = 0; i < kNumberParameterCount; ++i) prompt = replace_all(prompt, kNumberMarkers[i], NumberToJson(kDefaultNumberValues[i]));
+	for (size_t i = 0; i < kSubImageDropdownCount; ++i) prompt = replace_all(prompt, kSubImageMarkers[i], kSubImageUploadPrefixes[i] + "20261019120000.png");
+	prompt = replace_all(prompt, MARKER_SEED, "123456789");
+	return replace_all(prompt, MARKER_INPUT_IMAGE, "temp_img_req_20261019120000.png");
+}
+
+std::string ReadFile(const std::filesystem::path& path) {
+	std::ifstream file(path, std::ios::binary);
+	return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+void PrintUsage() {
+	std::fprintf(stderr,
+		"usage: BenchmarkKernels [options]\n"
+		"  --size WxH        画像の大きさ（既定 2048x2048）\n"
+		"  --block N         ホストのブロックの大きさ（既定 256）\n"
+		"  --min-time SEC    1つのベンチマークに掛ける時間（既定 0.5）\n"
+		"  --filter TEXT     名前に TEXT を含むものだけ実行する\n"
+		"  --examples DIR    ワークフローのフォルダー（既定 リポジトリの examples）\n"
+		"  --output PATH     結果の JSON の保存先（既定 標準出力）\n");
+}
+
+}
+
+int main(int argc, char** argv) {
+	using namespace Bench;
+	int width = 2048, height = 2048, blockSize = 256;
+	double minSeconds = 0.5;
+	std::string filter, output;
+	// 既定は forLinux/build/BenchmarkKernels から見たリポジトリの examples
+	std::filesystem::path examples = std::filesystem::weakly_canonical(std::filesystem::path(argv[0])).parent_path() / ".." / ".." / "examples";
+	for (int i = 1; i < argc; ++i) {
+		const std::string name = argv[i];
+		if (i + 1 >= argc) { PrintUsage(); return 2; }
+		const char* value = argv[++i];
+		if (name == "--size") { if (std::sscanf(value, "%dx%d", &width, &height) != 2) { PrintUsage(); return 2; } }
+		else if (name == "--block") blockSize = std::atoi(value);
+		else if (name == "--min-time") minSeconds = std::atof(value);
+		else if (name == "--filter") filter = value;
+		else if (name == "--examples") examples = value;
+		else if (name == "--output") output = value;
+		else { PrintUsage(); return 2; }
+	}
+	if (width <= 0 || height <= 0 || blockSize <= 0 || minSeconds <= 0.0) { PrintUsage(); return 2; }
+
+	// print の出力でファイル入出力の時間が変わらないよう、ログはエラーだけにする
+	Logger::Instance().SetLevel(LogLevel::Error);
+	Runner runner(minSeconds, filter);
+	BufferPool pool;
+	const std::string imageSize = std::to_string(width) + "x" + std::to_string(height);
+	const std::string layerParams = imageSize + " blocks " + std::to_string(blockSize);
+	const double pixels = static_cast<double>(width) * height;
+
+	Layer layer(width, height, blockSize);
+	ImageBuffer image(pool);
+	FillImage(image, width, height);
+	// read24BitBmpBlock が返すのと同じ、画像全体の 24bit ブロック
+	std::vector<unsigned char> rgb(static_cast<size_t>(width) * height * 3);
+	std::memcpy(rgb.data(), image.get_data_pointer(), rgb.size());
+	const FilterPlugIn::Block rgbBlock = { { 0, 0, width, height }, rgb.data(), width * 3, 3, 2, 1, 0, true };
+	// 選択範囲のマスク（半透明のグラデーション）
+	Layer select(width, height, blockSize);
+	for (auto& alpha : select.alphas) for (size_t i = 0; i < alpha.size(); ++i) alpha[i] = static_cast<unsigned char>(i);
+
+	// --- ホストのブロックへの転送（FilterPlugIn::Transfer） ---
+	runner.Run("filterplugin.transfer", layerParams, pixels * 4, [&] {
+		for (size_t i = 0; i < layer.rects.size(); ++i) FilterPlugIn::Transfer(layer.Image(i), rgbBlock);
+	});
+	runner.Run("filterplugin.transfer_alpha", layerParams, pixels * 4, [&] {
+		for (size_t i = 0; i < layer.rects.size(); ++i) FilterPlugIn::Transfer(layer.Image(i), rgbBlock, layer.Alpha(i));
+	});
+	runner.Run("filterplugin.transfer_alpha_select", layerParams, pixels * 4, [&] {
+		for (size_t i = 0; i < layer.rects.size(); ++i) FilterPlugIn::Transfer(layer.Image(i), rgbBlock, layer.Alpha(i), select.Alpha(i));
+	});
+
+	// --- ImageBuffer とホストのブロックの間の転送 ---
+	runner.Run("imagebuffer.capture", layerParams, pixels * 4, [&] {
+		for (size_t i = 0; i < layer.rects.size(); ++i) Transfer(image, layer.Image(i), 0, 0);
+	});
+	runner.Run("imagebuffer.writeback_opaque", layerParams, pixels * 4, [&] {
+		for (size_t i = 0; i < layer.rects.size(); ++i) Transfer(layer.Image(i), image, layer.Alpha(i));
+	});
+	runner.Run("imagebuffer.writeback_select", layerParams, pixels * 4, [&] {
+		for (size_t i = 0; i < layer.rects.size(); ++i) Transfer(layer.Image(i), image, layer.Alpha(i), select.Alpha(i));
+	});
+	layer.StripeAlpha();
+	runner.Run("imagebuffer.writeback_mixed", layerParams + " alpha stripes 64", pixels * 4, [&] {
+		for (size_t i = 0; i < layer.rects.size(); ++i) Transfer(layer.Image(i), image, layer.Alpha(i));
+	});
+
+	// --- RGBA への変換と選択範囲のマスク ---
+	BufferPool::Buffer rgba;
+	runner.Run("rgba.copy_image_to_rgba", imageSize, pixels * 4, [&] {
+		rgba = BufferPool::Buffer{};
+		CopyImageToRgba(image, pool, rgba);
+		g_Sink = g_Sink + rgba.data()[0];
+	});
+	const FilterPlugIn::Rect imageRect = { 0, 0, width, height };
+	const FilterPlugIn::Rect selectionRect = { width / 4, height / 4, width * 3 / 4, height * 3 / 4 };
+	// 選択範囲は画像の 1/4 の面積なので、書き換える RGBA は pixels バイト分
+	runner.Run("rgba.apply_rectangle_selection_mask", imageSize + " selection 1/4", pixels, [&] {
+		ApplyRectangleSelectionMask(selectionRect, imageRect, rgba.data());
+	});
+	rgba = BufferPool::Buffer{};
+
+	// --- 拡大縮小（Lanczos3。縦方向の SIMD あり・なし） ---
+	// 大きい方の画像のバイト数で MB/s を出す。SIMD なしでビルドした場合は scalar だけを測る
+	const int halfWidth = std::max(width / 2, 1), halfHeight = std::max(height / 2, 1);
+	const std::string halfSize = std::to_string(halfWidth) + "x" + std::to_string(halfHeight);
+	std::vector<unsigned char> half(static_cast<size_t>(halfWidth) * halfHeight * 3);
+	std::vector<unsigned char> resized(static_cast<size_t>(pixels * 3));
+	std::array<std::vector<unsigned char>, 2> downResults;
+	for (const bool simd : { true, false }) {
+		if (!ResizeImage::SetSimdEnabled(simd) && simd) continue;
+		const std::string variant = simd ? "simd" : "scalar";
+		runner.Run("resize.rgb_down/" + variant, imageSize + " -> " + halfSize, pixels * 3, [&] {
+			ResizeImage::ResizeRgb(image.get_data_pointer(), width, height, half.data(), halfWidth, halfHeight, pool);
+		});
+		downResults[simd ? 0 : 1] = half;
+		runner.Run("resize.rgb_up/" + variant, halfSize + " -> " + imageSize, pixels * 3, [&] {
+			ResizeImage::ResizeRgb(half.data(), halfWidth, halfHeight, resized.data(), width, height, pool);
+		});
+	}
+	ResizeImage::SetSimdEnabled(true);
+	if (!downResults[0].empty() && !downResults[1].empty() && downResults[0] != downResults[1]) std::fprintf(stderr, "Warning: SIMD and scalar resize results differ.\n");
+
+	// --- バッファプールからの確保（画像全体の 24bit バッファと同じ大きさ） ---
+	// 返却したバッファを保持するプールでは2回目から再利用になり、保持しないプールでは毎回確保と解放になる
+	const size_t poolBytes = static_cast<size_t>(pixels * 3);
+	BufferPool hitPool;
+	runner.Run("bufferpool.acquire_hit", imageSize + " rgb", 0.0, [&] {
+		const auto buffer = hitPool.Acquire(poolBytes);
+		g_Sink = g_Sink + buffer.size();
+	});
+	BufferPool missPool(0);
+	runner.Run("bufferpool.acquire_miss", imageSize + " rgb", 0.0, [&] {
+		const auto buffer = missPool.Acquire(poolBytes);
+		g_Sink = g_Sink + buffer.size();
+	});
+	runner.Run("bufferpool.acquire_hit_clear", imageSize + " rgb", static_cast<double>(poolBytes), [&] {
+		const auto buffer = hitPool.Acquire(poolBytes, true);
+		g_Sink = g_Sink + buffer.data()[0];
+	});
+	// 新しく確保したページは書き込む時にフォールトするので、ゼロ埋めを含めると再利用との差が大きくなる
+	runner.Run("bufferpool.acquire_miss_clear", imageSize + " rgb", static_cast<double>(poolBytes), [&] {
+		const auto buffer = missPool.Acquire(poolBytes, true);
+		g_Sink = g_Sink + buffer.data()[0];
+	});
+
+	// --- BMP の読み書き（ページキャッシュに載った一時ファイル） ---
+	std::error_code error;
+	const auto temporary = std::filesystem::temp_directory_path(error) / ("comfyui_bench_" + std::to_string(getpid()));
+	std::filesystem::create_directories(temporary, error);
+	const std::string bmpPath = (temporary / "image.bmp").string();
+	const double bmpBytes = pixels * 3;
+	runner.Run("bmp.write_bmp_file", imageSize, bmpBytes, [&] {
+		write_bmp_file(image, bmpPath);
+	});
+	runner.Run("bmp.load_bmp_rgb_to_buffer", imageSize, bmpBytes, [&] {
+		ImageBuffer loaded(pool);
+		load_bmp_rgb_to_buffer(bmpPath, loaded);
+		g_Sink = g_Sink + loaded.get_width();
+	});
+	runner.Run("bmp.read24bit_bmp_block", imageSize, bmpBytes, [&] {
+		BufferPool::Buffer storage;
+		const auto block = read24BitBmpBlock(bmpPath, pool, storage);
+		g_Sink = g_Sink + block.rowBytes;
+	});
+	std::filesystem::remove_all(temporary, error);
+
+	// --- テンプレートのマーカー置換とヒストリーの解析（同梱のワークフロー） ---
+	std::vector<std::filesystem::path> workflows;
+	for (const auto& entry : std::filesystem::directory_iterator(examples, error)) {
+		if (entry.path().extension() == ".json") workflows.push_back(entry.path());
+	}
+	std::sort(workflows.begin(), workflows.end());
+	if (workflows.empty()) std::fprintf(stderr, "No workflows in %s; skipping template and history benchmarks.\n", examples.string().c_str());
+	for (const auto& path : workflows) {
+		const std::string workflow = ReadFile(path);
+		const std::string stem = path.stem().string();
+		runner.Run("template.substitute/" + stem, std::to_string(workflow.size()) + " bytes", static_cast<double>(workflow.size()), [&] {
+			g_Sink = g_Sink + RenderTemplate(workflow).size();
+		});
+		const std::string history = MakeHistory(RenderTemplate(workflow));
+		runner.Run("history.extract_image/" + stem, std::to_string(history.size()) + " bytes", static_cast<double>(history.size()), [&] {
+			HistoryImage extracted;
+			ExtractHistoryImage(history, extracted);
+			g_Sink = g_Sink + extracted.filename.size();
+		});
+	}
+
+	// --- ログ（print と LOG_* が呼ぶ Logger::Write。1回は kLogBurst 行） ---
+	// 書き出しスレッドを開始する前は1行毎にファイルへ追記し、開始後はリングバッファに書式化するだけになる
+	// 開始後は、リングバッファに収まる行数を書いてから Flush で書き出しを待つ（捨てる行が出ない速さで書き続けた場合の時間）
+	constexpr int kLogBurst = static_cast<int>(Logger::kCapacity / 4);
+	const std::string logParams = std::to_string(kLogBurst) + " lines";
+	const auto logFolder = std::filesystem::temp_directory_path(error) / ("comfyui_bench_log_" + std::to_string(getpid()));
+	std::filesystem::create_directories(logFolder, error);
+	auto& logger = Logger::Instance();
+	logger.Open((logFolder / "debuglog.txt").string());
+	logger.SetLevel(LogLevel::Info);
+	const auto writeLines = [&] {
+		for (int i = 0; i < kLogBurst; ++i) {
+			logger.Write(LogLevel::Info, "end transfer: %d blocks in %d rows, %d written in %d update rects, %lld ms", 64, 8, i, 1, static_cast<long long>(g_Sink & 0xFF));
+		}
+	};
+	runner.Run("logger.write_direct", logParams, 0.0, writeLines);
+	logger.Start();
+	const auto before = logger.GetStatistics();
+	runner.Run("logger.write_async", logParams + ", then flush", 0.0, [&] {
+		writeLines();
+		logger.Flush();
+	});
+	const auto after = logger.GetStatistics();
+	if (after.dropped != before.dropped) std::fprintf(stderr, "Warning: logger.write_async dropped %llu lines.\n", static_cast<unsigned long long>(after.dropped - before.dropped));
+	logger.SetLevel(LogLevel::Error);
+	runner.Run("logger.write_filtered", logParams + " below the level", 0.0, writeLines);
+	logger.Stop();
+	std::filesystem::remove_all(logFolder, error);
+
+	char configuration[128];
+	std::snprintf(configuration, sizeof(configuration), "%s, min-time %g s", layerParams.c_str(), minSeconds);
+	if (output.empty()) {
+		runner.Write(stdout, configuration);
+	} else {
+		std::FILE* file = std::fopen(output.c_str(), "w");
+		if (!file) { std::fprintf(stderr, "Could not create %s\n", output.c_str()); return 1; }
+		runner.Write(file, configuration);
+		std::fclose(file);
+	}
+	return 0;
+}
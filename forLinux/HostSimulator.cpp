@@ -0,0 +1,476 @@
+/**
+ * @file HostSimulator.cpp
+ * @brief CLIP STUDIO の代わりに FilterPlugIn::Server を用意するホストシミュレーター
+ */
+#include "pch.h"
+
+#include "HostSimulator.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace HostSimulator {
+
+using namespace FilterPlugIn;
+
+namespace {
+
+/// 文字列オブジェクトの実体
+struct StringData {
+	std::u16string unicode;
+	std::string local;	///< ローカルコード（Linux では UTF-8）
+	int references = 1;
+};
+
+std::string ToUtf8(const std::u16string& text) {
+	std::string out;
+	for (size_t i = 0; i < text.size(); ++i) {
+		char32_t c = text[i];
+		if (c >= 0xD800 && c < 0xDC00 && i + 1 < text.size()) c = 0x10000 + ((c - 0xD800) << 10) + (text[++i] - 0xDC00);
+		if (c < 0x80) out += static_cast<char>(c);
+		else if (c < 0x800) { out += static_cast<char>(0xC0 | (c >> 6)); out += static_cast<char>(0x80 | (c & 0x3F)); }
+		else if (c < 0x10000) { out += static_cast<char>(0xE0 | (c >> 12)); out += static_cast<char>(0x80 | ((c >> 6) & 0x3F)); out += static_cast<char>(0x80 | (c & 0x3F)); }
+		else { out += static_cast<char>(0xF0 | (c >> 18)); out += static_cast<char>(0x80 | ((c >> 12) & 0x3F)); out += static_cast<char>(0x80 | ((c >> 6) & 0x3F)); out += static_cast<char>(0x80 | (c & 0x3F)); }
+	}
+	return out;
+}
+
+std::u16string FromUtf8(const std::string& text) {
+	std::u16string out;
+	for (size_t i = 0; i < text.size();) {
+		const unsigned char c = static_cast<unsigned char>(text[i]);
+		char32_t code = c;
+		int extra = 0;
+		if (c >= 0xF0) { code = c & 0x07; extra = 3; }
+		else if (c >= 0xE0) { code = c & 0x0F; extra = 2; }
+		else if (c >= 0xC0) { code = c & 0x1F; extra = 1; }
+		++i;
+		for (int k = 0; k < extra && i < text.size(); ++k, ++i) code = (code << 6) | (static_cast<unsigned char>(text[i]) & 0x3F);
+		if (code >= 0x10000) { code -= 0x10000; out += static_cast<char16_t>(0xD800 + (code >> 10)); out += static_cast<char16_t>(0xDC00 + (code & 0x3FF)); }
+		else out += static_cast<char16_t>(code);
+	}
+	return out;
+}
+
+StringData* AsString(StringObject object) { return reinterpret_cast<StringData*>(object); }
+
+/// プロパティの項目
+struct Item {
+	Int valueType = 0;
+	Bool booleanValue = 0, booleanDefault = 0;
+	Int integerValue = 0, integerDefault = 0, integerMin = 0, integerMax = 0;
+	Double decimalValue = 0.0, decimalDefault = 0.0, decimalMin = 0.0, decimalMax = 0.0;
+	Int enumerationValue = 0, enumerationDefault = 0;
+	std::vector<std::pair<Int, std::u16string>> enumerationItems;
+	StringObject stringValue = nullptr, stringDefault = nullptr;
+	Int stringMaxLength = 0;
+	std::u16string caption;
+	bool storeValue = false;
+};
+
+/// プロパティオブジェクトの実体
+struct PropertyData {
+	std::map<Int, Item> items;
+	int references = 1;
+};
+
+PropertyData* AsProperty(PropertyObject object) { return reinterpret_cast<PropertyData*>(object); }
+
+/// ブロック毎に別々の範囲を指す画像（実体は OffscreenData がまとめて持つ）
+struct Block {
+	Rect rect;
+	unsigned char* image = nullptr;
+	unsigned char* alpha = nullptr;
+};
+
+/// オフスクリーンオブジェクトの実体
+struct OffscreenData {
+	Canvas canvas;
+	std::vector<Block> blocks;
+	int references = 1;
+
+	OffscreenData() = default;
+	~OffscreenData() { Release(); }
+	OffscreenData(const OffscreenData&) = delete;
+	OffscreenData& operator=(const OffscreenData&) = delete;
+
+	void Allocate(const Canvas& setting) {
+		Release();
+		canvas = setting;
+		const auto& layer = canvas.layerRect;
+		columns_ = (layer.right - layer.left + canvas.blockWidth - 1) / canvas.blockWidth;
+		std::vector<size_t> offsets;
+		size_t total = 0;
+		for (Int y = layer.top; y < layer.bottom; y += canvas.blockHeight) {
+			for (Int x = layer.left; x < layer.right; x += canvas.blockWidth) {
+				Block block;
+				block.rect = { x, y, std::min<Int>(x + canvas.blockWidth, layer.right), std::min<Int>(y + canvas.blockHeight, layer.bottom) };
+				const size_t pixels = static_cast<size_t>(block.rect.right - block.rect.left) * (block.rect.bottom - block.rect.top);
+				offsets.push_back(total);
+				total += pixels * (canvas.pixelBytes + 1);
+				blocks.push_back(block);
+			}
+		}
+		unsigned char* memory = canvas.scratchDirectory.empty() ? nullptr : MapScratch(canvas.scratchDirectory, total);
+		if (memory) {
+			mapped_ = memory;
+			mappedBytes_ = total;
+		} else {
+			if (!canvas.scratchDirectory.empty()) std::fprintf(stderr, "Could not map the canvas to %s; using memory.\n", canvas.scratchDirectory.c_str());
+			heap_.assign(total, 0);
+			memory = heap_.data();
+		}
+		for (size_t i = 0; i < blocks.size(); ++i) {
+			auto& block = blocks[i];
+			const size_t pixels = static_cast<size_t>(block.rect.right - block.rect.left) * (block.rect.bottom - block.rect.top);
+			block.image = memory + offsets[i];
+			block.alpha = block.image + pixels * canvas.pixelBytes;
+		}
+	}
+	/// 座標を含むブロック（ブロックは格子状に並ぶので、位置から求める）
+	Block* Find(Int x, Int y) {
+		const auto& layer = canvas.layerRect;
+		if (x < layer.left || x >= layer.right || y < layer.top || y >= layer.bottom) return nullptr;
+		return &blocks[static_cast<size_t>((y - layer.top) / canvas.blockHeight) * columns_ + (x - layer.left) / canvas.blockWidth];
+	}
+	/// @note ブロックを列挙する時は、同じ範囲で個数とインデックス毎の矩形を繰り返し求めるので、直前の結果を使い回す
+	const std::vector<Rect>& Intersecting(const Rect& bounds) {
+		if (hasIntersecting_ && lastBounds_.left == bounds.left && lastBounds_.top == bounds.top && lastBounds_.right == bounds.right && lastBounds_.bottom == bounds.bottom) return lastRects_;
+		lastRects_.clear();
+		for (const auto& block : blocks) {
+			const auto rect = intersectRects(block.rect, bounds);
+			if (!isRectEmpty(rect)) lastRects_.push_back(rect);
+		}
+		lastBounds_ = bounds;
+		hasIntersecting_ = true;
+		return lastRects_;
+	}
+
+private:
+	/// @brief 削除済みの一時ファイルを共有マップする（大きなキャンバスで、書き込んだページをディスクに逃がせるように）
+	static unsigned char* MapScratch(const std::string& directory, size_t bytes) {
+		std::string path = directory + "/canvasXXXXXX";
+		const int fd = mkstemp(path.data());
+		if (fd < 0) return nullptr;
+		unlink(path.c_str());
+		void* memory = ftruncate(fd, static_cast<off_t>(bytes)) == 0 ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+		close(fd);
+		return memory == MAP_FAILED ? nullptr : static_cast<unsigned char*>(memory);
+	}
+	void Release() {
+		if (mapped_) munmap(mapped_, mappedBytes_);
+		mapped_ = nullptr;
+		mappedBytes_ = 0;
+		std::vector<unsigned char>().swap(heap_);
+		blocks.clear();
+		hasIntersecting_ = false;
+	}
+
+	std::vector<unsigned char> heap_;
+	unsigned char* mapped_ = nullptr;
+	size_t mappedBytes_ = 0;
+	Int columns_ = 0;
+	Rect lastBounds_{};
+	std::vector<Rect> lastRects_;
+	bool hasIntersecting_ = false;
+};
+
+OffscreenData* AsOffscreen(OffscreenObject object) { return reinterpret_cast<OffscreenData*>(object); }
+
+}
+
+struct Host::Impl {
+	Host* host = nullptr;
+	ModuleInitializeRecord moduleInitialize{};
+	FilterInitializeRecord filterInitialize{};
+	FilterRunRecord filterRun{};
+	StringService stringService{};
+	BitmapService bitmapService{};
+	OffscreenService offscreenService{};
+	OffscreenService2 offscreenService2{};
+	PropertyService propertyService{};
+	PropertyService2 propertyService2{};
+
+	std::deque<StringData> strings;
+	std::deque<PropertyData> properties;
+	OffscreenData source;
+	OffscreenData destination;
+	PropertyObject property = nullptr;
+	PropertyCallBackProc callback = nullptr;
+	Ptr callbackData = nullptr;
+
+	static Impl* From(HostObject object) { return reinterpret_cast<Impl*>(object); }
+
+	StringObject MakeString(std::u16string unicode) {
+		strings.push_back({ unicode, ToUtf8(unicode), 1 });
+		return reinterpret_cast<StringObject>(&strings.back());
+	}
+
+	Item& ItemOf(PropertyObject object, Int key) { return AsProperty(object)->items[key]; }
+
+	void Notify(Int key) {
+		if (!callback || !property) return;
+		PropertyCallBackResult result = PropertyCallBackResult::NoModify;
+		callback(&result, property, key, PropertyCallBackNotify::ValueChanged, callbackData);
+	}
+};
+
+// 文字列やプロパティのサービスにはホストのオブジェクトが渡されないので、最後に作ったホストを使う
+Host::Impl* Host::current_ = nullptr;
+
+Host::Host(const Canvas& canvas) : impl_(std::make_unique<Impl>()) {
+	auto& impl = *impl_;
+	impl.host = this;
+	current_ = &impl;
+	impl.source.Allocate(canvas);
+	impl.destination.Allocate(canvas);
+
+	impl.moduleInitialize.getHostVersionProc = [](Int* version, HostObject) -> Int { *version = 1; return 0; };
+	impl.moduleInitialize.setModuleIDProc = [](HostObject, StringObject) -> Int { return 0; };
+	impl.moduleInitialize.setModuleKindProc = [](HostObject, const Int) -> Int { return 0; };
+
+	impl.filterInitialize.setFilterCategoryNameProc = [](HostObject, StringObject, const Char) -> Int { return 0; };
+	impl.filterInitialize.setFilterNameProc = [](HostObject object, StringObject name, const Char) -> Int { Impl::From(object)->host->filterName_ = AsString(name)->local; return 0; };
+	impl.filterInitialize.setCanPreviewProc = [](HostObject object, const Bool preview) -> Int { Impl::From(object)->host->canPreview_ = preview != 0; return 0; };
+	impl.filterInitialize.setUseBlankImageProc = [](HostObject, const Bool) -> Int { return 0; };
+	impl.filterInitialize.setTargetKindsProc = [](HostObject, const Int*, const Int) -> Int { return 0; };
+	impl.filterInitialize.setPropertyProc = [](HostObject object, PropertyObject property) -> Int {
+		auto impl = Impl::From(object);
+		++AsProperty(property)->references;
+		impl->property = property;
+		return 0;
+	};
+	impl.filterInitialize.setPropertyCallBackProc = [](HostObject object, PropertyCallBackProc proc, Ptr data) -> Int {
+		auto impl = Impl::From(object);
+		impl->callback = proc;
+		impl->callbackData = data;
+		return 0;
+	};
+
+	impl.filterRun.getPropertyProc = [](PropertyObject* property, HostObject object) -> Int { *property = Impl::From(object)->property; return 0; };
+	impl.filterRun.isAlphaLockedProc = [](Bool* locked, HostObject) -> Int { *locked = 0; return 0; };
+	impl.filterRun.getSourceOffscreenProc = [](OffscreenObject* offscreen, HostObject object) -> Int { *offscreen = reinterpret_cast<OffscreenObject>(&Impl::From(object)->source); return 0; };
+	impl.filterRun.getDestinationOffscreenProc = [](OffscreenObject* offscreen, HostObject object) -> Int { *offscreen = reinterpret_cast<OffscreenObject>(&Impl::From(object)->destination); return 0; };
+	impl.filterRun.getSelectAreaRectProc = [](Rect* rect, HostObject object) -> Int { *rect = Impl::From(object)->source.canvas.selectRect; return 0; };
+	impl.filterRun.getSelectAreaOffscreenProc = [](OffscreenObject* offscreen, HostObject) -> Int { *offscreen = nullptr; return -1; };
+	impl.filterRun.updateDestinationOffscreenRectProc = [](HostObject object, const Rect* rect) -> Int {
+		auto& statistics = Impl::From(object)->host->statistics_;
+		++statistics.updateRects;
+		statistics.updatedPixels += static_cast<long long>(rect->right - rect->left) * (rect->bottom - rect->top);
+		return 0;
+	};
+	impl.filterRun.processProc = [](Int* result, HostObject object, const Int state) -> Int {
+		auto impl = Impl::From(object);
+		auto host = impl->host;
+		const int call = host->statistics_.processCalls++;
+		*result = host->processScript_ ? host->processScript_(state, call) : (state == static_cast<Int>(Run::States::End) ? static_cast<Int>(Run::Results::Exit) : static_cast<Int>(Run::Results::Continue));
+		if (*result == static_cast<Int>(Run::Results::Restart)) ++host->statistics_.restarts;
+		return 0;
+	};
+	impl.filterRun.setProgressTotalProc = [](HostObject, const Int) -> Int { return 0; };
+	impl.filterRun.setProgressDoneProc = [](HostObject, const Int) -> Int { return 0; };
+
+	impl.stringService.createWithAsciiStringProc = [](StringObject* object, const Char* text, const Int length) -> Int {
+		*object = current_->MakeString(FromUtf8(std::string(text, length)));
+		return 0;
+	};
+	impl.stringService.createWithUnicodeStringProc = [](StringObject* object, const UniChar* text, const Int length) -> Int {
+		*object = current_->MakeString(std::u16string(reinterpret_cast<const char16_t*>(text), length));
+		return 0;
+	};
+	impl.stringService.createWithLocalCodeStringProc = [](StringObject* object, const Char* text, const Int length) -> Int {
+		*object = current_->MakeString(FromUtf8(std::string(text, length)));
+		return 0;
+	};
+	impl.stringService.createWithStringIDProc = [](StringObject* object, const Int, HostObject) -> Int { *object = current_->MakeString(u""); return 0; };
+	impl.stringService.retainProc = [](StringObject object) -> Int { ++AsString(object)->references; return 0; };
+	impl.stringService.releaseProc = [](StringObject object) -> Int { --AsString(object)->references; return 0; };
+	impl.stringService.getUnicodeCharsProc = [](const UniChar** text, StringObject object) -> Int { *text = reinterpret_cast<const UniChar*>(AsString(object)->unicode.c_str()); return 0; };
+	impl.stringService.getUnicodeLengthProc = [](Int* length, StringObject object) -> Int { *length = static_cast<Int>(AsString(object)->unicode.size()); return 0; };
+	impl.stringService.getLocalCodeCharsProc = [](const Char** text, StringObject object) -> Int { *text = AsString(object)->local.c_str(); return 0; };
+	impl.stringService.getLocalCodeLengthProc = [](Int* length, StringObject object) -> Int { *length = static_cast<Int>(AsString(object)->local.size()); return 0; };
+
+	impl.offscreenService.retainProc = [](OffscreenObject object) -> Int { ++AsOffscreen(object)->references; return 0; };
+	impl.offscreenService.releaseProc = [](OffscreenObject object) -> Int { --AsOffscreen(object)->references; return 0; };
+	impl.offscreenService.getWidthProc = [](Int* width, OffscreenObject object) -> Int { const auto& r = AsOffscreen(object)->canvas.layerRect; *width = r.right - r.left; return 0; };
+	impl.offscreenService.getHeightProc = [](Int* height, OffscreenObject object) -> Int { const auto& r = AsOffscreen(object)->canvas.layerRect; *height = r.bottom - r.top; return 0; };
+	impl.offscreenService.getRectProc = [](Rect* rect, OffscreenObject object) -> Int { *rect = AsOffscreen(object)->canvas.layerRect; return 0; };
+	impl.offscreenService.getExtentRectProc = [](Rect* rect, OffscreenObject object) -> Int { *rect = AsOffscreen(object)->canvas.layerRect; return 0; };
+	impl.offscreenService.getRGBChannelIndexProc = [](Int* r, Int* g, Int* b, OffscreenObject object) -> Int {
+		const auto& canvas = AsOffscreen(object)->canvas;
+		*r = canvas.r; *g = canvas.g; *b = canvas.b;
+		return 0;
+	};
+	impl.offscreenService.getBlockRectCountProc = [](Int* count, OffscreenObject object, Rect* bounds) -> Int { *count = static_cast<Int>(AsOffscreen(object)->Intersecting(*bounds).size()); return 0; };
+	impl.offscreenService.getBlockRectProc = [](Rect* rect, Int index, OffscreenObject object, Rect* bounds) -> Int {
+		const auto& rects = AsOffscreen(object)->Intersecting(*bounds);
+		if (index < 0 || index >= static_cast<Int>(rects.size())) return -1;
+		*rect = rects[index];
+		return 0;
+	};
+	impl.offscreenService.getBlockImageProc = [](Ptr* address, Int* rowBytes, Int* pixelBytes, Rect* blockRect, OffscreenObject object, Point* pos) -> Int {
+		auto offscreen = AsOffscreen(object);
+		auto block = offscreen->Find(pos->x, pos->y);
+		++current_->host->statistics_.blockImageCalls;
+		if (!block) { *address = nullptr; return -1; }
+		const Int width = block->rect.right - block->rect.left;
+		*pixelBytes = offscreen->canvas.pixelBytes;
+		*rowBytes = width * *pixelBytes;
+		*blockRect = block->rect;
+		*address = block->image + (pos->y - block->rect.top) * *rowBytes + (pos->x - block->rect.left) * *pixelBytes;
+		return 0;
+	};
+	impl.offscreenService.getBlockAlphaProc = [](Ptr* address, Int* rowBytes, Int* pixelBytes, Rect* blockRect, OffscreenObject object, Point* pos) -> Int {
+		auto offscreen = AsOffscreen(object);
+		auto block = offscreen->Find(pos->x, pos->y);
+		++current_->host->statistics_.blockAlphaCalls;
+		if (!block) { *address = nullptr; return -1; }
+		const Int width = block->rect.right - block->rect.left;
+		*pixelBytes = 1;
+		*rowBytes = width;
+		*blockRect = block->rect;
+		*address = block->alpha + (pos->y - block->rect.top) * width + (pos->x - block->rect.left);
+		return 0;
+	};
+	impl.offscreenService.getBlockSelectAreaProc = [](Ptr* address, Int*, Int*, Rect*, OffscreenObject, Point*) -> Int { *address = nullptr; return -1; };
+
+	impl.propertyService.createProc = [](PropertyObject* object) -> Int {
+		current_->properties.emplace_back();
+		*object = reinterpret_cast<PropertyObject>(&current_->properties.back());
+		return 0;
+	};
+	impl.propertyService.retainProc = [](PropertyObject object) -> Int { ++AsProperty(object)->references; return 0; };
+	impl.propertyService.releaseProc = [](PropertyObject object) -> Int { --AsProperty(object)->references; return 0; };
+	impl.propertyService.addItemProc = [](PropertyObject object, const Int key, const Int valueType, const Int, const Int, StringObject caption, const Char) -> Int {
+		auto& item = AsProperty(object)->items[key];
+		item.valueType = valueType;
+		if (caption) item.caption = AsString(caption)->unicode;
+		return 0;
+	};
+	impl.propertyService.setBooleanValueProc = [](PropertyObject object, const Int key, const Bool value) -> Int { current_->ItemOf(object, key).booleanValue = value; return 0; };
+	impl.propertyService.getBooleanValueProc = [](Bool* value, PropertyObject object, const Int key) -> Int { *value = current_->ItemOf(object, key).booleanValue; return 0; };
+	impl.propertyService.setBooleanDefaultValueProc = [](PropertyObject object, const Int key, const Bool value) -> Int { auto& item = current_->ItemOf(object, key); item.booleanDefault = item.booleanValue = value; return 0; };
+	impl.propertyService.getBooleanDefaultValueProc = [](Bool* value, PropertyObject object, const Int key) -> Int { *value = current_->ItemOf(object, key).booleanDefault; return 0; };
+	impl.propertyService.setIntegerValueProc = [](PropertyObject object, const Int key, const Int value) -> Int { current_->ItemOf(object, key).integerValue = value; return 0; };
+	impl.propertyService.getIntegerValueProc = [](Int* value, PropertyObject object, const Int key) -> Int { *value = current_->ItemOf(object, key).integerValue; return 0; };
+	impl.propertyService.setIntegerDefaultValueProc = [](PropertyObject object, const Int key, const Int value) -> Int { auto& item = current_->ItemOf(object, key); item.integerDefault = item.integerValue = value; return 0; };
+	impl.propertyService.getIntegerDefaultValueProc = [](Int* value, PropertyObject object, const Int key) -> Int { *value = current_->ItemOf(object, key).integerDefault; return 0; };
+	impl.propertyService.setIntegerMinValueProc = [](PropertyObject object, const Int key, const Int value) -> Int { current_->ItemOf(object, key).integerMin = value; return 0; };
+	impl.propertyService.getIntegerMinValueProc = [](Int* value, PropertyObject object, const Int key) -> Int { *value = current_->ItemOf(object, key).integerMin; return 0; };
+	impl.propertyService.setIntegerMaxValueProc = [](PropertyObject object, const Int key, const Int value) -> Int { current_->ItemOf(object, key).integerMax = value; return 0; };
+	impl.propertyService.getIntegerMaxValueProc = [](Int* value, PropertyObject object, const Int key) -> Int { *value = current_->ItemOf(object, key).integerMax; return 0; };
+	impl.propertyService.setDecimalValueProc = [](PropertyObject object, const Int key, const Double value) -> Int { current_->ItemOf(object, key).decimalValue = value; return 0; };
+	impl.propertyService.getDecimalValueProc = [](Double* value, PropertyObject object, const Int key) -> Int { *value = current_->ItemOf(object, key).decimalValue; return 0; };
+	impl.propertyService.setDecimalDefaultValueProc = [](PropertyObject object, const Int key, const Double value) -> Int { current_->ItemOf(object, key).decimalDefault = value; return 0; };
+	impl.propertyService.getDecimalDefaultValueProc = [](Double* value, PropertyObject object, const Int key) -> Int { *value = current_->ItemOf(object, key).decimalDefault; return 0; };
+	impl.propertyService.setDecimalMinValueProc = [](PropertyObject object, const Int key, const Double value) -> Int { current_->ItemOf(object, key).decimalMin = value; return 0; };
+	impl.propertyService.getDecimalMinValueProc = [](Double* value, PropertyObject object, const Int key) -> Int { *value = current_->ItemOf(object, key).decimalMin; return 0; };
+	impl.propertyService.setDecimalMaxValueProc = [](PropertyObject object, const Int key, const Double value) -> Int { current_->ItemOf(object, key).decimalMax = value; return 0; };
+	impl.propertyService.getDecimalMaxValueProc = [](Double* value, PropertyObject object, const Int key) -> Int { *value = current_->ItemOf(object, key).decimalMax; return 0; };
+
+	impl.propertyService2.setItemStoreValueProc = [](PropertyObject object, const Int key, const Bool store) -> Int { current_->ItemOf(object, key).storeValue = store != 0; return 0; };
+	impl.propertyService2.setEnumerationValueProc = [](PropertyObject object, const Int key, const Int value) -> Int { current_->ItemOf(object, key).enumerationValue = value; return 0; };
+	impl.propertyService2.getEnumerationValueProc = [](Int* value, PropertyObject object, const Int key) -> Int { *value = current_->ItemOf(object, key).enumerationValue; return 0; };
+	impl.propertyService2.setEnumerationDefaultValueProc = [](PropertyObject object, const Int key, const Int value) -> Int { current_->ItemOf(object, key).enumerationDefault = value; return 0; };
+	impl.propertyService2.getEnumerationDefaultValueProc = [](Int* value, PropertyObject object, const Int key) -> Int { *value = current_->ItemOf(object, key).enumerationDefault; return 0; };
+	impl.propertyService2.addEnumerationItemProc = [](PropertyObject object, const Int key, const Int value, StringObject caption, const Char) -> Int {
+		current_->ItemOf(object, key).enumerationItems.emplace_back(value, caption ? AsString(caption)->unicode : u"");
+		return 0;
+	};
+	impl.propertyService2.setStringValueProc = [](PropertyObject object, const Int key, StringObject value) -> Int {
+		current_->ItemOf(object, key).stringValue = current_->MakeString(value ? AsString(value)->unicode : u"");
+		return 0;
+	};
+	impl.propertyService2.getStringValueProc = [](StringObject* value, PropertyObject object, const Int key) -> Int {
+		auto& item = current_->ItemOf(object, key);
+		if (!item.stringValue) item.stringValue = current_->MakeString(u"");
+		*value = item.stringValue;
+		return 0;
+	};
+	impl.propertyService2.setStringDefaultValueProc = [](PropertyObject object, const Int key, StringObject value) -> Int {
+		current_->ItemOf(object, key).stringDefault = current_->MakeString(value ? AsString(value)->unicode : u"");
+		return 0;
+	};
+	impl.propertyService2.getStringDefaultValueProc = [](StringObject* value, PropertyObject object, const Int key) -> Int {
+		auto& item = current_->ItemOf(object, key);
+		if (!item.stringDefault) item.stringDefault = current_->MakeString(u"");
+		*value = item.stringDefault;
+		return 0;
+	};
+	impl.propertyService2.setStringMaxLengthProc = [](PropertyObject object, const Int key, const Int length) -> Int { current_->ItemOf(object, key).stringMaxLength = length; return 0; };
+	impl.propertyService2.getStringMaxLengthProc = [](Int* length, PropertyObject object, const Int key) -> Int { *length = current_->ItemOf(object, key).stringMaxLength; return 0; };
+
+	server_.recordSuite.moduleInitializeRecord = &impl.moduleInitialize;
+	server_.recordSuite.filterInitializeRecord = &impl.filterInitialize;
+	server_.recordSuite.filterRunRecord = &impl.filterRun;
+	server_.serviceSuite.stringService = &impl.stringService;
+	server_.serviceSuite.bitmapService = &impl.bitmapService;
+	server_.serviceSuite.offscreenService = &impl.offscreenService;
+	server_.serviceSuite.offscreenService2 = &impl.offscreenService2;
+	server_.serviceSuite.propertyService = &impl.propertyService;
+	server_.serviceSuite.propertyService2 = &impl.propertyService2;
+	server_.hostObject = reinterpret_cast<HostObject>(&impl);
+}
+
+Host::~Host() {
+	if (current_ == impl_.get()) current_ = nullptr;
+}
+
+void Host::Fill(const std::function<void(int, int, unsigned char&, unsigned char&, unsigned char&, unsigned char&)>& pixel) {
+	for (auto* offscreen : { &impl_->source, &impl_->destination }) {
+		const auto& canvas = offscreen->canvas;
+		for (auto& block : offscreen->blocks) {
+			const int width = block.rect.right - block.rect.left;
+			for (Int y = block.rect.top; y < block.rect.bottom; ++y) {
+				for (Int x = block.rect.left; x < block.rect.right; ++x) {
+					const size_t index = static_cast<size_t>(y - block.rect.top) * width + (x - block.rect.left);
+					unsigned char* p = block.image + index * canvas.pixelBytes;
+					pixel(x, y, p[canvas.r], p[canvas.g], p[canvas.b], block.alpha[index]);
+				}
+			}
+		}
+	}
+}
+
+void Host::ReadDestination(int x, int y, unsigned char& r, unsigned char& g, unsigned char& b, unsigned char& alpha) const {
+	auto& offscreen = impl_->destination;
+	const auto* block = offscreen.Find(x, y);
+	if (!block) { r = g = b = alpha = 0; return; }
+	const size_t index = static_cast<size_t>(y - block->rect.top) * (block->rect.right - block->rect.left) + (x - block->rect.left);
+	const unsigned char* p = block->image + index * offscreen.canvas.pixelBytes;
+	r = p[offscreen.canvas.r]; g = p[offscreen.canvas.g]; b = p[offscreen.canvas.b]; alpha = block->alpha[index];
+}
+
+void Host::SetBoolean(int itemKey, bool value) { impl_->ItemOf(impl_->property, itemKey).booleanValue = value; impl_->Notify(itemKey); }
+void Host::SetInteger(int itemKey, int value) { impl_->ItemOf(impl_->property, itemKey).integerValue = value; impl_->Notify(itemKey); }
+void Host::SetDecimal(int itemKey, double value) { impl_->ItemOf(impl_->property, itemKey).decimalValue = value; impl_->Notify(itemKey); }
+void Host::SetEnumeration(int itemKey, int value) { impl_->ItemOf(impl_->property, itemKey).enumerationValue = value; impl_->Notify(itemKey); }
+void Host::SetString(int itemKey, const std::u16string& value) { impl_->ItemOf(impl_->property, itemKey).stringValue = impl_->MakeString(value); impl_->Notify(itemKey); }
+
+bool Initialize(EntryPoint entry, Host& host, FilterPlugIn::Ptr& data) {
+	CallResult result = CallResult::Failed;
+	entry(&result, &data, Selector::ModuleInitialize, host.Server(), nullptr);
+	if (result != CallResult::Success) return false;
+	entry(&result, &data, Selector::FilterInitialize, host.Server(), nullptr);
+	return result == CallResult::Success;
+}
+
+bool Run(EntryPoint entry, Host& host, FilterPlugIn::Ptr& data) {
+	host.ResetStatistics();
+	CallResult result = CallResult::Failed;
+	entry(&result, &data, Selector::FilterRun, host.Server(), nullptr);
+	return result == CallResult::Success;
+}
+
+void Terminate(EntryPoint entry, Host& host, FilterPlugIn::Ptr& data) {
+	CallResult result = CallResult::Failed;
+	entry(&result, &data, Selector::FilterTerminate, host.Server(), nullptr);
+	entry(&result, &data, Selector::ModuleTerminate, host.Server(), nullptr);
+}
+
+}
@@ -0,0 +1,103 @@
+/**
+ * @file HostSimulator.h
+ * @brief CLIP STUDIO の代わりに FilterPlugIn::Server を用意し、プラグインのエントリーポイントを Linux 上で動かすホストシミュレーター
+ *
+ * オフスクリーン・プロパティ・文字列サービスと、モジュール初期化・フィルタ初期化・フィルタ実行レコードを
+ * メモリ上で実装する。ブロックの分割、画素の並び（r/g/b の位置とピクセルのバイト数）、選択範囲、
+ * Process が返す結果（Continue/Restart/Exit）は設定で変えられる。
+ */
+#pragma once
+
+#include "FilterPlugIn.h"
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace HostSimulator {
+
+/// シミュレートするレイヤーと選択範囲
+struct Canvas {
+	FilterPlugIn::Rect layerRect{ 0, 0, 1024, 1024 };	///< レイヤーの範囲（GetRect / GetExtentRect が返す）
+	FilterPlugIn::Rect selectRect{};					///< 選択範囲の外接矩形（空なら選択なし）
+	int blockWidth = 256;								///< ブロックの大きさ（ホストのタイル）
+	int blockHeight = 256;
+	int pixelBytes = 4;									///< 1画素のバイト数
+	int r = 2, g = 1, b = 0;							///< 画素内の R/G/B の位置
+	std::string scratchDirectory;						///< 空でなければ、画像をこのフォルダーの一時ファイルにマップする（巨大なキャンバス用）
+};
+
+/// @brief 1つのホストを表す。Server() をプラグインのエントリーポイントに渡す。
+/// @note 画像はブロック毎に別々の範囲に持ち、ホストと同じくブロックをまたいだアドレス計算はできないようにする。
+class Host {
+public:
+	explicit Host(const Canvas& canvas = Canvas{});
+	~Host();
+	Host(const Host&) = delete;
+	Host& operator=(const Host&) = delete;
+
+	FilterPlugIn::Server* Server() { return &server_; }
+
+	/// ソースの画素を関数で埋める（色は 0～255、アルファも同じ）。デスティネーションにもコピーする。
+	void Fill(const std::function<void(int x, int y, unsigned char& r, unsigned char& g, unsigned char& b, unsigned char& alpha)>& pixel);
+
+	/// デスティネーションの画素を読む
+	void ReadDestination(int x, int y, unsigned char& r, unsigned char& g, unsigned char& b, unsigned char& alpha) const;
+
+	/// @brief Process が呼ばれる度に、返す結果を決める
+	/// @param state Start/Continue/End（FilterPlugIn::Run::States の値）
+	/// @param call このフィルタ実行で何回目の Process か（0から）
+	/// @return FilterPlugIn::Run::Results の値。未設定なら Start/Continue は Continue、End は Exit を返す。
+	using ProcessScript = std::function<FilterPlugIn::Int(FilterPlugIn::Int state, int call)>;
+	void SetProcessScript(ProcessScript script) { processScript_ = std::move(script); }
+
+	/// プロパティの値をダイアログで変更したことにする（プロパティのコールバックも呼ぶ）
+	void SetBoolean(int itemKey, bool value);
+	void SetInteger(int itemKey, int value);
+	void SetDecimal(int itemKey, double value);
+	void SetEnumeration(int itemKey, int value);
+	void SetString(int itemKey, const std::u16string& value);
+
+	/// 直近のフィルタ実行の統計（Run を呼ぶとリセットする）
+	struct Statistics {
+		int processCalls = 0;
+		int restarts = 0;
+		int updateRects = 0;
+		long long updatedPixels = 0;
+		int blockImageCalls = 0;
+		int blockAlphaCalls = 0;
+	};
+	const Statistics& GetStatistics() const { return statistics_; }
+	void ResetStatistics() { statistics_ = Statistics{}; }
+
+	/// プラグインが登録したフィルタの情報
+	const std::string& FilterName() const { return filterName_; }
+	bool CanPreview() const { return canPreview_; }
+
+private:
+	struct Impl;
+	friend struct Impl;
+	static Impl* current_;
+	std::unique_ptr<Impl> impl_;
+	FilterPlugIn::Server server_{};
+	ProcessScript processScript_;
+	Statistics statistics_;
+	std::string filterName_;
+	bool canPreview_ = false;
+};
+
+/// @brief プラグインのエントリーポイントを呼ぶ
+/// @param entry TriglavPluginCall と同じシグネチャの関数
+using EntryPoint = void (*)(FilterPlugIn::CallResult*, FilterPlugIn::Ptr*, FilterPlugIn::Selector, FilterPlugIn::Server*, void*);
+
+/// モジュール初期化→フィルタ初期化の順に呼ぶ
+bool Initialize(EntryPoint entry, Host& host, FilterPlugIn::Ptr& data);
+/// フィルタを実行する（ProcessScript が Exit を返すまで、Restart を繰り返す）
+bool Run(EntryPoint entry, Host& host, FilterPlugIn::Ptr& data);
+/// フィルタ終了→モジュール終了の順に呼ぶ
+void Terminate(EntryPoint entry, Host& host, FilterPlugIn::Ptr& data);
+
+}
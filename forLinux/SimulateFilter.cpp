@@ -0,0 +1,246 @@
+/**
+ * @file SimulateFilter.cpp
+ * @brief ホストシミュレーター上でプラグインのエントリーポイントを動かすコマンド（ベンチマーク・動作確認用）
+ *
+ * プラグイン本体（ComfyUIPlugin.cpp）を静的にリンクし、TriglavPluginCall をホストと同じ順序で呼ぶ。
+ * 設定ファイル・テンプレート・ログは、実行ファイルと同じフォルダーのものを使う。
+ */
+#include "pch.h"
+
+#include "HostSimulator.h"
+
+#include "ComfyUIPluginInternal.h"
+#include "ComvertImage.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+extern "C" void TriglavPluginCall(FilterPlugIn::CallResult* result, FilterPlugIn::Ptr* data, FilterPlugIn::Selector selector, FilterPlugIn::Server* server, void* reserved);
+
+namespace {
+
+/// ComfyUIPlugin.cpp の PropertyKey と同じ値
+enum PropertyKey {
+	ITEM_SETTING = 1,
+	ITEM_PROMPT = 9,
+	ITEM_NPROMPT = 10,
+	ITEM_USE_SELECTION_AS_MASK = 14,
+	ITEM_VARIANT_COUNT = 16,
+	ITEM_FAST_PREVIEW = 19,
+};
+
+struct Options {
+	HostSimulator::Canvas canvas;
+	int runs = 1;
+	int restarts = 0;
+	int exitAfter = -1;
+	int exitAfterMs = -1;
+	int exitAfterUpdates = -1;
+	int restartAfterMs = -1;
+	int setting = -1;
+	int variants = 0;
+	bool mask = false;
+	bool fastPreview = false;
+	std::string prompt;
+	std::string negativePrompt;
+	std::string output;
+};
+
+void PrintUsage() {
+	std::fprintf(stderr,
+		"usage: SimulateFilter [options]\n"
+		"  --size WxH             レイヤーの大きさ（既定 1024x1024）\n"
+		"  --origin X,Y           レイヤーの左上の座標（既定 0,0）\n"
+		"  --block WxH            ブロックの大きさ（既定 256x256）\n"
+		"  --layout bgra|rgba|bgr|rgb  画素の並び（既定 bgra）\n"
+		"  --select L,T,R,B       選択範囲の外接矩形（既定 選択なし）\n"
+		"  --mask                 選択範囲をマスクとして使う\n"
+		"  --setting N            テンプレートの番号（0から）\n"
+		"  --prompt TEXT          プロンプト（UTF-8）\n"
+		"  --nprompt TEXT         ネガティブプロンプト（UTF-8）\n"
+		"  --variants N           バリエーションの数\n"
+		"  --fast-preview         高速プレビューをオンにする（enable_preview の場合）\n"
+		"  --runs N               フィルタ実行の回数（既定 1）\n"
+		"  --restarts N           各フィルタ実行で、書き戻しの後に Restart を返す回数\n"
+		"  --exit-after N         N 回目の Process で Exit を返す（キャンセルの確認）\n"
+		"  --exit-after-ms MS     フィルタ実行の開始から MS ミリ秒後の Process で Exit を返す\n"
+		"  --exit-after-updates N 書き戻しの矩形が N 個になった後の Process で Exit を返す\n"
+		"  --restart-after-ms MS  各フィルタ実行の開始から MS ミリ秒後の Process で1度だけ Restart を返す\n"
+		"  --output PATH          最後の結果（デスティネーション）を PNG で保存する\n"
+		"  --scratch DIR          レイヤーの画像を DIR の一時ファイルにマップする（メモリに収まらない大きさ用）\n");
+}
+
+bool ParsePair(const char* text, int& a, int& b, char separator) {
+	char extra = 0;
+	const char format[] = { '%', 'd', separator, '%', 'd', '%', 'c', 0 };
+	return std::sscanf(text, format, &a, &b, &extra) == 2;
+}
+
+bool ParseOptions(int argc, char** argv, Options& options) {
+	auto& canvas = options.canvas;
+	int width = canvas.layerRect.right - canvas.layerRect.left, height = canvas.layerRect.bottom - canvas.layerRect.top;
+	int left = 0, top = 0;
+	for (int i = 1; i < argc; ++i) {
+		const std::string name = argv[i];
+		if (name == "--mask") { options.mask = true; continue; }
+		if (name == "--fast-preview") { options.fastPreview = true; continue; }
+		if (i + 1 >= argc) return false;
+		const char* value = argv[++i];
+		if (name == "--size") { if (!ParsePair(value, width, height, 'x')) return false; }
+		else if (name == "--origin") { if (!ParsePair(value, left, top, ',')) return false; }
+		else if (name == "--block") { if (!ParsePair(value, canvas.blockWidth, canvas.blockHeight, 'x')) return false; }
+		else if (name == "--layout") {
+			const std::string layout = value;
+			if (layout == "bgra") { canvas.pixelBytes = 4; canvas.r = 2; canvas.g = 1; canvas.b = 0; }
+			else if (layout == "rgba") { canvas.pixelBytes = 4; canvas.r = 0; canvas.g = 1; canvas.b = 2; }
+			else if (layout == "bgr") { canvas.pixelBytes = 3; canvas.r = 2; canvas.g = 1; canvas.b = 0; }
+			else if (layout == "rgb") { canvas.pixelBytes = 3; canvas.r = 0; canvas.g = 1; canvas.b = 2; }
+			else return false;
+		}
+		else if (name == "--select") {
+			int l = 0, t = 0, r = 0, b = 0;
+			if (std::sscanf(value, "%d,%d,%d,%d", &l, &t, &r, &b) != 4) return false;
+			canvas.selectRect = { l, t, r, b };
+		}
+		else if (name == "--setting") options.setting = std::atoi(value);
+		else if (name == "--prompt") options.prompt = value;
+		else if (name == "--nprompt") options.negativePrompt = value;
+		else if (name == "--variants") options.variants = std::atoi(value);
+		else if (name == "--runs") options.runs = std::atoi(value);
+		else if (name == "--restarts") options.restarts = std::atoi(value);
+		else if (name == "--exit-after") options.exitAfter = std::atoi(value);
+		else if (name == "--exit-after-ms") options.exitAfterMs = std::atoi(value);
+		else if (name == "--exit-after-updates") options.exitAfterUpdates = std::atoi(value);
+		else if (name == "--restart-after-ms") options.restartAfterMs = std::atoi(value);
+		else if (name == "--output") options.output = value;
+		else if (name == "--scratch") canvas.scratchDirectory = value;
+		else return false;
+	}
+	if (width <= 0 || height <= 0 || canvas.blockWidth <= 0 || canvas.blockHeight <= 0 || options.runs <= 0) return false;
+	canvas.layerRect = { left, top, left + width, top + height };
+	// 選択範囲が無い場合、ホストはレイヤー全体を返す
+	if (FilterPlugIn::isRectEmpty(canvas.selectRect)) canvas.selectRect = canvas.layerRect;
+	return true;
+}
+
+std::u16string ToUtf16(const std::string& text) {
+	std::u16string out;
+	for (size_t i = 0; i < text.size();) {
+		const unsigned char c = static_cast<unsigned char>(text[i]);
+		char32_t code = c;
+		int extra = 0;
+		if (c >= 0xF0) { code = c & 0x07; extra = 3; }
+		else if (c >= 0xE0) { code = c & 0x0F; extra = 2; }
+		else if (c >= 0xC0) { code = c & 0x1F; extra = 1; }
+		++i;
+		for (int k = 0; k < extra && i < text.size(); ++k, ++i) code = (code << 6) | (static_cast<unsigned char>(text[i]) & 0x3F);
+		if (code >= 0x10000) { code -= 0x10000; out += static_cast<char16_t>(0xD800 + (code >> 10)); out += static_cast<char16_t>(0xDC00 + (code & 0x3FF)); }
+		else out += static_cast<char16_t>(code);
+	}
+	return out;
+}
+
+bool SaveDestination(const HostSimulator::Host& host, const FilterPlugIn::Rect& rect, const std::string& path) {
+	const int width = rect.right - rect.left, height = rect.bottom - rect.top;
+	std::vector<unsigned char> rgba(static_cast<size_t>(width) * height * 4);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			unsigned char* p = rgba.data() + (static_cast<size_t>(y) * width + x) * 4;
+			host.ReadDestination(rect.left + x, rect.top + y, p[0], p[1], p[2], p[3]);
+		}
+	}
+	std::string error;
+	if (!ComvertImage::WriteRgbaPng(path, rgba.data(), width, height, &error)) {
+		std::fprintf(stderr, "Could not save %s: %s\n", path.c_str(), error.c_str());
+		return false;
+	}
+	return true;
+}
+
+}
+
+int main(int argc, char** argv) {
+	Options options;
+	if (!ParseOptions(argc, argv, options)) {
+		PrintUsage();
+		return 2;
+	}
+
+	HostSimulator::Host host(options.canvas);
+	// 確認しやすいよう、位置で色が変わるグラデーションを入れる
+	host.Fill([](int x, int y, unsigned char& r, unsigned char& g, unsigned char& b, unsigned char& alpha) {
+		r = static_cast<unsigned char>(x);
+		g = static_cast<unsigned char>(y);
+		b = static_cast<unsigned char>((x + y) / 2);
+		alpha = 255;
+	});
+
+	using Clock = std::chrono::steady_clock;
+	const auto milliseconds = [](Clock::time_point start) { return std::chrono::duration<double, std::milli>(Clock::now() - start).count(); };
+
+	int restartsLeft = 0;
+	bool restartedMidRun = false;
+	auto runStart = Clock::now();
+	host.SetProcessScript([&](FilterPlugIn::Int state, int call) -> FilterPlugIn::Int {
+		using Results = FilterPlugIn::Run::Results;
+		if (options.exitAfter >= 0 && call >= options.exitAfter) return static_cast<FilterPlugIn::Int>(Results::Exit);
+		// 時間や書き戻しの量で止めると、アップロード・生成待ち・デコード中のキャンセルを再現できる
+		if (options.exitAfterMs >= 0 && milliseconds(runStart) >= options.exitAfterMs) return static_cast<FilterPlugIn::Int>(Results::Exit);
+		if (options.exitAfterUpdates >= 0 && host.GetStatistics().updateRects >= options.exitAfterUpdates) return static_cast<FilterPlugIn::Int>(Results::Exit);
+		// 生成待ちなどの途中でパラメーターを変えたことにする（ダイアログを開いたままのキャンセルと再実行）
+		if (options.restartAfterMs >= 0 && !restartedMidRun && milliseconds(runStart) >= options.restartAfterMs) {
+			restartedMidRun = true;
+			return static_cast<FilterPlugIn::Int>(Results::Restart);
+		}
+		if (state != static_cast<FilterPlugIn::Int>(FilterPlugIn::Run::States::End)) return static_cast<FilterPlugIn::Int>(Results::Continue);
+		if (restartsLeft > 0) {
+			--restartsLeft;
+			return static_cast<FilterPlugIn::Int>(Results::Restart);
+		}
+		return static_cast<FilterPlugIn::Int>(Results::Exit);
+	});
+
+	FilterPlugIn::Ptr data = nullptr;
+	auto start = Clock::now();
+	if (!HostSimulator::Initialize(TriglavPluginCall, host, data)) {
+		std::fprintf(stderr, "Plug-in initialization failed.\n");
+		return 1;
+	}
+	std::printf("{\"filter\":\"%s\",\"can_preview\":%s,\"initialize_ms\":%.3f,\"runs\":[\n", host.FilterName().c_str(), host.CanPreview() ? "true" : "false", milliseconds(start));
+
+	if (options.setting >= 0) host.SetEnumeration(ITEM_SETTING, options.setting);
+	if (!options.prompt.empty()) host.SetString(ITEM_PROMPT, ToUtf16(options.prompt));
+	if (!options.negativePrompt.empty()) host.SetString(ITEM_NPROMPT, ToUtf16(options.negativePrompt));
+	if (options.variants > 0) host.SetInteger(ITEM_VARIANT_COUNT, options.variants);
+	if (options.mask) host.SetBoolean(ITEM_USE_SELECTION_AS_MASK, true);
+	if (options.fastPreview) host.SetBoolean(ITEM_FAST_PREVIEW, true);
+
+	bool succeeded = true;
+	for (int run = 0; run < options.runs; ++run) {
+		restartsLeft = options.restarts;
+		restartedMidRun = false;
+		start = Clock::now();
+		runStart = start;
+		const bool ok = HostSimulator::Run(TriglavPluginCall, host, data);
+		const double elapsed = milliseconds(start);
+		succeeded = succeeded && ok;
+		const auto& statistics = host.GetStatistics();
+		// 画像バッファのプールは実行（Restart 毎）の始めに統計をリセットするので、最後の実行の使用量になる
+		const auto& pool = static_cast<FilterInfo*>(data)->buffer_pool;
+		const auto poolStatistics = pool.GetStatistics();
+		std::string stagePeaks;
+		for (const auto& stage : pool.GetStageStatistics()) stagePeaks += (stagePeaks.empty() ? "\"" : ",\"") + std::string(stage.stage) + "\":" + std::to_string(stage.peakBytes);
+		std::printf("%s{\"ok\":%s,\"ms\":%.3f,\"process_calls\":%d,\"restarts\":%d,\"update_rects\":%d,\"updated_pixels\":%lld,\"block_image_calls\":%d,\"block_alpha_calls\":%d,"
+			"\"buffer_peak_bytes\":%zu,\"buffer_mapped_peak_bytes\":%zu,\"stage_peak_bytes\":{%s}}",
+			run ? ",\n" : "", ok ? "true" : "false", elapsed, statistics.processCalls, statistics.restarts, statistics.updateRects, statistics.updatedPixels,
+			statistics.blockImageCalls, statistics.blockAlphaCalls, poolStatistics.peakInUseBytes, poolStatistics.peakMappedBytes, stagePeaks.c_str());
+	}
+	std::printf("\n]}\n");
+
+	if (!options.output.empty() && !SaveDestination(host, options.canvas.layerRect, options.output)) succeeded = false;
+	HostSimulator::Terminate(TriglavPluginCall, host, data);
+	return succeeded ? 0 : 1;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+set -eu
+
+ROOT=$(CDPATH= cd -- "$(dirname -- "$0")" && pwd)
+SHARED_SRC=$(CDPATH= cd -- "$ROOT/../src" && pwd)
+BUILD_DIR="$ROOT/build"
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:-"-O2"}
+
+if [ ! -f "$SHARED_SRC/ComfyUIPlugin.cpp" ] || [ ! -f "$SHARED_SRC/ComvertImage_linux.cpp" ]; then
+    echo "共通 src が見つかりません。forLinux は ComfyUIPlugin リポジトリ直下に配置してください。" >&2
+    exit 1
+fi
+
+convert_ini_to_utf8() {
+    input=$1
+    output=$2
+    if ! iconv -f CP932 -t UTF-8 "$input" > "$output"; then
+        echo "INI ファイルの UTF-8 変換に失敗しました: $input" >&2
+        exit 1
+    fi
+}
+
+mkdir -p "$BUILD_DIR/SubImage" "$BUILD_DIR/obj" "$BUILD_DIR/tests"
+
+# プラグイン本体と共通 src は一度だけコンパイルし、各コマンドにリンクする
+# （GetBasePath は実行ファイルのフォルダーを返す）
+objects=""
+for source in ComfyUIPlugin.cpp BufferPool.cpp ResizeImage.cpp ResultCache.cpp Logger.cpp Trace.cpp Metrics.cpp ComvertImage_linux.cpp FilterPlugIn.cpp; do
+    object="$BUILD_DIR/obj/${source%.cpp}.o"
+    # shellcheck disable=SC2086
+    "$CXX" -std=c++20 $CXXFLAGS -I"$SHARED_SRC" -c "$SHARED_SRC/$source" -o "$object"
+    objects="$objects $object"
+done
+
+link_tool() {
+    output=$1
+    shift
+    # shellcheck disable=SC2086
+    "$CXX" -std=c++20 $CXXFLAGS -I"$SHARED_SRC" -I"$ROOT" "$@" $objects -o "$BUILD_DIR/$output" -lpng -ldl -pthread
+}
+
+link_tool SimulateFilter "$ROOT/HostSimulator.cpp" "$ROOT/SimulateFilter.cpp"
+link_tool BenchmarkKernels "$ROOT/BenchmarkKernels.cpp"
+# tests の C++ のテスト（run_tests.sh から、スタブサーバーに対して実行する）
+link_tool tests/StressWorkspaces "$ROOT/tests/StressWorkspaces.cpp"
+link_tool tests/BmpRoundTrip "$ROOT/tests/BmpRoundTrip.cpp"
+
+# 設定ファイルが既にあれば、書き換えた内容を残す
+[ -f "$BUILD_DIR/ComfyUIPlugin.ini" ] || convert_ini_to_utf8 "$SHARED_SRC/ComfyUIPlugin.ini" "$BUILD_DIR/ComfyUIPlugin.ini"
+# ユーザー設定とテンプレートは、スタブサーバー（stub_comfyui.py）で動かすためのもの
+[ -f "$BUILD_DIR/UserSetting.ini" ] || cp "$ROOT/UserSetting.ini" "$BUILD_DIR/UserSetting.ini"
+[ -f "$BUILD_DIR/template_stub.json" ] || cp "$ROOT/template_stub.json" "$BUILD_DIR/template_stub.json"
+
+echo "Built: $BUILD_DIR/SimulateFilter $BUILD_DIR/BenchmarkKernels $BUILD_DIR/tests"
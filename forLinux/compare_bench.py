@@ -0,0 +1,58 @@
+import argparse
+import json
+import sys
+
+
+def load_results(path: str) -> dict:
+    # ベンチマーク名 → 結果
+    with open(path, encoding="utf-8") as file:
+        data = json.load(file)
+    return {entry["name"]: entry for entry in data["benchmarks"]}
+
+
+def throughput(entry: dict) -> tuple:
+    # MB/s があればそれを、無ければ ops/s を比べる
+    if "mb_per_s" in entry:
+        return entry["mb_per_s"], "MB/s"
+    return entry["ops_per_s"], "ops/s"
+
+
+def compare(base_path: str, new_path: str, threshold: float) -> int:
+    base = load_results(base_path)
+    new = load_results(new_path)
+    regressions = 0
+    width = max([len(name) for name in list(base) + list(new)] + [9])
+    print(f"{'benchmark':<{width}}  {'base':>12}  {'new':>12}  {'change':>8}")
+    for name in sorted(set(base) | set(new)):
+        if name not in new:
+            print(f"{name:<{width}}  (新しい結果にありません)")
+            continue
+        if name not in base:
+            print(f"{name:<{width}}  (基準の結果にありません)")
+            continue
+        if base[name].get("params") != new[name].get("params"):
+            print(f"{name:<{width}}  (条件が違います: {base[name].get('params')} / {new[name].get('params')})")
+            continue
+        before, unit = throughput(base[name])
+        after, _ = throughput(new[name])
+        change = (after - before) / before if before > 0 else 0.0
+        mark = ""
+        # スループットが threshold 以上落ちたものを後退とする
+        if change < -threshold:
+            mark = "  REGRESSION"
+            regressions += 1
+        elif change > threshold:
+            mark = "  improved"
+        print(f"{name:<{width}}  {before:>12.1f}  {after:>12.1f}  {change:>+7.1%}{mark}  {unit}")
+    if regressions:
+        print(f"{regressions} 件のベンチマークが {threshold:.0%} 以上遅くなりました。")
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="BenchmarkKernels の2つの結果を比べ、遅くなったものを報告する")
+    parser.add_argument("base", help="基準の結果（JSON）")
+    parser.add_argument("new", help="比べる結果（JSON）")
+    parser.add_argument("--threshold", type=float, default=0.10, help="後退とみなす低下の割合（既定 0.10 = 10%%）")
+    args = parser.parse_args()
+    sys.exit(compare(args.base, args.new, args.threshold))
@@ -0,0 +1,14 @@
+#!/bin/sh
+set -eu
+
+ROOT=$(CDPATH= cd -- "$(dirname -- "$0")" && pwd)
+BUILD_DIR="$ROOT/build"
+
+if [ ! -x "$BUILD_DIR/SimulateFilter" ] || [ ! -x "$BUILD_DIR/tests/StressWorkspaces" ] || [ ! -x "$BUILD_DIR/tests/BmpRoundTrip" ]; then
+    echo "先に build.sh を実行してください。" >&2
+    exit 1
+fi
+
+# SimulateFilter と tests の C++ のテストを、スタブサーバー（stub_comfyui.py）に対して動かすテスト
+python3 -m unittest discover -s "$ROOT/tests" -p "test_*.py" "$@"
+echo "All tests passed."
@@ -0,0 +1,209 @@
+import argparse
+import json
+import re
+import struct
+import sys
+import threading
+import time
+import uuid
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+# ComfyUI の代わりに、プラグインが使う API（/upload/image・/prompt・/history・/view・/queue・/interrupt）だけを返すサーバー
+# 生成結果は、プロンプトが参照する入力画像と同じ大きさの単色の PNG にする（書き戻しで全てのタイルが変わる）
+
+OUTPUT_SUBFOLDER = "CLIPSTUDIO_ComfyUI_PLUGIN"
+OUTPUT_COLOR = (255, 128, 0)
+FALLBACK_SIZE = (64, 64)
+
+
+def png_size(data: bytes) -> tuple:
+    # IHDR の幅と高さ。PNG でなければ None
+    if len(data) < 24 or data[:8] != b"\x89PNG\r\n\x1a\n" or data[12:16] != b"IHDR":
+        return None
+    return struct.unpack(">II", data[16:24])
+
+
+def make_png(width: int, height: int, color: tuple) -> bytes:
+    def chunk(kind: bytes, body: bytes) -> bytes:
+        return struct.pack(">I", len(body)) + kind + body + struct.pack(">I", zlib.crc32(kind + body) & 0xFFFFFFFF)
+
+    # 大きな画像でも画素全体をメモリに並べないよう、行毎に圧縮する
+    row = b"\x00" + bytes(color) * width
+    compressor = zlib.compressobj(1)
+    data = b"".join(compressor.compress(row) for _ in range(height)) + compressor.flush()
+    header = struct.pack(">IIBBBBB", width, height, 8, 2, 0, 0, 0)
+    return b"\x89PNG\r\n\x1a\n" + chunk(b"IHDR", header) + chunk(b"IDAT", data) + chunk(b"IEND", b"")
+
+
+def parse_multipart(body: bytes, content_type: str) -> dict:
+    # フォームのフィールド名 → (ファイル名, 内容)
+    match = re.search(r"boundary=\"?([^\";]+)\"?", content_type)
+    if not match:
+        return {}
+    boundary = b"--" + match.group(1).encode()
+    fields = {}
+    for part in body.split(boundary)[1:]:
+        if part.startswith(b"--"):
+            break
+        head, _, content = part.partition(b"\r\n\r\n")
+        disposition = head.decode("utf-8", "replace")
+        name = re.search(r'name="([^"]*)"', disposition)
+        filename = re.search(r'filename="([^"]*)"', disposition)
+        if name:
+            fields[name.group(1)] = (filename.group(1) if filename else "", content[:-2] if content.endswith(b"\r\n") else content)
+    return fields
+
+
+class StubState:
+    def __init__(self, upload_delay: float, prompt_delay: float, history_delay: float, view_delay: float):
+        self.upload_delay = upload_delay
+        self.prompt_delay = prompt_delay
+        self.history_delay = history_delay
+        self.view_delay = view_delay
+        self.lock = threading.Lock()
+        self.inputs = {}
+        self.outputs = {}
+        self.prompts = {}
+        self.counts = {}
+        self.output_number = 0
+
+    def count(self, name: str) -> None:
+        with self.lock:
+            self.counts[name] = self.counts.get(name, 0) + 1
+
+    def add_prompt(self, prompt: dict) -> str:
+        # プロンプトが参照するアップロード済みの入力画像（最初に見つかったもの）の大きさで結果を作る
+        text = json.dumps(prompt)
+        with self.lock:
+            size = None
+            for name, data in self.inputs.items():
+                if json.dumps(name) in text:
+                    size = png_size(data)
+                    if size:
+                        break
+            self.output_number += 1
+            filename = f"CCPImage_{self.output_number:05d}_.png"
+            self.outputs[filename] = make_png(*(size or FALLBACK_SIZE), OUTPUT_COLOR)
+            prompt_id = str(uuid.uuid4())
+            self.prompts[prompt_id] = {"submitted": time.time(), "filename": filename}
+        return prompt_id
+
+
+class StubHandler(BaseHTTPRequestHandler):
+    server_version = "StubComfyUI/1.0"
+
+    @property
+    def state(self) -> StubState:
+        return self.server.state
+
+    def log_message(self, format, *args):
+        pass
+
+    def send_body(self, status: int, body: bytes, content_type: str = "application/json") -> None:
+        try:
+            self.send_response(status)
+            self.send_header("Content-Type", content_type)
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+        except (BrokenPipeError, ConnectionResetError):
+            # キャンセルで curl が終了した
+            pass
+
+    def send_json(self, value, status: int = 200) -> None:
+        self.send_body(status, json.dumps(value).encode())
+
+    def read_body(self) -> bytes:
+        return self.rfile.read(int(self.headers.get("Content-Length", 0)))
+
+    def do_POST(self):
+        path = urlparse(self.path).path
+        body = self.read_body()
+        if path == "/upload/image":
+            self.state.count("upload")
+            time.sleep(self.state.upload_delay)
+            fields = parse_multipart(body, self.headers.get("Content-Type", ""))
+            if "image" not in fields or not fields["image"][0]:
+                self.send_json({"error": "no image"}, 400)
+                return
+            filename, data = fields["image"]
+            with self.state.lock:
+                self.state.inputs[filename] = data
+            self.send_json({"name": filename, "subfolder": "", "type": "input"})
+        elif path == "/prompt":
+            self.state.count("prompt")
+            time.sleep(self.state.prompt_delay)
+            try:
+                prompt = json.loads(body)["prompt"]
+            except (ValueError, KeyError):
+                self.send_json({"error": "invalid prompt"}, 400)
+                return
+            prompt_id = self.state.add_prompt(prompt)
+            self.send_json({"prompt_id": prompt_id, "number": self.state.output_number, "node_errors": {}})
+        elif path in ("/queue", "/interrupt"):
+            self.state.count(path[1:])
+            self.send_json({})
+        else:
+            self.send_json({"error": "not found"}, 404)
+
+    def do_GET(self):
+        url = urlparse(self.path)
+        if url.path.startswith("/history/"):
+            self.state.count("history")
+            prompt_id = url.path[len("/history/"):]
+            with self.state.lock:
+                prompt = self.state.prompts.get(prompt_id)
+            # 生成に history_delay 秒掛かったことにする（それまでは空のヒストリー）
+            if not prompt or time.time() - prompt["submitted"] < self.state.history_delay:
+                self.send_json({})
+                return
+            start = int(prompt["submitted"] * 1000)
+            end = start + int(self.state.history_delay * 1000)
+            self.send_json({prompt_id: {
+                "outputs": {"9": {"images": [{"filename": prompt["filename"], "subfolder": OUTPUT_SUBFOLDER, "type": "output"}]}},
+                "status": {"status_str": "success", "completed": True, "messages": [
+                    ["execution_start", {"prompt_id": prompt_id, "timestamp": start}],
+                    ["execution_success", {"prompt_id": prompt_id, "timestamp": end}]]},
+            }})
+        elif url.path == "/view":
+            self.state.count("view")
+            time.sleep(self.state.view_delay)
+            query = parse_qs(url.query)
+            filename = query.get("filename", [""])[0]
+            kind = query.get("type", ["output"])[0]
+            with self.state.lock:
+                data = (self.state.inputs if kind == "input" else self.state.outputs).get(filename)
+            if data is None:
+                self.send_json({"error": "not found"}, 404)
+            else:
+                self.send_body(200, data, "image/png")
+        else:
+            self.send_json({"error": "not found"}, 404)
+
+
+def start_server(port: int = 0, upload_delay: float = 0.0, history_delay: float = 0.0, view_delay: float = 0.0, prompt_delay: float = 0.0) -> ThreadingHTTPServer:
+    # テストから使う。別スレッドで応答し、server.state で受け取った内容を確認できる
+    server = ThreadingHTTPServer(("127.0.0.1", port), StubHandler)
+    server.daemon_threads = True
+    server.state = StubState(upload_delay, prompt_delay, history_delay, view_delay)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="SimulateFilter 用の ComfyUI のスタブサーバー")
+    parser.add_argument("--port", type=int, default=8188, help="待ち受けるポート（既定 8188、0 なら空いているポート）")
+    parser.add_argument("--upload-delay", type=float, default=0.0, help="/upload/image の応答を遅らせる秒数")
+    parser.add_argument("--prompt-delay", type=float, default=0.0, help="/prompt の応答を遅らせる秒数")
+    parser.add_argument("--history-delay", type=float, default=0.0, help="/prompt から /history に結果が出るまでの秒数")
+    parser.add_argument("--view-delay", type=float, default=0.0, help="/view の応答を遅らせる秒数")
+    args = parser.parse_args()
+    server = start_server(args.port, args.upload_delay, args.history_delay, args.view_delay, args.prompt_delay)
+    print(f"Stub ComfyUI listening on http://127.0.0.1:{server.server_address[1]}", flush=True)
+    try:
+        threading.Event().wait()
+    except KeyboardInterrupt:
+        server.shutdown()
+        sys.exit(0)
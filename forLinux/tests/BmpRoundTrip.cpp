@@ -0,0 +1,108 @@
+/**
+ * @file BmpRoundTrip.cpp
+ * @brief 24bit BMP の書き出しと読み込み（write_bmp_file・load_bmp_rgb_to_buffer・read24BitBmpBlock）の往復を確かめるテスト
+ *
+ * 行のパディングが変わる幅を含むいくつかの大きさで、ヒープのバッファとスクラッチファイルにマップしたバッファの両方から
+ * BMP を書き出し、読み戻した画素が元と一致すること、2つのファイルが同じバイト列になることを確かめる。
+ * test_bmp.py から実行する（サーバーは使わない）。
+ */
+#include "pch.h"
+
+#include "ComfyUIPluginInternal.h"
+#include "Logger.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+int g_Failures = 0;
+
+void Fail(const std::string& message) {
+	std::fprintf(stderr, "FAIL: %s\n", message.c_str());
+	++g_Failures;
+}
+
+std::string ReadFile(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+/// 1つの大きさを書き出して読み戻す
+/// @param mapped true ならプールの全てのバッファをスクラッチファイルにマップする
+/// @return 書き出した BMP のパス（失敗した場合は空文字列）
+std::string RoundTrip(const std::filesystem::path& folder, int width, int height, bool mapped) {
+	const std::string label = std::to_string(width) + "x" + std::to_string(height) + (mapped ? " mapped" : " heap");
+	BufferPool pool;
+	if (mapped) pool.SetMappedThreshold(1, (folder / "scratch").string() + "/");
+
+	ImageBuffer source(pool);
+	if (!source.allocate(width, height, false)) { Fail(label + ": could not allocate the source"); return ""; }
+	source.rect = { 0, 0, width, height };
+	const size_t bytes = static_cast<size_t>(width) * height * 3;
+	unsigned char* data = source.get_data_pointer();
+	for (size_t i = 0; i < bytes; ++i) data[i] = static_cast<unsigned char>(i * 31 + i / 7 + width);
+	if (mapped && pool.GetStatistics().mappedBytes < bytes) Fail(label + ": the source buffer was not mapped");
+
+	const std::string path = (folder / (std::to_string(width) + "x" + std::to_string(height) + (mapped ? "_mapped.bmp" : "_heap.bmp"))).string();
+	if (!write_bmp_file(source, path)) { Fail(label + ": write_bmp_file failed"); return ""; }
+	const size_t rowBytes = (static_cast<size_t>(width) * 3 + 3) / 4 * 4;
+	const size_t fileBytes = ReadFile(path).size();
+	if (fileBytes != 54 + rowBytes * height) Fail(label + ": " + std::to_string(fileBytes) + " bytes in the file, expected " + std::to_string(54 + rowBytes * height));
+
+	ImageBuffer loaded(pool);
+	if (!load_bmp_rgb_to_buffer(path, loaded)) Fail(label + ": load_bmp_rgb_to_buffer failed");
+	else if (loaded.get_width() != width || loaded.get_height() != height) Fail(label + ": load_bmp_rgb_to_buffer returned " + std::to_string(loaded.get_width()) + "x" + std::to_string(loaded.get_height()));
+	else if (std::memcmp(loaded.get_data_pointer(), data, bytes) != 0) Fail(label + ": load_bmp_rgb_to_buffer pixels differ");
+
+	BufferPool::Buffer storage;
+	const auto block = read24BitBmpBlock(path, pool, storage);
+	if (!block.address) {
+		Fail(label + ": read24BitBmpBlock failed");
+	} else if (block.rect.right - block.rect.left != width || block.rect.bottom - block.rect.top != height || block.pixelBytes != 3) {
+		Fail(label + ": read24BitBmpBlock returned an unexpected block");
+	} else {
+		for (int y = 0; y < height; ++y) {
+			const unsigned char* row = static_cast<const unsigned char*>(block.address) + static_cast<size_t>(y) * block.rowBytes;
+			const unsigned char* expected = data + static_cast<size_t>(y) * width * 3;
+			bool same = true;
+			for (int x = 0; x < width && same; ++x) {
+				same = row[x * 3 + block.r] == expected[x * 3] && row[x * 3 + block.g] == expected[x * 3 + 1] && row[x * 3 + block.b] == expected[x * 3 + 2];
+			}
+			if (!same) { Fail(label + ": read24BitBmpBlock pixels differ in row " + std::to_string(y)); break; }
+		}
+	}
+	return path;
+}
+
+}
+
+int main() {
+	// 読み書きの print は出さない
+	ComfyUIPlugin::Logger::Instance().SetLevel(ComfyUIPlugin::LogLevel::Error);
+	std::error_code error;
+	const auto folder = std::filesystem::temp_directory_path(error) / ("comfyui_bmp_" + std::to_string(getpid()));
+	std::filesystem::create_directories(folder / "scratch", error);
+
+	// 幅は行のパディングが 0～3 バイトになるもの、1画素、ブロックの境界をまたぐものを含める
+	const std::vector<std::pair<int, int>> sizes = { { 1, 1 }, { 2, 3 }, { 3, 5 }, { 4, 4 }, { 5, 2 }, { 255, 17 }, { 1023, 767 }, { 4097, 3 } };
+	for (const auto& [width, height] : sizes) {
+		const std::string heap = RoundTrip(folder, width, height, false);
+		const std::string mapped = RoundTrip(folder, width, height, true);
+		if (!heap.empty() && !mapped.empty() && ReadFile(heap) != ReadFile(mapped)) Fail(std::to_string(width) + "x" + std::to_string(height) + ": the heap and mapped BMP files differ");
+	}
+	// マップしたバッファは返却時にスクラッチファイルごと解放する
+	if (!std::filesystem::is_empty(folder / "scratch", error)) Fail("scratch files were left behind");
+
+	std::filesystem::remove_all(folder, error);
+	std::printf("%d sizes: %d failures\n", static_cast<int>(sizes.size()), g_Failures);
+	return g_Failures == 0 ? 0 : 1;
+}
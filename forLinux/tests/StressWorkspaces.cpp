@@ -0,0 +1,147 @@
+/**
+ * @file StressWorkspaces.cpp
+ * @brief 実行毎の作業フォルダーとサブ画像の先行アップロードを並行して動かし、ファイルが混ざらないことを確かめるテスト
+ *
+ * 複数のスレッドが、それぞれの RunContext と作業フォルダーで別々の画像をアップロードし、/view から既定のファイル名
+ * （temp_img_res.png）で読み戻して元のファイルと比べる。同時に SubImagePreUploader で SubImage フォルダーの画像を
+ * 先にアップロードし、Take で受け取った名前から読み戻して比べる。スタブサーバー（stub_comfyui.py）に対して
+ * test_workspaces.py から実行する。プラグインフォルダーは実行ファイルのフォルダー。
+ */
+#include "pch.h"
+
+#include "ComfyUIPluginInternal.h"
+#include "ComvertImage.h"
+#include "Logger.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+std::mutex g_ReportMutex;
+std::atomic<int> g_Failures{ 0 };
+
+void Fail(const std::string& message) {
+	std::lock_guard<std::mutex> lock(g_ReportMutex);
+	std::fprintf(stderr, "FAIL: %s\n", message.c_str());
+	++g_Failures;
+}
+
+std::string ReadFile(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+/// seed 毎に模様の違う PNG を書き出す
+bool WriteTestPng(const std::string& path, int width, int height, unsigned seed) {
+	std::vector<unsigned char> rgba(static_cast<size_t>(width) * height * 4);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			unsigned char* p = rgba.data() + (static_cast<size_t>(y) * width + x) * 4;
+			p[0] = static_cast<unsigned char>(x * 7 + seed);
+			p[1] = static_cast<unsigned char>(y * 3 + seed * 13);
+			p[2] = static_cast<unsigned char>((x ^ y) + seed * 29);
+			p[3] = 255;
+		}
+	}
+	return ComvertImage::WriteRgbaPng(path, rgba.data(), width, height);
+}
+
+/// @brief /view から読み戻したファイルが expectedPath と同じ内容か確かめる
+void ExpectSameFile(const std::string& label, const std::string& expectedPath, const std::string& actualPath) {
+	if (actualPath.empty()) { Fail(label + ": download failed"); return; }
+	const std::string expected = ReadFile(expectedPath), actual = ReadFile(actualPath);
+	if (expected.empty() || expected != actual) Fail(label + ": " + actualPath + " (" + std::to_string(actual.size()) + " bytes) differs from " + expectedPath + " (" + std::to_string(expected.size()) + " bytes)");
+}
+
+/// 1つの実行と同じように、自分の作業フォルダーでアップロードと読み戻しを繰り返す
+void RunWorker(const std::string& server, int worker, int rounds) {
+	RunContext context;
+	context.server_address = server;
+	context.workspace = CreateWorkspace("stress_" + std::to_string(worker));
+	if (context.workspace.empty()) { Fail("worker " + std::to_string(worker) + ": no workspace"); return; }
+	for (int round = 0; round < rounds; ++round) {
+		const std::string label = "worker " + std::to_string(worker) + " round " + std::to_string(round);
+		// 作業フォルダーのファイル名は、どの実行でも同じものを使う
+		const std::string inputPath = context.Path("temp_img_input.png");
+		const std::string responsePath = context.Path("temp_json_preimage_res.json");
+		if (!WriteTestPng(inputPath, 96 + worker, 64 + round, static_cast<unsigned>(worker * 1000 + round))) { Fail(label + ": could not write the input"); continue; }
+		std::remove(responsePath.c_str());
+		http_post_image_to_file(context, server + "/upload/image", inputPath, "stress_" + std::to_string(worker) + "_" + std::to_string(round) + ".png", responsePath);
+		const std::string uploadedName = ReadUploadedName(responsePath);
+		if (uploadedName.empty()) { Fail(label + ": upload failed"); continue; }
+		ExpectSameFile(label, inputPath, get_image(context, uploadedName, "input", ""));
+	}
+	std::string workspace = context.workspace;
+	RemoveWorkspace(context.workspace);
+	if (std::filesystem::exists(workspace)) Fail("worker " + std::to_string(worker) + ": workspace was not removed");
+}
+
+/// ダイアログで選び直すように、全てのスロットのサブ画像を毎回変えて先行アップロードする
+void RunPreUploader(const std::string& server, int rounds) {
+	std::string workspace = CreateWorkspace("stress_upload");
+	if (workspace.empty()) { Fail("pre-uploader: no workspace"); return; }
+	SubImagePreUploader uploader;
+	uploader.Configure(server, workspace, nullptr);
+	RunContext context;
+	context.server_address = server;
+	context.workspace = CreateWorkspace("stress_take");
+	const std::string subImageFolder = g_BasePath + "SubImage/";
+	for (int round = 0; round < rounds; ++round) {
+		std::vector<std::string> fileNames(kSubImageDropdownCount);
+		for (size_t slot = 0; slot < kSubImageDropdownCount; ++slot) {
+			fileNames[slot] = "stress_sub_" + std::to_string(slot) + "_" + std::to_string(round) + ".png";
+			if (!WriteTestPng(subImageFolder + fileNames[slot], 48 + static_cast<int>(slot), 40, static_cast<unsigned>(500 + round * 10 + slot))) Fail("pre-uploader: could not write " + fileNames[slot]);
+			uploader.Request(slot, fileNames[slot]);
+		}
+		for (size_t slot = 0; slot < kSubImageDropdownCount; ++slot) {
+			const std::string label = "pre-uploader round " + std::to_string(round) + " slot " + std::to_string(slot);
+			double savedMs = 0.0;
+			const std::string uploadedName = uploader.Take(context, slot, fileNames[slot], savedMs);
+			if (uploadedName.empty()) { Fail(label + ": no pre-uploaded name"); continue; }
+			ExpectSameFile(label, subImageFolder + fileNames[slot], get_image(context, uploadedName, "input", "", context.Path("temp_img_subimage.png")));
+		}
+	}
+	uploader.Stop();
+	RemoveWorkspace(context.workspace);
+	RemoveWorkspace(workspace);
+}
+
+}
+
+int main(int argc, char** argv) {
+	std::string server;
+	int workers = 8, rounds = 4;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		const std::string name = argv[i];
+		if (name == "--server") server = argv[i + 1];
+		else if (name == "--workers") workers = std::atoi(argv[i + 1]);
+		else if (name == "--rounds") rounds = std::atoi(argv[i + 1]);
+	}
+	if (server.empty() || workers <= 0 || rounds <= 0) {
+		std::fprintf(stderr, "usage: StressWorkspaces --server URL [--workers N] [--rounds N]\n");
+		return 2;
+	}
+
+	// プラグインと同じく、実行ファイルのフォルダーをプラグインフォルダーにする
+	g_BasePath = std::filesystem::weakly_canonical("/proc/self/exe").parent_path().string() + "/";
+	InitDebugOutput(g_BasePath);
+	std::filesystem::create_directories(g_BasePath + "SubImage");
+
+	std::vector<std::thread> threads;
+	for (int worker = 0; worker < workers; ++worker) threads.emplace_back(RunWorker, server, worker, rounds);
+	threads.emplace_back(RunPreUploader, server, rounds);
+	for (auto& thread : threads) thread.join();
+
+	ComfyUIPlugin::Logger::Instance().Flush();
+	std::printf("%d workers x %d rounds and %d pre-upload rounds: %d failures\n", workers, rounds, rounds, g_Failures.load());
+	return g_Failures == 0 ? 0 : 1;
+}
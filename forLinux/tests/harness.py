@@ -0,0 +1,73 @@
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+# forLinux のテストの共通処理。ビルド済みの SimulateFilter を一時フォルダーにコピーし、
+# スタブサーバーに接続するユーザー設定で実行する（プラグインは実行ファイルのフォルダーを自分のフォルダーとして使う）
+
+FOR_LINUX = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+BUILD_DIR = os.environ.get("COMFYUI_BUILD_DIR", os.path.join(FOR_LINUX, "build"))
+sys.path.insert(0, FOR_LINUX)
+
+import stub_comfyui  # noqa: E402
+
+
+class PluginFolder:
+    """SimulateFilter と設定ファイル・テンプレートを置いた、テスト毎のプラグインフォルダー"""
+
+    def __init__(self, server_port: int, common: dict = None, setting: dict = None):
+        self.path = tempfile.mkdtemp(prefix="comfyui_test_")
+        self.executable = os.path.join(self.path, "SimulateFilter")
+        shutil.copy2(os.path.join(BUILD_DIR, "SimulateFilter"), self.executable)
+        shutil.copy2(os.path.join(BUILD_DIR, "ComfyUIPlugin.ini"), self.path)
+        shutil.copy2(os.path.join(FOR_LINUX, "template_stub.json"), self.path)
+        os.makedirs(os.path.join(self.path, "SubImage"))
+        common_values = {"server_address": f"http://127.0.0.1:{server_port}"}
+        common_values.update(common or {})
+        setting_values = {"template_workflow_filename": "template_stub.json", "prompt": "test prompt", "negative_prompt": "", "result_cache": "false"}
+        setting_values.update(setting or {})
+        with open(os.path.join(self.path, "UserSetting.ini"), "w", encoding="utf-8") as file:
+            file.write("[COMMON]\n")
+            file.writelines(f'{key} = "{value}"\n' for key, value in common_values.items())
+            file.write("\n[Test stub]\n")
+            file.writelines(f'{key} = "{value}"\n' for key, value in setting_values.items())
+
+    def run(self, *args: str, timeout: float = 60.0) -> tuple:
+        """SimulateFilter を実行し、(終了コード, 出力の JSON, 秒数) を返す"""
+        start = time.monotonic()
+        completed = subprocess.run([self.executable, "--setting", "0", *args], cwd=self.path, capture_output=True, text=True, timeout=timeout)
+        elapsed = time.monotonic() - start
+        try:
+            result = json.loads(completed.stdout)
+        except ValueError:
+            raise AssertionError(f"SimulateFilter did not print JSON (exit {completed.returncode}):\n{completed.stdout}\n{completed.stderr}")
+        return completed.returncode, result, elapsed
+
+    def log(self) -> str:
+        with open(os.path.join(self.path, "debuglog.txt"), encoding="utf-8", errors="replace") as file:
+            return file.read()
+
+    def remove(self) -> None:
+        shutil.rmtree(self.path, ignore_errors=True)
+
+
+def curl_processes(folder: PluginFolder) -> list:
+    """folder の作業フォルダーを使っている curl（キャンセルで終了できなかったもの）のコマンドライン"""
+    found = []
+    for pid in filter(str.isdigit, os.listdir("/proc")):
+        try:
+            with open(f"/proc/{pid}/cmdline", "rb") as file:
+                arguments = file.read().split(b"\0")
+        except OSError:
+            continue
+        if arguments and os.path.basename(arguments[0]) == b"curl" and any(folder.path.encode() in argument for argument in arguments):
+            found.append(b" ".join(arguments).decode("utf-8", "replace"))
+    return found
+
+
+def start_stub(**delays) -> object:
+    return stub_comfyui.start_server(0, **delays)
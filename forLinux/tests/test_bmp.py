@@ -0,0 +1,18 @@
+import os
+import subprocess
+import unittest
+
+import harness
+
+# BmpRoundTrip（C++）を実行する。ヒープとスクラッチファイルにマップしたバッファの両方で、24bit BMP の書き出しと
+# 読み込み（write_bmp_file・load_bmp_rgb_to_buffer・read24BitBmpBlock）の往復で画素とファイルのバイト列が一致することを確認する
+
+
+class BmpRoundTripTest(unittest.TestCase):
+    def test_round_trip_with_heap_and_mapped_buffers(self):
+        completed = subprocess.run([os.path.join(harness.BUILD_DIR, "tests", "BmpRoundTrip")], capture_output=True, text=True, timeout=60)
+        self.assertEqual(completed.returncode, 0, completed.stdout + completed.stderr)
+
+
+if __name__ == "__main__":
+    unittest.main()
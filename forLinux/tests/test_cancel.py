@@ -0,0 +1,94 @@
+import time
+import unittest
+
+import harness
+
+# 入力の取り込みとエンコード・アップロード・送信・生成待ち・ダウンロード・デコード（書き戻し）の途中で Exit を返し、
+# フィルタ実行がすぐに戻ることと、キャンセルした curl が残らないことを確認する。生成待ちの途中の Restart では、
+# 次の実行が最後まで書き戻すことを確認する
+
+# スタブの遅延。キャンセルしなければ、この時間が過ぎるまで戻らない
+STALL_SECONDS = 30.0
+# キャンセルから戻るまでに許す時間
+RETURN_SECONDS = 10.0
+
+
+class CancelTest(unittest.TestCase):
+    def start(self, **delays) -> None:
+        self.server = harness.start_stub(**delays)
+        self.folder = harness.PluginFolder(self.server.server_address[1])
+
+    def tearDown(self):
+        self.server.shutdown()
+        self.server.server_close()
+        self.folder.remove()
+
+    def assert_cancelled(self, *args: str, size: str = "512x512") -> dict:
+        code, result, elapsed = self.folder.run("--size", size, *args, timeout=STALL_SECONDS)
+        self.assertLess(elapsed, RETURN_SECONDS, self.folder.log())
+        self.assertEqual(len(result["runs"]), 1)
+        # curl は別のプロセスグループで動くので、終了を待ってから確認する
+        deadline = time.monotonic() + 2.0
+        while harness.curl_processes(self.folder) and time.monotonic() < deadline:
+            time.sleep(0.05)
+        self.assertEqual(harness.curl_processes(self.folder), [])
+        return result["runs"][0]
+
+    def test_cancel_during_capture_and_encode(self):
+        self.start()
+        # 64x64 のブロックでは取り込みだけで Process を数千回呼ぶので、200 回目は取り込みとエンコードの途中
+        run = self.assert_cancelled("--block", "64x64", "--exit-after", "200", size="4096x4096")
+        self.assertEqual(run["update_rects"], 0)
+        self.assertIsNone(self.server.state.counts.get("upload"))
+        self.assertNotIn("Input capture streamed", self.folder.log())
+
+    def test_cancel_during_upload(self):
+        self.start(upload_delay=STALL_SECONDS)
+        run = self.assert_cancelled("--exit-after-ms", "1000")
+        self.assertEqual(run["update_rects"], 0)
+        self.assertEqual(self.server.state.counts.get("upload"), 1)
+        self.assertIsNone(self.server.state.counts.get("prompt"))
+
+    def test_cancel_during_submit(self):
+        self.start(prompt_delay=STALL_SECONDS)
+        run = self.assert_cancelled("--exit-after-ms", "1500")
+        self.assertEqual(run["update_rects"], 0)
+        self.assertEqual(self.server.state.counts.get("prompt"), 1)
+        self.assertIsNone(self.server.state.counts.get("history"))
+
+    def test_cancel_while_polling_history(self):
+        self.start(history_delay=STALL_SECONDS)
+        run = self.assert_cancelled("--exit-after-ms", "1500")
+        self.assertEqual(run["update_rects"], 0)
+        self.assertEqual(self.server.state.counts.get("prompt"), 1)
+        self.assertGreater(self.server.state.counts.get("history", 0), 0)
+        self.assertIsNone(self.server.state.counts.get("view"))
+
+    def test_cancel_during_download(self):
+        self.start(view_delay=STALL_SECONDS)
+        run = self.assert_cancelled("--exit-after-ms", "1500")
+        self.assertEqual(run["update_rects"], 0)
+        self.assertEqual(self.server.state.counts.get("view"), 1)
+
+    def test_restart_while_polling_history(self):
+        # 生成待ちの途中で Restart した場合は、待っている curl を止めてから送り直し、次の実行で最後まで書き戻す
+        self.start(history_delay=2.0)
+        run = self.assert_cancelled("--restart-after-ms", "800")
+        self.assertTrue(run["ok"])
+        self.assertEqual(run["restarts"], 1)
+        self.assertEqual(run["updated_pixels"], 512 * 512)
+        self.assertIn("Cancelled background work (restart)", self.folder.log())
+        # 入力は変わらないので送り直すのはワークフローだけ
+        self.assertEqual(self.server.state.counts.get("upload"), 1)
+        self.assertEqual(self.server.state.counts.get("prompt"), 2)
+
+    def test_cancel_during_decode(self):
+        self.start()
+        run = self.assert_cancelled("--block", "64x64", "--exit-after-updates", "1")
+        # 最初の書き戻しの後で止めたので、残りの行は書き戻さない
+        self.assertGreater(run["update_rects"], 0)
+        self.assertLess(run["updated_pixels"], 512 * 512)
+
+
+if __name__ == "__main__":
+    unittest.main()
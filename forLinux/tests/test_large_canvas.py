@@ -0,0 +1,45 @@
+import os
+import unittest
+
+import harness
+
+# 20000x20000 のキャンバスを最後まで処理できることを確認する。ホストのキャンバスは --scratch のフォルダーのファイルに
+# マップし、プラグインも mapped_buffer_threshold_mb を下げて画像幅のバッファをスクラッチファイルにマップさせる
+
+SIZE = 20000
+# 20000 幅のブロック行（256 行）の 24bit のバッファ（約 15 MB）より小さくする
+MAPPED_THRESHOLD_MB = 8
+# ホストのキャンバス（BGRA と不透明度、約 2 GB）を置くディスクの空き
+CANVAS_DISK_BYTES = 3 * 1024 * 1024 * 1024
+
+
+class LargeCanvasTest(unittest.TestCase):
+    def setUp(self):
+        self.server = harness.start_stub()
+        self.folder = harness.PluginFolder(self.server.server_address[1], common={"mapped_buffer_threshold_mb": str(MAPPED_THRESHOLD_MB)})
+        self.canvas = os.path.join(self.folder.path, "canvas")
+        os.makedirs(self.canvas)
+        disk = os.statvfs(self.canvas)
+        if disk.f_bavail * disk.f_frsize < CANVAS_DISK_BYTES:
+            self.skipTest("not enough disk space for the host canvas")
+
+    def tearDown(self):
+        self.server.shutdown()
+        self.server.server_close()
+        self.folder.remove()
+
+    def test_full_frame_with_mapped_buffers(self):
+        code, result, _ = self.folder.run("--size", f"{SIZE}x{SIZE}", "--scratch", self.canvas, timeout=1200)
+        self.assertEqual(code, 0, self.folder.log())
+        run = result["runs"][0]
+        self.assertTrue(run["ok"], self.folder.log())
+        self.assertEqual(run["updated_pixels"], SIZE * SIZE)
+        # 画像幅のバッファはスクラッチファイルにマップされた
+        self.assertGreater(run["buffer_mapped_peak_bytes"], 0)
+        # スクラッチファイルは作成直後に削除するので、プラグインフォルダーにもキャンバスのフォルダーにも残らない
+        self.assertEqual([name for name in os.listdir(self.folder.path) if name.startswith("cfy")], [])
+        self.assertEqual(os.listdir(self.canvas), [])
+
+
+if __name__ == "__main__":
+    unittest.main()
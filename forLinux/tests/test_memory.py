@@ -0,0 +1,57 @@
+import unittest
+
+import harness
+
+# 標準的なキャンバスで、画像バッファのプールから同時に借りた量（全体と段階毎の最大値）が上限を超えないことを確認する
+# 入力の取り込みとエンコード、結果のデコードと書き戻しはブロック行毎に行うので、画像全体の大きさには比例しない
+
+MB = 1024 * 1024
+BLOCK = "256x256"
+
+# キャンバス → (全体, 段階毎) の上限。画像全体の 24bit のバッファ1枚より十分小さい
+CANVAS_BOUNDS = {
+    "1024x1024": (4 * MB, {"encode": 2 * MB, "decode": 4 * MB}),
+    # A4 350dpi
+    "2894x4093": (12 * MB, {"encode": 5 * MB, "decode": 12 * MB}),
+    "4096x4096": (16 * MB, {"encode": 6 * MB, "decode": 16 * MB}),
+}
+
+
+class BufferPeakTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.server = harness.start_stub()
+        cls.folder = harness.PluginFolder(cls.server.server_address[1])
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.server.shutdown()
+        cls.server.server_close()
+        cls.folder.remove()
+
+    def run_canvas(self, size: str, *args: str) -> dict:
+        code, result, _ = self.folder.run("--size", size, "--block", BLOCK, *args)
+        self.assertEqual(code, 0, self.folder.log())
+        run = result["runs"][0]
+        self.assertTrue(run["ok"])
+        return run
+
+    def test_peaks_stay_within_bounds(self):
+        for size, (total_bound, stage_bounds) in CANVAS_BOUNDS.items():
+            with self.subTest(size=size):
+                run = self.run_canvas(size)
+                self.assertGreater(run["buffer_peak_bytes"], 0)
+                self.assertLessEqual(run["buffer_peak_bytes"], total_bound)
+                for stage, peak in run["stage_peak_bytes"].items():
+                    self.assertIn(stage, stage_bounds)
+                    self.assertLessEqual(peak, stage_bounds[stage], stage)
+
+    def test_mask_decodes_only_the_selection(self):
+        # 大きなキャンバスの一部を描き直す場合は、選択範囲の分しかデコードしない
+        run = self.run_canvas("4096x4096", "--select", "1000,1000,1512,1512", "--mask")
+        self.assertLessEqual(run["buffer_peak_bytes"], CANVAS_BOUNDS["4096x4096"][0])
+        self.assertLessEqual(run["stage_peak_bytes"].get("decode", 0), 2 * MB)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,118 @@
+import os
+import unittest
+
+import harness
+
+# SimulateFilter をスタブサーバーに対して実行し、出力の JSON（ok・書き戻し・Restart の回数）を確認する
+
+
+class SimulateFilterTest(unittest.TestCase):
+    def setUp(self):
+        self.server = harness.start_stub()
+        self.folder = harness.PluginFolder(self.server.server_address[1])
+
+    def tearDown(self):
+        self.server.shutdown()
+        self.server.server_close()
+        self.folder.remove()
+
+    def test_run_writes_back_the_whole_layer(self):
+        code, result, _ = self.folder.run("--size", "512x384", "--block", "128x128")
+        self.assertEqual(code, 0, self.folder.log())
+        self.assertEqual(len(result["runs"]), 1)
+        run = result["runs"][0]
+        self.assertTrue(run["ok"])
+        self.assertEqual(run["restarts"], 0)
+        # スタブの結果は単色なので、全てのタイルが書き戻される
+        self.assertGreater(run["update_rects"], 0)
+        self.assertEqual(run["updated_pixels"], 512 * 384)
+        self.assertEqual(self.server.state.counts.get("prompt"), 1)
+
+    def test_restart_script_reuses_the_generated_result(self):
+        code, result, _ = self.folder.run("--size", "256x256", "--restarts", "2")
+        self.assertEqual(code, 0, self.folder.log())
+        run = result["runs"][0]
+        self.assertTrue(run["ok"])
+        self.assertEqual(run["restarts"], 2)
+        self.assertGreater(run["update_rects"], 0)
+        # 条件を変えずに Restart した場合は、生成済みの結果を書き戻し直す（送信も生成も1回だけ）
+        self.assertEqual(self.server.state.counts.get("prompt"), 1)
+        self.assertEqual(self.server.state.counts.get("upload"), 1)
+
+    def test_each_run_generates_again(self):
+        code, result, _ = self.folder.run("--size", "256x256", "--runs", "2")
+        self.assertEqual(code, 0, self.folder.log())
+        self.assertEqual([run["ok"] for run in result["runs"]], [True, True])
+        self.assertEqual(self.server.state.counts.get("prompt"), 2)
+
+    def test_selection_mask_and_rgb_layout(self):
+        code, result, _ = self.folder.run("--size", "300x200", "--layout", "rgb", "--select", "50,40,250,160", "--mask")
+        self.assertEqual(code, 0, self.folder.log())
+        run = result["runs"][0]
+        self.assertTrue(run["ok"])
+        self.assertGreater(run["update_rects"], 0)
+
+    def test_ok_during_fast_preview_applies_the_full_resolution_result(self):
+        # プレビューのまま OK しても、縮小した結果では終わらず、元の大きさでもう一度生成して書き戻す
+        folder = harness.PluginFolder(self.server.server_address[1], common={"enable_preview": "true"})
+        try:
+            code, result, _ = folder.run("--size", "1024x1024", "--fast-preview")
+            self.assertEqual(code, 0, folder.log())
+            self.assertTrue(result["can_preview"])
+            run = result["runs"][0]
+            self.assertTrue(run["ok"])
+            self.assertEqual(run["updated_pixels"], 2 * 1024 * 1024)
+            self.assertEqual(self.server.state.counts.get("prompt"), 2)
+            # 最後にアップロードした入力は縮小していない
+            self.assertIn((1024, 1024), [harness.stub_comfyui.png_size(data) for data in self.server.state.inputs.values()])
+        finally:
+            folder.remove()
+
+    def test_result_cache_is_kept_per_filter(self):
+        # 同じ条件の2回目の実行は、フィルタ毎のフォルダー（ResultCache/Generate）に保存した結果を使う
+        folder = harness.PluginFolder(self.server.server_address[1], setting={"result_cache": "true"})
+        try:
+            code, result, _ = folder.run("--size", "64x64", "--runs", "2")
+            self.assertEqual(code, 0, folder.log())
+            self.assertEqual([run["ok"] for run in result["runs"]], [True, True])
+            self.assertEqual(self.server.state.counts.get("prompt"), 1)
+            self.assertEqual(os.listdir(os.path.join(folder.path, "ResultCache")), ["Generate"])
+            self.assertEqual(len(os.listdir(os.path.join(folder.path, "ResultCache", "Generate"))), 1)
+        finally:
+            folder.remove()
+
+    def test_downscale_never_enlarges_a_side(self):
+        # 細長いレイヤーを縮小する場合も、size_multiple より短い辺を multiple まで広げない
+        folder = harness.PluginFolder(self.server.server_address[1], setting={"max_megapixels": "0.01", "size_multiple": "64"})
+        try:
+            code, result, _ = folder.run("--size", "4000x16")
+            self.assertEqual(code, 0, folder.log())
+            run = result["runs"][0]
+            self.assertTrue(run["ok"])
+            self.assertEqual(run["updated_pixels"], 4000 * 16)
+            sizes = [harness.stub_comfyui.png_size(data) for data in self.server.state.inputs.values()]
+            self.assertEqual(len(sizes), 1)
+            width, height = sizes[0]
+            self.assertLessEqual(width * height, 10000)
+            self.assertEqual(width % 64, 0)
+            self.assertLessEqual(height, 16)
+        finally:
+            folder.remove()
+
+    def test_failed_upload_is_counted_as_an_error(self):
+        # 接続できないサーバーへのアップロードは errors_total に数え、時間と送信量には数えない
+        folder = harness.PluginFolder(1)
+        try:
+            _, result, _ = folder.run("--size", "64x64")
+            self.assertFalse(result["runs"][0]["ok"])
+            with open(os.path.join(folder.path, "metrics_Generate.prom"), encoding="utf-8") as file:
+                metrics = file.read()
+            self.assertIn('kind="upload"', metrics)
+            self.assertNotIn('stage="upload"', metrics)
+            self.assertNotIn("comfyui_plugin_uploaded_bytes_total{", metrics)
+        finally:
+            folder.remove()
+
+
+if __name__ == "__main__":
+    unittest.main()
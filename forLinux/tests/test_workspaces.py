@@ -0,0 +1,39 @@
+import os
+import shutil
+import subprocess
+import tempfile
+import unittest
+
+import harness
+
+# StressWorkspaces（C++）をスタブサーバーに対して実行する。複数の実行の作業フォルダーとサブ画像の先行アップロードを
+# 並行して動かし、それぞれが自分のアップロードした画像を読み戻せることと、作業フォルダーが残らないことを確認する
+
+
+class WorkspaceStressTest(unittest.TestCase):
+    def setUp(self):
+        self.server = harness.start_stub()
+        self.path = tempfile.mkdtemp(prefix="comfyui_stress_")
+        self.executable = os.path.join(self.path, "StressWorkspaces")
+        shutil.copy2(os.path.join(harness.BUILD_DIR, "tests", "StressWorkspaces"), self.executable)
+
+    def tearDown(self):
+        self.server.shutdown()
+        self.server.server_close()
+        shutil.rmtree(self.path, ignore_errors=True)
+
+    def test_overlapping_runs_read_back_their_own_files(self):
+        workers, rounds = 8, 4
+        completed = subprocess.run([self.executable, "--server", f"http://127.0.0.1:{self.server.server_address[1]}", "--workers", str(workers), "--rounds", str(rounds)],
+                                   cwd=self.path, capture_output=True, text=True, timeout=60)
+        self.assertEqual(completed.returncode, 0, completed.stdout + completed.stderr)
+        counts = self.server.state.counts
+        pre_uploads = len(os.listdir(os.path.join(self.path, "SubImage")))
+        self.assertEqual(counts.get("upload"), workers * rounds + pre_uploads)
+        self.assertEqual(counts.get("view"), workers * rounds + pre_uploads)
+        # 各実行と先行アップロードの作業フォルダーは削除されている
+        self.assertEqual(os.listdir(os.path.join(self.path, "Work")), [])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -24,7 +24,7 @@ build_bundle() {
     for arch in $ARCHS; do
         output="$BUILD_DIR/$product/$product-$arch"
         extra=""
-        sources="$SHARED_SRC/ComfyUIPlugin.cpp $SHARED_SRC/ComvertImage_mac.mm $SHARED_SRC/FilterPlugIn.cpp"
+        sources="$SHARED_SRC/ComfyUIPlugin.cpp $SHARED_SRC/BufferPool.cpp $SHARED_SRC/ResizeImage.cpp $SHARED_SRC/ResultCache.cpp $SHARED_SRC/Logger.cpp $SHARED_SRC/Trace.cpp $SHARED_SRC/Metrics.cpp $SHARED_SRC/ComvertImage_mac.mm $SHARED_SRC/FilterPlugIn.cpp"
         if [ "$mode" = "banana" ]; then
             extra="-DCOMFYUI_INCLUDE_DEFAULT_ENTRYPOINT=0"
             sources="$sources $SHARED_SRC/ComfyUINanoBananaPlugin.cpp"
@@ -0,0 +1,333 @@
+/**
+ * @file BufferPool.cpp
+ * @brief 画像処理用の大きなバッファを使い回すプール
+ */
+#include "pch.h"
+
+#include "BufferPool.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace ComfyUIPlugin {
+
+namespace {
+
+/// StageScope で設定した、このスレッドの段階
+thread_local const char* t_stage = nullptr;
+
+}
+
+BufferPool::StageScope::StageScope(const char* stage) : previous_(t_stage) {
+	t_stage = stage;
+}
+
+BufferPool::StageScope::~StageScope() {
+	t_stage = previous_;
+}
+
+BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& other) noexcept {
+	if (this != &other) {
+		reset();
+		pool_ = other.pool_;
+		data_ = other.data_;
+		size_ = other.size_;
+		capacity_ = other.capacity_;
+		mapped_ = other.mapped_;
+		stage_ = other.stage_;
+		other.pool_ = nullptr;
+		other.data_ = nullptr;
+		other.size_ = 0;
+		other.capacity_ = 0;
+		other.mapped_ = false;
+		other.stage_ = -1;
+	}
+	return *this;
+}
+
+void BufferPool::Buffer::reset() {
+	if (data_ && pool_) pool_->Release(data_, capacity_, mapped_, stage_);
+	pool_ = nullptr;
+	data_ = nullptr;
+	size_ = 0;
+	capacity_ = 0;
+	mapped_ = false;
+	stage_ = -1;
+}
+
+BufferPool::BufferPool(int idleSeconds) : idle_(std::max(idleSeconds, 0)) {}
+
+BufferPool::~BufferPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	wakeup_.notify_all();
+	if (trimThread_.joinable()) trimThread_.join();
+	for (const auto& entry : free_) FreeAligned(entry.data);
+}
+
+/// @brief サイズクラスへの切り上げ
+/// @note 64KBまでは4KB単位、それ以上は2のべき乗を8分割した単位（無駄は最大12.5%）
+size_t BufferPool::SizeClass(size_t bytes) {
+	constexpr size_t kSmallStep = 4096;
+	if (bytes <= 16 * kSmallStep) return std::max<size_t>((bytes + kSmallStep - 1) / kSmallStep * kSmallStep, kSmallStep);
+	const size_t step = std::bit_floor(bytes) / 8;
+	return (bytes + step - 1) / step * step;
+}
+
+unsigned char* BufferPool::AllocateAligned(size_t bytes) {
+#if defined(_WIN32)
+	return static_cast<unsigned char*>(_aligned_malloc(bytes, kAlignment));
+#else
+	void* data = nullptr;
+	if (posix_memalign(&data, kAlignment, bytes) != 0) return nullptr;
+	return static_cast<unsigned char*>(data);
+#endif
+}
+
+void BufferPool::FreeAligned(unsigned char* data) {
+#if defined(_WIN32)
+	_aligned_free(data);
+#else
+	std::free(data);
+#endif
+}
+
+/// @brief スクラッチファイルを作成してメモリマップする
+/// @note ファイルは作成直後に削除予約するため、異常終了しても残らない。新規ファイルなので中身はゼロ。
+unsigned char* BufferPool::MapScratch(const std::string& directory, size_t bytes) {
+#if defined(_WIN32)
+	char path[MAX_PATH] = {};
+	if (GetTempFileNameA(directory.c_str(), "cfy", 0, path) == 0) return nullptr;
+	HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		DeleteFileA(path);
+		return nullptr;
+	}
+	const auto size = static_cast<unsigned long long>(bytes);
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size & 0xFFFFFFFFull), nullptr);
+	void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes) : nullptr;
+	// ビューがマッピングとファイルへの参照を保持するので、ハンドルはここで閉じてよい（アンマップ時に削除される）
+	if (mapping) CloseHandle(mapping);
+	CloseHandle(file);
+	return static_cast<unsigned char*>(data);
+#else
+	std::string path = directory + "cfyXXXXXX";
+	const int fd = mkstemp(path.data());
+	if (fd < 0) return nullptr;
+	unlink(path.c_str());
+	void* data = MAP_FAILED;
+	if (ftruncate(fd, static_cast<off_t>(bytes)) == 0) data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return data == MAP_FAILED ? nullptr : static_cast<unsigned char*>(data);
+#endif
+}
+
+void BufferPool::UnmapScratch(unsigned char* data, size_t bytes) {
+#if defined(_WIN32)
+	(void)bytes;
+	UnmapViewOfFile(data);
+#else
+	munmap(data, bytes);
+#endif
+}
+
+BufferPool::Buffer BufferPool::Acquire(size_t bytes, bool clear) {
+	const auto start = std::chrono::steady_clock::now();
+	const size_t capacity = SizeClass(std::max<size_t>(bytes, 1));
+	Buffer buffer;
+	std::string scratchDirectory;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (mappedThreshold_ > 0 && bytes >= mappedThreshold_) scratchDirectory = scratchDirectory_;
+	}
+	if (!scratchDirectory.empty()) {
+		// マップしたバッファはプールに保持せず、返却時にファイルごと解放する
+		buffer.data_ = MapScratch(scratchDirectory, bytes);
+		if (buffer.data_) {
+			buffer.pool_ = this;
+			buffer.size_ = bytes;
+			buffer.capacity_ = bytes;
+			buffer.mapped_ = true;
+			const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+			std::lock_guard<std::mutex> lock(mutex_);
+			statistics_.inUseBytes += bytes;
+			statistics_.mappedBytes += bytes;
+			statistics_.peakMappedBytes = std::max(statistics_.peakMappedBytes, statistics_.mappedBytes);
+			++statistics_.misses;
+			buffer.stage_ = CountAcquired(bytes);
+			statistics_.peakBytes = std::max(statistics_.peakBytes, statistics_.inUseBytes + statistics_.cachedBytes);
+			statistics_.acquireMilliseconds += elapsed.count();
+			return buffer;
+		}
+		// マップできなければヒープから確保する
+	}
+	{
+		// 同じサイズクラス以上、2倍未満のもののうち最小のものを再利用する
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto best = free_.end();
+		for (auto it = free_.begin(); it != free_.end(); ++it) {
+			if (it->capacity < capacity || it->capacity >= capacity * 2) continue;
+			if (best == free_.end() || it->capacity < best->capacity) best = it;
+		}
+		if (best != free_.end()) {
+			buffer.data_ = best->data;
+			buffer.capacity_ = best->capacity;
+			statistics_.cachedBytes -= best->capacity;
+			statistics_.inUseBytes += best->capacity;
+			++statistics_.hits;
+			buffer.stage_ = CountAcquired(best->capacity);
+			free_.erase(best);
+		}
+	}
+	if (!buffer.data_) {
+		buffer.data_ = AllocateAligned(capacity);
+		if (!buffer.data_) return Buffer{};
+		buffer.capacity_ = capacity;
+		std::lock_guard<std::mutex> lock(mutex_);
+		statistics_.inUseBytes += capacity;
+		++statistics_.misses;
+		buffer.stage_ = CountAcquired(capacity);
+		statistics_.peakBytes = std::max(statistics_.peakBytes, statistics_.inUseBytes + statistics_.cachedBytes);
+	}
+	buffer.pool_ = this;
+	buffer.size_ = bytes;
+	if (clear) std::memset(buffer.data_, 0, bytes);
+
+	const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	std::lock_guard<std::mutex> lock(mutex_);
+	statistics_.acquireMilliseconds += elapsed.count();
+	return buffer;
+}
+
+int BufferPool::CountAcquired(size_t bytes) {
+	const char* name = t_stage ? t_stage : "other";
+	auto stage = std::find_if(stages_.begin(), stages_.end(), [&](const StageStatistics& entry) { return std::strcmp(entry.stage, name) == 0; });
+	if (stage == stages_.end()) {
+		stages_.push_back({});
+		stage = stages_.end() - 1;
+		stage->stage = name;
+	}
+	stage->currentBytes += bytes;
+	stage->peakBytes = std::max(stage->peakBytes, stage->currentBytes);
+	stage->totalBytes += bytes;
+	++stage->acquisitions;
+	statistics_.peakInUseBytes = std::max(statistics_.peakInUseBytes, statistics_.inUseBytes);
+	return static_cast<int>(stage - stages_.begin());
+}
+
+void BufferPool::Release(unsigned char* data, size_t capacity, bool mapped, int stage) {
+	if (mapped) {
+		UnmapScratch(data, capacity);
+		std::lock_guard<std::mutex> lock(mutex_);
+		statistics_.inUseBytes -= capacity;
+		statistics_.mappedBytes -= capacity;
+		if (stage >= 0) stages_[static_cast<size_t>(stage)].currentBytes -= capacity;
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		statistics_.inUseBytes -= capacity;
+		if (stage >= 0) stages_[static_cast<size_t>(stage)].currentBytes -= capacity;
+		if (idle_.count() > 0 && !stopping_) {
+			free_.push_back({ data, capacity, std::chrono::steady_clock::now() });
+			statistics_.cachedBytes += capacity;
+			if (!trimThread_.joinable()) trimThread_ = std::thread(&BufferPool::TrimThread, this);
+			data = nullptr;
+		}
+	}
+	if (data) FreeAligned(data);
+	else wakeup_.notify_all();
+}
+
+void BufferPool::TrimLocked(std::chrono::seconds idle, std::vector<Entry>& released) {
+	const auto now = std::chrono::steady_clock::now();
+	auto expired = std::stable_partition(free_.begin(), free_.end(), [&](const Entry& entry) { return now - entry.released < idle; });
+	for (auto it = expired; it != free_.end(); ++it) {
+		statistics_.cachedBytes -= it->capacity;
+		released.push_back(*it);
+	}
+	free_.erase(expired, free_.end());
+}
+
+void BufferPool::Trim(std::chrono::seconds idle) {
+	std::vector<Entry> released;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		TrimLocked(idle, released);
+	}
+	for (const auto& entry : released) FreeAligned(entry.data);
+}
+
+void BufferPool::SetIdleSeconds(int idleSeconds) {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		idle_ = std::chrono::seconds(std::max(idleSeconds, 0));
+	}
+	wakeup_.notify_all();
+}
+
+void BufferPool::SetMappedThreshold(size_t thresholdBytes, const std::string& directory) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	mappedThreshold_ = thresholdBytes;
+	scratchDirectory_ = directory;
+}
+
+/// 保持中のバッファが一番早く期限切れになる時刻まで待って解放する
+void BufferPool::TrimThread() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!stopping_) {
+		if (free_.empty()) {
+			wakeup_.wait(lock, [this] { return stopping_ || !free_.empty(); });
+			continue;
+		}
+		const auto oldest = std::min_element(free_.begin(), free_.end(), [](const Entry& a, const Entry& b) { return a.released < b.released; });
+		wakeup_.wait_until(lock, oldest->released + idle_);
+		if (stopping_) break;
+		std::vector<Entry> released;
+		TrimLocked(idle_, released);
+		lock.unlock();
+		for (const auto& entry : released) FreeAligned(entry.data);
+		lock.lock();
+	}
+}
+
+BufferPool::Statistics BufferPool::GetStatistics() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return statistics_;
+}
+
+std::vector<BufferPool::StageStatistics> BufferPool::GetStageStatistics() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::vector<StageStatistics> stages;
+	for (const auto& stage : stages_) if (stage.acquisitions > 0 || stage.currentBytes > 0) stages.push_back(stage);
+	return stages;
+}
+
+void BufferPool::ResetStatistics() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	statistics_.hits = 0;
+	statistics_.misses = 0;
+	statistics_.acquireMilliseconds = 0.0;
+	statistics_.peakBytes = statistics_.inUseBytes + statistics_.cachedBytes;
+	statistics_.peakInUseBytes = statistics_.inUseBytes;
+	statistics_.peakMappedBytes = statistics_.mappedBytes;
+	// 貸し出し中のバッファは返却されるまで借りた段階に数えたままにする（添字は Buffer が持っているので消さない）
+	for (auto& stage : stages_) {
+		stage.peakBytes = stage.currentBytes;
+		stage.totalBytes = 0;
+		stage.acquisitions = 0;
+	}
+}
+
+}
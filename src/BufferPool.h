@@ -0,0 +1,156 @@
+/**
+ * @file BufferPool.h
+ * @brief 画像処理用の大きなバッファを使い回すプール
+ *
+ * 入力画像・生成結果・BMP読み込み用のバッファは毎回数十～数百MBになるため、
+ * Restart やフィルタの再実行のたびに確保し直さず、サイズクラス毎に再利用する。
+ * しばらく使われなかったバッファは、バックグラウンドで解放する。
+ * 閾値を超える巨大なバッファ（ポスターサイズのキャンバスなど）は、ヒープではなく
+ * スクラッチファイルをメモリマップして確保し、物理メモリを使い切らないようにする。
+ * 貸し出したバッファは StageScope で指定した段階（取得・エンコード・デコードなど）毎に数え、
+ * 1回の実行で各段階がどれだけ確保し、同時に最大どれだけ持っていたかを後から確認できる。
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ComfyUIPlugin {
+
+class BufferPool {
+public:
+	/// バッファのアライメント（キャッシュライン/SIMD用）
+	static constexpr size_t kAlignment = 64;
+
+	/// プールから借りたバッファ。破棄するとプールへ返却される。
+	class Buffer {
+	public:
+		Buffer() = default;
+		~Buffer() { reset(); }
+		Buffer(Buffer&& other) noexcept { *this = std::move(other); }
+		Buffer& operator=(Buffer&& other) noexcept;
+		Buffer(const Buffer&) = delete;
+		Buffer& operator=(const Buffer&) = delete;
+
+		unsigned char* data() const { return data_; }
+		size_t size() const { return size_; }
+		explicit operator bool() const { return data_ != nullptr; }
+
+		/// プールへ返却する
+		void reset();
+
+	private:
+		friend class BufferPool;
+		BufferPool* pool_ = nullptr;
+		unsigned char* data_ = nullptr;
+		size_t size_ = 0;
+		size_t capacity_ = 0;
+		bool mapped_ = false;
+		int stage_ = -1;	///< 数えている段階（stages_ の添字）
+	};
+
+	/// @brief このスレッドで Acquire したバッファを、生存中は stage の確保として数える
+	/// @note stage は文字列リテラルなど、プールより長く生きるものを渡す。入れ子にすると内側が優先される。
+	class StageScope {
+	public:
+		explicit StageScope(const char* stage);
+		~StageScope();
+		StageScope(const StageScope&) = delete;
+		StageScope& operator=(const StageScope&) = delete;
+
+	private:
+		const char* previous_;
+	};
+
+	/// 段階毎の統計（ResetStatistics から数える。バッファは返却されるまで借りた段階に数える）
+	struct StageStatistics {
+		const char* stage = nullptr;
+		size_t currentBytes = 0;	///< 貸し出し中のバイト数
+		size_t peakBytes = 0;		///< 貸し出し中のバイト数の最大値
+		size_t totalBytes = 0;		///< 借りたバイト数の合計
+		size_t acquisitions = 0;	///< 借りた回数
+	};
+
+	/// 統計情報
+	struct Statistics {
+		size_t inUseBytes = 0;		///< 貸し出し中のバイト数
+		size_t cachedBytes = 0;		///< 返却済みで保持しているバイト数
+		size_t peakBytes = 0;		///< 貸し出し中＋保持中の最大値
+		size_t peakInUseBytes = 0;	///< 貸し出し中の最大値（全ての段階の合計）
+		size_t hits = 0;			///< 再利用できた回数
+		size_t misses = 0;			///< 新規に確保した回数
+		size_t mappedBytes = 0;		///< 貸し出し中のうちスクラッチファイルにマップしたバイト数
+		size_t peakMappedBytes = 0;	///< mappedBytes の最大値
+		double acquireMilliseconds = 0.0;	///< Acquire に掛かった時間の合計（ゼロ埋めを含む）
+	};
+
+	/// @param idleSeconds 返却後この秒数使われなかったバッファを解放する（0なら返却時に即解放）
+	explicit BufferPool(int idleSeconds = 120);
+	~BufferPool();
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	/// @brief バッファを借りる
+	/// @param bytes 必要なバイト数
+	/// @param clear trueならゼロ埋めする
+	/// @return 確保に失敗した場合は空のバッファ
+	Buffer Acquire(size_t bytes, bool clear = false);
+
+	/// @brief 保持しているバッファのうち、idle 秒以上使われていないものを解放する
+	void Trim(std::chrono::seconds idle);
+
+	/// 保持しているバッファを全て解放する
+	void Clear() { Trim(std::chrono::seconds(0)); }
+
+	void SetIdleSeconds(int idleSeconds);
+
+	/// @brief スクラッチファイルへのマップに切り替えるサイズを設定する
+	/// @param thresholdBytes これ以上のバッファはマップする（0ならマップしない）
+	/// @param directory スクラッチファイルを作成するフォルダ（末尾の区切り文字を含む）
+	void SetMappedThreshold(size_t thresholdBytes, const std::string& directory);
+
+	Statistics GetStatistics() const;
+
+	/// 段階毎の統計（初めて確保した順。StageScope の外で確保したものは "other"）
+	std::vector<StageStatistics> GetStageStatistics() const;
+
+	/// 統計をリセットする（ピークは現在の使用量から数え直す）
+	void ResetStatistics();
+
+private:
+	struct Entry {
+		unsigned char* data;
+		size_t capacity;
+		std::chrono::steady_clock::time_point released;
+	};
+
+	static size_t SizeClass(size_t bytes);
+	static unsigned char* AllocateAligned(size_t bytes);
+	static void FreeAligned(unsigned char* data);
+	static unsigned char* MapScratch(const std::string& directory, size_t bytes);
+	static void UnmapScratch(unsigned char* data, size_t bytes);
+
+	void Release(unsigned char* data, size_t capacity, bool mapped, int stage);
+	/// 貸し出したバッファを、呼び出したスレッドの段階に数える（mutex_ を持って呼ぶ）
+	int CountAcquired(size_t bytes);
+	void TrimLocked(std::chrono::seconds idle, std::vector<Entry>& released);
+	void TrimThread();
+
+	mutable std::mutex mutex_;
+	std::condition_variable wakeup_;
+	std::vector<Entry> free_;
+	std::thread trimThread_;
+	bool stopping_ = false;
+	std::chrono::seconds idle_;
+	size_t mappedThreshold_ = 0;
+	std::string scratchDirectory_;
+	Statistics statistics_;
+	std::vector<StageStatistics> stages_;
+};
+
+}
@@ -21,10 +21,10 @@
 
 using namespace ComfyUIPlugin;
 
-#if defined(__APPLE__)
-#define COMFYUI_EXPORT extern "C" __attribute__((visibility("default")))
-#else
+#if defined(_WIN32)
 #define COMFYUI_EXPORT extern "C" __declspec(dllexport)
+#else
+#define COMFYUI_EXPORT extern "C" __attribute__((visibility("default")))
 #endif
 
 /// このプラグインのモジュールID（GUID）
@@ -18,25 +18,56 @@
 #include <chrono>  // sleep_for
 #include <thread>  // sleep_for
 #include <vector>
+#include <bit>     // countr_zero
+#include <cstring> // memcpy
+#include <tuple>   // tie
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <cmath>   // sqrt
+#include <limits>  // quiet_NaN
+#include <map>
+#include <random>  // ###seed###
+#include <unordered_set>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define COMFYUI_USE_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define COMFYUI_USE_NEON 1
+#endif
 
-#if defined(__APPLE__)
+#if !defined(_WIN32)
 #include <codecvt>
-#include <CoreFoundation/CoreFoundation.h>
 #include <dlfcn.h>
 #include <locale>
+#include <signal.h>
 #include <sys/wait.h>
+#include <unistd.h>
+#endif
+#if defined(__APPLE__)
+#include <CoreFoundation/CoreFoundation.h>
 #endif
 
+#include "BufferPool.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "ResizeImage.h"
+#include "ResultCache.h"
+#include "Trace.h"
 #include "ComfyUIPlugin.h"
+#include "ComfyUIPluginInternal.h"
 #include "ComvertImage.h"
 #include "FilterPlugIn.h"
 
 using namespace ComfyUIPlugin;
 
-#if defined(__APPLE__)
-#define COMFYUI_EXPORT extern "C" __attribute__((visibility("default")))
-#else
+#if defined(_WIN32)
 #define COMFYUI_EXPORT extern "C" __declspec(dllexport)
+#else
+#define COMFYUI_EXPORT extern "C" __attribute__((visibility("default")))
 #endif
 
 #ifndef COMFYUI_INCLUDE_DEFAULT_ENTRYPOINT
@@ -55,66 +86,11 @@ constexpr auto kModuleIDString = "cebe5795-0c3a-4ea5-81e4-e33c1372cd44";
 // ComfyUIのサーバーアドレス（デフォルト）
 const std::string SERVER_ADDRESS_DEFAULT = "http://127.0.0.1:8188";
 
-// 置換対象のマーカー 入力画像
-const std::string MARKER_INPUT_IMAGE = "temp_img_req_yyyyMMddhhmmss.png"; 
-
-// constexpr size_t kSubImageDropdownCount = 3;
-// const std::array<std::string, kSubImageDropdownCount> kSubImageMarkers = {
-// 	"temp_subimg_req_yyyyMMddhhmmss.png",
-// 	"temp_subimg2_req_yyyyMMddhhmmss.png",
-// 	"temp_subimg3_req_yyyyMMddhhmmss.png"
-// };
-// const std::array<std::string, kSubImageDropdownCount> kSubImageUploadPrefixes = {
-// 	"temp_subimg_req_",
-// 	"temp_subimg2_req_",
-// 	"temp_subimg3_req_"
-// };
-
-constexpr size_t kSubImageDropdownCount = 7;
-const std::array<std::string, kSubImageDropdownCount> kSubImageMarkers = {
-	"temp_subimg_req_yyyyMMddhhmmss.png",
-	"temp_subimg2_req_yyyyMMddhhmmss.png",
-	"temp_subimg3_req_yyyyMMddhhmmss.png",
-	"temp_subimg4_req_yyyyMMddhhmmss.png",
-	"temp_subimg5_req_yyyyMMddhhmmss.png",
-	"temp_subimg6_req_yyyyMMddhhmmss.png",
-	"temp_subimg7_req_yyyyMMddhhmmss.png"
-};
-const std::array<std::string, kSubImageDropdownCount> kSubImageUploadPrefixes = {
-	"temp_subimg_req_",
-	"temp_subimg2_req_",
-	"temp_subimg3_req_",
-	"temp_subimg4_req_",
-	"temp_subimg5_req_",
-	"temp_subimg6_req_",
-	"temp_subimg7_req_"
-};
-
-// 置換対象のマーカー プロンプト
-const std::string MARKER_PROMPT = "###input1###"; 
-const std::string MARKER_NPROMPT = "###input2###"; 
-const std::array<std::string, 3> kNumberMarkers = {
-	"###num1###",
-	"###num2###",
-	"###num3###",
-};
-
-constexpr size_t kNumberParameterCount = kNumberMarkers.size();
-constexpr std::array<double, kNumberParameterCount> kDefaultNumberMinimums = { 0.0, 0.0, 0.0 };
-constexpr std::array<double, kNumberParameterCount> kDefaultNumberMaximums = { 10.0, 1.0, 1.0 };
-constexpr std::array<double, kNumberParameterCount> kDefaultNumberValues = { 1.0, 0.75, 0.0 };
-
 const std::string kNoImageDisplayName = "(no image)";
 
 /// このDLLのベースパス
 std::string g_BasePath;
 
-/// デバッグログの書き出し先
-std::string g_DebugPath;
-
-/// server
-std::string g_ServerAddress;
-
 /// API Key
 std::string g_APIKey;
 
@@ -125,108 +101,20 @@ int g_RetryWaitSeconds;
 /// trueの場合は従来のbat/Pythonによる画像変換を使用する。
 bool g_UsePythonImageConversion = false;
 
-/// temp_post.jsonの書き出し先
-std::string g_TempPostJsonPath;
-
-/// temp_xxx_res.jsonの書き出し先
-std::string g_TempPromptResultJsonPath;
-std::string g_TempHistoryResultJsonPath;
-
-// パラメーター構造体
-struct Params {
-     std::string template_workflow_filename;
-     std::array<std::string, kSubImageDropdownCount> input_subimage_filenames;
-     std::string prompt;
-     std::string negative_prompt;
-	 std::array<double, kNumberParameterCount> numbers = kDefaultNumberValues;
-	 std::array<double, kNumberParameterCount> number_minimums = kDefaultNumberMinimums;
-	 std::array<double, kNumberParameterCount> number_maximums = kDefaultNumberMaximums;
-	 std::array<double, kNumberParameterCount> number_defaults = kDefaultNumberValues;
-     int sample_steps;
-};
-
-/// フィルター情報
-struct FilterInfo {
-	FilterPlugIn::Server const* server = nullptr;
-	Params params;
-	int setting = -1;
-	std::array<int, kSubImageDropdownCount> subimage_indices{};
-	bool use_selection_as_mask = false;
-	// bool outpaint_transparent_area = false; // Temporarily disabled.
-};
-
-
-class ImageBuffer {
-private:
-	int width_ = 0;
-	int height_ = 0;
-	
-	// R, G, B の順で全てのピクセルデータを連続して保持
-	std::unique_ptr<unsigned char[]> data_buffer_;
-	const int CHANNELS = 3; // R, G, B
+/// 生成結果と入力の差分がこの値（チャンネル毎の差の最大値）以下のタイルは書き戻さない。負の値なら常に書き戻す。
+int g_ChangeThreshold = 0;
 
-public:
-	ImageBuffer() = default;
+/// trueの場合は、入力範囲を不透明な部分（＋余白 g_AutoCropMargin）に切り詰めてから送る。
+bool g_AutoCropTransparent = false;
+int g_AutoCropMargin = 32;
 
-	FilterPlugIn::Rect rect;
+/// trueの場合は、入力画像全体をバッファに読み込まず、ブロック行毎に読んでそのままPNGへエンコードする。
+bool g_StreamInputCapture = true;
 
-	void allocate(int w, int h) {
-		width_ = w;
-		height_ = h;
-		size_t total_bytes = static_cast<size_t>(width_) * height_ * CHANNELS;
+/// trueの場合はフィルタのプレビューを有効にし、画面の「Fast preview」がオンの間は縮小した入力で生成する。
+bool g_EnablePreview = false;
+double g_PreviewMaxMegapixels = 0.25;
 
-		// 全ピクセル分のバイトを一度に割り当て
-		data_buffer_ = std::make_unique<unsigned char[]>(total_bytes);
-		std::fill_n(data_buffer_.get(), total_bytes, static_cast<unsigned char>(0));
-	}
-
-	int get_width()  const { return width_; }
-	int get_height() const { return height_; }
-	
-	/**
-	 * @brief 指定された座標 (x, y) のピクセル値を取得します。
-	 * @param x 列インデックス (0 から width-1)
-	 * @param y 行インデックス (0 から height-1)
-	 * @param channel_offset 取得したいチャネル (R=0, G=1, B=2)
-	 * @return unsigned char ピクセル値
-	 */
-	unsigned char get_pixel_value(int x, int y, int channel_offset) const {
-		if (x < 0 || x >= width_ || y < 0 || y >= height_ || channel_offset < 0 || channel_offset >= CHANNELS) {
-			// 範囲外のアクセスはエラーまたは0を返す
-			return 0; 
-		}
-
-		// 1次元配列内のインデックスを計算
-		// (y * 幅 + x) * チャンネル数 + チャンネルオフセット
-		size_t index = (static_cast<size_t>(y) * width_ + x) * CHANNELS + channel_offset;
-		
-		return data_buffer_[index];
-	}
-	
-	void set_pixel_value(int x, int y, int channel_offset, unsigned char value) const {
-		if (x < 0 || x >= width_ || y < 0 || y >= height_ || channel_offset < 0 || channel_offset >= CHANNELS) {
-			// 範囲外のアクセスはエラーまたは0を返す
-			return; 
-		}
-
-		// 1次元配列内のインデックスを計算
-		// (y * 幅 + x) * チャンネル数 + チャンネルオフセット
-		size_t index = (static_cast<size_t>(y) * width_ + x) * CHANNELS + channel_offset;
-		
-		data_buffer_[index] = value;
-	}
-	
-	// データポインタを取得する（データ格納関数内で使用）
-	unsigned char* get_data_pointer() {
-		return data_buffer_.get();
-	}
-};
-
-
-void Transfer(const FilterPlugIn::Block& dst, const class ImageBuffer& src, const FilterPlugIn::Block& alpha);
-// void TransferForOutpaint(const FilterPlugIn::Block& dst, const class ImageBuffer& src, const FilterPlugIn::Block& alpha); // Temporarily disabled.
-void Transfer(const ImageBuffer& dst, const FilterPlugIn::Block& src, int offsetY, int offsetX);
-void Transfer(const FilterPlugIn::Block& dst, const class ImageBuffer& src, const FilterPlugIn::Block& alpha, const FilterPlugIn::Block& select);
 static bool GetFullLayerRect(FilterPlugIn::Offscreen& offscreen, FilterPlugIn::Rect& layerRect) {
 	// Depending on the host context, one of these rectangles can be clipped to
 	// the selection.  Use their union so that a canvas-sized rectangle returned
@@ -252,13 +140,14 @@ static bool GetFullLayerRect(FilterPlugIn::Offscreen& offscreen, FilterPlugIn::R
 	layerRect = blocks.front(); for (const auto& block : blocks) { layerRect.left = std::min(layerRect.left, block.left); layerRect.top = std::min(layerRect.top, block.top); layerRect.right = std::max(layerRect.right, block.right); layerRect.bottom = std::max(layerRect.bottom, block.bottom); }
 	return !FilterPlugIn::isRectEmpty(layerRect);
 }
-static void CopyImageToRgba(const ImageBuffer& image, std::vector<unsigned char>& rgba, unsigned char initialAlpha = 255) {
-	const auto width = image.get_width(); const auto height = image.get_height(); rgba.resize(static_cast<size_t>(width) * static_cast<size_t>(height) * 4);
-	for (int y = 0; y < height; ++y) for (int x = 0; x < width; ++x) { const auto offset = (static_cast<size_t>(y) * width + x) * 4; rgba[offset] = image.get_pixel_value(x, y, 2); rgba[offset + 1] = image.get_pixel_value(x, y, 1); rgba[offset + 2] = image.get_pixel_value(x, y, 0); rgba[offset + 3] = initialAlpha; }
+bool CopyImageToRgba(const ImageBuffer& image, BufferPool& pool, BufferPool::Buffer& rgba, unsigned char initialAlpha) {
+	const auto width = image.get_width(); const auto height = image.get_height(); rgba = pool.Acquire(static_cast<size_t>(width) * static_cast<size_t>(height) * 4); if (!rgba) return false;
+	for (int y = 0; y < height; ++y) { const unsigned char* src = image.get_pixel_pointer(0, y); unsigned char* dst = rgba.data() + static_cast<size_t>(y) * width * 4; for (int x = 0; x < width; ++x, src += 3, dst += 4) { dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0]; dst[3] = initialAlpha; } }
+	return true;
 }
 
 // 非矩形の選択範囲では選択範囲オフスクリーン API を使わず、外接矩形をマスクとして扱う。
-static void ApplyRectangleSelectionMask(const FilterPlugIn::Rect& selectionRect, const FilterPlugIn::Rect& imageRect, std::vector<unsigned char>& rgba) {
+void ApplyRectangleSelectionMask(const FilterPlugIn::Rect& selectionRect, const FilterPlugIn::Rect& imageRect, unsigned char* rgba) {
 	const auto maskRect = FilterPlugIn::intersectRects(selectionRect, imageRect); if (FilterPlugIn::isRectEmpty(maskRect)) return;
 	const int imageWidth = imageRect.right - imageRect.left;
 	for (int y = maskRect.top; y < maskRect.bottom; ++y) for (int x = maskRect.left; x < maskRect.right; ++x) rgba[(static_cast<size_t>(y - imageRect.top) * imageWidth + (x - imageRect.left)) * 4 + 3] = 0;
@@ -284,17 +173,6 @@ static bool CopyLayerAlphaToRgba(FilterPlugIn::Offscreen& source, const FilterPl
 // パラメーター実体
 #endif
 
-Params g_params;
-
-/// 設定リスト（サブウィンドウの先頭のドロップダウン）
-std::vector<std::string> g_Settings;
-
-/// サブイメージリスト（サブウィンドウの次のドロップダウン）
-std::vector<std::string> g_SubImages;
-
-/// ユーザー設定ファイルの有無
-bool g_HasUserSettingIni = false;
-
 static FILE* OpenFile(const std::string& path, const char* mode) {
 #if defined(_WIN32)
 	FILE* file = nullptr; fopen_s(&file, path.c_str(), mode); return file;
@@ -305,22 +183,27 @@ static FILE* OpenFile(const std::string& path, const char* mode) {
 
 /// デバッグ出力の開始
 void InitDebugOutput(const std::string& basePath) {
-	g_DebugPath = basePath + "debuglog.txt";
-	if (FILE* fp = OpenFile(g_DebugPath, "w")) std::fclose(fp);
+	Logger::Instance().Open(basePath + "debuglog.txt");
 	if (FILE* fp = OpenFile(basePath + "debuglog_py.txt", "w")) std::fclose(fp);
 }
 
-/// デバッグ出力
+/// デバッグ出力（Info レベル）
 /// @note ホストアプリがデバッガを嫌うから原始的なファイル出力で
+/// 書き出しは Logger のスレッドが行うので、ここではリングバッファに書式化するだけ
 void print(const char* format, ...) {
-	if (g_DebugPath.empty()) return;
-	if (FILE* fp = OpenFile(g_DebugPath, "a")) { va_list arg; va_start(arg, format); std::vfprintf(fp, format, arg); va_end(arg); std::fputs("\n", fp); std::fclose(fp); }
+	va_list arg; va_start(arg, format);
+	Logger::Instance().WriteV(LogLevel::Info, format, arg);
+	va_end(arg);
 }
 
 /// デバッグ出力（wstring用）
 void print(const wchar_t* format, ...) {
-	if (g_DebugPath.empty()) return;
-	if (FILE* fp = OpenFile(g_DebugPath, "a")) { va_list arg; va_start(arg, format); std::vfwprintf(fp, format, arg); va_end(arg); std::fputws(L"\n", fp); std::fclose(fp); }
+	if (!Logger::Instance().IsEnabled(LogLevel::Info)) return;
+	std::array<wchar_t, Logger::kLineBytes> wide{};
+	va_list arg; va_start(arg, format); std::vswprintf(wide.data(), wide.size(), format, arg); va_end(arg);
+	std::array<char, Logger::kLineBytes * 2> narrow{};
+	if (std::wcstombs(narrow.data(), wide.data(), narrow.size() - 1) == static_cast<size_t>(-1)) narrow[0] = '\0';
+	Logger::Instance().Write(LogLevel::Info, "%s", narrow.data());
 }
 
 #if defined(__APPLE__)
@@ -351,6 +234,11 @@ static std::string EnsureUtf8ForMac(const std::string& value) {
 	utf8Value.resize(static_cast<size_t>(usedBytes));
 	return utf8Value;
 }
+#elif !defined(_WIN32)
+// Linux（ホストシミュレーター）では、文字列は全て UTF-8 で渡される
+static std::string EnsureUtf8ForMac(const std::string& value) {
+	return value;
+}
 #endif
 
 // curlでPOSTするためにjsonをファイルに書き出し
@@ -376,64 +264,119 @@ static std::string shellQuote(const std::string& value) {
 }
 
 /// @brief コマンドを実行し、終了コードを返す。
-int exe_command_silent(const std::string& command) {
+/// @param context cancel_requested が立ったら、コマンドを終了して戻る
+int exe_command_silent(const RunContext& context, const std::string& command) {
 #if defined(_WIN32)
 	STARTUPINFOW si{}; PROCESS_INFORMATION pi{}; si.cb = sizeof(si); si.dwFlags = STARTF_USESHOWWINDOW; si.wShowWindow = SW_HIDE;
 	std::wstring cmdLine = L"cmd.exe /C " + ShiftJIS_to_UTF16(command);
-	if (!CreateProcessW(nullptr, cmdLine.data(), nullptr, nullptr, FALSE, CREATE_NO_WINDOW | CREATE_UNICODE_ENVIRONMENT, nullptr, ShiftJIS_to_UTF16(g_BasePath).c_str(), &si, &pi)) { print("CreateProcessW failed: %lu", GetLastError()); return 1; }
-	WaitForSingleObject(pi.hProcess, INFINITE); DWORD exitCode = 1; GetExitCodeProcess(pi.hProcess, &exitCode); CloseHandle(pi.hProcess); CloseHandle(pi.hThread); return static_cast<int>(exitCode);
+	if (!CreateProcessW(nullptr, cmdLine.data(), nullptr, nullptr, FALSE, CREATE_NO_WINDOW | CREATE_UNICODE_ENVIRONMENT | CREATE_SUSPENDED, nullptr, ShiftJIS_to_UTF16(g_BasePath).c_str(), &si, &pi)) { print("CreateProcessW failed: %lu", GetLastError()); return 1; }
+	// キャンセル時に cmd.exe だけでなく子の curl も終了できるよう、ジョブに入れてから実行する
+	HANDLE job = CreateJobObjectW(nullptr, nullptr);
+	if (job) { JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits{}; limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE; SetInformationJobObject(job, JobObjectExtendedLimitInformation, &limits, sizeof(limits)); if (!AssignProcessToJobObject(job, pi.hProcess)) { CloseHandle(job); job = nullptr; } }
+	ResumeThread(pi.hThread);
+	while (WaitForSingleObject(pi.hProcess, 50) == WAIT_TIMEOUT) {
+		if (!context.cancel_requested) continue;
+		if (job) TerminateJobObject(job, 1); else TerminateProcess(pi.hProcess, 1);
+		WaitForSingleObject(pi.hProcess, INFINITE);
+		break;
+	}
+	DWORD exitCode = 1; GetExitCodeProcess(pi.hProcess, &exitCode); CloseHandle(pi.hProcess); CloseHandle(pi.hThread); if (job) CloseHandle(job); return static_cast<int>(exitCode);
 #else
-	const int status = std::system(("cd " + shellQuote(g_BasePath) + " && " + command).c_str());
-	return status == -1 ? 1 : (WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+	// std::system では待っている間に止められないので、プロセスグループを分けて起動し、キャンセル時はグループごと終了する
+	const std::string shellCommand = "cd " + shellQuote(g_BasePath) + " && " + command;
+	const pid_t pid = fork();
+	if (pid < 0) return 1;
+	if (pid == 0) { setpgid(0, 0); execl("/bin/sh", "sh", "-c", shellCommand.c_str(), static_cast<char*>(nullptr)); _exit(127); }
+	setpgid(pid, pid);
+	int status = 0;
+	while (true) {
+		const pid_t done = waitpid(pid, &status, WNOHANG);
+		if (done == pid) break;
+		if (done < 0) return 1;
+		if (context.cancel_requested) { kill(-pid, SIGTERM); waitpid(pid, &status, 0); return 1; }
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
 #endif
 }
 /**
  * @brief HTTP GETリクエストを実行し、レスポンスをファイルに保存
+ * @param context 実行中のフィルタ（キャンセルされたら curl を終了する）
  * @param url リクエストURL
  * @param output_filename レスポンスを書き込むファイル名
  * @return true 成功, false 失敗
  */
-bool http_get_to_file(const std::string& url, const std::string& output_filename) {
+bool http_get_to_file(const RunContext& context, const std::string& url, const std::string& output_filename) {
     std::string command = "curl -s -o " + output_filename + " \"" + url + "\"";
-    print(("GET Command: " + command).c_str());
-    int result = exe_command_silent(command);
-    print(("curl GET command returns :" + std::to_string(result)).c_str());
+    LOG_DEBUG("GET Command: %s", command.c_str());
+    int result = exe_command_silent(context, command);
+    LOG_DEBUG("curl GET command returns :%d", result);
     return true;
 }
 
 
 /**
  * @brief HTTP POSTリクエストを実行し、レスポンスをファイルに保存
+ * @param context 実行中のフィルタ（キャンセルされたら curl を終了する）
  * * @param url リクエストURL
  * @param data_filename POSTするデータファイル名
  * @param output_filename レスポンスを書き込むファイル名
  * @return true 成功, false 失敗
  */
-bool http_post_file_to_file(const std::string& url, const std::string& data_filename, const std::string& output_filename) {
+bool http_post_file_to_file(const RunContext& context, const std::string& url, const std::string& data_filename, const std::string& output_filename) {
     // Windowsで実行する前提として、curlを利用し、JSONをPOST
     std::string command = "curl -s -X POST -H \"Content-Type: application/json\" -d @" + data_filename + " -o " + output_filename + " \"" + url + "\"";
-    print(("POST Command: " + command).c_str());
-	int result = exe_command_silent(command);
-    print(("curl POST command returns :" + std::to_string(result)).c_str());
+    LOG_DEBUG("POST Command: %s", command.c_str());
+	int result = exe_command_silent(context, command);
+    LOG_DEBUG("curl POST command returns :%d", result);
     return true;
 }
 
 /**
  * @brief HTTP POSTリクエストを実行し、レスポンスをファイルに保存
+ * @param context 実行中のフィルタ（キャンセルされたら curl を終了する）
  * * @param url リクエストURL
  * @param image_filename POSTする画像ファイル名
  * @param output_filename レスポンスを書き込むファイル名
  * @return true 成功, false 失敗
  */
-bool http_post_image_to_file(const std::string& url, const std::string& image_filepath, const std::string& image_filename, const std::string& output_filename) {
+bool http_post_image_to_file(const RunContext& context, const std::string& url, const std::string& image_filepath, const std::string& image_filename, const std::string& output_filename) {
+	Trace::Scope span(context.trace, "upload", "http");
+	const auto start = std::chrono::steady_clock::now();
+	std::error_code sizeError;
+	const auto bytes = std::filesystem::file_size(image_filepath, sizeError);
+	span.Arg("file", image_filename);
+	span.Arg("bytes", sizeError ? -1LL : static_cast<long long>(bytes));
     // Windowsで実行する前提として、curlを利用し、JSONをPOST
     std::string command = "curl -s -X POST -F \"image=@" + image_filepath + ";filename=" + image_filename + "\" -o " + output_filename + " \"" + url + "\"";
-    print(("POST Command: " + command).c_str());
-	int result = exe_command_silent(command);
-    print(("curl POST command returns :" + std::to_string(result)).c_str());
+    LOG_DEBUG("POST Command: %s", command.c_str());
+	int result = exe_command_silent(context, command);
+    LOG_DEBUG("curl POST command returns :%d", result);
+	if (context.cancel_requested) return true;
+	// 失敗したアップロードは時間と送信量に数えない
+	if (result != 0) {
+		context.CountError("upload");
+		return true;
+	}
+	context.ObserveStage("upload", std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	if (!sizeError) context.Count("comfyui_plugin_uploaded_bytes_total", static_cast<double>(bytes));
     return true;
 }
 
+/// @brief /upload/image のレスポンスから、サーバー上のファイル名を取り出す（同じ名前のファイルがあるとサーバーが名前を変えるため）
+/// @return 取り出せない場合は空文字列
+std::string ReadUploadedName(const std::string& responsePath) {
+	std::ifstream ifs(responsePath);
+	const std::string response((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+	const size_t key = response.find("\"name\"");
+	if (key == std::string::npos) return "";
+	const size_t colon = response.find(':', key);
+	const size_t start = colon == std::string::npos ? std::string::npos : response.find('"', colon);
+	const size_t end = start == std::string::npos ? std::string::npos : response.find('"', start + 1);
+	if (end == std::string::npos) return "";
+	return response.substr(start + 1, end - start - 1);
+}
+
 static void LogImageConversionFailure(const char* conversion, const std::string& errorMessage) {
 	print("IMAGE_CONVERSION_FAILED: %s (%s)", conversion, errorMessage.c_str());
 #if defined(_WIN32)
@@ -442,27 +385,32 @@ static void LogImageConversionFailure(const char* conversion, const std::string&
 	print("macOS ImageIO/CoreGraphics image conversion failed.");
 #endif
 }
-bool call_png_to_bmp() {
+/// @brief pngPath を同じフォルダーの同じ名前の BMP に変換する
+bool call_png_to_bmp(const RunContext& context, const std::string& pngPath) {
+	Trace::Scope span(context.trace, "PNG to BMP", "convert");
 #if defined(_WIN32)
 	if (g_UsePythonImageConversion) {
-		if (exe_command_silent(g_BasePath + "png_to_bmp.bat") != 0) { print("Error: png_to_bmp command failed."); return false; }
+		if (exe_command_silent(context, g_BasePath + "png_to_bmp.bat \"" + pngPath + "\"") != 0) { print("Error: png_to_bmp command failed."); return false; }
 		return true;
 	}
 #endif
+	auto outputPath = std::filesystem::path(pngPath); outputPath.replace_extension(".bmp");
 	std::string errorMessage;
-	const bool converted = ComvertImage::PngToBmp(g_BasePath + "temp_img_res.png", g_BasePath + "temp_img_res.bmp", &errorMessage);
+	const bool converted = ComvertImage::PngToBmp(pngPath, outputPath.string(), &errorMessage);
 	if (!converted) LogImageConversionFailure("PNG to BMP", errorMessage);
 	return converted;
 }
 
-bool call_bmp_to_png(const std::string& imagePath) {
+/// @brief bmpPath を同じフォルダーの同じ名前の PNG に変換する
+bool call_bmp_to_png(const RunContext& context, const std::string& bmpPath) {
+	Trace::Scope span(context.trace, "BMP to PNG", "convert");
 #if defined(_WIN32)
 	if (g_UsePythonImageConversion) {
-		if (exe_command_silent(g_BasePath + "bmp_to_png.bat " + imagePath) != 0) { print("Error: bmp_to_png command failed."); return false; }
+		if (exe_command_silent(context, g_BasePath + "bmp_to_png.bat \"" + bmpPath + "\"") != 0) { print("Error: bmp_to_png command failed."); return false; }
 		return true;
 	}
 #endif
-	const std::filesystem::path inputPath = std::filesystem::path(g_BasePath) / imagePath;
+	const std::filesystem::path inputPath(bmpPath);
 	auto outputPath = inputPath; outputPath.replace_extension(".png");
 	std::string errorMessage;
 	const bool converted = ComvertImage::BmpToPng(inputPath.string(), outputPath.string(), &errorMessage);
@@ -475,19 +423,19 @@ bool call_bmp_to_png(const std::string& imagePath) {
  * @param client_id クライアントID
  * @return std::string prompt_id, 失敗時は空文字列
  */
-std::string run_workflow(const std::string& workflow_json_path, const std::string& client_id) {
-    std::string temp_res_file = g_TempPromptResultJsonPath;
-    std::string url = g_ServerAddress + "/prompt";
+std::string run_workflow(const RunContext& context, const std::string& workflow_json_path, const std::string& client_id) {
+    std::string temp_res_file = context.Path("temp_prompt_res.json");
+    std::string url = context.server_address + "/prompt";
     
     // POSTリクエスト実行
-    if (!http_post_file_to_file(url, workflow_json_path, temp_res_file)) {
+    if (!http_post_file_to_file(context, url, workflow_json_path, temp_res_file)) {
         std::remove(temp_res_file.c_str());
         return "";
     }
 
     std::ifstream ifs(temp_res_file);
     if (!ifs.is_open()) {
-        print(("Error: Could not open response file: " + temp_res_file).c_str() );
+        LOG_ERROR("Error: Could not open response file: %s", temp_res_file.c_str());
         return "";
     }
     
@@ -524,13 +472,15 @@ std::string run_workflow(const std::string& workflow_json_path, const std::strin
 /**
  * @brief 実行履歴を取得する関数 (get_historyの代替)
  * @param prompt_id 
+ * @param output_path 保存先（省略時は作業フォルダーの temp_history_res.json。複数のプロンプトを並行して待つ場合は別々にする）
  * @return std::string history_json_content, 失敗時は空文字列
  */
-std::string get_history(const std::string& prompt_id) {
-    std::string temp_res_file = g_TempHistoryResultJsonPath;
-    std::string url = g_ServerAddress + "/history/" + prompt_id;
+std::string get_history(const RunContext& context, const std::string& prompt_id, const std::string& output_path = "") {
+    Trace::Scope span(context.trace, "poll history", "http");
+    std::string temp_res_file = output_path.empty() ? context.Path("temp_history_res.json") : output_path;
+    std::string url = context.server_address + "/history/" + prompt_id;
     
-    if (!http_get_to_file(url, temp_res_file)) {
+    if (!http_get_to_file(context, url, temp_res_file)) {
         std::remove(temp_res_file.c_str());
         return "";
     }
@@ -540,8 +490,8 @@ std::string get_history(const std::string& prompt_id) {
     ifs.close();
     // std::remove(temp_res_file.c_str());
 
-	print("content");
-	print(content.c_str());
+	// ポーリングの度に届くヒストリー全体は、調査用のビルドでだけ出す（長い場合は切り詰められる）
+	LOG_TRACE("history content: %s", content.c_str());
 
     return content; // JSON全体を文字列として返す
 }
@@ -551,19 +501,34 @@ std::string get_history(const std::string& prompt_id) {
  * * @param filename ファイル名
  * @param type タイプ (image, outputなど)
  * @param subfolder サブフォルダ
+ * @param output_path 保存先（省略時は作業フォルダーの temp_img_res.png）
+ * @param preview_format 指定した場合は /view の preview パラメーター（"jpeg;80" など）で、非可逆に変換した画像を受け取る
  * @return std::string 一時ファイル名, 失敗時は空文字列
  */
-std::string get_image(const std::string& filename, const std::string& type, const std::string& subfolder) {
-    std::string temp_img_file = g_BasePath + "temp_img_res.png";
+std::string get_image(const RunContext& context, const std::string& filename, const std::string& type, const std::string& subfolder, const std::string& output_path, const std::string& preview_format) {
+    Trace::Scope span(context.trace, "download", "http");
+    span.Arg("file", filename);
+    const auto start = std::chrono::steady_clock::now();
+    std::string temp_img_file = output_path.empty() ? context.Path("temp_img_res.png") : output_path;
     
-    std::string url = g_ServerAddress + "/view?filename=" + filename + "&type=" + type + "&subfolder=" + subfolder;
+    std::string url = context.server_address + "/view?filename=" + filename + "&type=" + type + "&subfolder=" + subfolder;
+	if (!preview_format.empty()) url += "&preview=" + preview_format;
     
-    if (!http_get_to_file(url, temp_img_file)) {
+    if (!http_get_to_file(context, url, temp_img_file)) {
         std::remove(temp_img_file.c_str());
         return "";
     }
 
     // 画像データは一時ファイルに直接保存される
+    std::error_code sizeError;
+    const auto bytes = std::filesystem::file_size(temp_img_file, sizeError);
+    span.Arg("bytes", sizeError ? -1LL : static_cast<long long>(bytes));
+    if (!context.cancel_requested) {
+        // curl は失敗しても戻り値で分からないので、受け取れたファイルが無いか空なら失敗として数える
+        if (sizeError || bytes == 0) context.CountError("download");
+        context.ObserveStage("download", std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        if (!sizeError) context.Count("comfyui_plugin_downloaded_bytes_total", static_cast<double>(bytes));
+    }
     return temp_img_file;
 }
 
@@ -575,7 +540,7 @@ std::string get_image(const std::string& filename, const std::string& type, cons
 std::string read_file_to_string(const std::string& path) {
     std::ifstream file(path);
     if (!file.is_open()) {
-        print(("Error: Could not open file: " + path).c_str());
+        LOG_ERROR("Error: Could not open file: %s", path.c_str());
         return "";
     }
     std::stringstream buffer;
@@ -686,10 +651,12 @@ static std::string NormalizeFilenamePrefixSeparatorsForMac(std::string json) {
 #endif
 
 /**
- * ワークフローをComfyUIサーバーのキューに送信する
+ * ワークフローをComfyUIサーバーのキューに送信し、完了を待たずに prompt_id を返す
  * @param prompt_json ワークフローのJSON文字列
+ * @return prompt_id, 失敗時は空文字列
  */
-std::string queue_prompt(const std::string prompt_json) {
+std::string submit_prompt(const RunContext& context, const std::string& prompt_json) {
+	Trace::Scope span(context.trace, "submit", "http");
 
 	std::string prompt_json_to = prompt_json;
 
@@ -707,24 +674,117 @@ std::string queue_prompt(const std::string prompt_json) {
 
 	// print(payload_data.c_str());
 
-    print(("Write to json:" + g_TempPostJsonPath).c_str());
+	const std::string postJsonPath = context.Path("temp_post.json");
+    print(("Write to json:" + postJsonPath).c_str());
 	// ペイロードをファイル出力し、-dオプションで渡す
-	write_json_to_temp(payload_data.c_str(), g_TempPostJsonPath);
+	write_json_to_temp(payload_data.c_str(), postJsonPath);
     print("Write Finished");
 
     print("Sending prompt to ComfyUI...");
 	std::string client_id = "";
 
-	std::string prompt_id = run_workflow(g_TempPostJsonPath, client_id);
+	std::string prompt_id = run_workflow(context, postJsonPath, client_id);
+	if (prompt_id.empty()) {
+		print("Error: prompt_id was not returned.");
+		if (!context.cancel_requested) context.CountError("submit");
+	}
+	// キュー待ちはここから、サーバーが実行を始めるまで
+	else context.MarkSubmitted(prompt_id);
+	span.Arg("prompt_id", prompt_id);
+	return prompt_id;
+}
+
+/// @brief duration だけ待つ。context.cancel_requested が立ったらすぐに戻る。
+/// @return キャンセルされた場合はfalse
+static bool SleepUnlessCancelled(const RunContext& context, std::chrono::milliseconds duration) {
+	const auto until = std::chrono::steady_clock::now() + duration;
+	while (!context.cancel_requested) {
+		const auto now = std::chrono::steady_clock::now();
+		if (now >= until) return true;
+		std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(until - now, std::chrono::milliseconds(50)));
+	}
+	return false;
+}
 
+/// @brief ヒストリーの status.messages にあるサーバーの時刻から、キュー待ち・サーバーでの実行・完了に気付くまでの遅れをスパンにし、
+///        キュー待ちと実行の時間を統計に記録する
+/// @note サーバーの時計はこのPCの時計と同じとみなす（別のPCのサーバーで時計がずれていれば、その分ずれる）
+/// @param detected 完了したヒストリーを受け取った時刻
+static void RecordServerExecution(const RunContext& context, const std::string& prompt_id, const std::string& history, Trace::Clock::time_point detected) {
+	if (!context.trace.Enabled() && !context.metrics) return;
+	const auto timestamp = [&](const char* message) -> long long {
+		const size_t messagePos = history.find(std::string("\"") + message + "\"");
+		if (messagePos == std::string::npos) return -1;
+		const size_t keyPos = history.find("\"timestamp\"", messagePos);
+		const size_t colonPos = keyPos == std::string::npos ? std::string::npos : history.find(':', keyPos);
+		if (colonPos == std::string::npos) return -1;
+		return std::strtoll(history.c_str() + colonPos + 1, nullptr, 10);
+	};
+	const long long startMs = timestamp("execution_start"), endMs = timestamp("execution_success");
+	if (startMs <= 0 || endMs < startMs) return;
+	const long long queuedMs = context.SubmittedEpochMilliseconds(prompt_id);
+	if (queuedMs > 0) context.ObserveStage("queue_wait", std::max(startMs - queuedMs, 0LL) / 1000.0);
+	context.ObserveStage("execution", (endMs - startMs) / 1000.0);
+	if (!context.trace.Enabled()) return;
+	const auto start = context.trace.FromEpochMilliseconds(startMs), end = context.trace.FromEpochMilliseconds(endMs);
+	const std::string args = "\"prompt_id\":\"" + Trace::Escape(prompt_id) + "\"";
+	if (queuedMs > 0) context.trace.AddAsyncSpan("queue wait", "server", context.trace.FromEpochMilliseconds(queuedMs), start, args);
+	context.trace.AddAsyncSpan("server execution", "server", start, end, args);
+	context.trace.AddAsyncSpan("polling slack", "server", end, std::max(detected, end), args);
+}
+
+/// @brief ヒストリーの JSON から、最初の生成画像（CCPImage_*.png）のファイル名・種類・サブフォルダーを取り出す
+/// @return 生成画像が無ければfalse（image は既定値のまま）
+bool ExtractHistoryImage(const std::string& history_content, HistoryImage& image) {
+	const size_t image_pos = history_content.find("CCPImage_");
+	if (image_pos == std::string::npos) return false;
+
+	// "filename" 抽出
+	size_t fn_start = image_pos;
+	size_t fn_end = history_content.find(".png", fn_start) + 4;
+	LOG_TRACE("history filename range: %zu-%zu", fn_start, fn_end);
+	if (fn_start < fn_end) image.filename = history_content.substr(fn_start, fn_end - fn_start);
+
+	// "type" 抽出
+	size_t t_pos = history_content.find("\"type\"", image_pos);
+	if (t_pos != std::string::npos) {
+		size_t t_start = history_content.find('\"', t_pos + 6) + 1;
+		size_t t_end = history_content.find('\"', t_start);
+		if (t_start < t_end) image.type = history_content.substr(t_start, t_end - t_start);
+	}
+
+	// "subfolder" 抽出
+	size_t sf_pos = history_content.find("\"subfolder\"", image_pos);
+	if (sf_pos != std::string::npos) {
+		size_t sf_start = history_content.find('\"', sf_pos + 11) + 1;
+		size_t sf_end = history_content.find('\"', sf_start);
+		if (sf_start < sf_end) image.subfolder = history_content.substr(sf_start, sf_end - sf_start);
+	}
+	return true;
+}
+
+/**
+ * 送信済みのプロンプトの完了を待ち、生成画像をダウンロードする
+ * @param prompt_id submit_prompt の戻り値
+ * @param output_path 保存先（省略時は作業フォルダーの temp_img_res.png）
+ * @param preview_format get_image を参照
+ * @return 保存したファイルのパス, 失敗時は空文字列
+ */
+std::string wait_for_image(RunContext& context, const std::string& prompt_id, const std::string& output_path = "", const std::string& preview_format = "") {
+	if (prompt_id.empty() || context.cancel_requested) return "";
+	Trace::Scope span(context.trace, "wait for image");
+	span.Arg("prompt_id", prompt_id);
+
+	// 保存先を指定された場合は、履歴の取得結果も別のファイルにする（並行して待てるように）
+	std::string history_path;
+	if (!output_path.empty()) history_path = std::filesystem::path(output_path).replace_extension(".history.json").string();
     std::string history_content;
 	for (int i = 0; i < g_RetryMaxCount; i++) {
-		history_content = get_history(prompt_id);
+		history_content = get_history(context, prompt_id, history_path);
         size_t error_pos = history_content.find("execution_error");
 		if (error_pos != std::string::npos) {
-			print("");
-			print("history has returned execution error");
-			print("");
+			LOG_ERROR("history has returned execution error");
+			context.CountError("execution");
 			size_t message_pos = history_content.find("exception_message");
 			if (message_pos != std::string::npos) {
                 std::string message = history_content.substr(message_pos);
@@ -733,52 +793,29 @@ std::string queue_prompt(const std::string prompt_json) {
 				message = replace_all(message, "###back_to_n###", "\\\\n");
 				message = replace_all(message, "\", \"", "");
 				
-				print(message.c_str());
-				print("");
+				LOG_ERROR("%s", message.c_str());
 
 			}			
 			return "";
 		}
         size_t image_pos = history_content.find("CCPImage_");
 		if (image_pos == std::string::npos) {
-            std::this_thread::sleep_for(std::chrono::seconds(g_RetryWaitSeconds)); 
+			++context.wait_polls;
+			Trace::Scope sleepSpan(context.trace, "poll interval", "wait");
+			if (!SleepUnlessCancelled(context, std::chrono::seconds(g_RetryWaitSeconds))) return "";
 			continue;
 		}
+		RecordServerExecution(context, prompt_id, history_content, Trace::Clock::now());
 		break;
 	}
+	if (history_content.find("CCPImage_") == std::string::npos && !context.cancel_requested) context.CountError("timeout");
 
-	std::string filename;
-	std::string type = "output";
-	std::string subfolder = "CLIPSTUDIO_ComfyUI_PLUGIN";
-    size_t image_pos = history_content.find("CCPImage_");
-    if (image_pos != std::string::npos) {
-		// "filename" 抽出
-		size_t fn_start = image_pos;
-		size_t fn_end = history_content.find(".png", fn_start) + 4;
-		print(std::to_string(fn_start).c_str());
-		print(std::to_string(fn_end).c_str());
-		if (fn_start < fn_end) filename = history_content.substr(fn_start, fn_end - fn_start);
-
-		// "type" 抽出
-		size_t t_pos = history_content.find("\"type\"", image_pos);
-		if (t_pos != std::string::npos) {
-			size_t t_start = history_content.find('\"', t_pos + 6) + 1;
-			size_t t_end = history_content.find('\"', t_start);
-			if (t_start < t_end) type = history_content.substr(t_start, t_end - t_start);
-		}
-
-		// "subfolder" 抽出
-		size_t sf_pos = history_content.find("\"subfolder\"", image_pos);
-		if (sf_pos != std::string::npos) {
-			size_t sf_start = history_content.find('\"', sf_pos + 11) + 1;
-			size_t sf_end = history_content.find('\"', sf_start);
-			if (sf_start < sf_end) subfolder = history_content.substr(sf_start, sf_end - sf_start);
-		}
-	}
+	HistoryImage image;
+	ExtractHistoryImage(history_content, image);
 
-	print(filename.c_str());
+	print(image.filename.c_str());
 
-    std::string temp_image_path = get_image(filename, type, subfolder);
+    std::string temp_image_path = get_image(context, image.filename, image.type, image.subfolder, output_path, preview_format);
     if (temp_image_path.empty()) {
         print("Error: Failed to retrieve image data.");
     }
@@ -789,6 +826,30 @@ std::string queue_prompt(const std::string prompt_json) {
 
 }
 
+/**
+ * 古くなったプロンプトをサーバー側でも取り消す（キューから削除し、実行中なら中断する）
+ * @param prompt_id submit_prompt の戻り値
+ */
+void cancel_prompt(const RunContext& context, const std::string& prompt_id) {
+	if (prompt_id.empty()) return;
+	print(("Cancel prompt on the server: " + prompt_id).c_str());
+	const std::string requestPath = context.Path("temp_cancel.json");
+	const std::string responsePath = context.Path("temp_cancel_res.json");
+	write_json_to_temp(("{ \"delete\": [\"" + prompt_id + "\"] }").c_str(), requestPath);
+	http_post_file_to_file(context, context.server_address + "/queue", requestPath, responsePath);
+	// prompt_id を指定すると、そのプロンプトを実行中の場合だけ中断する
+	write_json_to_temp(("{ \"prompt_id\": \"" + prompt_id + "\" }").c_str(), requestPath);
+	http_post_file_to_file(context, context.server_address + "/interrupt", requestPath, responsePath);
+}
+
+/**
+ * ワークフローをComfyUIサーバーのキューに送信し、生成画像を作業フォルダーの temp_img_res.png に保存する
+ * @param prompt_json ワークフローのJSON文字列
+ */
+std::string queue_prompt(RunContext& context, const std::string prompt_json) {
+	return wait_for_image(context, submit_prompt(context, prompt_json));
+}
+
 /// @brief 実行中プラグインの配置フォルダーを返す。
 #if defined(_WIN32)
 static std::string GetBasePath(HMODULE module) {
@@ -799,21 +860,75 @@ static std::string GetBasePath(HMODULE module) {
 static std::string GetBasePath() {
 	Dl_info info{}; if (dladdr(reinterpret_cast<const void*>(&GetBasePath), &info) == 0 || !info.dli_fname) return "./";
 	const auto path = std::filesystem::weakly_canonical(info.dli_fname);
+#if defined(__APPLE__)
+	// <プラグインフォルダー>/<名前>.cpm/Contents/MacOS/<名前>
 	return path.parent_path().parent_path().parent_path().parent_path().string() + "/";
+#else
+	// Linux ではホストシミュレーターに静的にリンクするので、実行ファイルと同じフォルダー
+	return path.parent_path().string() + "/";
+#endif
 }
 #endif
 
 static void InitializeRuntimePaths() {
 	if (!g_BasePath.empty()) return;
-#if defined(__APPLE__)
+#if !defined(_WIN32)
 	g_BasePath = GetBasePath();
 #else
 	return;
 #endif
 	InitDebugOutput(g_BasePath);
-	g_TempPostJsonPath = g_BasePath + "temp_post.json";
-	g_TempPromptResultJsonPath = g_BasePath + "temp_prompt_res.json";
-	g_TempHistoryResultJsonPath = g_BasePath + "temp_history_res.json";
+}
+
+/// 作業フォルダーを作るフォルダー（プラグインフォルダーの下）
+const std::string kWorkspaceFolder = "Work";
+/// これより古い作業フォルダーは、異常終了したプロセスの残りとして削除する
+constexpr auto kStaleWorkspaceAge = std::chrono::hours(24);
+
+/// @brief 作業フォルダーを新しく作る（Work の下に <name>_<プロセスID>_<連番>）
+/// @note 同じフォルダーのプラグインが同じプロセスや別のプロセスで同時に実行しても、名前が重ならない
+/// @return 末尾に区切り文字を付けたパス。作れなかった場合は空文字列
+std::string CreateWorkspace(const std::string& name) {
+	static std::atomic<unsigned> sequence{ 0 };
+#if defined(_WIN32)
+	const unsigned long processId = GetCurrentProcessId();
+#else
+	const unsigned long processId = static_cast<unsigned long>(getpid());
+#endif
+	const std::filesystem::path parent = std::filesystem::path(g_BasePath) / kWorkspaceFolder;
+	std::error_code error;
+	std::filesystem::create_directories(parent, error);
+	// 既にあるフォルダーは他の実行が使っているかもしれないので、使わずに次の番号にする
+	for (int attempt = 0; attempt < 100; ++attempt) {
+		const auto path = parent / (name + "_" + std::to_string(processId) + "_" + std::to_string(++sequence));
+		if (std::filesystem::create_directory(path, error)) return path.string() + static_cast<char>(std::filesystem::path::preferred_separator);
+		if (error) break;
+	}
+	print("Failed to create a workspace in %s: %s", parent.string().c_str(), error.message().c_str());
+	return "";
+}
+
+/// @brief 作業フォルダーを中のファイルごと削除する
+void RemoveWorkspace(std::string& workspace) {
+	if (workspace.empty()) return;
+	std::error_code error;
+	std::filesystem::remove_all(workspace, error);
+	if (error) print("Failed to remove the workspace %s: %s", workspace.c_str(), error.message().c_str());
+	workspace.clear();
+}
+
+/// @brief 異常終了などで残った古い作業フォルダーを削除する
+static void RemoveStaleWorkspaces() {
+	std::error_code error;
+	const auto now = std::filesystem::file_time_type::clock::now();
+	for (std::filesystem::directory_iterator it(std::filesystem::path(g_BasePath) / kWorkspaceFolder, error), end; !error && it != end; it.increment(error)) {
+		std::error_code entryError;
+		if (!it->is_directory(entryError)) continue;
+		const auto writeTime = it->last_write_time(entryError);
+		if (entryError || now - writeTime < kStaleWorkspaceAge) continue;
+		std::filesystem::remove_all(it->path(), entryError);
+		print("Removed a stale workspace: %s", it->path().string().c_str());
+	}
 }
 
 #if defined(_WIN32)
@@ -821,9 +936,6 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD fdwReason, LPVOID) {
 	if (fdwReason == DLL_PROCESS_ATTACH) {
 		g_BasePath = GetBasePath(hModule);
 		InitDebugOutput(g_BasePath);
-		g_TempPostJsonPath = g_BasePath + "temp_post.json";
-		g_TempPromptResultJsonPath = g_BasePath + "temp_prompt_res.json";
-		g_TempHistoryResultJsonPath = g_BasePath + "temp_history_res.json";
 	}
 	return TRUE;
 }
@@ -845,6 +957,10 @@ enum PropertyKey {
 	ITEM_NUM3,
 	ITEM_USE_SELECTION_AS_MASK,
 	ITEM_OUTPAINT_TRANSPARENT_AREA,
+	ITEM_VARIANT_COUNT,
+	ITEM_VARIANT_INDEX,
+	ITEM_SWEEP,
+	ITEM_FAST_PREVIEW,
 };
 constexpr std::array<PropertyKey, kNumberParameterCount> kNumberPropertyKeys = {
 	ITEM_NUM1,
@@ -862,6 +978,9 @@ const std::array<std::string, kNumberParameterCount> kNumberPropertyNames = {
 /// @note ここでfalse返すとクリスタのバージョン上げろって言われる
 bool InitializeModule(FilterPlugIn::Server* server, FilterPlugIn::Ptr* data, std::string id) {
 	InitializeRuntimePaths();
+	// ここからモジュール終了まではログを書き出しスレッドに任せる
+	Logger::Instance().Start();
+	RemoveStaleWorkspaces();
 	// 初期化
 	FilterPlugIn::ModuleInitialize initialize(server);
     if (!initialize.Initialize(id)) return false;
@@ -878,13 +997,26 @@ bool InitializeModule(FilterPlugIn::Server* server, FilterPlugIn::Ptr* data, std
 /// プラグイン終了
 /// @return 正常終了ならtrue
 bool TerminateModule(FilterPlugIn::Server* server, FilterPlugIn::Ptr* data) {
-	// 情報インスタンス解放
+	// 情報インスタンス解放（先行アップロードを止めてから作業フォルダーを消す）
 	if (*data) {
-		delete static_cast<FilterInfo*>(*data);
+		auto info = static_cast<FilterInfo*>(*data);
+		info->subimage_uploader.Stop();
+		if (info->metrics.Enabled()) {
+			// セッション全体（保存済みの値を含む）の段階毎の時間の分布をログに残す
+			const auto summary = info->metrics.Summary();
+			if (!summary.empty()) print("Stage latency (%s, all sessions):", info->workspace_name.c_str());
+			for (const auto& line : summary) print("  %s", line.c_str());
+			if (!info->metrics.Save()) print("Failed to save the metrics.");
+		}
+		RemoveWorkspace(info->run_workspace);
+		RemoveWorkspace(info->upload_workspace);
+		delete info;
 		*data = nullptr;
 	}
 	// StableDiffusionのDLL解放
 	// StableDiffusion::Terminate();
+	// 溜まったログを書き出してスレッドを止める（DLL の解放中には join できない）
+	Logger::Instance().Stop();
 	return true;
 }
 
@@ -968,6 +1100,11 @@ static std::vector<std::string> GetCombinedIniSections(const std::string& defaul
 }
 
 // SubImageフォルダ内の.pngファイルのリストを返却する。
+/// SubImage フォルダー内のファイルのパス
+static std::string SubImagePath(const std::string& fileName) {
+	return g_BasePath + "SubImage" + static_cast<char>(std::filesystem::path::preferred_separator) + fileName;
+}
+
 static std::vector<std::string> GetSubImages()
 {
     std::vector<std::string> imageFiles;
@@ -997,27 +1134,27 @@ static std::vector<std::string> GetSubImages()
     return imageFiles;
 }
 
-static int GetNoImageSelectionIndex() {
-	return static_cast<int>(g_SubImages.size());
+static int GetNoImageSelectionIndex(const FilterInfo& info) {
+	return static_cast<int>(info.subimages.size());
 }
 
-static bool IsNoImageSelection(int selection) {
-	return selection < 0 || selection >= static_cast<int>(g_SubImages.size());
+static bool IsNoImageSelection(const FilterInfo& info, int selection) {
+	return selection < 0 || selection >= static_cast<int>(info.subimages.size());
 }
 
-static std::string ResolveSubImageFilename(int selection) {
-	if (selection >= 0 && selection < static_cast<int>(g_SubImages.size())) {
-		return g_SubImages[selection];
+static std::string ResolveSubImageFilename(const FilterInfo& info, int selection) {
+	if (selection >= 0 && selection < static_cast<int>(info.subimages.size())) {
+		return info.subimages[selection];
 	}
 	return "";
 }
 
 
 /// プロパティの初期化
-static void InitProperty(FilterPlugIn::Property& p, std::string mode) {
+static void InitProperty(FilterPlugIn::Property& p, const FilterInfo& info, std::string mode) {
 	auto setting = p.addEnumerationItem(ITEM_SETTING, "Setting");
-	for(int i = 0; i < g_Settings.size(); ++i) {
-		setting.addValue(i, ShiftJIS_to_UTF16(g_Settings[i])); // UI側はUNICODEが良い
+	for(int i = 0; i < info.settings.size(); ++i) {
+		setting.addValue(i, ShiftJIS_to_UTF16(info.settings[i])); // UI側はUNICODEが良い
 	}
 
 	p.addStringItem(ITEM_PROMPT, "Prompt", 800);
@@ -1032,12 +1169,20 @@ static void InitProperty(FilterPlugIn::Property& p, std::string mode) {
 	}
 	p.addBooleanItem(ITEM_USE_SELECTION_AS_MASK, L"選択範囲をマスクとし、対象レイヤーのキャンバス全体を渡す", false);
 	p.setItemStoreValue(ITEM_USE_SELECTION_AS_MASK);
+	// 生成したバリエーションは表示番号を変えるだけで切り替えられる（再生成しない）
+	p.addIntegerItem(ITEM_VARIANT_COUNT, "Variants", 1, 1, kMaxVariantCount);
+	p.setItemStoreValue(ITEM_VARIANT_COUNT);
+	p.addIntegerItem(ITEM_VARIANT_INDEX, "Show variant", 1, 1, kMaxVariantCount);
+	p.addBooleanItem(ITEM_SWEEP, L"num1～num3 を設定の *_sweep の範囲で振り、一覧画像にする", false);
+	if (g_EnablePreview) {
+		p.addBooleanItem(ITEM_FAST_PREVIEW, L"高速プレビュー（縮小して生成。OK では元の大きさで生成し直す）", true);
+	}
 	// p.addBooleanItem(ITEM_OUTPAINT_TRANSPARENT_AREA, L"外側の透明部分をアウトペイントする", false); // Temporarily disabled.
 // p.setItemStoreValue(ITEM_OUTPAINT_TRANSPARENT_AREA); // Temporarily disabled.
-	const int noImageIndex = static_cast<int>(g_SubImages.size());
+	const int noImageIndex = static_cast<int>(info.subimages.size());
 	auto addSubImageValues = [&](const FilterPlugIn::Property::EnumerationItem& enumeration) {
-		for(int i = 0; i < g_SubImages.size(); ++i) {
-			enumeration.addValue(i, ShiftJIS_to_UTF16(g_SubImages[i])); // UI側はUNICODEが良い
+		for(int i = 0; i < info.subimages.size(); ++i) {
+			enumeration.addValue(i, ShiftJIS_to_UTF16(info.subimages[i])); // UI側はUNICODEが良い
 		}
 		enumeration.addValue(noImageIndex, ShiftJIS_to_UTF16(kNoImageDisplayName));
 	};
@@ -1173,7 +1318,7 @@ static void iniUserPreferred(const std::string& defaultPath, const std::string&
 /// @param index スイッチ先の設定インデックス
 /// @param data フィルター情報
 /// @param propertyObject 反映先プロパティ
-static std::string NumberToJson(double value) {
+std::string NumberToJson(double value) {
 	std::ostringstream stream;
 	stream << std::setprecision(15) << value;
 	return stream.str();
@@ -1191,79 +1336,139 @@ static void LoadNumberSetting(const std::string& defaultPath, const std::string&
 	}
 }
 
+/// @brief ワークフローのテンプレートを読む
+/// @note 設定を切り替えた時に先読みしておき、ファイルの更新日時が変わっていなければ読み直さない
+static std::string ReadTemplate(const std::string& path) {
+	static std::string cachedPath;
+	static std::filesystem::file_time_type cachedWriteTime;
+	static std::string cachedContents;
+	std::error_code error;
+	const auto writeTime = std::filesystem::last_write_time(path, error);
+	if (!error && path == cachedPath && writeTime == cachedWriteTime && !cachedContents.empty()) return cachedContents;
+	cachedContents = read_file_to_string(path);
+	cachedPath = path;
+	cachedWriteTime = error ? std::filesystem::file_time_type{} : writeTime;
+	return cachedContents;
+}
+
+/// @brief スイープの範囲 "start,end,count" を、start から end までの count 個の等間隔の値にする
+static bool ParseSweep(const std::string& text, std::vector<double>& values) {
+	std::istringstream stream(text);
+	double first = 0.0, last = 0.0;
+	int count = 0;
+	char comma1 = 0, comma2 = 0;
+	if (!(stream >> first >> comma1 >> last >> comma2 >> count) || comma1 != ',' || comma2 != ',' || count < 1) return false;
+	values.clear();
+	for (int i = 0; i < count; ++i) {
+		const double value = count == 1 ? first : first + (last - first) * i / (count - 1);
+		// 0.1 刻みなどで誤差の桁がラベルやJSONに出ないように丸める
+		values.push_back(std::round(value * 1e6) / 1e6);
+	}
+	return true;
+}
+
+static void LoadIntegerSetting(const std::string& defaultPath, const std::string& userPath,
+	const std::string& section, const std::string& key, int& value) {
+	double number = value;
+	LoadNumberSetting(defaultPath, userPath, section, key, number);
+	value = static_cast<int>(number);
+}
+
 // resetNumberValues が false の場合は、前回実行時の数値を UI に戻す。
-static void SwitchToSetting(int index, FilterPlugIn::Property& property, bool resetNumberValues) {
-	if (index < 0 || g_Settings.size() <= index) return;
-	const auto setting = g_Settings[index];
+static void SwitchToSetting(FilterInfo& info, int index, FilterPlugIn::Property& property, bool resetNumberValues) {
+	if (index < 0 || info.settings.size() <= index) return;
+	const auto setting = info.settings[index];
 
 	// コンフィグのロード
 	auto iniPath = GetIniPath();
-	const auto userIniPath = g_HasUserSettingIni ? GetUserIniPath() : "";
-
-	g_params.template_workflow_filename.clear();
-    iniUserPreferred(iniPath, userIniPath, setting, "template_workflow_filename", g_params.template_workflow_filename);
+	const auto userIniPath = info.has_user_setting_ini ? GetUserIniPath() : "";
+
+	info.params.template_workflow_filename.clear();
+    iniUserPreferred(iniPath, userIniPath, setting, "template_workflow_filename", info.params.template_workflow_filename);
+	info.params.tile_size = 0;
+	info.params.tile_overlap = 64;
+	LoadIntegerSetting(iniPath, userIniPath, setting, "tile_size", info.params.tile_size);
+	LoadIntegerSetting(iniPath, userIniPath, setting, "tile_overlap", info.params.tile_overlap);
+	info.params.mask_context_margin = -1;
+	info.params.size_multiple = 8;
+	LoadIntegerSetting(iniPath, userIniPath, setting, "mask_context_margin", info.params.mask_context_margin);
+	LoadIntegerSetting(iniPath, userIniPath, setting, "size_multiple", info.params.size_multiple);
+	info.params.size_multiple = std::max(info.params.size_multiple, 1);
+	info.params.max_megapixels = 0.0;
+	LoadNumberSetting(iniPath, userIniPath, setting, "max_megapixels", info.params.max_megapixels);
+	info.params.preview_template_workflow_filename.clear();
+	iniUserPreferred(iniPath, userIniPath, setting, "preview_template_workflow_filename", info.params.preview_template_workflow_filename);
+	std::string resultCache = "true";
+	iniUserPreferred(iniPath, userIniPath, setting, "result_cache", resultCache);
+	info.params.result_cache = iniBoolean(resultCache);
 	if (resetNumberValues) {
-		g_params.prompt.clear();
-		g_params.negative_prompt.clear();
-        iniUserPreferred(iniPath, userIniPath, setting, "prompt", g_params.prompt);
-        iniUserPreferred(iniPath, userIniPath, setting, "negative_prompt", g_params.negative_prompt);
+		info.params.prompt.clear();
+		info.params.negative_prompt.clear();
+        iniUserPreferred(iniPath, userIniPath, setting, "prompt", info.params.prompt);
+        iniUserPreferred(iniPath, userIniPath, setting, "negative_prompt", info.params.negative_prompt);
 	}
 
 	for (size_t i = 0; i < kNumberParameterCount; ++i) {
 		const std::string numberName = "num" + std::to_string(i + 1);
-		g_params.number_minimums[i] = kDefaultNumberMinimums[i];
-		g_params.number_maximums[i] = kDefaultNumberMaximums[i];
-		g_params.number_defaults[i] = kDefaultNumberValues[i];
-		LoadNumberSetting(iniPath, userIniPath, setting, numberName + "_min", g_params.number_minimums[i]);
-		LoadNumberSetting(iniPath, userIniPath, setting, numberName + "_max", g_params.number_maximums[i]);
-		LoadNumberSetting(iniPath, userIniPath, setting, numberName + "_default", g_params.number_defaults[i]);
-		if (g_params.number_minimums[i] > g_params.number_maximums[i]) {
+		info.params.number_minimums[i] = kDefaultNumberMinimums[i];
+		info.params.number_maximums[i] = kDefaultNumberMaximums[i];
+		info.params.number_defaults[i] = kDefaultNumberValues[i];
+		LoadNumberSetting(iniPath, userIniPath, setting, numberName + "_min", info.params.number_minimums[i]);
+		LoadNumberSetting(iniPath, userIniPath, setting, numberName + "_max", info.params.number_maximums[i]);
+		LoadNumberSetting(iniPath, userIniPath, setting, numberName + "_default", info.params.number_defaults[i]);
+		if (info.params.number_minimums[i] > info.params.number_maximums[i]) {
 			print(("Invalid numeric range: [" + setting + "] " + numberName).c_str());
-			g_params.number_minimums[i] = kDefaultNumberMinimums[i];
-			g_params.number_maximums[i] = kDefaultNumberMaximums[i];
+			info.params.number_minimums[i] = kDefaultNumberMinimums[i];
+			info.params.number_maximums[i] = kDefaultNumberMaximums[i];
+		}
+		info.params.number_defaults[i] = std::clamp(info.params.number_defaults[i],
+			info.params.number_minimums[i], info.params.number_maximums[i]);
+		if (resetNumberValues) info.params.numbers[i] = info.params.number_defaults[i];
+		info.params.preview_numbers[i] = std::numeric_limits<double>::quiet_NaN();
+		LoadNumberSetting(iniPath, userIniPath, setting, "preview_" + numberName, info.params.preview_numbers[i]);
+		std::string sweepText;
+		info.params.number_sweeps[i].clear();
+		iniUserPreferred(iniPath, userIniPath, setting, numberName + "_sweep", sweepText);
+		if (!sweepText.empty() && !ParseSweep(sweepText, info.params.number_sweeps[i])) {
+			print(("Invalid sweep INI value (expected \"start,end,count\"): [" + setting + "] " + numberName + "_sweep = " + sweepText).c_str());
 		}
-		g_params.number_defaults[i] = std::clamp(g_params.number_defaults[i],
-			g_params.number_minimums[i], g_params.number_maximums[i]);
-		if (resetNumberValues) g_params.numbers[i] = g_params.number_defaults[i];
-		property.setDecimalMin(kNumberPropertyKeys[i], g_params.number_minimums[i]);
-		property.setDecimalMax(kNumberPropertyKeys[i], g_params.number_maximums[i]);
-		property.setDecimalDefault(kNumberPropertyKeys[i], g_params.number_defaults[i]);
-		property.setDecimal(kNumberPropertyKeys[i], g_params.numbers[i]);
+		property.setDecimalMin(kNumberPropertyKeys[i], info.params.number_minimums[i]);
+		property.setDecimalMax(kNumberPropertyKeys[i], info.params.number_maximums[i]);
+		property.setDecimalDefault(kNumberPropertyKeys[i], info.params.number_defaults[i]);
+		property.setDecimal(kNumberPropertyKeys[i], info.params.numbers[i]);
 	}
+	if (!info.params.template_workflow_filename.empty()) ReadTemplate(g_BasePath + info.params.template_workflow_filename);
 	print("SwitchToSetting:");
 	print(setting.c_str());
-	print(g_params.template_workflow_filename.c_str());
-	print(g_params.prompt.c_str());
-	print(g_params.negative_prompt.c_str());
+	print(info.params.template_workflow_filename.c_str());
+	print(info.params.prompt.c_str());
+	print(info.params.negative_prompt.c_str());
 
 	// プロパティへの反映
 	property.setEnumeration(ITEM_SETTING, index);
 	if (resetNumberValues) {
-		property.setStringDefault(ITEM_PROMPT, ShiftJIS_to_UTF16(g_params.prompt));
-		property.setStringDefault(ITEM_NPROMPT, ShiftJIS_to_UTF16(g_params.negative_prompt));
-        property.setString(ITEM_PROMPT, ShiftJIS_to_UTF16(g_params.prompt));
-		property.setString(ITEM_NPROMPT, ShiftJIS_to_UTF16(g_params.negative_prompt));
+		property.setStringDefault(ITEM_PROMPT, ShiftJIS_to_UTF16(info.params.prompt));
+		property.setStringDefault(ITEM_NPROMPT, ShiftJIS_to_UTF16(info.params.negative_prompt));
+        property.setString(ITEM_PROMPT, ShiftJIS_to_UTF16(info.params.prompt));
+		property.setString(ITEM_NPROMPT, ShiftJIS_to_UTF16(info.params.negative_prompt));
 	}
 }
 
 /// プロパティ同期
 static bool SyncProperty(FilterPlugIn::Int itemKey, FilterPlugIn::PropertyObject propertyObject, FilterPlugIn::Ptr data) {
 	auto& info = *static_cast<FilterInfo*>(data);
-	// auto& params = info.params;
 	FilterPlugIn::Property property(info.server, propertyObject);
 
-	print("setting itemKey:");
-	print(std::to_string(itemKey).c_str());
+	LOG_DEBUG("setting itemKey: %d", static_cast<int>(itemKey));
 	
 	switch (itemKey) {
 	case ITEM_SETTING:
 	{
 		// 設定変更を検出してコンフィグを切り替える
 		auto setting = property.getEnumeration(ITEM_SETTING);
-		print("setting:");
-		print(std::to_string(setting).c_str());
+		LOG_DEBUG("setting: %d", static_cast<int>(setting));
 		if (info.setting != setting) {
-			SwitchToSetting(setting, property, true);
+			SwitchToSetting(info, setting, property, true);
 			info.setting = setting;
 			return true;
 		}
@@ -1333,17 +1538,25 @@ static bool SyncProperty(FilterPlugIn::Int itemKey, FilterPlugIn::PropertyObject
 		break;
 	}
 	case ITEM_PROMPT:
-		return property.sync(ITEM_PROMPT, g_params.prompt);
+		return property.sync(ITEM_PROMPT, info.params.prompt);
 	case ITEM_NPROMPT:
-	 	return property.sync(ITEM_NPROMPT, g_params.negative_prompt);
+	 	return property.sync(ITEM_NPROMPT, info.params.negative_prompt);
 	case ITEM_NUM1:
-		return property.sync(ITEM_NUM1, g_params.numbers[0]);
+		return property.sync(ITEM_NUM1, info.params.numbers[0]);
 	case ITEM_NUM2:
-		return property.sync(ITEM_NUM2, g_params.numbers[1]);
+		return property.sync(ITEM_NUM2, info.params.numbers[1]);
 	case ITEM_NUM3:
-		return property.sync(ITEM_NUM3, g_params.numbers[2]);
+		return property.sync(ITEM_NUM3, info.params.numbers[2]);
 	case ITEM_USE_SELECTION_AS_MASK:
 		return property.sync(ITEM_USE_SELECTION_AS_MASK, info.use_selection_as_mask);
+	case ITEM_VARIANT_COUNT:
+		return property.sync(ITEM_VARIANT_COUNT, info.variant_count);
+	case ITEM_VARIANT_INDEX:
+		return property.sync(ITEM_VARIANT_INDEX, info.variant_index);
+	case ITEM_SWEEP:
+		return property.sync(ITEM_SWEEP, info.sweep);
+	case ITEM_FAST_PREVIEW:
+		return property.sync(ITEM_FAST_PREVIEW, info.fast_preview);
 	// 	case ITEM_OUTPAINT_TRANSPARENT_AREA:
 		// 		return property.sync(ITEM_OUTPAINT_TRANSPARENT_AREA, info.outpaint_transparent_area);
 	}
@@ -1357,9 +1570,27 @@ static void FilterPropertyCallBack(FilterPlugIn::PropertyCallBackResult* result,
 	if (SyncProperty(itemKey, propertyObject, data)) {
 		(*result) = FilterPlugIn::PropertyCallBackResult::Modify;
 	}
+	// プロンプトを入力している間に、選ばれているサブ画像をアップロードしておく（選択が変わったスロットはやり直す）
+	auto& info = *static_cast<FilterInfo*>(data);
+	for (size_t i = 0; i < kSubImageDropdownCount; ++i) {
+		info.subimage_uploader.Request(i, ResolveSubImageFilename(info, info.subimage_indices[i]));
+	}
 }
 
 
+/// @brief ログのレベル名（trace / debug / info / warning / error / off）を変換する
+/// @note 知らない名前は info として扱う
+static LogLevel ParseLogLevel(std::string name) {
+	std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+	if (name == "trace") return LogLevel::Trace;
+	if (name == "debug") return LogLevel::Debug;
+	if (name == "warning" || name == "warn") return LogLevel::Warning;
+	if (name == "error") return LogLevel::Error;
+	if (name == "off" || name == "none") return LogLevel::Off;
+	if (name != "info") print(("Unknown INI value: [COMMON] log_level = " + name).c_str());
+	return LogLevel::Info;
+}
+
 /// フィルタ初期化
 /// @return 正常終了ならtrue
 bool InitializeFilter(FilterPlugIn::Server* server, FilterPlugIn::Ptr* data, std::string mode) {
@@ -1370,13 +1601,17 @@ bool InitializeFilter(FilterPlugIn::Server* server, FilterPlugIn::Ptr* data, std
 	// 初期設定の読み込み
 	std::string iniPath = GetIniPath();
 	const std::string userIniPath = GetUserIniPath();
-	g_HasUserSettingIni = std::filesystem::exists(userIniPath);
-	const std::string userIniOptionalPath = g_HasUserSettingIni ? userIniPath : "";
+	info->has_user_setting_ini = std::filesystem::exists(userIniPath);
+	const std::string userIniOptionalPath = info->has_user_setting_ini ? userIniPath : "";
 
-	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "server_address", g_ServerAddress);
-	if (g_ServerAddress.empty()) {
-		g_ServerAddress = SERVER_ADDRESS_DEFAULT;
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "server_address", info->server_address);
+	if (info->server_address.empty()) {
+		info->server_address = SERVER_ADDRESS_DEFAULT;
 	}
+	// 一時ファイルは実行毎の作業フォルダーに書き出す（先行アップロードはフィルタ毎に1つ）
+	info->workspace_name = mode.empty() ? "Generate" : mode;
+	info->upload_workspace = CreateWorkspace(info->workspace_name + "_upload");
+	info->subimage_uploader.Configure(info->server_address, info->upload_workspace, &info->metrics);
 	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "api_key", g_APIKey);
 	std::string retryMaxCount;
 	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "getimage_retry_max_count", retryMaxCount);
@@ -1384,22 +1619,104 @@ bool InitializeFilter(FilterPlugIn::Server* server, FilterPlugIn::Ptr* data, std
 	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "getimage_retry_wait_seconds", retryWaitSeconds);
 	std::string usePythonImageConversion = "false";
 	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "use_python_image_conversion", usePythonImageConversion);
+	std::string changeThreshold = "0";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "change_threshold", changeThreshold);
+	std::string bufferPoolIdleSeconds = "120";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "buffer_pool_idle_seconds", bufferPoolIdleSeconds);
+	std::string mappedBufferThresholdMb = "1024";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "mapped_buffer_threshold_mb", mappedBufferThresholdMb);
+	std::string autoCropTransparent = "false";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "auto_crop_transparent", autoCropTransparent);
+	std::string autoCropMargin = "32";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "auto_crop_margin", autoCropMargin);
+	std::string streamInputCapture = "true";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "stream_input_capture", streamInputCapture);
+	std::string enablePreview = "false";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "enable_preview", enablePreview);
+	std::string previewMaxMegapixels = "0.25";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "preview_max_megapixels", previewMaxMegapixels);
+	std::string resultCacheMaxMb = "1024";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "result_cache_max_mb", resultCacheMaxMb);
+	std::string traceKeepRuns = "20";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "trace_keep_runs", traceKeepRuns);
+	std::string logLevel = "info";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "log_level", logLevel);
+	std::string logMaxMb = "4";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "log_max_mb", logMaxMb);
+	std::string logFiles = "3";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "log_files", logFiles);
+	std::string metrics = "true";
+	iniWithOverride(iniPath, userIniOptionalPath, "COMMON", "metrics", metrics);
 
 	g_RetryMaxCount = std::stoi(retryMaxCount);
 	g_RetryWaitSeconds = std::stoi(retryWaitSeconds);
 	g_UsePythonImageConversion = iniBoolean(usePythonImageConversion);
+	try {
+		g_ChangeThreshold = std::stoi(changeThreshold);
+	} catch (const std::exception&) {
+		print(("Invalid numeric INI value: [COMMON] change_threshold = " + changeThreshold).c_str());
+		g_ChangeThreshold = 0;
+	}
+	try {
+		info->buffer_pool.SetIdleSeconds(std::stoi(bufferPoolIdleSeconds));
+	} catch (const std::exception&) {
+		print(("Invalid numeric INI value: [COMMON] buffer_pool_idle_seconds = " + bufferPoolIdleSeconds).c_str());
+	}
+	try {
+		const auto thresholdMb = std::max(std::stoll(mappedBufferThresholdMb), 0LL);
+		info->buffer_pool.SetMappedThreshold(static_cast<size_t>(thresholdMb) * 1024 * 1024, g_BasePath);
+	} catch (const std::exception&) {
+		print(("Invalid numeric INI value: [COMMON] mapped_buffer_threshold_mb = " + mappedBufferThresholdMb).c_str());
+	}
+	g_AutoCropTransparent = iniBoolean(autoCropTransparent);
+	try {
+		g_AutoCropMargin = std::max(std::stoi(autoCropMargin), 0);
+	} catch (const std::exception&) {
+		print(("Invalid numeric INI value: [COMMON] auto_crop_margin = " + autoCropMargin).c_str());
+		g_AutoCropMargin = 32;
+	}
+	g_StreamInputCapture = iniBoolean(streamInputCapture);
+	g_EnablePreview = iniBoolean(enablePreview);
+	try {
+		g_PreviewMaxMegapixels = std::max(std::stod(previewMaxMegapixels), 0.0);
+	} catch (const std::exception&) {
+		print(("Invalid numeric INI value: [COMMON] preview_max_megapixels = " + previewMaxMegapixels).c_str());
+		g_PreviewMaxMegapixels = 0.25;
+	}
+	try {
+		const auto cacheMb = std::max(std::stoll(resultCacheMaxMb), 0LL);
+		// フィルタ毎に別のフォルダーを使う（同じフォルダーを共有すると、他のフィルタが保存した分を数えずに上限を判断してしまう）
+		info->result_cache.Configure(g_BasePath + "ResultCache/" + info->workspace_name, static_cast<unsigned long long>(cacheMb) * 1024 * 1024);
+	} catch (const std::exception&) {
+		print(("Invalid numeric INI value: [COMMON] result_cache_max_mb = " + resultCacheMaxMb).c_str());
+	}
+	try {
+		info->trace_keep_runs = std::max(std::stoi(traceKeepRuns), 0);
+	} catch (const std::exception&) {
+		print(("Invalid numeric INI value: [COMMON] trace_keep_runs = " + traceKeepRuns).c_str());
+		info->trace_keep_runs = 20;
+	}
+	// 標準と Nano Banana のフィルタが同じプラグインフォルダーにあっても上書きし合わないよう、フィルタ毎に別のファイルにする
+	info->metrics.Configure(iniBoolean(metrics) ? g_BasePath + "metrics_" + info->workspace_name + ".prom" : "", info->workspace_name);
+	Logger::Instance().SetLevel(ParseLogLevel(logLevel));
+	try {
+		const auto maxMb = std::max(std::stoll(logMaxMb), 0LL);
+		Logger::Instance().SetRotation(static_cast<unsigned long long>(maxMb) * 1024 * 1024, std::stoi(logFiles));
+	} catch (const std::exception&) {
+		print(("Invalid numeric INI value: [COMMON] log_max_mb / log_files = " + logMaxMb + " / " + logFiles).c_str());
+	}
 	print(g_UsePythonImageConversion
 		? "Image conversion: Python fallback"
 		: "Image conversion: C++ / Windows WIC");
 
 	// 設定リストの初期化
-	g_Settings = GetCombinedIniSections(iniPath, userIniOptionalPath, mode);
+	info->settings = GetCombinedIniSections(iniPath, userIniOptionalPath, mode);
 
 	// SubImageの初期化
-	g_SubImages = GetSubImages();
-	const int noImageIndex = static_cast<int>(g_SubImages.size());
+	info->subimages = GetSubImages();
+	const int noImageIndex = static_cast<int>(info->subimages.size());
 
-	info->subimage_indices[0] = g_SubImages.empty() ? noImageIndex : 0;
+	info->subimage_indices[0] = info->subimages.empty() ? noImageIndex : 0;
 	for (size_t i = 1; i < kSubImageDropdownCount; ++i) {
 		info->subimage_indices[i] = noImageIndex;
 	}
@@ -1412,8 +1729,8 @@ bool InitializeFilter(FilterPlugIn::Server* server, FilterPlugIn::Ptr* data, std
 		initialize.SetFilterName("Generate", 'x');
 	}
 
-	// プレビュー無し（LCMとかで高速化出来たらONにしてもいいか？）
-	initialize.SetCanPreview(false);
+	// プレビューは enable_preview の場合のみ（縮小した入力と preview_* の設定で高速に生成する）
+	initialize.SetCanPreview(g_EnablePreview);
 
 	// ブランク画像はNG
 	initialize.SetUseBlankImage(false);
@@ -1423,7 +1740,7 @@ bool InitializeFilter(FilterPlugIn::Server* server, FilterPlugIn::Ptr* data, std
 
 	// プロパティの作成
 	auto property = FilterPlugIn::Property(server);
-	InitProperty(property, mode);
+	InitProperty(property, *info, mode);
 	property.setEnumeration(ITEM_SUBIMAGE, info->subimage_indices[0]);
 	property.setEnumeration(ITEM_SUBIMAGE_PICTURE3, info->subimage_indices[1]);
 	property.setEnumeration(ITEM_SUBIMAGE_PICTURE4, info->subimage_indices[2]);
@@ -1433,11 +1750,15 @@ bool InitializeFilter(FilterPlugIn::Server* server, FilterPlugIn::Ptr* data, std
 	property.setEnumeration(ITEM_SUBIMAGE_PICTURE8, info->subimage_indices[6]);
 	property.setBoolean(ITEM_USE_SELECTION_AS_MASK, info->use_selection_as_mask);
 	// property.setBoolean(ITEM_OUTPAINT_TRANSPARENT_AREA, info->outpaint_transparent_area); // Temporarily disabled.
+	property.setInteger(ITEM_VARIANT_COUNT, info->variant_count);
+	property.setInteger(ITEM_VARIANT_INDEX, info->variant_index);
+	property.setBoolean(ITEM_SWEEP, info->sweep);
+	if (g_EnablePreview) property.setBoolean(ITEM_FAST_PREVIEW, info->fast_preview);
 	initialize.SetProperty(property);
 
 	// 初回は0番設定に
-	if (!g_Settings.empty()) {
-		SwitchToSetting(0, property, true);
+	if (!info->settings.empty()) {
+		SwitchToSetting(*info, 0, property, true);
 		info->setting = 0;
 	} else {
 		print("iniファイルに有効な設定セクションが見つかりませんでした。");
@@ -1531,38 +1852,45 @@ bool load_bmp_rgb_to_buffer(const std::string& filename, ImageBuffer& img_data)
         return false;
     }
 
-    long width = info_header.width;
-    long height = std::abs(info_header.height);
+    const int width = info_header.width;
+    const int height = std::abs(info_header.height);
+    if (width <= 0 || height <= 0) {
+        print("エラー: BMPサイズが不正です。");
+        return false;
+    }
 
-    img_data.allocate(width, height);
+    // 全行を上書きするのでゼロ埋めは不要
+    if (!img_data.allocate(width, height, false)) {
+        print("エラー: 画像バッファを確保できませんでした。");
+        return false;
+    }
     
-    const long BYTES_PER_PIXEL = 3;
-    long row_size = width * BYTES_PER_PIXEL;
-    long padding = (4 - (row_size % 4)) % 4;
+    // サイズは全て 64bit で計算する（ポスターサイズのキャンバスでは 32bit を超える）
+    const size_t BYTES_PER_PIXEL = 3;
+    const size_t row_size = static_cast<size_t>(width) * BYTES_PER_PIXEL;
+    const size_t padding = (4 - (row_size % 4)) % 4;
 
     file.seekg(file_header.data_offset, std::ios::beg);
 
-    std::vector<unsigned char> row_data(row_size);
+    // パディングごと1行を読み込む
+    std::vector<unsigned char> row_data(row_size + padding);
     unsigned char* dest_ptr = img_data.get_data_pointer();
     
     // BMPはボトムアップ形式 (下から上)
     // ImageBufferはトップダウン形式 (左上から順)で格納するため、行の順序を反転
-    for (long y = height - 1; y >= 0; --y) {
-        // 1. 1行分のピクセルデータを読み込み (BGR順)
-        if (!file.read(reinterpret_cast<char*>(row_data.data()), row_size)) return false;
-        
-        // 2. パディングをスキップ
-        file.seekg(padding, std::ios::cur);
+    for (int y = height - 1; y >= 0; --y) {
+        // 1. 1行分のピクセルデータを読み込み (BGR順、パディング込み)
+        if (!file.read(reinterpret_cast<char*>(row_data.data()), static_cast<std::streamsize>(row_data.size()))) return false;
         
-        // 3. データ格納位置の計算: ImageBufferの y 行目の開始位置
+        // 2. データ格納位置の計算: ImageBufferの y 行目の開始位置
         // (y * width * CHANNELS) を指すポインタ
-        size_t row_start_index = static_cast<size_t>(y) * width * BYTES_PER_PIXEL;
+        size_t row_start_index = static_cast<size_t>(y) * row_size;
         unsigned char* current_row_dest = dest_ptr + row_start_index;
 
-        // 4. 1行内のピクセルを処理 (BGRをRGBに並べ替えて格納)
-        for (long x = 0; x < width; ++x) {
-            long src_index = x * BYTES_PER_PIXEL; // 読み込んだ row_data 内の B の位置
-            long dest_index = x * BYTES_PER_PIXEL; // 格納先の R の位置
+        // 3. 1行内のピクセルを処理 (BGRをRGBに並べ替えて格納)
+        for (size_t x = 0; x < static_cast<size_t>(width); ++x) {
+            size_t src_index = x * BYTES_PER_PIXEL; // 読み込んだ row_data 内の B の位置
+            size_t dest_index = x * BYTES_PER_PIXEL; // 格納先の R の位置
 
             // BMP (BGR) から ImageBuffer (RGB) へコピー
             current_row_dest[dest_index + 0] = row_data[src_index + 2]; // R = row_data[B+2]
@@ -1594,33 +1922,34 @@ bool write_bmp_file(const ImageBuffer& buffer, const std::string& filename) {
     }
 
     // 各行に必要なパディングバイト数を計算 (行バイト長が4の倍数になるように)
-    // 24bit (3バイト) * 幅
-    const int row_byte_size = width * CHANNELS; 
+    // 24bit (3バイト) * 幅。サイズは全て 64bit で計算する
+    const size_t row_byte_size = static_cast<size_t>(width) * CHANNELS; 
     // row_byte_sizeを4で割った余りを計算し、4から引く。ただし余りが0の場合はパディングは0
-    const int padding_size = (4 - (row_byte_size % 4)) % 4; 
+    const size_t padding_size = (4 - (row_byte_size % 4)) % 4; 
     
     // パディングを含む1行の合計バイト数
-    const int padded_row_size = row_byte_size + padding_size;
+    const size_t padded_row_size = row_byte_size + padding_size;
     
     // ピクセルデータ全体のサイズ
-    const unsigned int image_size = padded_row_size * height;
+    const unsigned long long image_size = static_cast<unsigned long long>(padded_row_size) * height;
     
     // ファイル全体のサイズ (ヘッダー54バイト + ピクセルデータサイズ)
-    const unsigned int file_size = 54 + image_size;
+    const unsigned long long file_size = 54 + image_size;
 
     // ヘッダーを準備
+    // ヘッダーのサイズ欄は 32bit なので、収まらない場合は 0 とする（非圧縮BMPでは image_size は 0 でもよい）
     BMPFileHeader file_header;
-    file_header.file_size = file_size;
+    file_header.file_size = file_size <= UINT32_MAX ? static_cast<unsigned int>(file_size) : 0;
 
     BMPInfoHeader info_header;
     info_header.width = width;
     info_header.height = height; // BMPは通常、正の値で左下から上へ
-    info_header.image_size = image_size;
+    info_header.image_size = image_size <= UINT32_MAX ? static_cast<unsigned int>(image_size) : 0;
 
     // ファイルを開く (バイナリモードで出力)
     std::ofstream ofs(filename, std::ios::binary);
     if (!ofs) {
-        print(("Error: Could not open file " + filename + " for writing.").c_str());
+        LOG_ERROR("Error: Could not open file %s for writing.", filename.c_str());
         return false;
     }
 
@@ -1631,95 +1960,110 @@ bool write_bmp_file(const ImageBuffer& buffer, const std::string& filename) {
     // 2. ピクセルデータを書き込み
     // BMPは通常、左下から上に向かって書き込むため、行を逆順に処理する (y = height - 1 から 0 へ)
     
-    // パディング用のゼロデータ
-    const unsigned char padding_byte = 0;
+    // 1行分 (パディングはゼロのまま) を組み立ててから書き込む
+    std::vector<unsigned char> row_data(padded_row_size, 0);
 
     for (int y = height - 1; y >= 0; --y) {
-        for (int x = 0; x < width; ++x) {
+        const unsigned char* src = buffer.get_pixel_pointer(0, y);
+        for (size_t i = 0; i < row_byte_size; i += CHANNELS) {
             // ImageBufferは R, G, B の順。BMPは B, G, R の順で書き込む
-            unsigned char R = buffer.get_pixel_value(x, y, 0); // R
-            unsigned char G = buffer.get_pixel_value(x, y, 1); // G
-            unsigned char B = buffer.get_pixel_value(x, y, 2); // B
-
-            // B, G, R の順で書き込み
-            ofs.write(reinterpret_cast<const char*>(&B), 1);
-            ofs.write(reinterpret_cast<const char*>(&G), 1);
-            ofs.write(reinterpret_cast<const char*>(&R), 1);
-        }
-
-        // 行の終わりにパディングを書き込み
-        for (int p = 0; p < padding_size; ++p) {
-            ofs.write(reinterpret_cast<const char*>(&padding_byte), 1);
+            row_data[i + 0] = src[i + 2]; // B
+            row_data[i + 1] = src[i + 1]; // G
+            row_data[i + 2] = src[i + 0]; // R
         }
+        ofs.write(reinterpret_cast<const char*>(row_data.data()), static_cast<std::streamsize>(padded_row_size));
     }
 
     ofs.close();
+    if (!ofs) {
+        LOG_ERROR("Error: Failed to write %s", filename.c_str());
+        return false;
+    }
 	print(("Successfully wrote BMP file: " + filename).c_str());
 	
     return true;
 }
 
+/// write_bmp_file をトレースに記録しながら呼ぶ
+static bool write_bmp_file(const RunContext& context, const ImageBuffer& buffer, const std::string& filename) {
+	Trace::Scope span(context.trace, "BMP write", "convert");
+	return write_bmp_file(buffer, filename);
+}
+
 // 24ビットBMPファイルからBlock構造体を読み込む
-FilterPlugIn::Block read24BitBmpBlock(const std::string& filename) {
+// @param storage 返却する Block のピクセルデータを保持する（Block を使い終わるまで破棄しないこと）
+FilterPlugIn::Block read24BitBmpBlock(const std::string& filename, BufferPool& pool, BufferPool::Buffer& storage) {
     std::ifstream file(filename, std::ios::binary);
     if (!file) {
-        print(("Error: ファイルが見つかりません: " + filename).c_str());
+        LOG_ERROR("Error: ファイルが見つかりません: %s", filename.c_str());
         return FilterPlugIn::Block{};
     }
 
     // --- 1. ヘッダー情報の読み込みと抽出 ---
     
     // 幅 (0x12) と 高さ (0x16) の位置にシーク
-    FilterPlugIn::Int width = 0, height = 0;
+    // ヘッダーの値は 32bit なので、long が 64bit の環境でも 4 バイトの型で読む
+    std::int32_t width = 0, height = 0;
     file.seekg(0x12, std::ios::beg);
     file.read(reinterpret_cast<char*>(&width), 4);
     file.read(reinterpret_cast<char*>(&height), 4);
 
     // データ開始オフセット (0x0A) の位置にシーク
-    FilterPlugIn::Int dataOffset = 0;
+    std::uint32_t dataOffset = 0;
     file.seekg(0x0A, std::ios::beg);
     file.read(reinterpret_cast<char*>(&dataOffset), 4);
 
-    if (width <= 0 || height == 0) {
+    // トップダウン (高さが負) には対応していない
+    if (width <= 0 || height <= 0) {
         print("Error: BMPサイズが不正です。");
         return FilterPlugIn::Block{};
     }
 
     // --- 2. パディングを含む物理的な行バイト数とデータサイズの計算 ---
-    const FilterPlugIn::Int PIXEL_BYTES = 3; // 24bit = 3 bytes/pixel
+    // FilterPlugIn::Int は Windows では 32bit なので、サイズは size_t で計算する
+    const size_t PIXEL_BYTES = 3; // 24bit = 3 bytes/pixel
     
     // 論理的な行バイト数 (パディングなし)
-    FilterPlugIn::Int logicalRowBytes = width * PIXEL_BYTES;
+    const size_t logicalRowBytes = static_cast<size_t>(width) * PIXEL_BYTES;
     
     // BMPの物理的な行バイト数 (4の倍数に切り上げ)
     // actualRowBytes = ((3 * width) + 3) & (~3); 
-    FilterPlugIn::Int actualRowBytes = ((logicalRowBytes + 3) / 4) * 4;
+    const size_t actualRowBytes = ((logicalRowBytes + 3) / 4) * 4;
     
-    FilterPlugIn::Int physicalDataSize = height * actualRowBytes;
+    const size_t physicalDataSize = static_cast<size_t>(height) * actualRowBytes;
 
 	print(("physicalDataSize:" + std::to_string(physicalDataSize)).c_str());
 	// print(("dataOffset:" + std::to_string(dataOffset)).c_str());
 
     // --- 3. ファイルからの物理データ読み込み ---
-    auto rawData = std::make_unique<unsigned char[]>(physicalDataSize);
+    auto rawData = pool.Acquire(physicalDataSize);
+    if (!rawData) {
+        print("Error: BMP読み込み用のバッファを確保できませんでした。");
+        return FilterPlugIn::Block{};
+    }
     file.seekg(dataOffset, std::ios::beg);
-    file.read(reinterpret_cast<char*>(rawData.get()), physicalDataSize);
+    file.read(reinterpret_cast<char*>(rawData.data()), static_cast<std::streamsize>(physicalDataSize));
 
     // --- 4. 連続メモリへの再配置と上下反転処理 (ここが重要) ---
     
     // 最終的に Block に格納する、パディングなしの連続データ領域
-    FilterPlugIn::Int finalDataSize = height * logicalRowBytes;
-    auto finalData = std::make_unique<unsigned char[]>(finalDataSize);
+    const size_t finalDataSize = static_cast<size_t>(height) * logicalRowBytes;
+    storage = pool.Acquire(finalDataSize);
+    if (!storage) {
+        print("Error: BMP読み込み用のバッファを確保できませんでした。");
+        return FilterPlugIn::Block{};
+    }
+    unsigned char* finalData = storage.data();
 
     for (int y = 0; y < height; ++y) {
         // BMPは通常「下から上」に格納されている。
         // ファイルの (height - 1 - y) 行目を、メモリの (y) 行目にコピーする。
         
         // ファイルから読み込んだデータ配列内の対応する行ポインタ
-        const unsigned char* srcRow = rawData.get() + (height - 1 - y) * actualRowBytes;
+        const unsigned char* srcRow = rawData.data() + static_cast<size_t>(height - 1 - y) * actualRowBytes;
         
         // 最終的な連続データ配列内の対応する行ポインタ
-        unsigned char* dstRow = finalData.get() + y * logicalRowBytes;
+        unsigned char* dstRow = finalData + static_cast<size_t>(y) * logicalRowBytes;
         
         // パディングを除いてコピーする (logicalRowBytes のみコピー)
         std::memcpy(dstRow, srcRow, logicalRowBytes);
@@ -1728,17 +2072,17 @@ FilterPlugIn::Block read24BitBmpBlock(const std::string& filename) {
     // --- 5. Block構造体の設定 ---
     FilterPlugIn::Block block;
     block.rect = {0, 0, width, height};
-    block.rowBytes = logicalRowBytes;   // パディングなし
-    block.pixelBytes = PIXEL_BYTES;     // 3バイト
+    block.rowBytes = static_cast<FilterPlugIn::Int>(logicalRowBytes);   // パディングなし
+    block.pixelBytes = static_cast<FilterPlugIn::Int>(PIXEL_BYTES);     // 3バイト
     
     // 24ビットBMPは通常 BGR 形式 (B=0, G=1, R=2)
     block.r = 2; block.g = 1; block.b = 0;
     block.needOffset = false;
 
     // メモリのアドレスを設定
-    block.address = finalData.get();
+    block.address = finalData;
 
-	// print(convert_address_to_hex_string(finalData.get()).c_str());
+	// print(convert_address_to_hex_string(finalData).c_str());
     
     print(("read: " + filename + ", RowBytes: " + std::to_string( logicalRowBytes) 
 	    + " (real file : " + std::to_string(actualRowBytes) + ")\n").c_str());
@@ -1760,6 +2104,813 @@ std::string getDateString() {
 	return oss.str();
 }
 
+/// 先にアップロードしたサブ画像を使う期限（サーバーの再起動などで消えている可能性があるため）
+constexpr auto kPreUploadMaxAge = std::chrono::minutes(10);
+/// 失敗したアップロードをやり直すまでの間隔（サーバーが止まっている間にコールバック毎に送らないように）
+constexpr auto kPreUploadRetryInterval = std::chrono::seconds(5);
+
+void SubImagePreUploader::Configure(const std::string& serverAddress, const std::string& workspace, Metrics* metrics) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	context_.server_address = serverAddress;
+	context_.workspace = workspace;
+	context_.metrics = metrics;
+}
+
+void SubImagePreUploader::Request(size_t slot, const std::string& fileName) {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		// 作業フォルダーが無い場合は先行アップロードしない（実行時にアップロードする）
+		if (stopping_ || context_.workspace.empty()) return;
+		auto& entry = slots_[slot];
+		const auto now = std::chrono::steady_clock::now();
+		if (entry.fileName == fileName) {
+			if (entry.state == State::Idle || entry.state == State::Queued || entry.state == State::Uploading) return;
+			if (entry.state == State::Done && now - entry.finished < kPreUploadMaxAge) return;
+			if (entry.state == State::Failed && now - entry.finished < kPreUploadRetryInterval) return;
+		}
+		const unsigned generation = entry.generation + 1;
+		entry = {};
+		entry.fileName = fileName;
+		entry.generation = generation;
+		if (fileName.empty()) return;
+		entry.state = State::Queued;
+		if (!worker_.joinable()) worker_ = std::thread(&SubImagePreUploader::WorkerThread, this);
+	}
+	wakeup_.notify_all();
+}
+
+std::string SubImagePreUploader::Take(const RunContext& context, size_t slot, const std::string& fileName, double& savedMs) {
+	const auto start = std::chrono::steady_clock::now();
+	savedMs = 0.0;
+	std::unique_lock<std::mutex> lock(mutex_);
+	const auto& entry = slots_[slot];
+	while (entry.fileName == fileName && (entry.state == State::Queued || entry.state == State::Uploading)) {
+		if (context.cancel_requested) return "";
+		done_.wait_for(lock, std::chrono::milliseconds(50));
+	}
+	if (entry.fileName != fileName || entry.state != State::Done) return "";
+	if (std::chrono::steady_clock::now() - entry.finished >= kPreUploadMaxAge) return "";
+	const double waitedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	savedMs = std::max(entry.uploadMs - waitedMs, 0.0);
+	return entry.uploadedName;
+}
+
+void SubImagePreUploader::Stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+	}
+	// アップロード中の curl も終了させる
+	context_.cancel_requested = true;
+	wakeup_.notify_all();
+	if (worker_.joinable()) worker_.join();
+}
+
+/// 選択された順ではなくスロット順に、待っているサブ画像を1つずつアップロードする
+void SubImagePreUploader::WorkerThread() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!stopping_) {
+		const auto queued = std::find_if(slots_.begin(), slots_.end(), [](const Slot& entry) { return entry.state == State::Queued; });
+		if (queued == slots_.end()) {
+			wakeup_.wait(lock);
+			continue;
+		}
+		const size_t slot = static_cast<size_t>(queued - slots_.begin());
+		queued->state = State::Uploading;
+		const std::string fileName = queued->fileName;
+		const unsigned generation = queued->generation;
+		lock.unlock();
+
+		const auto start = std::chrono::steady_clock::now();
+		const std::string uploadName = kSubImageUploadPrefixes[slot] + getDateString() + ".png";
+		const std::string responsePath = context_.Path("temp_json_preupload_res_" + std::to_string(slot) + ".json");
+		std::remove(responsePath.c_str());
+		print(("speculative pre-post subimage[" + std::to_string(slot) + "]: " + fileName).c_str());
+		http_post_image_to_file(context_, context_.server_address + "/upload/image", SubImagePath(fileName), uploadName, responsePath);
+		const std::string uploadedName = ReadUploadedName(responsePath);
+		const auto finished = std::chrono::steady_clock::now();
+
+		lock.lock();
+		auto& entry = slots_[slot];
+		if (entry.generation != generation) {
+			// アップロード中に選択が変わったので、この結果は使わない
+			print("speculative pre-post subimage[%d] discarded: the selection changed", static_cast<int>(slot));
+		} else {
+			entry.state = uploadedName.empty() ? State::Failed : State::Done;
+			entry.uploadedName = uploadedName;
+			entry.uploadMs = std::chrono::duration<double, std::milli>(finished - start).count();
+			entry.finished = finished;
+		}
+		done_.notify_all();
+	}
+}
+
+/// @brief タイル内で生成結果が入力から変化したかどうか
+/// @param source 入力レイヤー（入力画像をバッファに残さない場合もあるので、元のオフスクリーンと比べる）
+/// @param after 生成結果
+/// @param rect 比較する矩形（レイヤー座標、ブロックの矩形）
+/// @param threshold チャンネル毎の差の許容値
+/// @return 差が許容値を超えるピクセルがあればtrue
+static bool TileChanged(FilterPlugIn::Offscreen& source, const ImageBuffer& after, const FilterPlugIn::Rect& rect, int threshold) {
+	const auto compareRect = FilterPlugIn::intersectRects(rect, after.rect);
+	if (FilterPlugIn::isRectEmpty(compareRect)) return true;
+	FilterPlugIn::Block before = source.GetBlockImage(rect);
+	before.needOffset = true;
+	if (!before.address) return true;
+	const auto r = before.r, g = before.g, b = before.b;
+	pbyte_t pBeforeRow = static_cast<pbyte_t>(before.address) + FilterPlugIn::addressOffset(before, compareRect);
+	for (auto y = compareRect.top; y < compareRect.bottom; ++y, pBeforeRow += before.rowBytes) {
+		pbyte_t pBefore = pBeforeRow;
+		const unsigned char* pAfter = after.get_pixel_pointer(compareRect.left - after.rect.left, y - after.rect.top);
+		for (auto x = compareRect.left; x < compareRect.right; ++x, pBefore += before.pixelBytes, pAfter += 3) {
+			if (std::abs(static_cast<int>(pBefore[r]) - pAfter[0]) > threshold
+				|| std::abs(static_cast<int>(pBefore[g]) - pAfter[1]) > threshold
+				|| std::abs(static_cast<int>(pBefore[b]) - pAfter[2]) > threshold) return true;
+		}
+	}
+	return false;
+}
+
+/// @brief 隣接する矩形をまとめ、UpdateRect の呼び出し回数を減らす
+/// @note 同じ行で横に接するものを繋げた後、同じ幅で縦に接するものを繋げる
+static std::vector<FilterPlugIn::Rect> CoalesceRects(std::vector<FilterPlugIn::Rect> rects) {
+	auto merge = [](std::vector<FilterPlugIn::Rect>& list, auto less, auto adjacent, auto join) {
+		std::sort(list.begin(), list.end(), less);
+		std::vector<FilterPlugIn::Rect> merged;
+		for (const auto& rect : list) {
+			if (!merged.empty() && adjacent(merged.back(), rect)) join(merged.back(), rect);
+			else merged.push_back(rect);
+		}
+		list.swap(merged);
+	};
+	merge(rects,
+		[](const FilterPlugIn::Rect& a, const FilterPlugIn::Rect& b) { return std::tie(a.top, a.bottom, a.left) < std::tie(b.top, b.bottom, b.left); },
+		[](const FilterPlugIn::Rect& a, const FilterPlugIn::Rect& b) { return a.top == b.top && a.bottom == b.bottom && a.right == b.left; },
+		[](FilterPlugIn::Rect& a, const FilterPlugIn::Rect& b) { a.right = b.right; });
+	merge(rects,
+		[](const FilterPlugIn::Rect& a, const FilterPlugIn::Rect& b) { return std::tie(a.left, a.right, a.top) < std::tie(b.left, b.right, b.top); },
+		[](const FilterPlugIn::Rect& a, const FilterPlugIn::Rect& b) { return a.left == b.left && a.right == b.right && a.bottom == b.top; },
+		[](FilterPlugIn::Rect& a, const FilterPlugIn::Rect& b) { a.bottom = b.bottom; });
+	return rects;
+}
+
+/// ブロックの左上の座標から作るキー（ホストのブロックは重ならないので、ブロックを一意に表す）
+static uint64_t BlockKey(const FilterPlugIn::Rect& rect) {
+	return (static_cast<uint64_t>(static_cast<uint32_t>(rect.top)) << 32) | static_cast<uint32_t>(rect.left);
+}
+
+static bool SameRect(const FilterPlugIn::Rect& a, const FilterPlugIn::Rect& b) {
+	return a.left == b.left && a.top == b.top && a.right == b.right && a.bottom == b.bottom;
+}
+
+/// @brief src を width x height に拡大縮小して dst に入れる
+static bool ResizeImageBuffer(const ImageBuffer& src, ImageBuffer& dst, int width, int height, BufferPool& pool) {
+	const auto start = std::chrono::steady_clock::now();
+	if (!dst.allocate(width, height, false)) return false;
+	if (!ResizeImage::ResizeRgb(src.get_pixel_pointer(0, 0), src.get_width(), src.get_height(), dst.get_pixel_pointer(0, 0), width, height, pool)) return false;
+	const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	print("Resize %dx%d -> %dx%d: %.1f ms (%.1f MP/s)", src.get_width(), src.get_height(), width, height, ms,
+		static_cast<double>(std::max(src.get_width(), width)) * std::max(src.get_height(), height) / 1000.0 / std::max(ms, 0.001));
+	return true;
+}
+
+/// @brief 生成結果を読み込む。output.rect はレイヤー座標になる。
+/// @param targetRect 生成結果が対応する入力範囲（レイヤー座標）。画像がこれと違うサイズなら全体を読んでリサイズする。
+/// @param neededRect 書き戻しに必要な範囲（targetRect の内側）。サイズが合う場合はこの範囲の行と列だけをデコードする。
+/// @note 失敗した場合、output は空（rect も空）になる
+static bool LoadGeneratedImage(const RunContext& context, const std::string& pngPath, const FilterPlugIn::Rect& targetRect, const FilterPlugIn::Rect& neededRect, BufferPool& pool, ImageBuffer& output) {
+	Trace::Scope span(context.trace, "decode");
+	BufferPool::StageScope stage("decode");
+	const auto start = std::chrono::steady_clock::now();
+	const int targetWidth = targetRect.right - targetRect.left, targetHeight = targetRect.bottom - targetRect.top;
+	output.rect = {};
+	ImageBuffer decoded(pool);
+	const auto region = FilterPlugIn::intersectRects(neededRect, targetRect);
+	FilterPlugIn::Rect decodedRect = targetRect;
+	if (g_UsePythonImageConversion) {
+		// Python での変換を指定している場合は、従来通り BMP を経由して全体を読む（変換するのは temp_img_res.png なので、別名の結果はコピーしておく）
+		const std::string defaultPath = context.Path("temp_img_res.png");
+		std::error_code copyError;
+		if (pngPath != defaultPath && !std::filesystem::copy_file(pngPath, defaultPath, std::filesystem::copy_options::overwrite_existing, copyError)) { print("Error: could not copy %s: %s", pngPath.c_str(), copyError.message().c_str()); return false; }
+		if (!call_png_to_bmp(context, defaultPath) || !load_bmp_rgb_to_buffer(context.Path("temp_img_res.bmp"), decoded)) return false;
+	} else {
+		ComvertImage::RegionDecoder decoder;
+		std::string errorMessage;
+		if (!decoder.Open(pngPath, &errorMessage)) { LogImageConversionFailure("PNG decode", errorMessage); return false; }
+		int left = 0, top = 0, width = decoder.Width(), height = decoder.Height();
+		if (width == targetWidth && height == targetHeight && !FilterPlugIn::isRectEmpty(region)) {
+			decodedRect = region;
+			left = region.left - targetRect.left; top = region.top - targetRect.top;
+			width = region.right - region.left; height = region.bottom - region.top;
+		}
+		if (!decoded.allocate(width, height, false)) { print("Aborting process because the output image buffer could not be allocated."); return false; }
+		if (!decoder.ReadRgb(left, top, width, height, decoded.get_pixel_pointer(0, 0), static_cast<size_t>(width) * 3, &errorMessage)) { LogImageConversionFailure("PNG decode", errorMessage); return false; }
+		print("Decode %dx%d region [%d, %d, %d, %d] of %dx%d result: %lld ms", width, height, left, top, left + width, top + height, decoder.Width(), decoder.Height(),
+			static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()));
+	}
+	// 縮小して送った場合や、モデルが違うサイズで返した場合は入力範囲のサイズに戻す
+	if (decodedRect.right - decodedRect.left != decoded.get_width() || decodedRect.bottom - decodedRect.top != decoded.get_height()) {
+		ImageBuffer resized(pool);
+		if (!ResizeImageBuffer(decoded, resized, targetWidth, targetHeight, pool)) { print("Aborting process because the generated image could not be resized."); return false; }
+		decoded.swap(resized);
+	}
+	output.swap(decoded);
+	output.rect = decodedRect;
+	return true;
+}
+
+/// @brief 生成結果を帯単位でデコードするワーカースレッド
+/// @note ホストへの書き戻しと並行して、次の帯を先読みしてデコードしておく（先読みは kLookahead 本まで）。
+///       デコーダーの作成から破棄までワーカースレッドだけで行う。
+class ResultBandReader {
+public:
+	explicit ResultBandReader(BufferPool& pool) : pool_(pool) {}
+	~ResultBandReader() { Stop(); }
+	ResultBandReader(const ResultBandReader&) = delete;
+	ResultBandReader& operator=(const ResultBandReader&) = delete;
+
+	/// @brief デコードを開始する
+	/// @param targetRect 生成結果が対応する入力範囲（レイヤー座標）
+	/// @param bands デコードする帯（レイヤー座標、targetRect の内側。空の帯は空のバッファを返す）
+	/// @return 画像を開けない、またはサイズが targetRect と違う場合は false（全体を読んでリサイズする経路に任せる）
+	bool Start(const std::string& path, const FilterPlugIn::Rect& targetRect, std::vector<FilterPlugIn::Rect> bands) {
+		Stop();
+		path_ = path;
+		targetRect_ = targetRect;
+		bands_ = std::move(bands);
+		opened_ = false;
+		failed_ = false;
+		stopping_ = false;
+		error_.clear();
+		thread_ = std::thread(&ResultBandReader::Decode, this);
+		std::unique_lock<std::mutex> lock(mutex_);
+		changed_.wait(lock, [this] { return opened_ || failed_; });
+		if (opened_) return true;
+		lock.unlock();
+		Stop();
+		return false;
+	}
+
+	/// @brief 次の帯を受け取る（デコードが終わるまで待つ）
+	bool Next(ImageBuffer& band) {
+		std::unique_lock<std::mutex> lock(mutex_);
+		changed_.wait(lock, [this] { return !ready_.empty() || failed_; });
+		if (ready_.empty()) return false;
+		band.swap(*ready_.front());
+		ready_.pop_front();
+		changed_.notify_all();
+		return true;
+	}
+
+	void Stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping_ = true;
+		}
+		changed_.notify_all();
+		if (thread_.joinable()) thread_.join();
+		ready_.clear();
+	}
+
+	const std::string& Error() const { return error_; }
+
+private:
+	static constexpr size_t kLookahead = 2;
+
+	void Fail(const std::string& message) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		error_ = message;
+		failed_ = true;
+		changed_.notify_all();
+	}
+
+	void Decode() {
+		BufferPool::StageScope stage("decode");
+		ComvertImage::RegionDecoder decoder;
+		std::string errorMessage;
+		if (!decoder.Open(path_, &errorMessage)) { Fail("PNG decode: " + errorMessage); return; }
+		if (decoder.Width() != targetRect_.right - targetRect_.left || decoder.Height() != targetRect_.bottom - targetRect_.top) {
+			Fail("result is " + std::to_string(decoder.Width()) + "x" + std::to_string(decoder.Height()) + ", not the input size");
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			opened_ = true;
+		}
+		changed_.notify_all();
+		for (const auto& rect : bands_) {
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				changed_.wait(lock, [this] { return stopping_ || ready_.size() < kLookahead; });
+				if (stopping_) return;
+			}
+			auto band = std::make_unique<ImageBuffer>(pool_);
+			band->rect = {};
+			if (!FilterPlugIn::isRectEmpty(rect)) {
+				const int width = rect.right - rect.left, rows = rect.bottom - rect.top;
+				if (!band->allocate(width, rows, false)) { Fail("band buffer allocation failed"); return; }
+				if (!decoder.ReadRgb(rect.left - targetRect_.left, rect.top - targetRect_.top, width, rows, band->get_pixel_pointer(0, 0), static_cast<size_t>(width) * 3, &errorMessage)) { Fail("PNG decode: " + errorMessage); return; }
+				band->rect = rect;
+			}
+			std::lock_guard<std::mutex> lock(mutex_);
+			ready_.push_back(std::move(band));
+			changed_.notify_all();
+		}
+	}
+
+	BufferPool& pool_;
+	std::string path_;
+	FilterPlugIn::Rect targetRect_{};
+	std::vector<FilterPlugIn::Rect> bands_;
+	std::mutex mutex_;
+	std::condition_variable changed_;
+	std::deque<std::unique_ptr<ImageBuffer>> ready_;
+	bool opened_ = false;
+	bool failed_ = false;
+	bool stopping_ = false;
+	std::string error_;
+	std::thread thread_;
+};
+
+/// @brief 書き戻し先のブロックを行毎にまとめる
+/// @return 各行の [開始, 終了) の添字。rects は行の順（上端、左端の順）に並べ替える。
+static std::vector<std::pair<size_t, size_t>> GroupBlockRows(std::vector<FilterPlugIn::Rect>& rects) {
+	std::stable_sort(rects.begin(), rects.end(), [](const FilterPlugIn::Rect& a, const FilterPlugIn::Rect& b) { return std::tie(a.top, a.left) < std::tie(b.top, b.left); });
+	std::vector<std::pair<size_t, size_t>> rows;
+	for (size_t begin = 0, end = 0; begin < rects.size(); begin = end) {
+		for (end = begin + 1; end < rects.size() && rects[end].top == rects[begin].top; ++end) {}
+		rows.emplace_back(begin, end);
+	}
+	return rows;
+}
+
+/// @brief 画素数が maxMegapixels を超える場合に、縦横比を保って収まるサイズを求める
+/// @note 縮小後の幅と高さは multiple の倍数に切り下げる。元の長さが multiple より短い辺は切り下げず、どちらの辺も元の長さを超えない。
+/// @return 縮小が必要ならtrue
+static bool FitToMegapixels(int width, int height, double maxMegapixels, int multiple, int& fittedWidth, int& fittedHeight) {
+	fittedWidth = width;
+	fittedHeight = height;
+	const double pixels = static_cast<double>(width) * height;
+	if (maxMegapixels <= 0.0 || pixels <= maxMegapixels * 1000000.0) return false;
+	const double scale = std::sqrt(maxMegapixels * 1000000.0 / pixels);
+	auto fit = [&](int original) {
+		const int scaled = std::max(1, static_cast<int>(original * scale));
+		if (original < multiple) return std::min(original, scaled);
+		return std::min(original, std::max(multiple, scaled / multiple * multiple));
+	};
+	fittedWidth = fit(width);
+	fittedHeight = fit(height);
+	return fittedWidth < width || fittedHeight < height;
+}
+
+/// @brief 選択範囲の周囲 margin を含み、幅と高さを multiple の倍数に広げた矩形を返す
+/// @param bounds はみ出さないようにする範囲（レイヤー全体）。収まらない場合は内側へずらし、それでも収まらなければ切り詰める。
+static FilterPlugIn::Rect ExpandToContext(const FilterPlugIn::Rect& selection, const FilterPlugIn::Rect& bounds, int margin, int multiple) {
+	auto expandAxis = [&](FilterPlugIn::Int start, FilterPlugIn::Int end, FilterPlugIn::Int lower, FilterPlugIn::Int upper, FilterPlugIn::Int& outStart, FilterPlugIn::Int& outEnd) {
+		start -= margin;
+		end += margin;
+		const auto length = end - start;
+		const auto rounded = std::min<FilterPlugIn::Int>((length + multiple - 1) / multiple * multiple, upper - lower);
+		start -= (rounded - length) / 2;
+		start = std::clamp<FilterPlugIn::Int>(start, lower, upper - rounded);
+		outStart = start;
+		outEnd = start + rounded;
+	};
+	FilterPlugIn::Rect result{};
+	expandAxis(selection.left, selection.right, bounds.left, bounds.right, result.left, result.right);
+	expandAxis(selection.top, selection.bottom, bounds.top, bounds.bottom, result.top, result.bottom);
+	return result;
+}
+
+/// タイル分割の1方向分（開始位置と長さ）
+struct TileSpan {
+	int start;
+	int size;
+};
+
+/// @brief length を tileSize の区間に分割する。隣り合う区間は少なくとも overlap だけ重なり、端は揃える。
+static std::vector<TileSpan> SplitIntoSpans(int length, int tileSize, int overlap) {
+	if (length <= tileSize) return { { 0, length } };
+	const int step = tileSize - overlap;
+	const int count = (length - overlap + step - 1) / step;
+	std::vector<TileSpan> spans;
+	for (int i = 0; i < count; ++i) {
+		// 余りを均等に配分して、全ての重なりをほぼ同じ幅にする
+		const int start = static_cast<int>((static_cast<long long>(length - tileSize) * i + (count - 1) / 2) / (count - 1));
+		spans.push_back({ start, tileSize });
+	}
+	return spans;
+}
+
+/// @brief src の region（ImageBuffer 内の座標）を dst にコピーする
+static bool CopyImageRegion(const ImageBuffer& src, const FilterPlugIn::Rect& region, ImageBuffer& dst) {
+	const int w = region.right - region.left, h = region.bottom - region.top;
+	if (!dst.allocate(w, h, false)) return false;
+	for (int y = 0; y < h; ++y) std::memcpy(dst.get_pixel_pointer(0, y), src.get_pixel_pointer(region.left, region.top + y), static_cast<size_t>(w) * 3);
+	return true;
+}
+
+/// @brief 生成したタイルを dst に合成する
+/// @param overlapLeft 左隣のタイルとの重なり幅（この範囲は左隣から徐々に切り替える）
+/// @param overlapTop 上のタイルとの重なり幅
+/// @note タイルは左上から順に合成する前提。重なり部分だけをブレンドし、それ以外は行単位でコピーする。
+static void BlendTile(ImageBuffer& dst, const ImageBuffer& tile, int left, int top, int overlapLeft, int overlapTop) {
+	const int w = tile.get_width(), h = tile.get_height();
+	for (int y = 0; y < h; ++y) {
+		// 重みは 0～256 の固定小数点（画素の中心で評価する）
+		const int ay = y < overlapTop ? ((2 * y + 1) * 128) / overlapTop : 256;
+		const unsigned char* src = tile.get_pixel_pointer(0, y);
+		unsigned char* out = dst.get_pixel_pointer(left, top + y);
+		int x = 0;
+		if (ay == 256) {
+			for (; x < overlapLeft; ++x) {
+				const int a = ((2 * x + 1) * 128) / overlapLeft;
+				for (int c = 0; c < 3; ++c) out[x * 3 + c] = static_cast<unsigned char>((out[x * 3 + c] * (256 - a) + src[x * 3 + c] * a + 128) >> 8);
+			}
+			std::memcpy(out + x * 3, src + x * 3, static_cast<size_t>(w - x) * 3);
+			continue;
+		}
+		for (; x < w; ++x) {
+			const int ax = x < overlapLeft ? ((2 * x + 1) * 128) / overlapLeft : 256;
+			const int a = (ax * ay) >> 8;
+			for (int c = 0; c < 3; ++c) out[x * 3 + c] = static_cast<unsigned char>((out[x * 3 + c] * (256 - a) + src[x * 3 + c] * a + 128) >> 8);
+		}
+	}
+}
+
+/// @brief 一覧画像のラベル用の 5x7 ドットのフォント（上の行から、各行の下位5ビットが左から右）
+/// @return 対応する文字が無い場合（空白など）はnullptr
+static const std::array<uint8_t, 7>* LabelGlyph(char c) {
+	static const std::array<std::array<uint8_t, 7>, 10> digits = { {
+		{ 0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E },
+		{ 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E },
+		{ 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F },
+		{ 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E },
+		{ 0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02 },
+		{ 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E },
+		{ 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E },
+		{ 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },
+		{ 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E },
+		{ 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C },
+	} };
+	static const std::array<uint8_t, 7> dot = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C };
+	static const std::array<uint8_t, 7> minus = { 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00 };
+	static const std::array<uint8_t, 7> plus = { 0x00, 0x04, 0x04, 0x1F, 0x04, 0x04, 0x00 };
+	static const std::array<uint8_t, 7> exponent = { 0x00, 0x00, 0x0E, 0x11, 0x1F, 0x10, 0x0E };
+	if (c >= '0' && c <= '9') return &digits[c - '0'];
+	switch (c) {
+	case '.': return &dot;
+	case '-': return &minus;
+	case '+': return &plus;
+	case 'e': return &exponent;
+	default: return nullptr;
+	}
+}
+
+/// @brief 黒い帯の上に白で text を描く（1ドットを scale 四方の画素にする）
+static void DrawLabel(ImageBuffer& image, int x, int y, const std::string& text, int scale) {
+	auto fill = [&](int left, int top, int right, int bottom, unsigned char value) {
+		left = std::max(left, 0); top = std::max(top, 0);
+		right = std::min(right, image.get_width()); bottom = std::min(bottom, image.get_height());
+		for (int py = top; py < bottom; ++py) {
+			if (left < right) std::memset(image.get_pixel_pointer(left, py), value, static_cast<size_t>(right - left) * 3);
+		}
+	};
+	const int advance = 6 * scale;
+	fill(x, y, x + static_cast<int>(text.size()) * advance + scale, y + 9 * scale, 0);
+	for (size_t i = 0; i < text.size(); ++i) {
+		const auto glyph = LabelGlyph(text[i]);
+		if (!glyph) continue;
+		const int glyphLeft = x + scale + static_cast<int>(i) * advance, glyphTop = y + scale;
+		for (int row = 0; row < 7; ++row) {
+			for (int column = 0; column < 5; ++column) {
+				if (((*glyph)[row] >> (4 - column)) & 1) fill(glyphLeft + column * scale, glyphTop + row * scale, glyphLeft + (column + 1) * scale, glyphTop + (row + 1) * scale, 255);
+			}
+		}
+	}
+}
+
+/// @brief スイープの結果を格子状に並べ、セル毎に数値のラベルを描いた一覧画像を sheetRect の大きさで作る
+/// @param aspectWidth, aspectHeight セルに入れる画像の縦横比（入力範囲の大きさ）
+/// @param readyMs セル毎の、キューに積み終えてから受け取るまでの時間（ログ用）
+/// @note 画像は縦横比を保ってセルに収め、余白と受け取れなかったセルは黒にする。
+static bool BuildContactSheet(const RunContext& context, const std::vector<std::string>& paths, const std::vector<std::string>& labels, const std::vector<double>& readyMs, int columns,
+	int aspectWidth, int aspectHeight, const FilterPlugIn::Rect& sheetRect, BufferPool& pool, ImageBuffer& sheet) {
+	BufferPool::StageScope stage("contact sheet");
+	const int count = static_cast<int>(paths.size());
+	const int rows = (count + columns - 1) / columns;
+	const int width = sheetRect.right - sheetRect.left, height = sheetRect.bottom - sheetRect.top;
+	if (!sheet.allocate(width, height, true)) { print("Aborting process because the contact sheet buffer could not be allocated."); return false; }
+	sheet.rect = sheetRect;
+	const int cellWidth = width / columns, cellHeight = height / rows;
+	const double scale = std::min(static_cast<double>(cellWidth) / aspectWidth, static_cast<double>(cellHeight) / aspectHeight);
+	const int imageWidth = std::max(static_cast<int>(aspectWidth * scale), 1), imageHeight = std::max(static_cast<int>(aspectHeight * scale), 1);
+	const int labelScale = std::clamp(imageHeight / 120, 1, 4);
+	print("Contact sheet: %d x %d cells of %dx%d in %dx%d", columns, rows, imageWidth, imageHeight, width, height);
+	for (int i = 0; i < count; ++i) {
+		if (paths[i].empty()) { print("cell %d/%d [%s]: no result", i + 1, count, labels[i].c_str()); continue; }
+		const auto start = std::chrono::steady_clock::now();
+		ImageBuffer cell(pool);
+		const FilterPlugIn::Rect cellRect = { 0, 0, imageWidth, imageHeight };
+		if (!LoadGeneratedImage(context, paths[i], cellRect, cellRect, pool, cell)) { print("cell %d/%d [%s]: the result could not be decoded", i + 1, count, labels[i].c_str()); continue; }
+		const int left = (i % columns) * cellWidth + (cellWidth - imageWidth) / 2;
+		const int top = (i / columns) * cellHeight + (cellHeight - imageHeight) / 2;
+		for (int y = 0; y < imageHeight; ++y) std::memcpy(sheet.get_pixel_pointer(left, top + y), cell.get_pixel_pointer(0, y), static_cast<size_t>(imageWidth) * 3);
+		DrawLabel(sheet, left + labelScale, top + labelScale, labels[i], labelScale);
+		print("cell %d/%d [%s]: ready %.0f ms after submission, decode+place %lld ms", i + 1, count, labels[i].c_str(), readyMs[i],
+			static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()));
+	}
+	return true;
+}
+
+/// 高速プレビューで /view に指定する変換形式と品質
+const std::string kPreviewFormat = "jpeg;80";
+
+/// ワーカーを待つ間に、ホストへ制御を返す間隔
+constexpr auto kHostPumpInterval = std::chrono::milliseconds(50);
+
+/// @brief 通信やエンコード・デコードなど時間の掛かる処理をワーカースレッドで実行し、終わるまでホストに制御を返し続ける
+/// @note ホストのスレッドは kHostPumpInterval 毎に Process(Continue) を呼ぶだけなので、待っている間もクリスタが固まらない。
+///       Restart / Exit が返ったら context.cancel_requested を立て、curl やポーリングを止めてワーカーの終了を待つ。
+///       結果はワーカーが終了フラグを立てる前に書き込み、ホストはフラグを見てから読む（ロックは不要）。
+/// @param reportPolls trueなら wait_for_image のポーリング回数を進捗として通知する
+/// @return work の戻り値。キャンセルされた場合は false（キャンセルかどうかは run.Result() で判定する）
+static bool RunInBackground(FilterPlugIn::Run& run, RunContext& context, const std::function<bool()>& work, bool reportPolls = false) {
+	std::atomic<bool> finished{ false };
+	bool result = false;
+	context.cancel_requested = false;
+	context.wait_polls = 0;
+	std::thread worker([&] { result = work(); finished.store(true, std::memory_order_release); });
+	int reported = -1;
+	if (reportPolls) run.Total(std::max(g_RetryMaxCount, 1));
+	while (!finished.load(std::memory_order_acquire)) {
+		if (run.Process(FilterPlugIn::Run::States::Continue) != FilterPlugIn::Run::Results::Continue) {
+			const auto cancelStart = std::chrono::steady_clock::now();
+			context.cancel_requested = true;
+			worker.join();
+			context.cancel_requested = false;
+			print("Cancelled background work (%s) in %lld ms.", run.Result() == FilterPlugIn::Run::Results::Restart ? "restart" : "exit",
+				static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - cancelStart).count()));
+			return false;
+		}
+		if (reportPolls && context.wait_polls != reported) { reported = context.wait_polls; run.Progress(std::min(reported, std::max(g_RetryMaxCount, 1))); }
+		std::this_thread::sleep_for(kHostPumpInterval);
+	}
+	worker.join();
+	return result;
+}
+
+/// @brief ###seed### に入れる乱数（JSON の数値として誤差なく扱える範囲）
+static unsigned long long RandomSeed() {
+	static std::mt19937_64 engine(std::random_device{}());
+	return std::uniform_int_distribution<unsigned long long>(0, (1ULL << 53) - 1)(engine);
+}
+
+/// Restart をまたいで覚えておく、アップロード済みの入力画像の数（プレビューの切り替えなどで送るサイズが変わる）
+constexpr size_t kMaxUploadedInputs = 4;
+
+/// 生成結果を並行して待つスレッドの最大数
+constexpr int kMaxParallelDownloads = 4;
+
+/// @brief ワークフローを全てキューに積んでから、複数のスレッドで並行して完了を待ち、終わったものからダウンロードする
+/// @note ワーカースレッドで呼ぶ。サーバーは積んだ順に処理するので、各スレッドは積んだ順に次のプロンプトを受け持つ。
+///       1つだけの場合は従来通り作業フォルダーの temp_img_res.png に、複数の場合は outputStem と番号から作るファイルに保存する（履歴もプロンプト毎に分ける）。
+/// @param paths 保存したファイルのパス（受け取れなかったものは空文字列）
+/// @param readyMs 全て積み終えてから受け取るまでの時間
+/// @return キューに積めなかった場合はfalse
+static bool SubmitAndDownload(RunContext& context, const std::vector<std::string>& prompts, const std::string& outputStem, std::vector<std::string>& paths, std::vector<double>& readyMs) {
+	const int count = static_cast<int>(prompts.size());
+	Trace::Scope span(context.trace, "submit and download");
+	span.Arg("prompts", count);
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::string> promptIds(count);
+	for (int i = 0; i < count; ++i) {
+		promptIds[i] = submit_prompt(context, prompts[i]);
+		if (promptIds[i].empty()) return false;
+	}
+	const auto submitted = std::chrono::steady_clock::now();
+
+	paths.assign(count, "");
+	readyMs.assign(count, 0.0);
+	std::atomic<int> next{ 0 };
+	std::vector<std::thread> waiters;
+	for (int t = 0; t < std::min(count, kMaxParallelDownloads); ++t) {
+		waiters.emplace_back([&] {
+			for (int i = next++; i < count && !context.cancel_requested; i = next++) {
+				const std::string outputPath = count > 1 ? context.Path(outputStem + std::to_string(i + 1) + ".png") : "";
+				paths[i] = wait_for_image(context, promptIds[i], outputPath);
+				readyMs[i] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - submitted).count();
+			}
+		});
+	}
+	for (auto& waiter : waiters) waiter.join();
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	const auto received = std::count_if(paths.begin(), paths.end(), [](const std::string& path) { return !path.empty(); });
+	print("%d/%d images in %.1f s (submit %lld ms), %.1f images/min", static_cast<int>(received), count, seconds,
+		static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(submitted - start).count()), received * 60.0 / std::max(seconds, 0.001));
+	return true;
+}
+
+/// @brief シードだけを変えたワークフローを count 個キューに積み、生成が終わったものから並行してダウンロードする
+/// @param renderVariant シードから、マーカーを置換したワークフローJSONを作る
+/// @param paths 受け取った生成結果のパス（失敗したバリエーションは含めない）
+/// @param seeds paths のそれぞれのシード
+/// @return 1つ以上受け取れた場合はtrue
+static bool GenerateVariants(RunContext& context, int count, const std::function<std::string(unsigned long long)>& renderVariant, std::vector<std::string>& paths, std::vector<unsigned long long>& seeds) {
+	std::vector<unsigned long long> variantSeeds(count);
+	std::vector<std::string> prompts(count);
+	for (int i = 0; i < count; ++i) {
+		variantSeeds[i] = RandomSeed();
+		prompts[i] = renderVariant(variantSeeds[i]);
+	}
+	std::vector<std::string> variantPaths;
+	std::vector<double> readyMs;
+	if (!SubmitAndDownload(context, prompts, "temp_img_res_v", variantPaths, readyMs)) return false;
+
+	paths.clear();
+	seeds.clear();
+	for (int i = 0; i < count; ++i) {
+		if (variantPaths[i].empty()) continue;
+		print("variant %d/%d (seed %llu) ready %.0f ms after submission", i + 1, count, variantSeeds[i], readyMs[i]);
+		paths.push_back(variantPaths[i]);
+		seeds.push_back(variantSeeds[i]);
+	}
+	return !paths.empty();
+}
+
+/// @brief 入力画像をタイルに分割し、タイル毎にワークフローを実行して output に貼り合わせる
+/// @param renderPrompt 入力画像のアップロード名から、マーカーを置換したワークフローJSONを作る
+/// @note 先に全タイルをアップロードしてキューに積み、その後に順番に結果を受け取る。
+///       サーバーの GPU が前のタイルを処理している間に、次のタイルのアップロードや前のタイルのダウンロードが進む。
+/// @return 失敗またはキャンセルされた場合は false（キャンセルかどうかは run.Result() で判断する）
+static bool GenerateTiled(FilterPlugIn::Run& run, RunContext& context, FilterInfo& info, const ImageBuffer& input, const std::string& inputImageFileName,
+	const std::function<std::string(const std::string&)>& renderPrompt, ImageBuffer& output) {
+	BufferPool::StageScope stage("tiles");
+	const int tileSize = info.params.tile_size;
+	const int overlap = std::clamp(info.params.tile_overlap, 0, tileSize / 2);
+	const auto columns = SplitIntoSpans(input.get_width(), tileSize, overlap);
+	const auto rows = SplitIntoSpans(input.get_height(), tileSize, overlap);
+	const int tileCount = static_cast<int>(columns.size() * rows.size());
+	print("Tiled generation: %d x %d tiles, tile size %d, overlap %d", static_cast<int>(columns.size()), static_cast<int>(rows.size()), tileSize, overlap);
+
+	struct TileJob {
+		FilterPlugIn::Rect rect;
+		int overlapLeft;
+		int overlapTop;
+		std::string promptId;
+		std::chrono::steady_clock::time_point submitted;
+		double uploadMs;
+	};
+	std::vector<TileJob> jobs;
+	run.Total(tileCount * 2);
+	int progress = 0;
+
+	// 1. 全タイルをアップロードしてキューに積む
+	const std::string tempImagePath = context.Path("temp_img_req");
+	const std::string uploadUrl = context.server_address + "/upload/image";
+	for (size_t r = 0; r < rows.size(); ++r) {
+		for (size_t c = 0; c < columns.size(); ++c) {
+			if (run.Process(FilterPlugIn::Run::States::Continue) != FilterPlugIn::Run::Results::Continue) return false;
+			const auto start = std::chrono::steady_clock::now();
+			TileJob job{};
+			job.rect = { columns[c].start, rows[r].start, columns[c].start + columns[c].size, rows[r].start + rows[r].size };
+			job.overlapLeft = c > 0 ? columns[c - 1].start + columns[c - 1].size - columns[c].start : 0;
+			job.overlapTop = r > 0 ? rows[r - 1].start + rows[r - 1].size - rows[r].start : 0;
+
+			const std::string uploadName = inputImageFileName + "_tile" + std::to_string(jobs.size()) + ".png";
+			const bool submitted = RunInBackground(run, context, [&] {
+				Trace::Scope tileSpan(context.trace, "tile upload and submit");
+				tileSpan.Arg("tile", static_cast<long long>(jobs.size()));
+				ImageBuffer tile(info.buffer_pool);
+				if (!CopyImageRegion(input, job.rect, tile)) { print("Aborting process because the tile buffer could not be allocated."); return false; }
+				if (!write_bmp_file(context, tile, tempImagePath + ".bmp") || !call_bmp_to_png(context, tempImagePath + ".bmp")) { print("Aborting process because BMP to PNG conversion failed."); return false; }
+				http_post_image_to_file(context, uploadUrl, tempImagePath + ".png", uploadName, context.Path("temp_json_preimage_res.json"));
+				job.promptId = submit_prompt(context, renderPrompt(uploadName));
+				return !job.promptId.empty();
+			});
+			if (!submitted) return false;
+			job.submitted = std::chrono::steady_clock::now();
+			job.uploadMs = std::chrono::duration<double, std::milli>(job.submitted - start).count();
+			jobs.push_back(job);
+			run.Progress(++progress);
+		}
+	}
+
+	// 2. 投入した順に結果を受け取り、フェザーを掛けて貼り合わせる
+	if (!output.allocate(input.get_width(), input.get_height(), false)) { print("Aborting process because the output image buffer could not be allocated."); return false; }
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		if (run.Process(FilterPlugIn::Run::States::Continue) != FilterPlugIn::Run::Results::Continue) return false;
+		const auto& job = jobs[i];
+		const int tileWidth = job.rect.right - job.rect.left, tileHeight = job.rect.bottom - job.rect.top;
+		std::chrono::steady_clock::time_point received;
+		ImageBuffer tile(info.buffer_pool);
+		const bool loaded = RunInBackground(run, context, [&] {
+			const std::string tileImagePath = wait_for_image(context, job.promptId);
+			if (tileImagePath.empty()) return false;
+			received = std::chrono::steady_clock::now();
+			// モデルがタイルと違うサイズで返した場合は、タイルのサイズに戻してから貼り合わせる
+			const FilterPlugIn::Rect tileRect = { 0, 0, tileWidth, tileHeight };
+			return LoadGeneratedImage(context, tileImagePath, tileRect, tileRect, info.buffer_pool, tile);
+		});
+		if (!loaded) return false;
+		{
+			Trace::Scope blendSpan(context.trace, "blend tile");
+			BlendTile(output, tile, job.rect.left, job.rect.top, job.overlapLeft, job.overlapTop);
+		}
+		run.Progress(++progress);
+
+		const auto done = std::chrono::steady_clock::now();
+		const double totalMs = std::chrono::duration<double, std::milli>(done - job.submitted).count() + job.uploadMs;
+		const auto poolStats = info.buffer_pool.GetStatistics();
+		print("tile %d/%d [%d, %d, %d, %d]: upload %.0f ms, queue+generate+download %.0f ms, decode+blend %.0f ms, %.2f MP/s, pool peak %.1f MB",
+			static_cast<int>(i + 1), tileCount, job.rect.left, job.rect.top, job.rect.right, job.rect.bottom, job.uploadMs,
+			std::chrono::duration<double, std::milli>(received - job.submitted).count(), std::chrono::duration<double, std::milli>(done - received).count(),
+			static_cast<double>(tileWidth) * tileHeight / 1000.0 / std::max(totalMs, 1.0), poolStats.peakBytes / 1048576.0);
+	}
+	return true;
+}
+
+/// @brief 入力範囲をブロック行毎に読み込み、BGRAに並べ替えてそのままPNGへエンコードする
+/// @note 入力画像全体のバッファもRGBAのコピーも作らないため、メモリはブロック行1本分で済む。
+///       ブロックの無い部分は黒、アルファは不透明（maskRect の内側だけ透明）にする。
+/// @param maskRect 透明にする矩形（空ならマスクなし）
+/// @return 失敗またはキャンセルされた場合はfalse（キャンセルかどうかは run.Result() で判定する）
+static bool StreamInputToPng(FilterPlugIn::Run& run, FilterPlugIn::Offscreen& source, const FilterPlugIn::Rect& area, const FilterPlugIn::Rect& maskRect, BufferPool& pool, const std::string& outputPath) {
+	BufferPool::StageScope stage("encode");
+	const auto start = std::chrono::steady_clock::now();
+	const int width = area.right - area.left, height = area.bottom - area.top;
+	const auto rects = source.GetBlockRects(area);
+	// ブロックの上端で帯に区切る（通常はブロック行と一致する）
+	std::vector<FilterPlugIn::Int> edges = { area.top, area.bottom };
+	for (const auto& rect : rects) if (rect.top > area.top && rect.top < area.bottom) edges.push_back(rect.top);
+	std::sort(edges.begin(), edges.end());
+	edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+	FilterPlugIn::Int bandHeight = 0;
+	for (size_t i = 0; i + 1 < edges.size(); ++i) bandHeight = std::max(bandHeight, edges[i + 1] - edges[i]);
+
+	const size_t stride = static_cast<size_t>(width) * 4;
+	BufferPool::Buffer band = pool.Acquire(stride * static_cast<size_t>(bandHeight));
+	if (!band) { print("Aborting process because the capture band buffer could not be allocated."); return false; }
+	ComvertImage::PngStreamWriter writer;
+	std::string errorMessage;
+	if (!writer.Open(outputPath, width, height, &errorMessage)) { LogImageConversionFailure("PNG stream creation", errorMessage); return false; }
+	for (size_t i = 0; i + 1 < edges.size(); ++i) {
+		const FilterPlugIn::Rect bandRect = { area.left, edges[i], area.right, edges[i + 1] };
+		const int rows = static_cast<int>(bandRect.bottom - bandRect.top);
+		for (size_t offset = 0; offset < stride * rows; offset += 4) { band.data()[offset] = 0; band.data()[offset + 1] = 0; band.data()[offset + 2] = 0; band.data()[offset + 3] = 255; }
+		for (const auto& rect : rects) {
+			const auto copyRect = FilterPlugIn::intersectRects(rect, bandRect);
+			if (FilterPlugIn::isRectEmpty(copyRect)) continue;
+			if (run.Process(FilterPlugIn::Run::States::Continue) != FilterPlugIn::Run::Results::Continue) return false;
+			FilterPlugIn::Block block = source.GetBlockImage(rect);
+			block.needOffset = true;
+			if (!block.address) continue;
+			const auto r = block.r, g = block.g, b = block.b;
+			pbyte_t pSrcRow = static_cast<pbyte_t>(block.address) + FilterPlugIn::addressOffset(block, copyRect);
+			for (auto y = copyRect.top; y < copyRect.bottom; ++y, pSrcRow += block.rowBytes) {
+				pbyte_t pSrc = pSrcRow;
+				unsigned char* pDst = band.data() + static_cast<size_t>(y - bandRect.top) * stride + static_cast<size_t>(copyRect.left - bandRect.left) * 4;
+				for (auto x = copyRect.left; x < copyRect.right; ++x, pSrc += block.pixelBytes, pDst += 4) { pDst[0] = pSrc[b]; pDst[1] = pSrc[g]; pDst[2] = pSrc[r]; }
+			}
+		}
+		if (!FilterPlugIn::isRectEmpty(maskRect)) ApplyRectangleSelectionMask(maskRect, bandRect, band.data());
+		if (!writer.WriteRows(band.data(), rows, stride, &errorMessage)) { LogImageConversionFailure("PNG stream encoding", errorMessage); return false; }
+	}
+	if (!writer.Close(&errorMessage)) { LogImageConversionFailure("PNG stream encoding", errorMessage); return false; }
+	print("Input capture streamed: %d bands of up to %d rows, band buffer %.1f MB, capture+encode %lld ms",
+		static_cast<int>(edges.size() - 1), static_cast<int>(bandHeight), stride * bandHeight / 1048576.0,
+		static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()));
+	return true;
+}
+
+/// トレースを書き出すフォルダー（プラグインフォルダーの下）
+const std::string kTraceFolder = "Trace";
+
+/// @brief この実行のトレースを Trace フォルダーに書き出し、古いものは trace_keep_runs 個まで減らす
+static void WriteRunTrace(const FilterInfo& info, const RunContext& context) {
+	if (!context.trace.Enabled() || context.trace.SpanCount() == 0) return;
+	const std::filesystem::path folder = std::filesystem::path(g_BasePath) / kTraceFolder;
+	std::error_code error;
+	std::filesystem::create_directories(folder, error);
+	// 作業フォルダーの名前はプロセスと実行毎に違うので、同じ秒に別のフィルタが実行しても重ならない
+	const std::string workspaceName = std::filesystem::path(context.workspace).parent_path().filename().string();
+	const auto path = folder / ("trace_" + getDateString() + "_" + (workspaceName.empty() ? info.workspace_name : workspaceName) + ".json");
+	if (!context.trace.Export(path.string())) { print("Failed to write the trace: %s", path.string().c_str()); return; }
+	print("Trace: %s (%d spans)", path.string().c_str(), static_cast<int>(context.trace.SpanCount()));
+
+	std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> traces;
+	for (std::filesystem::directory_iterator it(folder, error), end; !error && it != end; it.increment(error)) {
+		std::error_code entryError;
+		const auto name = it->path().filename().string();
+		if (name.rfind("trace_", 0) != 0 || it->path().extension() != ".json") continue;
+		traces.emplace_back(it->last_write_time(entryError), it->path());
+	}
+	if (traces.size() <= static_cast<size_t>(info.trace_keep_runs)) return;
+	std::sort(traces.begin(), traces.end());
+	for (size_t i = 0; i + info.trace_keep_runs < traces.size(); ++i) std::filesystem::remove(traces[i].second, error);
+}
+
 /// フィルタ実行f
 /// @return 正常終了ならtrue
 bool RunFilter(FilterPlugIn::Server* server, FilterPlugIn::Ptr* data, std::string mode) {
@@ -1768,24 +2919,52 @@ bool RunFilter(FilterPlugIn::Server* server, FilterPlugIn::Ptr* data, std::strin
 	auto info = static_cast<FilterInfo*>(*data);
 	info->server = server;
 
+	// この実行の作業フォルダー（前回の実行のものはデバッグ用にここまで残しておく）
+	RemoveWorkspace(info->run_workspace);
+	info->run_workspace = CreateWorkspace(info->workspace_name + "_run");
+	if (info->run_workspace.empty()) { print("Aborting process because the workspace could not be created."); return false; }
+	RunContext context;
+	context.server_address = info->server_address;
+	context.workspace = info->run_workspace;
+	context.metrics = info->metrics.Enabled() ? &info->metrics : nullptr;
+	print(("Workspace: " + context.workspace).c_str());
+	// この実行のトレースと統計。途中で戻る場合も含め、RunFilter を抜ける時に書き出す（runSpan が先に閉じる）
+	if (info->trace_keep_runs > 0) context.trace.Begin();
+	context.trace.SetTag("server", context.server_address);
+	struct RunRecorder {
+		const FilterInfo& info;
+		RunContext& context;
+		~RunRecorder() {
+			WriteRunTrace(info, context);
+			if (info.metrics.Enabled() && !info.metrics.Save()) print("Failed to save the metrics.");
+		}
+	} runRecorder{ *info, context };
+	Trace::Scope runSpan(context.trace, "RunFilter", "run");
+
 	// 前回の設定で開く
 	FilterPlugIn::Property property(server, run.GetProperty());
-	property.sync(ITEM_PROMPT, g_params.prompt);
-	property.sync(ITEM_NPROMPT, g_params.negative_prompt);
+	property.sync(ITEM_PROMPT, info->params.prompt);
+	property.sync(ITEM_NPROMPT, info->params.negative_prompt);
 	property.sync(ITEM_USE_SELECTION_AS_MASK, info->use_selection_as_mask);
 	// property.sync(ITEM_OUTPAINT_TRANSPARENT_AREA, info->outpaint_transparent_area); // Temporarily disabled.
+	property.sync(ITEM_VARIANT_COUNT, info->variant_count);
+	property.sync(ITEM_VARIANT_INDEX, info->variant_index);
+	property.sync(ITEM_SWEEP, info->sweep);
+	if (g_EnablePreview) property.sync(ITEM_FAST_PREVIEW, info->fast_preview);
 	// API 実行後に変更された数値を保持したままフィルターを開く。
-	SwitchToSetting(info->setting, property, false);
+	SwitchToSetting(*info, info->setting, property, false);
 	auto refreshSelectedSubImages = [&]() {
 		for (size_t i = 0; i < kSubImageDropdownCount; ++i) {
 			const int selection = info->subimage_indices[i];
-			if (IsNoImageSelection(selection)) {
-				g_params.input_subimage_filenames[i].clear();
+			if (IsNoImageSelection(*info, selection)) {
+				info->params.input_subimage_filenames[i].clear();
 			} else {
-				g_params.input_subimage_filenames[i] = g_SubImages[selection];
+				info->params.input_subimage_filenames[i] = info->subimages[selection];
 			}
+			// 入力画像を取得している間にアップロードが進むよう、ここでも依頼しておく（済んでいれば何もしない）
+			info->subimage_uploader.Request(i, info->params.input_subimage_filenames[i]);
 			std::string logMessage = "subimage_selection[" + std::to_string(i) + "] : ";
-			logMessage += g_params.input_subimage_filenames[i].empty() ? kNoImageDisplayName : g_params.input_subimage_filenames[i];
+			logMessage += info->params.input_subimage_filenames[i].empty() ? kNoImageDisplayName : info->params.input_subimage_filenames[i];
 
 			print(logMessage.c_str());
 		}
@@ -1812,34 +2991,189 @@ bool RunFilter(FilterPlugIn::Server* server, FilterPlugIn::Ptr* data, std::strin
 	FilterPlugIn::Rect fullLayerRect{}; const bool hasFullLayerRect = GetFullLayerRect(offscreenSource, fullLayerRect);
 	print("Selection rect: [%d, %d, %d, %d], full layer rect: [%d, %d, %d, %d]", selectAreaRect.left, selectAreaRect.top, selectAreaRect.right, selectAreaRect.bottom, fullLayerRect.left, fullLayerRect.top, fullLayerRect.right, fullLayerRect.bottom);
 	if (FilterPlugIn::isRectEmpty(selectAreaRect) && hasFullLayerRect) { selectAreaRect = fullLayerRect; print("Selection rectangle is empty; using the full layer rectangle."); }
-	const bool useFullLayerInput = info->use_selection_as_mask;
-	FilterPlugIn::Rect inputAreaRect = selectAreaRect;
-	if (useFullLayerInput && hasFullLayerRect) inputAreaRect = fullLayerRect;
-	else if (useFullLayerInput) print("Mask mode: failed to get full layer rect; using selection rectangle.");
-	if (FilterPlugIn::isRectEmpty(inputAreaRect)) { print("Aborting process because the input rectangle is empty."); return false; }
 	const FilterPlugIn::Rect outputAreaRect = selectAreaRect;
-	const auto width = inputAreaRect.right - inputAreaRect.left; const auto height = inputAreaRect.bottom - inputAreaRect.top;
-	const auto offsetX = inputAreaRect.left; const auto offsetY = inputAreaRect.top;
-	if (info->use_selection_as_mask) print("Input mode: full layer with rectangular selection mask");
-	else print("Input mode: selection bounding rectangle");
+	// 自動切り詰めで走査した範囲と、その中の不透明な部分の外接矩形
+	bool opaqueScanned = false, opaqueFound = false;
+	FilterPlugIn::Rect opaqueScanRect{}, opaqueBounds{};
+
+	// アップロード済みの入力画像。ソースはダイアログを開いている間は変わらないので、範囲・マスク・送るサイズが同じなら
+	// Restart では取得もエンコードもアップロードもせず、サーバー上のファイルを使う（新しいものから kMaxUploadedInputs 件）
+	struct UploadedInput {
+		FilterPlugIn::Rect rect;
+		bool mask;
+		FilterPlugIn::Rect maskRect;
+		int width;
+		int height;
+		std::string name;	///< サーバー上のファイル名
+		std::string hash;	///< エンコードした PNG のハッシュ（生成結果のキャッシュを使わなかった場合は空）
+	};
+	std::vector<UploadedInput> uploadedInputs;
+	int iteration = 0;
+
+	// 前回のループで書き戻したタイル（BlockKey）。Restart 後は入力と同じ結果でも書き直して元に戻す必要がある。
+	// 大きなキャンバスではブロックが数千になるので、ブロック毎に探すのは集合で行う
+	std::unordered_set<uint64_t> writtenTiles;
+
+	// 生成済みのバリエーション。生成条件が変わっていなければ、Restart では表示するものを切り替えるだけにする。
+	std::string variantKey;
+	std::vector<std::string> variantPaths;
+	std::vector<unsigned long long> variantSeeds;
+	// プレビューはプロンプトの変更の影響だけを比べられるよう、ダイアログを開いている間は同じシードを使う
+	const auto previewSeed = RandomSeed();
+	// プレビューのまま OK された場合は、プレビューを止めて元の大きさでもう一度実行する（プレビューを確定させない）
+	bool fullResolutionPass = false;
 
 	// メイン処理
 	while (true) {
 		if (run.Process(FilterPlugIn::Run::States::Start) == FilterPlugIn::Run::Results::Exit) break;
+		const auto iterationStart = std::chrono::steady_clock::now();
+		++iteration;
+		Trace::Scope iterationSpan(context.trace, "iteration", "run");
+		iterationSpan.Arg("index", iteration);
 		refreshSelectedSubImages();
+		info->buffer_pool.ResetStatistics();
+
+		// 入力範囲はマスクモードや設定（mask_context_margin など）の変更に合わせて、毎回求め直す
+		const bool useFullLayerInput = info->use_selection_as_mask;
+		FilterPlugIn::Rect inputAreaRect = selectAreaRect;
+		if (useFullLayerInput && hasFullLayerRect) inputAreaRect = fullLayerRect;
+		else if (useFullLayerInput) print("Mask mode: failed to get full layer rect; using selection rectangle.");
+		if (FilterPlugIn::isRectEmpty(inputAreaRect)) { print("Aborting process because the input rectangle is empty."); return false; }
+		const auto maskSelectionRect = FilterPlugIn::intersectRects(selectAreaRect, inputAreaRect);
+		if (useFullLayerInput && info->params.mask_context_margin >= 0 && !FilterPlugIn::isRectEmpty(maskSelectionRect)) {
+			// レイヤー全体ではなく、選択範囲と周囲の文脈だけを送る。生成結果は選択範囲にだけ書き戻す。
+			inputAreaRect = ExpandToContext(maskSelectionRect, inputAreaRect, info->params.mask_context_margin, info->params.size_multiple);
+			print("Mask mode: context crop [%d, %d, %d, %d] (margin %d, multiple %d)", inputAreaRect.left, inputAreaRect.top, inputAreaRect.right, inputAreaRect.bottom,
+				info->params.mask_context_margin, info->params.size_multiple);
+		}
+		if (g_AutoCropTransparent) {
+			// 透明な余白を送らないよう、不透明な部分と余白だけに切り詰める。書き戻しは切り詰めた位置に行うので結果の位置はずれない。
+			// ソースはダイアログを開いている間は変わらないので、同じ範囲の走査結果は Restart をまたいで使う
+			const auto scanStart = std::chrono::steady_clock::now();
+			if (!opaqueScanned || !SameRect(opaqueScanRect, inputAreaRect)) {
+				opaqueFound = FindOpaqueBounds(offscreenSource, inputAreaRect, opaqueBounds);
+				opaqueScanRect = inputAreaRect;
+				opaqueScanned = true;
+			}
+			FilterPlugIn::Rect opaqueRect = opaqueBounds;
+			if (opaqueFound) {
+				// マスクモードでは生成する範囲（選択範囲）も残す
+				const auto maskRect = FilterPlugIn::intersectRects(selectAreaRect, inputAreaRect);
+				if (info->use_selection_as_mask && !FilterPlugIn::isRectEmpty(maskRect)) {
+					opaqueRect = { std::min(opaqueRect.left, maskRect.left), std::min(opaqueRect.top, maskRect.top), std::max(opaqueRect.right, maskRect.right), std::max(opaqueRect.bottom, maskRect.bottom) };
+				}
+				const FilterPlugIn::Rect marginRect = { opaqueRect.left - g_AutoCropMargin, opaqueRect.top - g_AutoCropMargin, opaqueRect.right + g_AutoCropMargin, opaqueRect.bottom + g_AutoCropMargin };
+				const auto croppedRect = FilterPlugIn::intersectRects(marginRect, inputAreaRect);
+				const double keptPercent = 100.0 * (croppedRect.right - croppedRect.left) * (croppedRect.bottom - croppedRect.top) / (static_cast<double>(inputAreaRect.right - inputAreaRect.left) * (inputAreaRect.bottom - inputAreaRect.top));
+				print("Auto crop: [%d, %d, %d, %d] -> [%d, %d, %d, %d] (%.1f%% of pixels kept, scan %lld ms)",
+					inputAreaRect.left, inputAreaRect.top, inputAreaRect.right, inputAreaRect.bottom, croppedRect.left, croppedRect.top, croppedRect.right, croppedRect.bottom, keptPercent,
+					static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - scanStart).count()));
+				inputAreaRect = croppedRect;
+			} else {
+				print("Auto crop: no opaque pixels found; using the whole input rectangle.");
+			}
+		}
+		const auto width = inputAreaRect.right - inputAreaRect.left; const auto height = inputAreaRect.bottom - inputAreaRect.top;
+		const auto offsetX = inputAreaRect.left; const auto offsetY = inputAreaRect.top;
+		context.template_name = ansi_to_utf8(info->params.template_workflow_filename);
+		context.trace.SetTag("template", context.template_name);
+		context.trace.SetTag("image_size", std::to_string(width) + "x" + std::to_string(height));
+		if (info->use_selection_as_mask) print("Input mode: full layer with rectangular selection mask");
+		else print("Input mode: selection bounding rectangle");
 
 		// パラメータの取得
+		// タイル分割はマスクモード以外で、入力が tile_size を超える場合のみ
+		// 高速プレビューでは、preview_max_megapixels まで縮小した入力を1枚だけ生成する（タイル分割・バリエーション・スイープはしない）
+		const bool preview = g_EnablePreview && info->fast_preview && !fullResolutionPass;
+		if (preview) print("Fast preview: up to %.2f MP", g_PreviewMaxMegapixels);
+		const bool tiled = !preview && !info->use_selection_as_mask && info->params.tile_size > 0 && (width > info->params.tile_size || height > info->params.tile_size);
+		if (info->params.tile_size > 0 && info->use_selection_as_mask) print("tile_size is ignored in mask mode.");
+		// 画素数の上限を超える場合は縮小してから送る（生成結果は書き戻す前に元のサイズへ戻す）
+		int uploadWidth = width, uploadHeight = height;
+		const double maxMegapixels = preview && g_PreviewMaxMegapixels > 0.0 && (info->params.max_megapixels <= 0.0 || g_PreviewMaxMegapixels < info->params.max_megapixels)
+			? g_PreviewMaxMegapixels : info->params.max_megapixels;
+		const bool downscale = !tiled && FitToMegapixels(width, height, maxMegapixels, info->params.size_multiple, uploadWidth, uploadHeight);
+		if (tiled && info->params.max_megapixels > 0.0) print("max_megapixels is ignored in tiled mode (tile_size = %d).", info->params.tile_size);
+		// タイル分割・縮小をしない場合は、入力画像全体を読み込まずにブロック行毎にPNGへエンコードする
+		// （Python での変換を指定している場合は、BMP を経由する従来の方法で送る）
+		const bool streamInput = g_StreamInputCapture && !tiled && !downscale && (info->use_selection_as_mask || !g_UsePythonImageConversion);
+		// スイープモードでは、*_sweep の値の全ての組み合わせを生成する（num1 を横に並べ、残りを縦に並べる）
+		std::vector<std::array<double, kNumberParameterCount>> sweepCells;
+		std::vector<std::string> sweepLabels;
+		int sweepColumns = 0;
+		if (info->sweep && tiled) print("Sweep is ignored in tiled mode.");
+		if (info->sweep && preview) print("Sweep is ignored in fast preview.");
+		if (info->sweep && !tiled && !preview) {
+			sweepCells = { info->params.numbers };
+			for (size_t n = kNumberParameterCount; n-- > 0;) {
+				const auto& values = info->params.number_sweeps[n];
+				if (values.empty()) continue;
+				std::vector<std::array<double, kNumberParameterCount>> expanded;
+				for (const auto& cell : sweepCells) {
+					for (const auto value : values) { expanded.push_back(cell); expanded.back()[n] = value; }
+				}
+				sweepCells.swap(expanded);
+				sweepColumns = static_cast<int>(values.size());
+			}
+			if (sweepColumns == 0) {
+				print("Sweep: this setting has no num1_sweep / num2_sweep / num3_sweep; generating once.");
+				sweepCells.clear();
+			} else if (static_cast<int>(sweepCells.size()) > kMaxSweepCells) {
+				print("Aborting process because the sweep has %d combinations (limit %d).", static_cast<int>(sweepCells.size()), kMaxSweepCells);
+				return false;
+			}
+			for (const auto& cell : sweepCells) {
+				std::string label;
+				for (size_t n = 0; n < kNumberParameterCount; ++n) {
+					if (info->params.number_sweeps[n].empty()) continue;
+					char text[32];
+					std::snprintf(text, sizeof(text), "%g", cell[n]);
+					label += (label.empty() ? "" : " ") + std::string(text);
+				}
+				sweepLabels.push_back(label);
+			}
+		}
+		const bool sweep = !sweepCells.empty();
+		// 表示するバリエーション以外の条件が前回の生成と同じなら、キャプチャも生成もせずに生成済みの結果を使う
+		const int variantCount = tiled || sweep || preview ? 1 : std::clamp(info->variant_count, 1, kMaxVariantCount);
+		if (tiled && info->variant_count > 1) print("Variants are ignored in tiled mode.");
+		if (sweep && info->variant_count > 1) print("Variants are ignored in sweep mode.");
+		std::ostringstream keyStream;
+		keyStream << info->setting << ' ' << info->use_selection_as_mask << ' ' << variantCount << ' ' << inputAreaRect.left << ' ' << inputAreaRect.top << ' ' << inputAreaRect.right << ' ' << inputAreaRect.bottom
+			<< ' ' << uploadWidth << ' ' << uploadHeight << '\n' << info->params.template_workflow_filename << '\n' << info->params.prompt << '\n' << info->params.negative_prompt;
+		for (const auto number : info->params.numbers) keyStream << '\n' << NumberToJson(number);
+		for (const auto& name : info->params.input_subimage_filenames) keyStream << '\n' << name;
+		const std::string generationKey = keyStream.str();
+		const bool reuseVariants = !tiled && !sweep && !preview && !variantPaths.empty() && generationKey == variantKey;
+		// 同じ入力をアップロード済みなら、プロンプトや数値を変えただけなので、ワークフローの置換と /prompt だけを行う
+		// ワーカーでアップロード済みの入力として覚える時に使うので、プロパティのコールバックで変わらないようコピーしておく
+		const bool uploadMask = info->use_selection_as_mask;
+		const FilterPlugIn::Rect uploadMaskRect = uploadMask ? FilterPlugIn::intersectRects(selectAreaRect, inputAreaRect) : FilterPlugIn::Rect{};
+		const auto uploadedInput = tiled || reuseVariants ? uploadedInputs.end() : std::find_if(uploadedInputs.begin(), uploadedInputs.end(), [&](const UploadedInput& entry) {
+			return SameRect(entry.rect, inputAreaRect) && entry.mask == uploadMask && SameRect(entry.maskRect, uploadMaskRect) && entry.width == uploadWidth && entry.height == uploadHeight;
+		});
+		const bool reuseInput = uploadedInput != uploadedInputs.end();
+		const UploadedInput reusedInput = reuseInput ? *uploadedInput : UploadedInput{};
+		iterationSpan.Arg("mode", tiled ? "tiled" : sweep ? "sweep" : preview ? "preview" : variantCount > 1 ? "variants" : "single");
+		iterationSpan.Arg("upload_size", std::to_string(uploadWidth) + "x" + std::to_string(uploadHeight));
+
 		// 入力画像の取得
-		ImageBuffer inputImageBuffer;
-		inputImageBuffer.allocate(width, height);
-		inputImageBuffer.rect.top = offsetY;
-		inputImageBuffer.rect.left = offsetX;
-		inputImageBuffer.rect.bottom = offsetY + inputImageBuffer.get_height();
-		inputImageBuffer.rect.right = offsetX + inputImageBuffer.get_width();
-		auto sourceRects = offscreenSource.GetBlockRects(inputAreaRect);
-		print("Source block count: %d for input rect [%d, %d, %d, %d]", static_cast<int>(sourceRects.size()), inputAreaRect.left, inputAreaRect.top, inputAreaRect.right, inputAreaRect.bottom);
+		ImageBuffer inputImageBuffer(info->buffer_pool);
+		const bool captureInput = !streamInput && !reuseVariants && !reuseInput;
+		auto sourceRects = captureInput ? offscreenSource.GetBlockRects(inputAreaRect) : std::vector<FilterPlugIn::Rect>{};
+		if (captureInput) {
+			BufferPool::StageScope stage("capture");
+			if (!inputImageBuffer.allocate(width, height)) { print("Aborting process because the input image buffer could not be allocated."); return false; }
+			inputImageBuffer.rect.top = offsetY;
+			inputImageBuffer.rect.left = offsetX;
+			inputImageBuffer.rect.bottom = offsetY + inputImageBuffer.get_height();
+			inputImageBuffer.rect.right = offsetX + inputImageBuffer.get_width();
+			print("Source block count: %d for input rect [%d, %d, %d, %d]", static_cast<int>(sourceRects.size()), inputAreaRect.left, inputAreaRect.top, inputAreaRect.right, inputAreaRect.bottom);
+		}
+		const auto captureStart = Trace::Clock::now();
+		bool captureCancelled = false;
 		for (const auto& rect : sourceRects) {
-			if (run.Process(FilterPlugIn::Run::States::Continue) != FilterPlugIn::Run::Results::Continue) break;
+			if (run.Process(FilterPlugIn::Run::States::Continue) != FilterPlugIn::Run::Results::Continue) { captureCancelled = true; break; }
 			FilterPlugIn::Block srcBlock = offscreenSource.GetBlockImage(rect);
 			// print("offscreenSource srcBlock:");
 			// print(std::to_string(srcBlock.rect.top).c_str());
@@ -1848,108 +3182,421 @@ bool RunFilter(FilterPlugIn::Server* server, FilterPlugIn::Ptr* data, std::strin
 			// print(std::to_string(srcBlock.rect.right).c_str());
 			Transfer(inputImageBuffer, srcBlock, offsetY, offsetX);
 		}
+		// 取得の途中でキャンセルされた場合は、途中までの画像を送らない（アップロード済みとしても覚えない）
+		if (captureCancelled && run.Result() == FilterPlugIn::Run::Results::Restart) continue;
+		if (captureCancelled) break;
+		if (captureInput) context.trace.AddSpan("capture", "stage", captureStart, Trace::Clock::now(), "\"blocks\":" + std::to_string(sourceRects.size()));
 		std::string datetimenow = getDateString();
 		std::string inputImageFileName = "temp_img_req_" + datetimenow;
+		std::string inputUploadName = reuseInput ? reusedInput.name : inputImageFileName + ".png";
 		std::array<std::string, kSubImageDropdownCount> subImageUploadFileNames{};
 		std::string tempImageFileName = "temp_img_req";
-		if (info->use_selection_as_mask) {
-			std::vector<unsigned char> rgba; CopyImageToRgba(inputImageBuffer, rgba);
+		std::string url = context.server_address + "/upload/image";
+		const ImageBuffer* uploadImageBuffer = &inputImageBuffer;
+		ImageBuffer scaledInputBuffer(info->buffer_pool);
+		if (downscale && captureInput) {
+			Trace::Scope downscaleSpan(context.trace, "downscale");
+			BufferPool::StageScope stage("downscale");
+			if (!ResizeImageBuffer(inputImageBuffer, scaledInputBuffer, uploadWidth, uploadHeight, info->buffer_pool)) { print("Aborting process because the input image could not be downscaled."); return false; }
+			uploadImageBuffer = &scaledInputBuffer;
+		}
+		if (reuseVariants) {
+			// 生成済みのバリエーションを使うので、入力画像は送らない
+		} else if (reuseInput) {
+			// アップロード済みの入力画像を使う
+		} else if (tiled) {
+			// タイル毎にアップロードするので、ここでは入力画像全体を送らない
+		} else if (streamInput) {
+			const FilterPlugIn::Rect streamMaskRect = info->use_selection_as_mask ? FilterPlugIn::intersectRects(selectAreaRect, inputAreaRect) : FilterPlugIn::Rect{};
+			Trace::Scope streamSpan(context.trace, "capture and encode (streaming)");
+			if (!StreamInputToPng(run, offscreenSource, inputAreaRect, streamMaskRect, info->buffer_pool, context.Path(tempImageFileName + ".png"))) {
+				if (run.Result() == FilterPlugIn::Run::Results::Restart) continue;
+				if (run.Result() == FilterPlugIn::Run::Results::Exit) break;
+				print("Aborting process because the input image could not be encoded.");
+				return false;
+			}
+		} else if (info->use_selection_as_mask) {
+			Trace::Scope maskSpan(context.trace, "RGBA PNG write", "convert");
+			BufferPool::StageScope stage("encode");
+			BufferPool::Buffer rgba;
+			if (!CopyImageToRgba(*uploadImageBuffer, info->buffer_pool, rgba)) { print("Aborting process because the RGBA buffer could not be allocated."); return false; }
 			// 			if (info->outpaint_transparent_area && !CopyLayerAlphaToRgba(offscreenSource, inputAreaRect, rgba)) { print("Aborting process because the layer alpha channel could not be read for outpaint mask."); return false; } // Temporarily disabled.
-			if (info->use_selection_as_mask) ApplyRectangleSelectionMask(selectAreaRect, inputAreaRect, rgba);
-			std::string errorMessage;
-			if (!ComvertImage::WriteRgbaPng(g_BasePath + tempImageFileName + ".png", rgba.data(), width, height, &errorMessage)) { LogImageConversionFailure("RGBA PNG creation for ComfyUI mask", errorMessage); return false; }
-		} else { write_bmp_file(inputImageBuffer, g_BasePath + tempImageFileName +".bmp"); if (!call_bmp_to_png(tempImageFileName + ".bmp")) { print("Aborting process because BMP to PNG conversion failed."); return false; } }
-		// 入力画像を事前にPOST
-        std::string url = g_ServerAddress + "/upload/image";
-		http_post_image_to_file(url, g_BasePath + tempImageFileName + ".png", inputImageFileName + ".png", "temp_json_preimage_res.json");
-
-		for (size_t i = 0; i < kSubImageDropdownCount; ++i) {
-			const auto& selectedSubImage = g_params.input_subimage_filenames[i];
-			if (!selectedSubImage.empty()) {
-				const std::string uploadFileName = kSubImageUploadPrefixes[i] + datetimenow + ".png";
-				const std::string localPath = g_BasePath + "SubImage\\" + selectedSubImage;
-				const std::string responseFile = "temp_json_presubimage_res_" + std::to_string(i) + ".json";
-				print(("pre-post subimage[" + std::to_string(i) + "]: " + localPath).c_str());
-				http_post_image_to_file(url, localPath, uploadFileName, responseFile);
-				subImageUploadFileNames[i] = uploadFileName;
-			} else {
-				subImageUploadFileNames[i] = "empty.png";
-				print(("skip pre-post subimage[" + std::to_string(i) + "]: " + kNoImageDisplayName).c_str());
+			if (info->use_selection_as_mask) {
+				// 縮小した場合は、マスクの矩形も同じ比率で縮める（境界の画素は含める側に丸める）
+				const auto maskRect = FilterPlugIn::intersectRects(selectAreaRect, inputAreaRect);
+				const FilterPlugIn::Rect uploadRect = { 0, 0, uploadWidth, uploadHeight };
+				const FilterPlugIn::Rect scaledMaskRect = {
+					static_cast<FilterPlugIn::Int>((static_cast<long long>(maskRect.left - inputAreaRect.left) * uploadWidth) / width),
+					static_cast<FilterPlugIn::Int>((static_cast<long long>(maskRect.top - inputAreaRect.top) * uploadHeight) / height),
+					static_cast<FilterPlugIn::Int>((static_cast<long long>(maskRect.right - inputAreaRect.left) * uploadWidth + width - 1) / width),
+					static_cast<FilterPlugIn::Int>((static_cast<long long>(maskRect.bottom - inputAreaRect.top) * uploadHeight + height - 1) / height) };
+				ApplyRectangleSelectionMask(scaledMaskRect, uploadRect, rgba.data());
 			}
-		}
-
-		// 生成
+			std::string errorMessage;
+			if (!ComvertImage::WriteRgbaPng(context.Path(tempImageFileName + ".png"), rgba.data(), uploadWidth, uploadHeight, &errorMessage)) { LogImageConversionFailure("RGBA PNG creation for ComfyUI mask", errorMessage); return false; }
+		} else { write_bmp_file(context, *uploadImageBuffer, context.Path(tempImageFileName + ".bmp")); if (!call_bmp_to_png(context, context.Path(tempImageFileName + ".bmp"))) { print("Aborting process because BMP to PNG conversion failed."); return false; } }
+		// エンコード後は縮小画像も、（タイル分割しなければ）入力画像も使わないので、生成を待つ間はプールへ返しておく
+		{ ImageBuffer released(info->buffer_pool); scaledInputBuffer.swap(released); }
+		if (!tiled) { ImageBuffer released(info->buffer_pool); inputImageBuffer.swap(released); }
 		// JSONファイルを読み込む
-		std::string prompt_original = read_file_to_string(g_BasePath + g_params.template_workflow_filename);
+		const bool previewTemplate = preview && !info->params.preview_template_workflow_filename.empty();
+		std::string prompt_original = ReadTemplate(g_BasePath + (previewTemplate ? info->params.preview_template_workflow_filename : info->params.template_workflow_filename));
 		if (prompt_original.empty()) {
 			print("Aborting process.");
 			return false;
 		}
 
-		FilterPlugIn::Block outputBlock;
-
 		print("Replace prompt");
 
-		// 2. 読み込んだJSON文字列内のマーカーを置換する
-		std::string prompt_modified = replace_all(prompt_original, MARKER_PROMPT, g_params.prompt);
-		prompt_modified = replace_all(prompt_modified, MARKER_NPROMPT, g_params.negative_prompt);
-		for (size_t i = 0; i < kNumberParameterCount; ++i) {
-			prompt_modified = replace_all(prompt_modified, kNumberMarkers[i], NumberToJson(g_params.numbers[i]));
+		// 1. 読み込んだJSON文字列内のプロンプトと数値のマーカーを置換する
+		std::string prompt_modified = replace_all(prompt_original, MARKER_PROMPT, info->params.prompt);
+		prompt_modified = replace_all(prompt_modified, MARKER_NPROMPT, info->params.negative_prompt);
+		// スイープモードでは数値はセル毎に置換する
+		// 高速プレビューでは preview_num1～3 の指定があればそちらを使う（ステップ数の少ない設定など）
+		for (size_t i = 0; i < kNumberParameterCount && !sweep; ++i) {
+			const double number = preview && !std::isnan(info->params.preview_numbers[i]) ? info->params.preview_numbers[i] : info->params.numbers[i];
+			prompt_modified = replace_all(prompt_modified, kNumberMarkers[i], NumberToJson(number));
 		}
-		print("Replace input image path");
-		prompt_modified = replace_all(prompt_modified, MARKER_INPUT_IMAGE, inputImageFileName + ".png");
+
+		// 待っている間にプロパティのコールバックで info->params が変わることがあるので、ワーカーにはコピーを渡す
+		const auto selectedSubImages = info->params.input_subimage_filenames;
+
+		// 同じワークフロー・入力画像・サブ画像で生成したことがあれば、アップロードも生成もせずに保存しておいた結果を使う
+		// キーはアップロード名やシードを置換する前のワークフローと、エンコードした入力画像・サブ画像の内容から作る
+		// シードのマーカーがあるテンプレートは実行毎に結果が変わるので使わない
+		std::string resultCacheKey, cachedResultPath;
+		std::string inputImageHash = reusedInput.hash;
+		if (info->result_cache.Enabled() && info->params.result_cache && !tiled && !sweep && !preview && !reuseVariants && variantCount == 1
+			&& prompt_modified.find(MARKER_SEED) == std::string::npos) {
+			Trace::Scope cacheSpan(context.trace, "result cache lookup");
+			const auto hashStart = std::chrono::steady_clock::now();
+			if (!reuseInput) {
+				Fnv1a64 inputHash;
+				if (inputHash.AddFile(context.Path(tempImageFileName + ".png"))) inputImageHash = inputHash.Hex();
+			}
+			Fnv1a64 hash;
+			hash.Add(context.server_address);
+			hash.Add(prompt_modified);
+			hash.Add(inputImageHash);
+			bool hashed = !inputImageHash.empty();
+			for (const auto& selectedSubImage : selectedSubImages) {
+				if (selectedSubImage.empty()) hash.Add("");
+				else hashed = hashed && hash.AddFile(SubImagePath(selectedSubImage));
+			}
+			if (hashed) {
+				resultCacheKey = hash.Hex();
+				cachedResultPath = info->result_cache.Find(resultCacheKey);
+				info->metrics.Add(cachedResultPath.empty() ? "comfyui_plugin_result_cache_misses_total" : "comfyui_plugin_result_cache_hits_total", { { "template", context.template_name } });
+			}
+			const auto cacheStats = info->result_cache.GetStatistics();
+			print("Result cache %s: key %s, %d hits, %d misses, %d entries, %.1f MB, hash %lld ms", !hashed ? "skipped (no input hash)" : cachedResultPath.empty() ? "miss" : "hit",
+				resultCacheKey.c_str(), static_cast<int>(cacheStats.hits), static_cast<int>(cacheStats.misses), static_cast<int>(cacheStats.entries), cacheStats.bytes / 1048576.0,
+				static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - hashStart).count()));
+		}
+		const bool resultCacheHit = !cachedResultPath.empty();
+
+		// 入力画像とサブ画像を事前にPOST（待っている間もホストに制御を返す）
+		// サブ画像はダイアログを開いている間や入力画像の取得中に先にアップロードしてあれば、それを使う
+		int preUploadedCount = 0, selectedCount = 0;
+		double preUploadSavedMs = 0.0;
+		if (!reuseVariants && !resultCacheHit) RunInBackground(run, context, [&] {
+			Trace::Scope uploadSpan(context.trace, "upload inputs");
+			if (!tiled && !reuseInput) {
+				std::error_code sizeError;
+				const auto uploadBytes = std::filesystem::file_size(context.Path(tempImageFileName + ".png"), sizeError);
+				print("Input image: %dx%d, %lld bytes", uploadWidth, uploadHeight, sizeError ? -1LL : static_cast<long long>(uploadBytes));
+				const std::string responsePath = context.Path("temp_json_preimage_res.json");
+				std::remove(responsePath.c_str());
+				http_post_image_to_file(context, url, context.Path(tempImageFileName + ".png"), inputUploadName, responsePath);
+				// サーバーが受け取った名前を覚えておき、次の Restart で使う（受け取れたか分からない場合は覚えない）
+				const std::string uploadedName = ReadUploadedName(responsePath);
+				if (!uploadedName.empty()) {
+					inputUploadName = uploadedName;
+					uploadedInputs.insert(uploadedInputs.begin(), { inputAreaRect, uploadMask, uploadMaskRect, uploadWidth, uploadHeight, uploadedName, inputImageHash });
+					if (uploadedInputs.size() > kMaxUploadedInputs) uploadedInputs.pop_back();
+				}
+			}
+
+			for (size_t i = 0; i < kSubImageDropdownCount; ++i) {
+				const auto& selectedSubImage = selectedSubImages[i];
+				if (!selectedSubImage.empty()) {
+					++selectedCount;
+					double savedMs = 0.0;
+					const std::string preUploadedName = info->subimage_uploader.Take(context, i, selectedSubImage, savedMs);
+					if (!preUploadedName.empty()) {
+						print(("use pre-posted subimage[" + std::to_string(i) + "]: " + preUploadedName).c_str());
+						subImageUploadFileNames[i] = preUploadedName;
+						++preUploadedCount;
+						preUploadSavedMs += savedMs;
+						continue;
+					}
+					const std::string uploadFileName = kSubImageUploadPrefixes[i] + datetimenow + ".png";
+					const std::string localPath = SubImagePath(selectedSubImage);
+					const std::string responseFile = context.Path("temp_json_presubimage_res_" + std::to_string(i) + ".json");
+					print(("pre-post subimage[" + std::to_string(i) + "]: " + localPath).c_str());
+					http_post_image_to_file(context, url, localPath, uploadFileName, responseFile);
+					subImageUploadFileNames[i] = uploadFileName;
+				} else {
+					subImageUploadFileNames[i] = "empty.png";
+					print(("skip pre-post subimage[" + std::to_string(i) + "]: " + kNoImageDisplayName).c_str());
+				}
+			}
+			return true;
+		});
+		if (run.Result() == FilterPlugIn::Run::Results::Restart) continue;
+		if (run.Result() == FilterPlugIn::Run::Results::Exit) break;
+		if (selectedCount > 0) print("Speculative sub-image uploads: %d/%d used, %.0f ms saved", preUploadedCount, selectedCount, preUploadSavedMs);
+		// Restart 毎の入力の扱いと、ここまで（ワークフローの置換と /prompt の直前）の時間
+		std::string inputPath = "captured, encoded and uploaded";
+		if (reuseVariants) inputPath = "not needed (reusing variants)";
+		else if (resultCacheHit) inputPath = "not uploaded (result cache hit)";
+		else if (reuseInput) inputPath = "reused upload " + reusedInput.name + " (no capture, encode or upload)";
+		else if (tiled) inputPath = "captured for tiling";
+		print("Iteration %d: input %s, %lld ms to template rendering", iteration, inputPath.c_str(),
+			static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - iterationStart).count()));
+
+		// 生成
+		// 2. 読み込んだJSON文字列内のサブ画像のマーカーを置換する（プロンプトと数値はアップロード前に置換済み）
 		for (size_t i = 0; i < kSubImageDropdownCount; ++i) {
 			prompt_modified = replace_all(prompt_modified, kSubImageMarkers[i], subImageUploadFileNames[i]);
 		}
 		#if defined(__APPLE__)
 		prompt_modified = NormalizeFilenamePrefixSeparatorsForMac(prompt_modified);
 		#endif
+		// シードはバリエーション毎に置換する（タイル分割時は全タイルで同じシードを使う）
+		if (tiled) prompt_modified = replace_all(prompt_modified, MARKER_SEED, std::to_string(RandomSeed()));
+		if (variantCount > 1 && prompt_modified.find(MARKER_SEED) == std::string::npos) print("Warning: the template has no %s marker; all variants may be identical.", MARKER_SEED.c_str());
+		// 入力画像のマーカーは最後に置換する（タイル分割時はタイル毎に置換する）
+		auto renderPrompt = [&](const std::string& uploadedInputName) {
+			print("Replace input image path");
+			return replace_all(prompt_modified, MARKER_INPUT_IMAGE, uploadedInputName);
+		};
 		
 		print("Replace finished.");
 
-		// 3. 変更したワークフローをキューに送信
-		std::string temp_image_path = queue_prompt(prompt_modified);
-
-		if (temp_image_path == "") {
-    		print("Generate error.");
-			return false;
-		} 
+		// 書き戻し先のブロックは行毎に処理し、行を書き終える毎に更新を通知する
+		auto destRects = offscreenDestination.GetBlockRects(outputAreaRect);
+		const auto destRows = GroupBlockRows(destRects);
+
+		ImageBuffer outputImageBuffer(info->buffer_pool);
+		ResultBandReader bandReader(info->buffer_pool);
+		bool streamResult = false;
+		// 結果を読み込めなかった、または途中の行をデコードできなかった（書き戻しを最後まで終えていない）
+		bool writeBackFailed = false;
+		std::chrono::steady_clock::time_point resultReady;
+		if (tiled) {
+			if (!GenerateTiled(run, context, *info, inputImageBuffer, inputImageFileName, renderPrompt, outputImageBuffer)) {
+				if (run.Result() == FilterPlugIn::Run::Results::Restart) continue;
+				if (run.Result() == FilterPlugIn::Run::Results::Exit) break;
+				print("Generate error.");
+				return false;
+			}
+			outputImageBuffer.rect = inputAreaRect;
+			print("Output to layer.");
+		} else if (sweep) {
+			// 3. 全ての組み合わせを一度にキューに積んで並行して受け取り、一覧画像にして書き戻す
+			// シードは全てのセルで同じにして、数値の違いだけを比べられるようにする
+			variantKey.clear();
+			const auto seed = std::to_string(RandomSeed());
+			std::vector<std::string> prompts;
+			for (const auto& cell : sweepCells) {
+				std::string cellPrompt = replace_all(renderPrompt(inputUploadName), MARKER_SEED, seed);
+				for (size_t n = 0; n < kNumberParameterCount; ++n) cellPrompt = replace_all(cellPrompt, kNumberMarkers[n], NumberToJson(cell[n]));
+				prompts.push_back(cellPrompt);
+			}
+			print("Sweep: %d combinations (seed %s)", static_cast<int>(prompts.size()), seed.c_str());
+			const auto sheetRect = FilterPlugIn::intersectRects(outputAreaRect, inputAreaRect);
+			const bool generated = RunInBackground(run, context, [&] {
+				std::vector<std::string> cellPaths;
+				std::vector<double> readyMs;
+				if (!SubmitAndDownload(context, prompts, "temp_img_res_s", cellPaths, readyMs)) return false;
+				if (std::all_of(cellPaths.begin(), cellPaths.end(), [](const std::string& path) { return path.empty(); })) return false;
+				return BuildContactSheet(context, cellPaths, sweepLabels, readyMs, sweepColumns, width, height, sheetRect, info->buffer_pool, outputImageBuffer);
+			}, true);
+			if (run.Result() == FilterPlugIn::Run::Results::Restart) continue;
+			if (run.Result() == FilterPlugIn::Run::Results::Exit) break;
+			if (!generated) {
+				print("Generate error.");
+				return false;
+			}
+			// 一覧画像はレイヤーに書き戻すほか、元の大きさでファイルにも保存する
+			BufferPool::StageScope stage("encode");
+			BufferPool::Buffer rgba;
+			std::string errorMessage;
+			const std::string sheetPath = g_BasePath + "sweep_" + datetimenow + ".png";
+			if (!CopyImageToRgba(outputImageBuffer, info->buffer_pool, rgba)) print("The contact sheet could not be saved because the RGBA buffer could not be allocated.");
+			else if (!ComvertImage::WriteRgbaPng(sheetPath, rgba.data(), outputImageBuffer.get_width(), outputImageBuffer.get_height(), &errorMessage)) LogImageConversionFailure("contact sheet PNG creation", errorMessage);
+			else print(("Contact sheet saved: " + sheetPath).c_str());
+			resultReady = std::chrono::steady_clock::now();
+			print("Output to layer.");
+		} else {
+			std::string temp_image_path;
+			if (preview) {
+				// 3. プレビューは1枚だけ生成し、ComfyUI が非可逆に変換した画像を受け取ってダウンロード量を減らす
+				// 生成中に新しいプロパティの変更で古くなった場合は、サーバーでも取り消して GPU を次のプレビューに回す
+				variantKey.clear();
+				std::string previewPromptId;
+				RunInBackground(run, context, [&] {
+					previewPromptId = submit_prompt(context, replace_all(renderPrompt(inputUploadName), MARKER_SEED, std::to_string(previewSeed)));
+					temp_image_path = wait_for_image(context, previewPromptId, context.Path("temp_img_preview.jpg"), kPreviewFormat);
+					return !temp_image_path.empty();
+				}, true);
+				if (run.Result() != FilterPlugIn::Run::Results::Continue) cancel_prompt(context, previewPromptId);
+				if (run.Result() == FilterPlugIn::Run::Results::Restart) continue;
+				if (run.Result() == FilterPlugIn::Run::Results::Exit) break;
+
+				if (temp_image_path.empty()) {
+					print("Generate error.");
+					return false;
+				}
+			} else if (resultCacheHit) {
+				variantKey.clear();
+				temp_image_path = cachedResultPath;
+				print(("Show cached result: " + cachedResultPath).c_str());
+			} else {
+				// 3. 変更したワークフローをバリエーションの数だけキューに送信（生成を待つ間はポーリング回数を進捗として表示する）
+				if (!reuseVariants) {
+					variantKey.clear();
+					RunInBackground(run, context, [&] {
+						return GenerateVariants(context, variantCount, [&](unsigned long long seed) { return replace_all(renderPrompt(inputUploadName), MARKER_SEED, std::to_string(seed)); }, variantPaths, variantSeeds);
+					}, true);
+					if (run.Result() == FilterPlugIn::Run::Results::Restart) continue;
+					if (run.Result() == FilterPlugIn::Run::Results::Exit) break;
+
+					if (variantPaths.empty()) {
+						print("Generate error.");
+						return false;
+					}
+					variantKey = generationKey;
+					if (!resultCacheKey.empty() && !info->result_cache.Store(resultCacheKey, variantPaths[0])) print("Failed to store the result in the result cache.");
+				}
+				const size_t shownVariant = static_cast<size_t>(std::clamp(info->variant_index, 1, kMaxVariantCount) - 1) % variantPaths.size();
+				temp_image_path = variantPaths[shownVariant];
+				print("Show variant %d/%d (seed %llu)%s", static_cast<int>(shownVariant + 1), static_cast<int>(variantPaths.size()), variantSeeds[shownVariant],
+					reuseVariants ? ", reused without regenerating" : "");
+			}
 
-		if (!call_png_to_bmp()) {
-			print("Aborting process because PNG to BMP conversion failed.");
-			return false;
+			print("Output to layer.");
+			resultReady = std::chrono::steady_clock::now();
+
+			// 書き戻すのは選択範囲だけなので、その範囲だけをデコードする（マスクモードで大きなページの一部を描き直す場合など）
+			// サイズが入力と同じなら、ブロック行毎にデコードしながら書き戻し、次の行のデコードを書き戻しと並行して行う
+			const auto neededRect = FilterPlugIn::intersectRects(outputAreaRect, inputAreaRect);
+			std::vector<FilterPlugIn::Rect> bands;
+			for (const auto& row : destRows) {
+				FilterPlugIn::Rect band = { neededRect.left, destRects[row.first].top, neededRect.right, destRects[row.first].bottom };
+				for (size_t i = row.first; i < row.second; ++i) band.bottom = std::max(band.bottom, destRects[i].bottom);
+				bands.push_back(FilterPlugIn::intersectRects(band, neededRect));
+			}
+			if (!g_UsePythonImageConversion && !FilterPlugIn::isRectEmpty(neededRect)) {
+				streamResult = bandReader.Start(temp_image_path, inputAreaRect, std::move(bands));
+				if (!streamResult) print("Band decode unavailable (%s); decoding the whole result.", bandReader.Error().c_str());
+			}
+			if (!streamResult && !RunInBackground(run, context, [&] { return LoadGeneratedImage(context, temp_image_path, inputAreaRect, neededRect, info->buffer_pool, outputImageBuffer); })) {
+				if (run.Result() == FilterPlugIn::Run::Results::Restart) continue;
+				if (run.Result() == FilterPlugIn::Run::Results::Exit) break;
+				print("Failed to load the generated image.");
+				context.CountError("decode");
+				writeBackFailed = true;
+			}
 		}
 
-		print("Output to layer.");
-
-		ImageBuffer outputImageBuffer;
-		load_bmp_rgb_to_buffer(g_BasePath + "temp_img_res.bmp", outputImageBuffer);
-		outputBlock = read24BitBmpBlock(g_BasePath + "temp_img_res.bmp");
-        if (!outputBlock.address) print("address is error");
-
-		outputImageBuffer.rect.top = offsetY;
-		outputImageBuffer.rect.left = offsetX;
-		outputImageBuffer.rect.bottom = offsetY + outputImageBuffer.get_height();
-		outputImageBuffer.rect.right = offsetX + outputImageBuffer.get_width();
-
 		print("start transfer");
 
 		// ブロック転送は常に選択範囲の外接矩形へ反映する。アウトペイント時も入力だけはレイヤー全体である。
-		auto destRects = offscreenDestination.GetBlockRects(outputAreaRect);
-		for (const auto& rect : destRects) {
-			if (run.Process(FilterPlugIn::Run::States::Continue) != FilterPlugIn::Run::Results::Continue) break;
-			FilterPlugIn::Block imageBlock = offscreenDestination.GetBlockImage(rect);
-			FilterPlugIn::Block alphaBlock = offscreenDestination.GetBlockAlpha(rect);
-			// 			if (info->outpaint_transparent_area) TransferForOutpaint(imageBlock, outputImageBuffer, alphaBlock); // Temporarily disabled.
-			Transfer(imageBlock, outputImageBuffer, alphaBlock);
-			run.UpdateRect(rect);
-		}
-		print("end transfer");
+		// 全透明のブロックは画像を取得せず、更新通知もしない。
+		// 入力から変化していないタイル（編集モデルで背景がそのまま残った部分など）も書き戻さない。
+		const bool detectChanges = g_ChangeThreshold >= 0;
+		const auto transferStart = std::chrono::steady_clock::now();
+		std::chrono::steady_clock::time_point firstUpdate{};
+		std::array<int, 3> coverageCounts{};
+		int unchangedTiles = 0;
+		int dirtyCount = 0;
+		int updateCount = 0;
+		bool cancelled = false;
+		for (const auto& row : destRows) {
+			if (streamResult && !bandReader.Next(outputImageBuffer)) { print("Failed to decode the generated image: %s", bandReader.Error().c_str()); context.CountError("decode"); writeBackFailed = true; break; }
+			std::vector<FilterPlugIn::Rect> dirtyRects;
+			for (size_t index = row.first; index < row.second; ++index) {
+				const auto& rect = destRects[index];
+				if (run.Process(FilterPlugIn::Run::States::Continue) != FilterPlugIn::Run::Results::Continue) { cancelled = true; break; }
+				// 切り詰めた入力ではブロックの一部だけを書き戻すことがあるので、転送時にオフセットを計算させる
+				FilterPlugIn::Block alphaBlock = offscreenDestination.GetBlockAlpha(rect);
+				alphaBlock.needOffset = true;
+				const auto coverage = ClassifyAlpha(alphaBlock, FilterPlugIn::intersectRects(rect, outputImageBuffer.rect));
+				++coverageCounts[static_cast<size_t>(coverage)];
+				if (coverage == AlphaCoverage::Transparent) continue;
+				const uint64_t tileKey = BlockKey(rect);
+				const bool written = writtenTiles.count(tileKey) != 0;
+				if (detectChanges && !written && !TileChanged(offscreenSource, outputImageBuffer, rect, g_ChangeThreshold)) {
+					++unchangedTiles;
+					continue;
+				}
+				FilterPlugIn::Block imageBlock = offscreenDestination.GetBlockImage(rect);
+				imageBlock.needOffset = true;
+				// 			if (info->outpaint_transparent_area) TransferForOutpaint(imageBlock, outputImageBuffer, alphaBlock); // Temporarily disabled.
+				Transfer(imageBlock, outputImageBuffer, alphaBlock, coverage);
+				dirtyRects.push_back(rect);
+				if (!written) writtenTiles.insert(tileKey);
+			}
+			// 行を書き終えたらすぐに通知し、残りの行のデコード中にも結果が見えるようにする
+			const auto updateRects = CoalesceRects(dirtyRects);
+			for (const auto& rect : updateRects) run.UpdateRect(rect);
+			if (!updateRects.empty() && updateCount == 0) firstUpdate = std::chrono::steady_clock::now();
+			dirtyCount += static_cast<int>(dirtyRects.size());
+			updateCount += static_cast<int>(updateRects.size());
+			if (cancelled) break;
+		}
+		bandReader.Stop();
+		const auto transferEnd = std::chrono::steady_clock::now();
+		const auto transferMs = std::chrono::duration_cast<std::chrono::milliseconds>(transferEnd - transferStart).count();
+		context.trace.AddSpan("write back", "stage", transferStart, transferEnd, "\"blocks\":" + std::to_string(destRects.size()) + ",\"written\":" + std::to_string(dirtyCount)
+			+ (streamResult ? ",\"band_decode\":1" : ""));
+		print("end transfer: %d blocks in %d rows (transparent %d, opaque %d, mixed %d, unchanged %d), %d written in %d update rects, %lld ms%s",
+			static_cast<int>(destRects.size()), static_cast<int>(destRows.size()), coverageCounts[static_cast<size_t>(AlphaCoverage::Transparent)],
+			coverageCounts[static_cast<size_t>(AlphaCoverage::Opaque)], coverageCounts[static_cast<size_t>(AlphaCoverage::Mixed)],
+			unchangedTiles, dirtyCount, updateCount, static_cast<long long>(transferMs), streamResult ? " (band decode)" : "");
+		if (resultReady != std::chrono::steady_clock::time_point{}) {
+			// 生成結果を受け取ってから、最初の行が見えるまでと全体を書き終えるまで
+			print("result to first visible pixels %lld ms, to completion %lld ms",
+				updateCount > 0 ? static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(firstUpdate - resultReady).count()) : -1LL,
+				static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(transferEnd - resultReady).count()));
+		}
+		const auto poolStats = info->buffer_pool.GetStatistics();
+		print("buffer pool: %d hits, %d misses, acquire %.1f ms, peak %.1f MB, cached %.1f MB, mapped %.1f MB (peak %.1f MB)",
+			static_cast<int>(poolStats.hits), static_cast<int>(poolStats.misses), poolStats.acquireMilliseconds,
+			poolStats.peakBytes / 1048576.0, poolStats.cachedBytes / 1048576.0, poolStats.mappedBytes / 1048576.0, poolStats.peakMappedBytes / 1048576.0);
+		// 段階毎の確保（この実行で借りた合計と、同時に持っていた最大値）。統計にはピークの最大値を残す
+		std::string stageUsage;
+		for (const auto& stage : info->buffer_pool.GetStageStatistics()) {
+			char text[160];
+			std::snprintf(text, sizeof(text), "%s%s peak %.1f MB, %.1f MB in %d", stageUsage.empty() ? "" : "; ", stage.stage,
+				stage.peakBytes / 1048576.0, stage.totalBytes / 1048576.0, static_cast<int>(stage.acquisitions));
+			stageUsage += text;
+			info->metrics.Add("comfyui_plugin_buffer_acquired_bytes_total", { { "stage", stage.stage } }, static_cast<double>(stage.totalBytes));
+			info->metrics.Add("comfyui_plugin_buffer_acquisitions_total", { { "stage", stage.stage } }, static_cast<double>(stage.acquisitions));
+			info->metrics.SetMax("comfyui_plugin_buffer_peak_bytes", { { "stage", stage.stage } }, static_cast<double>(stage.peakBytes));
+		}
+		info->metrics.SetMax("comfyui_plugin_buffer_peak_bytes", { { "stage", "all" } }, static_cast<double>(poolStats.peakInUseBytes));
+		iterationSpan.Arg("buffer_peak_bytes", static_cast<long long>(poolStats.peakInUseBytes));
+		print("buffer pool by stage: peak in use %.1f MB%s%s", poolStats.peakInUseBytes / 1048576.0, stageUsage.empty() ? "" : ": ", stageUsage.c_str());
+		print("Iteration %d: %lld ms in total%s", iteration,
+			static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - iterationStart).count()), reuseInput ? " (input reused)" : "");
+		if (!cancelled && !writeBackFailed) {
+			// 書き戻しを終えた実行だけを数える（途中で Restart された実行や、結果を読み込めなかった実行の時間は分布に混ぜない）
+			context.ObserveStage("write_back", std::chrono::duration<double>(transferEnd - transferStart).count());
+			context.ObserveStage("end_to_end", std::chrono::duration<double>(std::chrono::steady_clock::now() - iterationStart).count());
+			if (context.metrics) context.metrics->Add("comfyui_plugin_runs_total", { { "template", context.template_name }, { "server", context.server_address } });
+		}
 		if (run.Result() == FilterPlugIn::Run::Results::Restart) continue;
 		if (run.Result() == FilterPlugIn::Run::Results::Exit) break;
 
 		// 継続確認
-		if (run.Process(FilterPlugIn::Run::States::End) != FilterPlugIn::Run::Results::Restart) break;
+		if (run.Process(FilterPlugIn::Run::States::End) != FilterPlugIn::Run::Results::Restart) {
+			if (!preview) break;
+			print("Fast preview was on at the end; generating the full-resolution result.");
+			fullResolutionPass = true;
+		}
 	}
 
 	return true;
@@ -2003,11 +3650,130 @@ void Transfer(const ImageBuffer& dst, const FilterPlugIn::Block& src, int offset
 }
 
 
+/// @brief アルファ行を走査し、透明/不透明が切り替わる位置を返す
+/// @param row アルファ行の先頭
+/// @param x 走査開始位置
+/// @param cols 行のピクセル数
+/// @param pixelBytes アルファ1ピクセルのバイト数
+/// @param opaque trueなら不透明の区間を、falseなら透明の区間を読み飛ばす
+/// @return 区間が終わった位置（行末まで続く場合はcols）
+/// @note 1バイト/ピクセルのアルファは16ピクセル単位でまとめて判定する
+static int ScanAlphaRun(const unsigned char* row, int x, int cols, int pixelBytes, bool opaque) {
+	if (pixelBytes == 1) {
+#if defined(COMFYUI_USE_SSE2)
+		const __m128i zero = _mm_setzero_si128();
+		for (; x + 16 <= cols; x += 16) {
+			const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x));
+			const unsigned zeroMask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+			const unsigned stopMask = opaque ? zeroMask : (~zeroMask & 0xFFFFu);
+			if (stopMask) return x + std::countr_zero(stopMask);
+		}
+#elif defined(COMFYUI_USE_NEON)
+		for (; x + 16 <= cols; x += 16) {
+			const auto v = vld1q_u8(row + x);
+			if (opaque ? vminvq_u8(v) == 0 : vmaxvq_u8(v) != 0) break;
+		}
+#else
+		constexpr uint64_t kLow = 0x0101010101010101ull;
+		constexpr uint64_t kHigh = 0x8080808080808080ull;
+		for (; x + 8 <= cols; x += 8) {
+			uint64_t v; std::memcpy(&v, row + x, sizeof(v));
+			const bool hasZero = ((v - kLow) & ~v & kHigh) != 0;
+			if (opaque ? hasZero : v != 0) break;
+		}
+#endif
+	}
+	for (; x < cols; ++x) {
+		if ((row[static_cast<size_t>(x) * pixelBytes] > 0) != opaque) return x;
+	}
+	return cols;
+}
+
+/// @brief 書き戻し範囲のアルファを分類する
+/// @param alpha 転送先のアルファチャンネル
+/// @param rect 判定する矩形（alphaのブロック内）
+/// @return 全透明/全不透明/混在
+AlphaCoverage ClassifyAlpha(const FilterPlugIn::Block& alpha, const FilterPlugIn::Rect& rect) {
+	if (FilterPlugIn::isRectEmpty(rect)) return AlphaCoverage::Transparent;
+	const int cols = rect.right - rect.left;
+	const int rows = rect.bottom - rect.top;
+	const int pixelBytes = alpha.pixelBytes;
+	bool hasTransparent = false, hasOpaque = false;
+	pbyte_t pAlpRow = static_cast<pbyte_t>(alpha.address) + FilterPlugIn::addressOffset(alpha, rect);
+	for (int y = 0; y < rows; ++y) {
+		// 行頭の値で、どちらの区間が行末まで続くかを調べれば足りる
+		if (*pAlpRow > 0) {
+			hasOpaque = true;
+			if (ScanAlphaRun(pAlpRow, 0, cols, pixelBytes, true) < cols) hasTransparent = true;
+		} else {
+			hasTransparent = true;
+			if (ScanAlphaRun(pAlpRow, 0, cols, pixelBytes, false) < cols) hasOpaque = true;
+		}
+		if (hasTransparent && hasOpaque) return AlphaCoverage::Mixed;
+		pAlpRow += alpha.rowBytes;
+	}
+	return hasOpaque ? AlphaCoverage::Opaque : AlphaCoverage::Transparent;
+}
+
+/// @brief area 内でアルファが 0 でない画素を囲む最小の矩形を求める
+/// @param offscreen アルファを調べるオフスクリーン
+/// @param bounds 見つかった矩形
+/// @return 不透明な画素が無ければfalse
+/// @note 透明な区間は ScanAlphaRun でまとめて読み飛ばす。右端は現在の範囲より外側だけを後ろから調べる。
+bool FindOpaqueBounds(FilterPlugIn::Offscreen& offscreen, const FilterPlugIn::Rect& area, FilterPlugIn::Rect& bounds) {
+	bool found = false;
+	for (const auto& blockRect : offscreen.GetBlockRects(area)) {
+		const auto rect = FilterPlugIn::intersectRects(blockRect, area);
+		if (FilterPlugIn::isRectEmpty(rect)) continue;
+		// 既に範囲に含まれているブロックは調べなくてよい
+		if (found && rect.left >= bounds.left && rect.right <= bounds.right && rect.top >= bounds.top && rect.bottom <= bounds.bottom) continue;
+		FilterPlugIn::Block alpha = offscreen.GetBlockAlpha(blockRect);
+		if (!alpha.address) continue;
+		alpha.needOffset = true;
+		const int cols = rect.right - rect.left;
+		const int rows = rect.bottom - rect.top;
+		const int pixelBytes = alpha.pixelBytes;
+		pbyte_t pAlpRow = static_cast<pbyte_t>(alpha.address) + FilterPlugIn::addressOffset(alpha, rect);
+		for (int y = 0; y < rows; ++y, pAlpRow += alpha.rowBytes) {
+			const int first = ScanAlphaRun(pAlpRow, 0, cols, pixelBytes, false);
+			if (first == cols) continue;
+			int last = cols - 1;
+			const int knownRight = found ? std::max(static_cast<int>(bounds.right - rect.left), first + 1) : first + 1;
+			while (last >= knownRight && pAlpRow[static_cast<size_t>(last) * pixelBytes] == 0) --last;
+			const FilterPlugIn::Rect rowBounds = { rect.left + first, rect.top + y, rect.left + std::max(last + 1, first + 1), rect.top + y + 1 };
+			if (!found) {
+				bounds = rowBounds;
+				found = true;
+			} else {
+				bounds.left = std::min(bounds.left, rowBounds.left);
+				bounds.top = std::min(bounds.top, rowBounds.top);
+				bounds.right = std::max(bounds.right, rowBounds.right);
+				bounds.bottom = std::max(bounds.bottom, rowBounds.bottom);
+			}
+		}
+	}
+	return found;
+}
+
+/// @brief RGBの連続区間を転送先の画素配置でコピーする
+static void CopyRgbSpan(pbyte_t pDst, FilterPlugIn::Int dstPixelBytes, FilterPlugIn::Int dstR, FilterPlugIn::Int dstG, FilterPlugIn::Int dstB, const unsigned char* pSrc, int count) {
+	for (int x = 0; x < count; ++x) {
+		pDst[dstR] = pSrc[0];
+		pDst[dstG] = pSrc[1];
+		pDst[dstB] = pSrc[2];
+		pSrc += 3;
+		pDst += dstPixelBytes;
+	}
+}
+
 /// @brief ブロック転送（アルファ付き）
 /// @param dst 転送先のブロック
 /// @param src 転送元のブロック
 /// @param alpha 転送先のアルファチャンネル
-void Transfer(const FilterPlugIn::Block& dst, const ImageBuffer& src, const FilterPlugIn::Block& alpha) {
+/// @param coverage ClassifyAlpha で求めたアルファの分類
+/// @note 透明(アルファ0)のピクセルには書き込まない。不透明な区間は範囲チェックなしでまとめてコピーする。
+void Transfer(const FilterPlugIn::Block& dst, const ImageBuffer& src, const FilterPlugIn::Block& alpha, AlphaCoverage coverage) {
+	if (coverage == AlphaCoverage::Transparent) return;
 	const auto rect = FilterPlugIn::intersectRects(dst.rect, src.rect);
 	if (FilterPlugIn::isRectEmpty(rect)) return;
 
@@ -2015,48 +3781,39 @@ void Transfer(const FilterPlugIn::Block& dst, const ImageBuffer& src, const Filt
 	const auto dstPixelBytes = dst.pixelBytes;
 	const auto dstR = dst.r, dstG = dst.g, dstB = dst.b;
 
-	// const auto srcRowBytes = src.rowBytes;
-	// const auto srcPixelBytes = src.pixelBytes;
-	// const auto srcR = src.r, srcG = src.g, srcB = src.b;
-
 	const auto alpRowBytes = alpha.rowBytes;
 	const auto alpPixelBytes = alpha.pixelBytes;
 
 	const auto cols = rect.right - rect.left;
 	const auto rows = rect.bottom - rect.top;
+	const int sourceX = rect.left - src.rect.left;
+	const int sourceY = rect.top - src.rect.top;
 	pbyte_t pDstRow = static_cast<pbyte_t>(dst.address) + FilterPlugIn::addressOffset(dst, rect);
-	//pbyte_t pSrcRow = static_cast<pbyte_t>(src.address) + addressOffset(src, rect);
 	pbyte_t pAlpRow = static_cast<pbyte_t>(alpha.address) + FilterPlugIn::addressOffset(alpha, rect);
 	for (int y = 0; y < rows; ++y) {
-		//pbyte_t pSrc = pSrcRow;
-		pbyte_t pDst = pDstRow;
-		pbyte_t pAlp = pAlpRow;
-		for (int x = 0; x < cols; ++x) {
-			//print(std::to_string(x).c_str());
-			//print(std::to_string(y).c_str());
-			if (*pAlp > 0) {
-				//if (pDst[dstR] != NULL) print("pDst[dstR]");
-				//if (pSrc[srcR] != NULL) print("pSrc[srcR]");
-				//print("pAlp");
-				// print((const char*)src.get_pixel_value(x, y, 2));
-				// print((const char*)src.get_pixel_value(x, y, 1));
-				// print((const char*)src.get_pixel_value(x, y, 0));
-				const int sourceX = x + rect.left - src.rect.left;
-				const int sourceY = y + rect.top - src.rect.top;
-				pDst[dstR] = src.get_pixel_value(sourceX, sourceY, 0);
-				pDst[dstG] = src.get_pixel_value(sourceX, sourceY, 1);
-				pDst[dstB] = src.get_pixel_value(sourceX, sourceY, 2);
+		const unsigned char* pSrcRow = src.get_pixel_pointer(sourceX, sourceY + y);
+		if (coverage == AlphaCoverage::Opaque) {
+			CopyRgbSpan(pDstRow, dstPixelBytes, dstR, dstG, dstB, pSrcRow, cols);
+		} else {
+			for (int x = ScanAlphaRun(pAlpRow, 0, cols, alpPixelBytes, false); x < cols;) {
+				const int end = ScanAlphaRun(pAlpRow, x, cols, alpPixelBytes, true);
+				CopyRgbSpan(pDstRow + static_cast<size_t>(x) * dstPixelBytes, dstPixelBytes, dstR, dstG, dstB, pSrcRow + static_cast<size_t>(x) * 3, end - x);
+				x = ScanAlphaRun(pAlpRow, end, cols, alpPixelBytes, false);
 			}
-			//pSrc += srcPixelBytes;
-			pDst += dstPixelBytes;
-			pAlp += alpPixelBytes;
 		}
-		//pSrcRow += srcRowBytes;
 		pDstRow += dstRowBytes;
 		pAlpRow += alpRowBytes;
 	}
 }
 
+/// @brief ブロック転送（アルファ付き）
+/// @param dst 転送先のブロック
+/// @param src 転送元のブロック
+/// @param alpha 転送先のアルファチャンネル
+void Transfer(const FilterPlugIn::Block& dst, const ImageBuffer& src, const FilterPlugIn::Block& alpha) {
+	Transfer(dst, src, alpha, ClassifyAlpha(alpha, FilterPlugIn::intersectRects(dst.rect, src.rect)));
+}
+
 
 #if 0 // Temporarily disabled outpaint write-back implementation.
 // アウトペイント結果は、元レイヤーで透明だったピクセルにも書き込み、アルファを不透明にする。
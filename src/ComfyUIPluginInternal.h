@@ -0,0 +1,410 @@
+/**
+ * @file ComfyUIPluginInternal.h
+ * @brief ComfyUIPlugin.cpp の内部の型と関数の宣言
+ * @note プラグインのエントリーポイントは ComfyUIPlugin.h を使う。これは forLinux のベンチマーク・テストが
+ *       ComfyUIPlugin.cpp をリンクして、画像の転送・変換や実行の状態を直接呼ぶためのもの。
+ */
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "BufferPool.h"
+#include "FilterPlugIn.h"
+#include "Metrics.h"
+#include "ResultCache.h"
+#include "Trace.h"
+
+using ComfyUIPlugin::BufferPool;
+using ComfyUIPlugin::Metrics;
+using ComfyUIPlugin::ResultCache;
+using ComfyUIPlugin::Trace;
+
+// 置換対象のマーカー 入力画像
+const std::string MARKER_INPUT_IMAGE = "temp_img_req_yyyyMMddhhmmss.png"; 
+
+// constexpr size_t kSubImageDropdownCount = 3;
+// const std::array<std::string, kSubImageDropdownCount> kSubImageMarkers = {
+// 	"temp_subimg_req_yyyyMMddhhmmss.png",
+// 	"temp_subimg2_req_yyyyMMddhhmmss.png",
+// 	"temp_subimg3_req_yyyyMMddhhmmss.png"
+// };
+// const std::array<std::string, kSubImageDropdownCount> kSubImageUploadPrefixes = {
+// 	"temp_subimg_req_",
+// 	"temp_subimg2_req_",
+// 	"temp_subimg3_req_"
+// };
+
+constexpr size_t kSubImageDropdownCount = 7;
+const std::array<std::string, kSubImageDropdownCount> kSubImageMarkers = {
+	"temp_subimg_req_yyyyMMddhhmmss.png",
+	"temp_subimg2_req_yyyyMMddhhmmss.png",
+	"temp_subimg3_req_yyyyMMddhhmmss.png",
+	"temp_subimg4_req_yyyyMMddhhmmss.png",
+	"temp_subimg5_req_yyyyMMddhhmmss.png",
+	"temp_subimg6_req_yyyyMMddhhmmss.png",
+	"temp_subimg7_req_yyyyMMddhhmmss.png"
+};
+const std::array<std::string, kSubImageDropdownCount> kSubImageUploadPrefixes = {
+	"temp_subimg_req_",
+	"temp_subimg2_req_",
+	"temp_subimg3_req_",
+	"temp_subimg4_req_",
+	"temp_subimg5_req_",
+	"temp_subimg6_req_",
+	"temp_subimg7_req_"
+};
+
+// 置換対象のマーカー プロンプト
+const std::string MARKER_PROMPT = "###input1###"; 
+const std::string MARKER_NPROMPT = "###input2###"; 
+const std::array<std::string, 3> kNumberMarkers = {
+	"###num1###",
+	"###num2###",
+	"###num3###",
+};
+
+constexpr size_t kNumberParameterCount = kNumberMarkers.size();
+constexpr std::array<double, kNumberParameterCount> kDefaultNumberMinimums = { 0.0, 0.0, 0.0 };
+constexpr std::array<double, kNumberParameterCount> kDefaultNumberMaximums = { 10.0, 1.0, 1.0 };
+constexpr std::array<double, kNumberParameterCount> kDefaultNumberValues = { 1.0, 0.75, 0.0 };
+
+// 置換対象のマーカー シード（バリエーション毎に別の値にする）
+const std::string MARKER_SEED = "###seed###";
+/// 一度に生成するバリエーションの最大数
+constexpr int kMaxVariantCount = 8;
+/// スイープで一度に生成する組み合わせの最大数
+constexpr int kMaxSweepCells = 64;
+
+/// このDLLのベースパス
+extern std::string g_BasePath;
+
+/// @brief 1回のフィルタ実行（またはサブ画像の先行アップロード）が使うサーバーと作業フォルダー、キャンセルの状態
+/// @note 一時ファイルは全て workspace に作る。実行毎に別のフォルダーにするので、標準と Nano Banana のフィルタが
+///       同じプラグインフォルダーにあっても、先行アップロードと実行が重なっても、同じファイルを書き合わない。
+struct RunContext {
+	/// ComfyUI サーバー
+	std::string server_address;
+	/// 一時ファイルを置くフォルダー（末尾に区切り文字を付ける）
+	std::string workspace;
+	/// trueにすると、実行中の curl を終了し、ポーリングの待機を打ち切る（ホストから Restart / Exit が返った時）
+	std::atomic<bool> cancel_requested{ false };
+	/// wait_for_image がポーリングした回数（進捗表示用）
+	std::atomic<int> wait_polls{ 0 };
+	/// 各段階の時間の記録（HTTP の呼び出しなど context を const で受け取る関数からも記録する）
+	mutable Trace trace;
+	/// セッションをまたいで積算する統計（null なら記録しない）と、その系列に付けるテンプレート名（UTF-8）
+	Metrics* metrics = nullptr;
+	std::string template_name;
+
+	/// 作業フォルダー内のファイルのパス
+	std::string Path(const std::string& fileName) const { return workspace + fileName; }
+
+	/// 段階の時間を統計に記録する
+	void ObserveStage(const char* stage, double seconds) const {
+		if (metrics) metrics->ObserveStage(stage, template_name, server_address, seconds);
+	}
+	/// 統計のカウンターに加える（サーバー毎）
+	void Count(const char* name, double value = 1.0) const {
+		if (metrics) metrics->Add(name, { { "server", server_address } }, value);
+	}
+	/// 失敗を種類（submit / execution / timeout / download / decode）毎に数える
+	void CountError(const char* kind) const {
+		if (metrics) metrics->Add("comfyui_plugin_errors_total", { { "kind", kind }, { "server", server_address } });
+	}
+
+	/// submit_prompt でキューに積んだ時刻を覚えておく（キュー待ちの時間を求めるため）
+	void MarkSubmitted(const std::string& promptId) const {
+		std::lock_guard<std::mutex> lock(submitted_mutex_);
+		submitted_epoch_ms_[promptId] = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+	/// @return キューに積んだ時刻（エポックからのミリ秒）。分からなければ -1
+	long long SubmittedEpochMilliseconds(const std::string& promptId) const {
+		std::lock_guard<std::mutex> lock(submitted_mutex_);
+		const auto it = submitted_epoch_ms_.find(promptId);
+		return it == submitted_epoch_ms_.end() ? -1 : it->second;
+	}
+
+private:
+	mutable std::mutex submitted_mutex_;
+	mutable std::map<std::string, long long> submitted_epoch_ms_;
+};
+
+// パラメーター構造体
+struct Params {
+     std::string template_workflow_filename;
+     std::array<std::string, kSubImageDropdownCount> input_subimage_filenames;
+     std::string prompt;
+     std::string negative_prompt;
+	 std::array<double, kNumberParameterCount> numbers = kDefaultNumberValues;
+	 std::array<double, kNumberParameterCount> number_minimums = kDefaultNumberMinimums;
+	 std::array<double, kNumberParameterCount> number_maximums = kDefaultNumberMaximums;
+	 std::array<double, kNumberParameterCount> number_defaults = kDefaultNumberValues;
+     int sample_steps;
+	 /// タイル分割する場合のタイルの一辺（0なら分割しない）と、隣のタイルとの重なり幅
+	 int tile_size = 0;
+	 int tile_overlap = 64;
+	 /// マスクモードで選択範囲の周囲に含める幅（負ならレイヤー全体を送る）
+	 int mask_context_margin = -1;
+	 /// モデルが扱いやすい画像サイズの倍数
+	 int size_multiple = 8;
+	 /// 送る画像の画素数の上限（メガピクセル、0なら制限しない）
+	 double max_megapixels = 0.0;
+	 /// スイープモードで num1～num3 に入れる値（空なら画面の値のまま）
+	 std::array<std::vector<double>, kNumberParameterCount> number_sweeps;
+	 /// プレビューで使うテンプレート（空なら template_workflow_filename）と、num1～num3 の値（NaNなら画面の値のまま）
+	 std::string preview_template_workflow_filename;
+	 std::array<double, kNumberParameterCount> preview_numbers{};
+	 /// falseなら生成結果のキャッシュを使わない（シードを固定しても結果が変わるテンプレート用）
+	 bool result_cache = true;
+};
+
+/// @brief ダイアログでサブ画像が選ばれた時点で、OK が押される前にバックグラウンドでアップロードしておく
+/// @note プロパティのコールバックから Request し、RunFilter で Take する。選択が変わったスロットの古いアップロードは使わない。
+///       レイヤーの画像は RunFilter の中でしかオフスクリーンを読めないため、ここでは扱わない。
+class SubImagePreUploader {
+public:
+	SubImagePreUploader() = default;
+	~SubImagePreUploader() { Stop(); }
+	SubImagePreUploader(const SubImagePreUploader&) = delete;
+	SubImagePreUploader& operator=(const SubImagePreUploader&) = delete;
+
+	/// @brief アップロード先のサーバーと、レスポンスを書き出す作業フォルダー、転送量を数える統計を設定する（Request より前に呼ぶ）
+	void Configure(const std::string& serverAddress, const std::string& workspace, Metrics* metrics);
+
+	/// @brief slot のサブ画像を fileName（SubImage フォルダー内のファイル名、空なら選択なし）にする
+	/// @note 同じファイルのアップロードが済んでいるか実行中なら何もしない
+	void Request(size_t slot, const std::string& fileName);
+
+	/// @brief slot に fileName をアップロード済みなら、サーバー上のファイル名を返す（アップロード中なら終わるまで待つ）
+	/// @param context 待っている実行（キャンセルされたら待たずに戻る）
+	/// @param savedMs 先にアップロードしておいたことで短縮できた時間
+	/// @return 使えるアップロードが無い場合は空文字列（その場でアップロードする）
+	std::string Take(const RunContext& context, size_t slot, const std::string& fileName, double& savedMs);
+
+	void Stop();
+
+private:
+	enum class State { Idle, Queued, Uploading, Done, Failed };
+	struct Slot {
+		std::string fileName;
+		State state = State::Idle;
+		unsigned generation = 0;	///< 選択が変わる毎に増やし、古いアップロードの結果を捨てる
+		std::string uploadedName;
+		double uploadMs = 0.0;
+		std::chrono::steady_clock::time_point finished;
+	};
+	void WorkerThread();
+
+	std::mutex mutex_;
+	std::condition_variable wakeup_;
+	std::condition_variable done_;
+	std::array<Slot, kSubImageDropdownCount> slots_{};
+	RunContext context_;
+	std::thread worker_;
+	bool stopping_ = false;
+};
+
+/// フィルター情報
+struct FilterInfo {
+	FilterPlugIn::Server const* server = nullptr;
+	/// 選んでいる設定のパラメーター（プロパティのコールバックと RunFilter で更新する）
+	Params params;
+	/// 設定リスト（サブウィンドウの先頭のドロップダウン）
+	std::vector<std::string> settings;
+	/// サブイメージリスト（サブウィンドウの次のドロップダウン）
+	std::vector<std::string> subimages;
+	/// ComfyUI サーバー
+	std::string server_address;
+	/// ユーザー設定ファイルの有無
+	bool has_user_setting_ini = false;
+	/// 作業フォルダーの名前の先頭（フィルタ毎に変える）
+	std::string workspace_name;
+	/// 前回の実行の作業フォルダー（デバッグ用に次の実行まで残す）と、先行アップロードの作業フォルダー
+	std::string run_workspace;
+	std::string upload_workspace;
+	int setting = -1;
+	std::array<int, kSubImageDropdownCount> subimage_indices{};
+	bool use_selection_as_mask = false;
+	// bool outpaint_transparent_area = false; // Temporarily disabled.
+	/// 一度に生成するバリエーション数と、レイヤーに表示するバリエーション（1から）
+	int variant_count = 1;
+	int variant_index = 1;
+	/// trueなら num1～num3 を *_sweep の範囲で振って一覧画像を作る
+	bool sweep = false;
+	/// trueならプレビューを縮小した入力と preview_* の設定で生成する（enable_preview の場合のみ）
+	/// ホストからはプレビューと OK を区別できず、OK でもチェックした状態の結果を確定するので、既定はオフ
+	bool fast_preview = false;
+	/// 画像バッファのプール（Restart やフィルタの再実行をまたいで再利用する）
+	BufferPool buffer_pool;
+	/// セッションをまたいで積算する統計（プラグインフォルダーの metrics_<workspace_name>.prom に保存する）。先行アップロードからも数えるので、それより先に作る
+	Metrics metrics;
+	/// ダイアログを開いている間に、選ばれたサブ画像をアップロードしておく
+	SubImagePreUploader subimage_uploader;
+	/// 同じ条件で生成済みの結果（プラグインフォルダーの ResultCache/<workspace_name> に保存する）
+	ResultCache result_cache;
+	/// 残しておく実行毎のトレース（Trace フォルダーの Chrome トレース形式の JSON）の数。0ならトレースを記録しない
+	int trace_keep_runs = 20;
+};
+
+
+class ImageBuffer {
+private:
+	int width_ = 0;
+	int height_ = 0;
+	
+	// R, G, B の順で全てのピクセルデータを連続して保持
+	BufferPool& pool_;
+	BufferPool::Buffer data_buffer_;
+	const int CHANNELS = 3; // R, G, B
+
+public:
+	explicit ImageBuffer(BufferPool& pool) : pool_(pool) {}
+
+	FilterPlugIn::Rect rect;
+
+	/// @param clear falseの場合はゼロ埋めしない（全ピクセルを上書きする場合）
+	bool allocate(int w, int h, bool clear = true) {
+		width_ = w;
+		height_ = h;
+		size_t total_bytes = static_cast<size_t>(width_) * height_ * CHANNELS;
+
+		// 全ピクセル分のバイトを一度に割り当て（プールから再利用）
+		data_buffer_ = pool_.Acquire(total_bytes, clear);
+		if (!data_buffer_) {
+			width_ = 0;
+			height_ = 0;
+			return false;
+		}
+		return true;
+	}
+
+	int get_width()  const { return width_; }
+	int get_height() const { return height_; }
+	
+	/**
+	 * @brief 指定された座標 (x, y) のピクセル値を取得します。
+	 * @param x 列インデックス (0 から width-1)
+	 * @param y 行インデックス (0 から height-1)
+	 * @param channel_offset 取得したいチャネル (R=0, G=1, B=2)
+	 * @return unsigned char ピクセル値
+	 */
+	unsigned char get_pixel_value(int x, int y, int channel_offset) const {
+		if (x < 0 || x >= width_ || y < 0 || y >= height_ || channel_offset < 0 || channel_offset >= CHANNELS) {
+			// 範囲外のアクセスはエラーまたは0を返す
+			return 0; 
+		}
+
+		// 1次元配列内のインデックスを計算
+		// (y * 幅 + x) * チャンネル数 + チャンネルオフセット
+		size_t index = (static_cast<size_t>(y) * width_ + x) * CHANNELS + channel_offset;
+		
+		return data_buffer_.data()[index];
+	}
+	
+	void set_pixel_value(int x, int y, int channel_offset, unsigned char value) const {
+		if (x < 0 || x >= width_ || y < 0 || y >= height_ || channel_offset < 0 || channel_offset >= CHANNELS) {
+			// 範囲外のアクセスはエラーまたは0を返す
+			return; 
+		}
+
+		// 1次元配列内のインデックスを計算
+		// (y * 幅 + x) * チャンネル数 + チャンネルオフセット
+		size_t index = (static_cast<size_t>(y) * width_ + x) * CHANNELS + channel_offset;
+		
+		data_buffer_.data()[index] = value;
+	}
+	
+	// データポインタを取得する（データ格納関数内で使用）
+	unsigned char* get_data_pointer() {
+		return data_buffer_.data();
+	}
+
+	/// @brief (x, y) の R を指すポインタ（範囲チェックなし。転送ループの内側で使う）
+	const unsigned char* get_pixel_pointer(int x, int y) const {
+		return data_buffer_.data() + (static_cast<size_t>(y) * width_ + x) * CHANNELS;
+	}
+	unsigned char* get_pixel_pointer(int x, int y) {
+		return data_buffer_.data() + (static_cast<size_t>(y) * width_ + x) * CHANNELS;
+	}
+
+	/// 画素データとサイズを入れ替える（rect はそのまま）
+	void swap(ImageBuffer& other) {
+		std::swap(width_, other.width_);
+		std::swap(height_, other.height_);
+		std::swap(data_buffer_, other.data_buffer_);
+		std::swap(rect, other.rect);
+	}
+};
+
+/// 書き戻し先ブロックのアルファ分類
+enum class AlphaCoverage {
+	Transparent,	///< 全ピクセル透明（書き込み不要）
+	Opaque,			///< 全ピクセル不透明（行単位でそのままコピー）
+	Mixed,			///< 混在（不透明な区間だけをコピー）
+};
+
+AlphaCoverage ClassifyAlpha(const FilterPlugIn::Block& alpha, const FilterPlugIn::Rect& rect);
+bool FindOpaqueBounds(FilterPlugIn::Offscreen& offscreen, const FilterPlugIn::Rect& area, FilterPlugIn::Rect& bounds);
+void Transfer(const FilterPlugIn::Block& dst, const class ImageBuffer& src, const FilterPlugIn::Block& alpha, AlphaCoverage coverage);
+void Transfer(const FilterPlugIn::Block& dst, const class ImageBuffer& src, const FilterPlugIn::Block& alpha);
+// void TransferForOutpaint(const FilterPlugIn::Block& dst, const class ImageBuffer& src, const FilterPlugIn::Block& alpha); // Temporarily disabled.
+void Transfer(const ImageBuffer& dst, const FilterPlugIn::Block& src, int offsetY, int offsetX);
+void Transfer(const FilterPlugIn::Block& dst, const class ImageBuffer& src, const FilterPlugIn::Block& alpha, const FilterPlugIn::Block& select);
+
+/// デバッグ出力（Info レベル）
+void print(const char* format, ...);
+
+/// @brief 24bit の画像を RGBA に並べ替えてプールのバッファにコピーする
+bool CopyImageToRgba(const ImageBuffer& image, BufferPool& pool, BufferPool::Buffer& rgba, unsigned char initialAlpha = 255);
+/// @brief RGBA の画像（imageRect の範囲）のうち、選択範囲の外接矩形の中を透明にする
+void ApplyRectangleSelectionMask(const FilterPlugIn::Rect& selectionRect, const FilterPlugIn::Rect& imageRect, unsigned char* rgba);
+
+std::string replace_all(std::string str, const std::string& from, const std::string& to);
+/// 数値をワークフローの JSON に埋め込む文字列にする
+std::string NumberToJson(double value);
+
+/// ヒストリーに書かれた生成画像の場所（/view に渡すパラメーター）
+struct HistoryImage {
+	std::string filename;
+	std::string type = "output";
+	std::string subfolder = "CLIPSTUDIO_ComfyUI_PLUGIN";
+};
+
+/// @brief ヒストリーの JSON から、最初の生成画像（CCPImage_*.png）のファイル名・種類・サブフォルダーを取り出す
+/// @return 生成画像が無ければfalse（image は既定値のまま）
+bool ExtractHistoryImage(const std::string& history_content, HistoryImage& image);
+
+/// デバッグ出力の開始（basePath の debuglog.txt に書く）
+void InitDebugOutput(const std::string& basePath);
+
+/// @brief 作業フォルダーを新しく作る（プラグインフォルダーの Work の下）
+/// @return 末尾に区切り文字を付けたパス。作れなかった場合は空文字列
+std::string CreateWorkspace(const std::string& name);
+/// 作業フォルダーを中のファイルごと削除し、workspace を空にする
+void RemoveWorkspace(std::string& workspace);
+
+/// 画像を /upload/image に POST し、レスポンスを output_filename に保存する
+bool http_post_image_to_file(const RunContext& context, const std::string& url, const std::string& image_filepath, const std::string& image_filename, const std::string& output_filename);
+/// @brief /upload/image のレスポンスから、サーバー上のファイル名を取り出す
+/// @return 取り出せない場合は空文字列
+std::string ReadUploadedName(const std::string& responsePath);
+/// @brief /view から画像を受け取り、output_path（省略時は作業フォルダーの temp_img_res.png）に保存する
+/// @return 保存したファイルのパス。失敗時は空文字列
+std::string get_image(const RunContext& context, const std::string& filename, const std::string& type, const std::string& subfolder, const std::string& output_path = "", const std::string& preview_format = "");
+
+/// 24bit の BMP を ImageBuffer に読み込む
+bool load_bmp_rgb_to_buffer(const std::string& filename, ImageBuffer& img_data);
+/// ImageBuffer を 24bit の BMP に書き出す
+bool write_bmp_file(const ImageBuffer& buffer, const std::string& filename);
+/// @brief 24bit の BMP をプールのバッファに読み込み、画像全体のブロックとして返す
+/// @return 読めなかった場合は address が null のブロック
+FilterPlugIn::Block read24BitBmpBlock(const std::string& filename, BufferPool& pool, BufferPool::Buffer& storage);
@@ -15,6 +15,7 @@
 
 #include <wincodec.h>
 
+#include <algorithm>
 #include <iomanip>
 #include <sstream>
 
@@ -251,14 +252,96 @@ bool PngToBmp(const std::string& inputPath, const std::string& outputPath, std::
 
 bool WriteRgbaPng(const std::string& outputPath, const unsigned char* rgbaPixels, int width, int height, std::string* errorMessage) {
 	if (errorMessage) errorMessage->clear(); if (!rgbaPixels || width <= 0 || height <= 0) { if (errorMessage) *errorMessage = "Invalid RGBA image buffer."; return false; }
+	PngStreamWriter writer; if (!writer.Open(outputPath, width, height, errorMessage)) return false;
+	// 全体のサイズが UINT に収まらない巨大な画像も書けるよう、64MB程度の帯に分けて渡す
+	const size_t stride = static_cast<size_t>(width) * 4;
+	const int bandRows = static_cast<int>(std::max<size_t>(1, std::min<size_t>(static_cast<size_t>(height), (size_t(64) << 20) / stride)));
+	for (int y = 0; y < height; y += bandRows) { if (!writer.WriteRows(rgbaPixels + stride * y, std::min(bandRows, height - y), stride, errorMessage)) return false; }
+	return writer.Close(errorMessage);
+}
+
+struct PngStreamWriter::Impl {
+	ComInitializer com;
+	ComObject<IWICImagingFactory> factory;
+	ComObject<IWICStream> stream;
+	ComObject<IWICBitmapEncoder> encoder;
+	ComObject<IWICBitmapFrameEncode> frame;
+	int width = 0;
+	int height = 0;
+	int written = 0;
+};
+
+PngStreamWriter::PngStreamWriter() = default;
+PngStreamWriter::~PngStreamWriter() = default;
+
+bool PngStreamWriter::Open(const std::string& outputPath, int width, int height, std::string* errorMessage) {
+	if (errorMessage) errorMessage->clear(); impl_.reset(); if (width <= 0 || height <= 0) { if (errorMessage) *errorMessage = "Invalid RGBA image size."; return false; }
 	const auto outputPathWide = LocalPathToWide(outputPath); if (outputPathWide.empty()) { if (errorMessage) *errorMessage = "Image path conversion failed."; return false; }
-	const auto stride64 = static_cast<unsigned long long>(width) * 4; const auto bufferSize64 = stride64 * static_cast<unsigned long long>(height); if (stride64 > UINT_MAX || bufferSize64 > UINT_MAX) { if (errorMessage) *errorMessage = "RGBA image is too large."; return false; }
-	ComInitializer com; if (FAILED(com.result())) return Fail("CoInitializeEx", com.result(), errorMessage); ComObject<IWICImagingFactory> factory; HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(factory.put())); if (FAILED(hr)) return Fail("CoCreateInstance(CLSID_WICImagingFactory)", hr, errorMessage);
-	ComObject<IWICBitmap> bitmap; hr = factory->CreateBitmapFromMemory(static_cast<UINT>(width), static_cast<UINT>(height), GUID_WICPixelFormat32bppBGRA, static_cast<UINT>(stride64), static_cast<UINT>(bufferSize64), const_cast<BYTE*>(reinterpret_cast<const BYTE*>(rgbaPixels)), bitmap.put()); if (FAILED(hr)) return Fail("IWICImagingFactory::CreateBitmapFromMemory", hr, errorMessage);
-	DeleteFileW(outputPathWide.c_str()); ComObject<IWICStream> stream; hr = factory->CreateStream(stream.put()); if (FAILED(hr)) return Fail("IWICImagingFactory::CreateStream", hr, errorMessage); hr = stream->InitializeFromFilename(outputPathWide.c_str(), GENERIC_WRITE); if (FAILED(hr)) return Fail("IWICStream::InitializeFromFilename", hr, errorMessage);
-	ComObject<IWICBitmapEncoder> encoder; hr = factory->CreateEncoder(GUID_ContainerFormatPng, nullptr, encoder.put()); if (FAILED(hr)) return Fail("IWICImagingFactory::CreateEncoder", hr, errorMessage); hr = encoder->Initialize(stream.get(), WICBitmapEncoderNoCache); if (FAILED(hr)) return Fail("IWICBitmapEncoder::Initialize", hr, errorMessage);
-	ComObject<IWICBitmapFrameEncode> frame; ComObject<IPropertyBag2> options; hr = encoder->CreateNewFrame(frame.put(), options.put()); if (FAILED(hr)) return Fail("IWICBitmapEncoder::CreateNewFrame", hr, errorMessage); hr = frame->Initialize(options.get()); if (FAILED(hr)) return Fail("IWICBitmapFrameEncode::Initialize", hr, errorMessage); hr = frame->SetSize(static_cast<UINT>(width), static_cast<UINT>(height)); if (FAILED(hr)) return Fail("IWICBitmapFrameEncode::SetSize", hr, errorMessage);
-	WICPixelFormatGUID format = GUID_WICPixelFormat32bppBGRA; hr = frame->SetPixelFormat(&format); if (FAILED(hr) || !IsEqualGUID(format, GUID_WICPixelFormat32bppBGRA)) return Fail("IWICBitmapFrameEncode::SetPixelFormat", FAILED(hr) ? hr : WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT, errorMessage); hr = frame->WriteSource(bitmap.get(), nullptr); if (FAILED(hr)) return Fail("IWICBitmapFrameEncode::WriteSource", hr, errorMessage); hr = frame->Commit(); if (FAILED(hr)) return Fail("IWICBitmapFrameEncode::Commit", hr, errorMessage); hr = encoder->Commit(); if (FAILED(hr)) return Fail("IWICBitmapEncoder::Commit", hr, errorMessage); return true;
+	if (static_cast<unsigned long long>(width) * 4 > UINT_MAX) { if (errorMessage) *errorMessage = "RGBA image is too large."; return false; }
+	auto impl = std::make_unique<Impl>(); impl->width = width; impl->height = height;
+	if (FAILED(impl->com.result())) return Fail("CoInitializeEx", impl->com.result(), errorMessage); HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(impl->factory.put())); if (FAILED(hr)) return Fail("CoCreateInstance(CLSID_WICImagingFactory)", hr, errorMessage);
+	DeleteFileW(outputPathWide.c_str()); hr = impl->factory->CreateStream(impl->stream.put()); if (FAILED(hr)) return Fail("IWICImagingFactory::CreateStream", hr, errorMessage); hr = impl->stream->InitializeFromFilename(outputPathWide.c_str(), GENERIC_WRITE); if (FAILED(hr)) return Fail("IWICStream::InitializeFromFilename", hr, errorMessage);
+	hr = impl->factory->CreateEncoder(GUID_ContainerFormatPng, nullptr, impl->encoder.put()); if (FAILED(hr)) return Fail("IWICImagingFactory::CreateEncoder", hr, errorMessage); hr = impl->encoder->Initialize(impl->stream.get(), WICBitmapEncoderNoCache); if (FAILED(hr)) return Fail("IWICBitmapEncoder::Initialize", hr, errorMessage);
+	ComObject<IPropertyBag2> options; hr = impl->encoder->CreateNewFrame(impl->frame.put(), options.put()); if (FAILED(hr)) return Fail("IWICBitmapEncoder::CreateNewFrame", hr, errorMessage); hr = impl->frame->Initialize(options.get()); if (FAILED(hr)) return Fail("IWICBitmapFrameEncode::Initialize", hr, errorMessage); hr = impl->frame->SetSize(static_cast<UINT>(width), static_cast<UINT>(height)); if (FAILED(hr)) return Fail("IWICBitmapFrameEncode::SetSize", hr, errorMessage);
+	WICPixelFormatGUID format = GUID_WICPixelFormat32bppBGRA; hr = impl->frame->SetPixelFormat(&format); if (FAILED(hr) || !IsEqualGUID(format, GUID_WICPixelFormat32bppBGRA)) return Fail("IWICBitmapFrameEncode::SetPixelFormat", FAILED(hr) ? hr : WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT, errorMessage);
+	impl_ = std::move(impl); return true;
+}
+
+bool PngStreamWriter::WriteRows(const unsigned char* bgraRows, int rows, size_t stride, std::string* errorMessage) {
+	if (errorMessage) errorMessage->clear(); if (!impl_ || !bgraRows || rows <= 0 || impl_->written + rows > impl_->height || stride < static_cast<size_t>(impl_->width) * 4) { if (errorMessage) *errorMessage = "Invalid PNG stream rows."; return false; }
+	const auto bytes = static_cast<unsigned long long>(stride) * rows; if (stride > UINT_MAX || bytes > UINT_MAX) { if (errorMessage) *errorMessage = "PNG stream band is too large."; return false; }
+	// WIC の PNG エンコーダーは渡された行をその場でフィルター・圧縮してストリームへ書き出す
+	const HRESULT hr = impl_->frame->WritePixels(static_cast<UINT>(rows), static_cast<UINT>(stride), static_cast<UINT>(bytes), const_cast<BYTE*>(reinterpret_cast<const BYTE*>(bgraRows))); if (FAILED(hr)) return Fail("IWICBitmapFrameEncode::WritePixels", hr, errorMessage);
+	impl_->written += rows; return true;
+}
+
+bool PngStreamWriter::Close(std::string* errorMessage) {
+	if (errorMessage) errorMessage->clear(); if (!impl_ || impl_->written != impl_->height) { if (errorMessage) *errorMessage = "PNG stream closed before all rows were written."; impl_.reset(); return false; }
+	auto impl = std::move(impl_);
+	HRESULT hr = impl->frame->Commit(); if (FAILED(hr)) return Fail("IWICBitmapFrameEncode::Commit", hr, errorMessage); hr = impl->encoder->Commit(); if (FAILED(hr)) return Fail("IWICBitmapEncoder::Commit", hr, errorMessage); return true;
+}
+
+struct RegionDecoder::Impl {
+	ComInitializer com;
+	ComObject<IWICImagingFactory> factory;
+	ComObject<IWICBitmapDecoder> decoder;
+	ComObject<IWICBitmapFrameDecode> frame;
+	ComObject<IWICFormatConverter> converter;
+	UINT width = 0;
+	UINT height = 0;
+};
+
+RegionDecoder::RegionDecoder() = default;
+RegionDecoder::~RegionDecoder() = default;
+int RegionDecoder::Width() const { return impl_ ? static_cast<int>(impl_->width) : 0; }
+int RegionDecoder::Height() const { return impl_ ? static_cast<int>(impl_->height) : 0; }
+
+bool RegionDecoder::Open(const std::string& inputPath, std::string* errorMessage) {
+	if (errorMessage) errorMessage->clear(); impl_.reset();
+	const auto inputPathWide = LocalPathToWide(inputPath); if (inputPathWide.empty()) { if (errorMessage) *errorMessage = "Image path conversion failed."; return false; }
+	auto impl = std::make_unique<Impl>();
+	if (FAILED(impl->com.result())) return Fail("CoInitializeEx", impl->com.result(), errorMessage); HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(impl->factory.put())); if (FAILED(hr)) return Fail("CoCreateInstance(CLSID_WICImagingFactory)", hr, errorMessage);
+	// WICDecodeMetadataCacheOnDemand: 画素もメタデータも、CopyPixels で必要になるまで読まない
+	hr = impl->factory->CreateDecoderFromFilename(inputPathWide.c_str(), nullptr, GENERIC_READ, WICDecodeMetadataCacheOnDemand, impl->decoder.put()); if (FAILED(hr)) return Fail("IWICImagingFactory::CreateDecoderFromFilename", hr, errorMessage);
+	hr = impl->decoder->GetFrame(0, impl->frame.put()); if (FAILED(hr)) return Fail("IWICBitmapDecoder::GetFrame", hr, errorMessage);
+	hr = impl->frame->GetSize(&impl->width, &impl->height); if (FAILED(hr) || impl->width == 0 || impl->height == 0 || impl->width > INT_MAX || impl->height > INT_MAX) return Fail("IWICBitmapFrameDecode::GetSize", FAILED(hr) ? hr : E_INVALIDARG, errorMessage);
+	hr = impl->factory->CreateFormatConverter(impl->converter.put()); if (FAILED(hr)) return Fail("IWICImagingFactory::CreateFormatConverter", hr, errorMessage);
+	hr = impl->converter->Initialize(impl->frame.get(), GUID_WICPixelFormat24bppRGB, WICBitmapDitherTypeNone, nullptr, 0.0, WICBitmapPaletteTypeCustom); if (FAILED(hr)) return Fail("IWICFormatConverter::Initialize", hr, errorMessage);
+	impl_ = std::move(impl); return true;
+}
+
+bool RegionDecoder::ReadRgb(int left, int top, int width, int rows, unsigned char* rgbPixels, size_t stride, std::string* errorMessage) {
+	if (errorMessage) errorMessage->clear();
+	if (!impl_ || !rgbPixels || left < 0 || top < 0 || width <= 0 || rows <= 0 || static_cast<UINT>(left + width) > impl_->width || static_cast<UINT>(top + rows) > impl_->height || stride < static_cast<size_t>(width) * 3 || stride > UINT_MAX) { if (errorMessage) *errorMessage = "Invalid decode region."; return false; }
+	// CopyPixels のバッファサイズは UINT なので、巨大な範囲は64MB程度の帯に分けて読む
+	const int bandRows = static_cast<int>(std::max<size_t>(1, std::min<size_t>(static_cast<size_t>(rows), (size_t(64) << 20) / stride)));
+	for (int y = 0; y < rows; y += bandRows) {
+		const int count = std::min(bandRows, rows - y);
+		const WICRect rect = { left, top + y, width, count };
+		const auto bytes = stride * static_cast<size_t>(count - 1) + static_cast<size_t>(width) * 3;
+		const HRESULT hr = impl_->converter->CopyPixels(&rect, static_cast<UINT>(stride), static_cast<UINT>(bytes), rgbPixels + stride * static_cast<size_t>(y)); if (FAILED(hr)) return Fail("IWICFormatConverter::CopyPixels", hr, errorMessage);
+	}
+	return true;
 }
 }
 
@@ -5,6 +5,8 @@
  */
 #pragma once
 
+#include <cstddef>
+#include <memory>
 #include <string>
 
 namespace ComvertImage {
@@ -18,4 +20,47 @@ bool PngToBmp(const std::string& inputPath, const std::string& outputPath, std::
 /// RGBAピクセルを、アルファ付きPNGとして保存する。
 bool WriteRgbaPng(const std::string& outputPath, const unsigned char* rgbaPixels, int width, int height, std::string* errorMessage = nullptr);
 
+/// @brief 上の行から帯単位でBGRAピクセルを受け取り、アルファ付きPNGへ書き出す
+/// @note 画像全体をメモリに持たずにエンコードする（macOSでは全体を溜めてから書き出す）
+class PngStreamWriter {
+public:
+	PngStreamWriter();
+	~PngStreamWriter();
+	PngStreamWriter(const PngStreamWriter&) = delete;
+	PngStreamWriter& operator=(const PngStreamWriter&) = delete;
+
+	bool Open(const std::string& outputPath, int width, int height, std::string* errorMessage = nullptr);
+	/// @param stride 1行のバイト数（width * 4 以上）
+	bool WriteRows(const unsigned char* bgraRows, int rows, size_t stride, std::string* errorMessage = nullptr);
+	/// 全ての行を書き終えたら呼ぶ。呼ばずに破棄した場合、出力は不完全なまま残る。
+	bool Close(std::string* errorMessage = nullptr);
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> impl_;
+};
+
+/// @brief 画像の一部の矩形だけをデコードし、24bit RGB で取り出す
+/// @note 生成結果のうち書き戻す範囲だけを読むために使う。出力バッファは読む範囲の大きさで足りる。
+class RegionDecoder {
+public:
+	RegionDecoder();
+	~RegionDecoder();
+	RegionDecoder(const RegionDecoder&) = delete;
+	RegionDecoder& operator=(const RegionDecoder&) = delete;
+
+	/// 画像を開いてサイズを読む（画素はまだデコードしない）
+	bool Open(const std::string& inputPath, std::string* errorMessage = nullptr);
+	int Width() const;
+	int Height() const;
+	/// @brief (left, top) から width x rows の範囲をデコードする
+	/// @param stride 出力の1行のバイト数（width * 3 以上）
+	/// @note 上から順に帯単位で呼ぶと、デコーダーが行を順に展開するだけで済む
+	bool ReadRgb(int left, int top, int width, int rows, unsigned char* rgbPixels, size_t stride, std::string* errorMessage = nullptr);
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> impl_;
+};
+
 }
@@ -0,0 +1,283 @@
+/**
+ * @file ComvertImage_linux.cpp
+ * @brief libpng による画像変換（Linux でホストシミュレーターを使ってビルドする場合）
+ */
+#include "pch.h"
+#include "ComvertImage.h"
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+#include <png.h>
+
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+namespace {
+
+bool SetError(std::string* errorMessage, const char* message) {
+	if (errorMessage) *errorMessage = message;
+	return false;
+}
+
+#pragma pack(push, 1)
+struct BmpFileHeader {
+	uint16_t type = 0x4D42;
+	uint32_t size = 0;
+	uint16_t reserved1 = 0;
+	uint16_t reserved2 = 0;
+	uint32_t offset = 54;
+};
+struct BmpInfoHeader {
+	uint32_t size = 40;
+	int32_t width = 0;
+	int32_t height = 0;
+	uint16_t planes = 1;
+	uint16_t bitCount = 24;
+	uint32_t compression = 0;
+	uint32_t imageSize = 0;
+	int32_t xPixelsPerMeter = 0;
+	int32_t yPixelsPerMeter = 0;
+	uint32_t colorsUsed = 0;
+	uint32_t colorsImportant = 0;
+};
+#pragma pack(pop)
+
+/// PNG を開いて、8bit RGB で行を読めるように変換を設定する
+struct PngReader {
+	FILE* file = nullptr;
+	png_structp png = nullptr;
+	png_infop info = nullptr;
+	int width = 0;
+	int height = 0;
+	int nextRow = 0;
+	bool interlaced = false;
+
+	~PngReader() { Close(); }
+	void Close() {
+		if (png) png_destroy_read_struct(&png, info ? &info : nullptr, nullptr);
+		png = nullptr;
+		info = nullptr;
+		if (file) std::fclose(file);
+		file = nullptr;
+	}
+	bool Open(const std::string& path, std::string* errorMessage) {
+		Close();
+		file = std::fopen(path.c_str(), "rb");
+		if (!file) return SetError(errorMessage, "Could not open the input image.");
+		unsigned char signature[8] = {};
+		if (std::fread(signature, 1, sizeof(signature), file) != sizeof(signature) || png_sig_cmp(signature, 0, sizeof(signature)) != 0) return SetError(errorMessage, "The input image is not a PNG.");
+		png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+		info = png ? png_create_info_struct(png) : nullptr;
+		if (!info) return SetError(errorMessage, "libpng could not be initialized.");
+		if (setjmp(png_jmpbuf(png))) return SetError(errorMessage, "libpng could not read the PNG header.");
+		png_init_io(png, file);
+		png_set_sig_bytes(png, sizeof(signature));
+		png_read_info(png, info);
+		width = static_cast<int>(png_get_image_width(png, info));
+		height = static_cast<int>(png_get_image_height(png, info));
+		interlaced = png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
+		png_set_expand(png);
+		png_set_strip_16(png);
+		png_set_strip_alpha(png);
+		png_set_gray_to_rgb(png);
+		if (interlaced) png_set_interlace_handling(png);
+		png_read_update_info(png, info);
+		nextRow = 0;
+		return true;
+	}
+	/// 次の行を読む（rgb は width * 3 バイト）
+	bool ReadRow(unsigned char* rgb, std::string* errorMessage) {
+		if (setjmp(png_jmpbuf(png))) return SetError(errorMessage, "libpng could not decode the PNG.");
+		png_read_row(png, rgb, nullptr);
+		++nextRow;
+		return true;
+	}
+};
+
+bool WritePng(const std::string& outputPath, int width, int height, int colorType, const std::function<const unsigned char*(int)>& row, bool bgr, std::string* errorMessage) {
+	FILE* file = std::fopen(outputPath.c_str(), "wb");
+	if (!file) return SetError(errorMessage, "Could not create the output file.");
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+	png_infop info = png ? png_create_info_struct(png) : nullptr;
+	if (!info) {
+		if (png) png_destroy_write_struct(&png, nullptr);
+		std::fclose(file);
+		return SetError(errorMessage, "libpng could not be initialized.");
+	}
+	if (setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct(&png, &info);
+		std::fclose(file);
+		return SetError(errorMessage, "libpng could not write the PNG.");
+	}
+	png_init_io(png, file);
+	png_set_IHDR(png, info, width, height, 8, colorType, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_compression_level(png, 1);
+	png_write_info(png, info);
+	if (bgr) png_set_bgr(png);
+	for (int y = 0; y < height; ++y) png_write_row(png, const_cast<png_bytep>(row(y)));
+	png_write_end(png, nullptr);
+	png_destroy_write_struct(&png, &info);
+	return std::fclose(file) == 0 ? true : SetError(errorMessage, "Could not close the output file.");
+}
+
+}
+
+namespace ComvertImage {
+
+bool BmpToPng(const std::string& inputPath, const std::string& outputPath, std::string* errorMessage) {
+	std::ifstream input(inputPath, std::ios::binary);
+	BmpFileHeader fileHeader;
+	BmpInfoHeader infoHeader;
+	if (!input.read(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader)) || !input.read(reinterpret_cast<char*>(&infoHeader), sizeof(infoHeader))) return SetError(errorMessage, "Could not read the BMP header.");
+	if (fileHeader.type != 0x4D42 || infoHeader.bitCount != 24 || infoHeader.compression != 0 || infoHeader.width <= 0 || infoHeader.height == 0) return SetError(errorMessage, "Only uncompressed 24bit BMP is supported.");
+	const int width = infoHeader.width;
+	const int height = infoHeader.height < 0 ? -infoHeader.height : infoHeader.height;
+	const size_t rowBytes = (static_cast<size_t>(width) * 3 + 3) & ~static_cast<size_t>(3);
+	std::vector<unsigned char> pixels(rowBytes * height);
+	input.seekg(fileHeader.offset);
+	if (!input.read(reinterpret_cast<char*>(pixels.data()), static_cast<std::streamsize>(pixels.size()))) return SetError(errorMessage, "Could not read the BMP pixels.");
+	const bool bottomUp = infoHeader.height > 0;
+	return WritePng(outputPath, width, height, PNG_COLOR_TYPE_RGB, [&](int y) { return pixels.data() + rowBytes * (bottomUp ? height - 1 - y : y); }, true, errorMessage);
+}
+
+bool PngToBmp(const std::string& inputPath, const std::string& outputPath, std::string* errorMessage) {
+	PngReader reader;
+	if (!reader.Open(inputPath, errorMessage)) return false;
+	const size_t rowBytes = (static_cast<size_t>(reader.width) * 3 + 3) & ~static_cast<size_t>(3);
+	std::vector<unsigned char> pixels(rowBytes * reader.height);
+	const int passes = reader.interlaced ? png_set_interlace_handling(reader.png) : 1;
+	std::vector<unsigned char> row(static_cast<size_t>(reader.width) * 3);
+	for (int pass = 0; pass < passes; ++pass) {
+		for (int y = 0; y < reader.height; ++y) {
+			unsigned char* dst = pixels.data() + rowBytes * (reader.height - 1 - y);
+			if (reader.interlaced) std::memcpy(row.data(), dst, row.size());
+			if (!reader.ReadRow(row.data(), errorMessage)) return false;
+			for (int x = 0; x < reader.width; ++x) { dst[x * 3] = row[x * 3 + 2]; dst[x * 3 + 1] = row[x * 3 + 1]; dst[x * 3 + 2] = row[x * 3]; }
+		}
+	}
+	BmpFileHeader fileHeader;
+	BmpInfoHeader infoHeader;
+	infoHeader.width = reader.width;
+	infoHeader.height = reader.height;
+	infoHeader.imageSize = static_cast<uint32_t>(pixels.size());
+	fileHeader.size = static_cast<uint32_t>(sizeof(fileHeader) + sizeof(infoHeader) + pixels.size());
+	std::ofstream output(outputPath, std::ios::binary);
+	output.write(reinterpret_cast<const char*>(&fileHeader), sizeof(fileHeader));
+	output.write(reinterpret_cast<const char*>(&infoHeader), sizeof(infoHeader));
+	output.write(reinterpret_cast<const char*>(pixels.data()), static_cast<std::streamsize>(pixels.size()));
+	return output ? true : SetError(errorMessage, "Could not write the BMP output.");
+}
+
+bool WriteRgbaPng(const std::string& outputPath, const unsigned char* rgbaPixels, int width, int height, std::string* errorMessage) {
+	if (!rgbaPixels || width <= 0 || height <= 0) return SetError(errorMessage, "Invalid RGBA image.");
+	const size_t stride = static_cast<size_t>(width) * 4;
+	return WritePng(outputPath, width, height, PNG_COLOR_TYPE_RGBA, [&](int y) { return rgbaPixels + stride * y; }, false, errorMessage);
+}
+
+struct PngStreamWriter::Impl {
+	FILE* file = nullptr;
+	png_structp png = nullptr;
+	png_infop info = nullptr;
+	int width = 0;
+	int height = 0;
+	int written = 0;
+	~Impl() {
+		if (png) png_destroy_write_struct(&png, info ? &info : nullptr);
+		if (file) std::fclose(file);
+	}
+};
+
+PngStreamWriter::PngStreamWriter() = default;
+PngStreamWriter::~PngStreamWriter() = default;
+
+bool PngStreamWriter::Open(const std::string& outputPath, int width, int height, std::string* errorMessage) {
+	if (width <= 0 || height <= 0) return SetError(errorMessage, "Invalid image dimensions.");
+	auto impl = std::make_unique<Impl>();
+	impl->file = std::fopen(outputPath.c_str(), "wb");
+	if (!impl->file) return SetError(errorMessage, "Could not create the output file.");
+	impl->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+	impl->info = impl->png ? png_create_info_struct(impl->png) : nullptr;
+	if (!impl->info) return SetError(errorMessage, "libpng could not be initialized.");
+	if (setjmp(png_jmpbuf(impl->png))) return SetError(errorMessage, "libpng could not write the PNG header.");
+	png_init_io(impl->png, impl->file);
+	png_set_IHDR(impl->png, impl->info, width, height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_compression_level(impl->png, 1);
+	png_write_info(impl->png, impl->info);
+	png_set_bgr(impl->png);
+	impl->width = width;
+	impl->height = height;
+	impl_ = std::move(impl);
+	return true;
+}
+
+bool PngStreamWriter::WriteRows(const unsigned char* bgraRows, int rows, size_t stride, std::string* errorMessage) {
+	if (!impl_ || impl_->written + rows > impl_->height) return SetError(errorMessage, "Too many rows for the PNG stream.");
+	if (setjmp(png_jmpbuf(impl_->png))) return SetError(errorMessage, "libpng could not encode the rows.");
+	for (int y = 0; y < rows; ++y) png_write_row(impl_->png, const_cast<png_bytep>(bgraRows + stride * y));
+	impl_->written += rows;
+	return true;
+}
+
+bool PngStreamWriter::Close(std::string* errorMessage) {
+	if (!impl_ || impl_->written != impl_->height) return SetError(errorMessage, "The PNG stream is incomplete.");
+	if (setjmp(png_jmpbuf(impl_->png))) return SetError(errorMessage, "libpng could not finish the PNG.");
+	png_write_end(impl_->png, nullptr);
+	png_destroy_write_struct(&impl_->png, &impl_->info);
+	impl_->png = nullptr;
+	const bool closed = std::fclose(impl_->file) == 0;
+	impl_->file = nullptr;
+	impl_.reset();
+	return closed ? true : SetError(errorMessage, "Could not close the output file.");
+}
+
+struct RegionDecoder::Impl {
+	std::string path;
+	PngReader reader;
+	std::vector<unsigned char> row;
+	/// インターレースの場合は全体をデコードしておく
+	std::vector<unsigned char> whole;
+};
+
+RegionDecoder::RegionDecoder() : impl_(std::make_unique<Impl>()) {}
+RegionDecoder::~RegionDecoder() = default;
+
+bool RegionDecoder::Open(const std::string& inputPath, std::string* errorMessage) {
+	impl_->path = inputPath;
+	impl_->whole.clear();
+	if (!impl_->reader.Open(inputPath, errorMessage)) return false;
+	impl_->row.resize(static_cast<size_t>(impl_->reader.width) * 3);
+	return true;
+}
+
+int RegionDecoder::Width() const { return impl_->reader.width; }
+int RegionDecoder::Height() const { return impl_->reader.height; }
+
+bool RegionDecoder::ReadRgb(int left, int top, int width, int rows, unsigned char* rgbPixels, size_t stride, std::string* errorMessage) {
+	auto& reader = impl_->reader;
+	if (left < 0 || top < 0 || width <= 0 || rows <= 0 || left + width > reader.width || top + rows > reader.height) return SetError(errorMessage, "The region is outside the image.");
+	const size_t rowBytes = static_cast<size_t>(reader.width) * 3;
+	if (reader.interlaced) {
+		if (impl_->whole.empty()) {
+			impl_->whole.resize(rowBytes * reader.height);
+			const int passes = png_set_interlace_handling(reader.png);
+			for (int pass = 0; pass < passes; ++pass) {
+				for (int y = 0; y < reader.height; ++y) if (!reader.ReadRow(impl_->whole.data() + rowBytes * y, errorMessage)) return false;
+			}
+		}
+		for (int y = 0; y < rows; ++y) std::memcpy(rgbPixels + stride * y, impl_->whole.data() + rowBytes * (top + y) + static_cast<size_t>(left) * 3, static_cast<size_t>(width) * 3);
+		return true;
+	}
+	// 行は前から順にしか読めないので、戻る場合は開き直す
+	if (top < reader.nextRow && !reader.Open(impl_->path, errorMessage)) return false;
+	while (reader.nextRow < top) if (!reader.ReadRow(impl_->row.data(), errorMessage)) return false;
+	for (int y = 0; y < rows; ++y) {
+		if (!reader.ReadRow(impl_->row.data(), errorMessage)) return false;
+		std::memcpy(rgbPixels + stride * y, impl_->row.data() + static_cast<size_t>(left) * 3, static_cast<size_t>(width) * 3);
+	}
+	return true;
+}
+
+}
+#endif
@@ -127,12 +127,11 @@ bool PngToBmp(const std::string& inputPath, const std::string& outputPath, std::
 bool WriteRgbaPng(const std::string& outputPath, const unsigned char* bgraPixels, int width, int height, std::string* errorMessage) {
 	if (errorMessage) errorMessage->clear();
 	if (!bgraPixels || width <= 0 || height <= 0) return SetError(errorMessage, "Invalid BGRA image buffer.");
-	const size_t pixelCount = static_cast<size_t>(width) * static_cast<size_t>(height);
-	std::vector<uint8_t> rgba(pixelCount * 4);
-	for (size_t i = 0; i < pixelCount; ++i) { rgba[i * 4] = bgraPixels[i * 4 + 2]; rgba[i * 4 + 1] = bgraPixels[i * 4 + 1]; rgba[i * 4 + 2] = bgraPixels[i * 4]; rgba[i * 4 + 3] = bgraPixels[i * 4 + 3]; }
+	// BGRA のバイト列は 32bit リトルエンディアンの ARGB と同じなので、並べ替えずにそのまま渡す（巨大な画像でもコピーしない）
+	const size_t stride = static_cast<size_t>(width) * 4;
 	CGColorSpaceRef colorSpace = CGColorSpaceCreateDeviceRGB();
-	CGDataProviderRef provider = CGDataProviderCreateWithData(nullptr, rgba.data(), rgba.size(), nullptr);
-	CGImageRef image = CGImageCreate(static_cast<size_t>(width), static_cast<size_t>(height), 8, 32, static_cast<size_t>(width) * 4, colorSpace, kCGImageAlphaLast | kCGBitmapByteOrder32Big, provider, nullptr, false, kCGRenderingIntentDefault);
+	CGDataProviderRef provider = CGDataProviderCreateWithData(nullptr, bgraPixels, stride * static_cast<size_t>(height), nullptr);
+	CGImageRef image = CGImageCreate(static_cast<size_t>(width), static_cast<size_t>(height), 8, 32, stride, colorSpace, kCGImageAlphaFirst | kCGBitmapByteOrder32Little, provider, nullptr, false, kCGRenderingIntentDefault);
 	CGDataProviderRelease(provider); CGColorSpaceRelease(colorSpace);
 	if (!image) return SetError(errorMessage, "CoreGraphics could not create RGBA image.");
 	const bool result = WritePng(image, outputPath, errorMessage);
@@ -140,5 +139,88 @@ bool WriteRgbaPng(const std::string& outputPath, const unsigned char* bgraPixels
 	return result;
 }
 
+// ImageIO には行単位で書き込む API がないので、行を溜めておき Close でまとめて書き出す
+struct PngStreamWriter::Impl {
+	std::string outputPath;
+	int width = 0;
+	int height = 0;
+	int written = 0;
+	std::vector<unsigned char> pixels;
+};
+
+PngStreamWriter::PngStreamWriter() = default;
+PngStreamWriter::~PngStreamWriter() = default;
+
+bool PngStreamWriter::Open(const std::string& outputPath, int width, int height, std::string* errorMessage) {
+	if (errorMessage) errorMessage->clear();
+	impl_.reset();
+	if (width <= 0 || height <= 0) return SetError(errorMessage, "Invalid BGRA image size.");
+	auto impl = std::make_unique<Impl>();
+	impl->outputPath = outputPath; impl->width = width; impl->height = height;
+	impl->pixels.resize(static_cast<size_t>(width) * 4 * static_cast<size_t>(height));
+	impl_ = std::move(impl);
+	return true;
+}
+
+bool PngStreamWriter::WriteRows(const unsigned char* bgraRows, int rows, size_t stride, std::string* errorMessage) {
+	if (errorMessage) errorMessage->clear();
+	if (!impl_ || !bgraRows || rows <= 0 || impl_->written + rows > impl_->height || stride < static_cast<size_t>(impl_->width) * 4) return SetError(errorMessage, "Invalid PNG stream rows.");
+	const size_t rowBytes = static_cast<size_t>(impl_->width) * 4;
+	for (int y = 0; y < rows; ++y) std::memcpy(impl_->pixels.data() + rowBytes * static_cast<size_t>(impl_->written + y), bgraRows + stride * static_cast<size_t>(y), rowBytes);
+	impl_->written += rows;
+	return true;
+}
+
+bool PngStreamWriter::Close(std::string* errorMessage) {
+	if (errorMessage) errorMessage->clear();
+	auto impl = std::move(impl_);
+	if (!impl || impl->written != impl->height) return SetError(errorMessage, "PNG stream closed before all rows were written.");
+	return WriteRgbaPng(impl->outputPath, impl->pixels.data(), impl->width, impl->height, errorMessage);
+}
+
+struct RegionDecoder::Impl {
+	CGImageRef image = nullptr;
+	~Impl() { if (image) CGImageRelease(image); }
+};
+
+RegionDecoder::RegionDecoder() = default;
+RegionDecoder::~RegionDecoder() = default;
+int RegionDecoder::Width() const { return impl_ ? static_cast<int>(CGImageGetWidth(impl_->image)) : 0; }
+int RegionDecoder::Height() const { return impl_ ? static_cast<int>(CGImageGetHeight(impl_->image)) : 0; }
+
+bool RegionDecoder::Open(const std::string& inputPath, std::string* errorMessage) {
+	if (errorMessage) errorMessage->clear();
+	impl_.reset();
+	auto impl = std::make_unique<Impl>();
+	impl->image = LoadImage(inputPath, errorMessage);
+	if (!impl->image) return false;
+	if (CGImageGetWidth(impl->image) == 0 || CGImageGetHeight(impl->image) == 0 || CGImageGetWidth(impl->image) > INT32_MAX || CGImageGetHeight(impl->image) > INT32_MAX) return SetError(errorMessage, "Invalid image dimensions.");
+	impl_ = std::move(impl);
+	return true;
+}
+
+bool RegionDecoder::ReadRgb(int left, int top, int width, int rows, unsigned char* rgbPixels, size_t stride, std::string* errorMessage) {
+	if (errorMessage) errorMessage->clear();
+	if (!impl_ || !rgbPixels || left < 0 || top < 0 || width <= 0 || rows <= 0 || left + width > Width() || top + rows > Height() || stride < static_cast<size_t>(width) * 3) return SetError(errorMessage, "Invalid decode region.");
+	// 切り出した画像を帯の大きさのコンテキストに描画する（ImageIO は描画に必要な範囲だけを展開する）
+	CGImageRef region = CGImageCreateWithImageInRect(impl_->image, CGRectMake(left, top, width, rows));
+	if (!region) return SetError(errorMessage, "CoreGraphics could not crop the image.");
+	const size_t bgraStride = static_cast<size_t>(width) * 4;
+	std::vector<uint8_t> pixels(bgraStride * static_cast<size_t>(rows));
+	CGColorSpaceRef colorSpace = CGColorSpaceCreateDeviceRGB();
+	CGContextRef context = CGBitmapContextCreate(pixels.data(), width, rows, 8, bgraStride, colorSpace, kCGImageAlphaNoneSkipFirst | kCGBitmapByteOrder32Little);
+	CGColorSpaceRelease(colorSpace);
+	if (!context) { CGImageRelease(region); return SetError(errorMessage, "CoreGraphics could not create bitmap context."); }
+	CGContextDrawImage(context, CGRectMake(0, 0, width, rows), region);
+	CGContextRelease(context);
+	CGImageRelease(region);
+	for (int y = 0; y < rows; ++y) {
+		const uint8_t* src = pixels.data() + bgraStride * static_cast<size_t>(y);
+		unsigned char* dst = rgbPixels + stride * static_cast<size_t>(y);
+		for (int x = 0; x < width; ++x, src += 4, dst += 3) { dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0]; }
+	}
+	return true;
+}
+
 } // namespace ComvertImage
 #endif // defined(__APPLE__)
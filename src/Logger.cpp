@@ -0,0 +1,268 @@
+/**
+ * @file Logger.cpp
+ * @brief レベル付きのデバッグログ。呼び出し側はリングバッファに書くだけで、ファイルへの書き出しはバックグラウンドで行う
+ */
+#include "pch.h"
+
+#include "Logger.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+
+namespace ComfyUIPlugin {
+
+namespace {
+
+constexpr char kLevelNames[] = { 'T', 'D', 'I', 'W', 'E', '-' };
+
+FILE* OpenFile(const std::string& path, const char* mode) {
+#if defined(_WIN32)
+	FILE* file = nullptr; fopen_s(&file, path.c_str(), mode); return file;
+#else
+	return std::fopen(path.c_str(), mode);
+#endif
+}
+
+long long NowMilliseconds() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/// 行頭の時刻とレベル（"hh:mm:ss.mmm [I] "）を書く
+/// @note ファイルへ書くのは fileMutex_ を持っている間だけなので、秒が変わるまで時刻の変換結果を使い回す
+void WritePrefix(FILE* fp, long long time, LogLevel level) {
+	static long long cachedSeconds = -1;
+	static std::tm local{};
+	const long long seconds = time / 1000;
+	if (seconds != cachedSeconds) {
+		const std::time_t value = static_cast<std::time_t>(seconds);
+#if defined(_WIN32)
+		localtime_s(&local, &value);
+#else
+		localtime_r(&value, &local);
+#endif
+		cachedSeconds = seconds;
+	}
+	std::fprintf(fp, "%02d:%02d:%02d.%03d [%c] ", local.tm_hour, local.tm_min, local.tm_sec, static_cast<int>(time % 1000), kLevelNames[static_cast<int>(level)]);
+}
+
+}
+
+Logger& Logger::Instance() {
+	static Logger logger;
+	return logger;
+}
+
+Logger::Logger() : slots_(new Slot[kCapacity]) {
+	for (size_t i = 0; i < kCapacity; ++i) slots_[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+Logger::~Logger() {
+#if defined(_WIN32)
+	// DLL の解放中（ローダーロック中）に join すると戻らないので、TerminateModule で止めていなければ切り離す
+	if (worker_.joinable()) worker_.detach();
+#else
+	Stop();
+#endif
+}
+
+void Logger::Open(const std::string& path) {
+	std::lock_guard<std::mutex> lock(fileMutex_);
+	path_ = path;
+	if (FILE* fp = OpenFile(path_, "w")) std::fclose(fp);
+}
+
+void Logger::SetRotation(unsigned long long maxBytes, int files) {
+	std::lock_guard<std::mutex> lock(fileMutex_);
+	maxBytes_ = maxBytes;
+	files_ = std::max(files, 0);
+}
+
+void Logger::Start() {
+	std::lock_guard<std::mutex> lock(wakeMutex_);
+	if (worker_.joinable()) return;
+	stop_ = false;
+	worker_ = std::thread([this] { WorkerLoop(); });
+	running_.store(true, std::memory_order_release);
+}
+
+void Logger::Stop() {
+	{
+		std::lock_guard<std::mutex> lock(wakeMutex_);
+		if (!worker_.joinable()) return;
+		stop_ = true;
+		// これ以降に書かれた行は同期モードで追記する。止める直前に書かれた行は最後にまとめて書き出す
+		running_.store(false, std::memory_order_release);
+	}
+	wake_.notify_one();
+	worker_.join();
+	Drain();
+}
+
+void Logger::Flush() {
+	if (!running_.load(std::memory_order_acquire)) return;
+	const size_t target = enqueue_.load(std::memory_order_acquire);
+	std::unique_lock<std::mutex> lock(wakeMutex_);
+	flushRequested_ = true;
+	wake_.notify_one();
+	// 書きかけのスロットがあると追い付かないので、待つのは少しだけにする
+	drained_.wait_for(lock, std::chrono::seconds(2), [&] { return dequeue_.load(std::memory_order_acquire) >= target || stop_; });
+}
+
+void Logger::Write(LogLevel level, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	WriteV(level, format, args);
+	va_end(args);
+}
+
+void Logger::WriteV(LogLevel level, const char* format, va_list args) {
+	if (!IsEnabled(level)) return;
+	if (!running_.load(std::memory_order_acquire)) {
+		WriteDirect(level, format, args);
+		return;
+	}
+
+	// 空きスロットを確保する（スロットの sequence が書き込み位置と同じなら空き）
+	size_t position = enqueue_.load(std::memory_order_relaxed);
+	Slot* slot = nullptr;
+	for (;;) {
+		slot = &slots_[position & (kCapacity - 1)];
+		const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+		const auto difference = static_cast<std::ptrdiff_t>(sequence - position);
+		if (difference == 0) {
+			if (enqueue_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+		} else if (difference < 0) {
+			// 一杯。呼び出し側を待たせず捨てて、書き出しスレッドが捨てた数を記録する
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+			urgent_.store(true, std::memory_order_relaxed);
+			wake_.notify_one();
+			return;
+		} else {
+			position = enqueue_.load(std::memory_order_relaxed);
+		}
+	}
+	slot->level = level;
+	slot->time = NowMilliseconds();
+	if (Format(*slot, format, args)) truncated_.fetch_add(1, std::memory_order_relaxed);
+	slot->sequence.store(position + 1, std::memory_order_release);
+
+	// 警告以上と、半分以上溜まった時だけ起こす（それ以外は kFlushInterval 毎にまとめて書く）
+	if (level >= LogLevel::Warning || position - dequeue_.load(std::memory_order_relaxed) >= kCapacity / 2) {
+		urgent_.store(true, std::memory_order_relaxed);
+		wake_.notify_one();
+	}
+}
+
+bool Logger::Format(Slot& slot, const char* format, va_list args) {
+	const int length = std::vsnprintf(slot.text, kLineBytes, format, args);
+	if (length < 0) {
+		slot.length = static_cast<uint32_t>(std::snprintf(slot.text, kLineBytes, "(invalid log format: %s)", format));
+		return false;
+	}
+	if (static_cast<size_t>(length) < kLineBytes) {
+		slot.length = static_cast<uint32_t>(length);
+		return false;
+	}
+	// 長すぎる行は末尾を元の長さの注記に置き換える
+	char marker[64];
+	const int markerLength = std::snprintf(marker, sizeof(marker), " ... (truncated, %d bytes)", length);
+	const size_t keep = kLineBytes - 1 - static_cast<size_t>(markerLength);
+	std::memcpy(slot.text + keep, marker, static_cast<size_t>(markerLength) + 1);
+	slot.length = static_cast<uint32_t>(kLineBytes - 1);
+	return true;
+}
+
+void Logger::WriteDirect(LogLevel level, const char* format, va_list args) {
+	std::lock_guard<std::mutex> lock(fileMutex_);
+	if (path_.empty()) return;
+	Slot slot;
+	slot.level = level;
+	slot.time = NowMilliseconds();
+	if (Format(slot, format, args)) truncated_.fetch_add(1, std::memory_order_relaxed);
+	if (FILE* fp = OpenForAppend()) {
+		WritePrefix(fp, slot.time, slot.level);
+		std::fwrite(slot.text, 1, slot.length, fp);
+		std::fputc('\n', fp);
+		std::fclose(fp);
+		++written_;
+	}
+}
+
+void Logger::Drain() {
+	std::lock_guard<std::mutex> lock(fileMutex_);
+	FILE* fp = nullptr;
+	size_t position = dequeue_.load(std::memory_order_relaxed);
+	for (;;) {
+		Slot& slot = slots_[position & (kCapacity - 1)];
+		if (slot.sequence.load(std::memory_order_acquire) != position + 1) break;
+		if (!fp && !path_.empty()) fp = OpenForAppend();
+		if (fp) {
+			WritePrefix(fp, slot.time, slot.level);
+			std::fwrite(slot.text, 1, slot.length, fp);
+			std::fputc('\n', fp);
+			++written_;
+		}
+		slot.sequence.store(position + kCapacity, std::memory_order_release);
+		dequeue_.store(++position, std::memory_order_release);
+	}
+	const uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+	if (dropped != reportedDrops_) {
+		if (!fp && !path_.empty()) fp = OpenForAppend();
+		if (fp) {
+			WritePrefix(fp, NowMilliseconds(), LogLevel::Warning);
+			std::fprintf(fp, "%llu log lines were dropped because the log buffer was full\n", static_cast<unsigned long long>(dropped - reportedDrops_));
+		}
+		reportedDrops_ = dropped;
+	}
+	if (fp) std::fclose(fp);
+}
+
+FILE* Logger::OpenForAppend() {
+	if (maxBytes_ > 0 && files_ > 0) {
+		std::error_code error;
+		const auto size = std::filesystem::file_size(path_, error);
+		if (!error && size >= maxBytes_) Rotate();
+	}
+	return OpenFile(path_, "a");
+}
+
+void Logger::Rotate() {
+	// debuglog.txt → debuglog.1.txt → debuglog.2.txt …（files_ より古いものは消える）
+	const std::filesystem::path path(path_);
+	const auto numbered = [&](int index) {
+		auto name = path;
+		return name.replace_filename(path.stem().string() + "." + std::to_string(index) + path.extension().string());
+	};
+	std::error_code error;
+	std::filesystem::remove(numbered(files_), error);
+	for (int index = files_ - 1; index >= 1; --index) std::filesystem::rename(numbered(index), numbered(index + 1), error);
+	// 別のプロセスが開いているなどで名前を変えられなければ、そのまま追記を続ける
+	std::filesystem::rename(path, numbered(1), error);
+	if (!error) ++rotations_;
+}
+
+void Logger::WorkerLoop() {
+	std::unique_lock<std::mutex> lock(wakeMutex_);
+	while (!stop_) {
+		wake_.wait_for(lock, kFlushInterval, [&] { return stop_ || flushRequested_ || urgent_.exchange(false, std::memory_order_relaxed); });
+		flushRequested_ = false;
+		lock.unlock();
+		Drain();
+		lock.lock();
+		drained_.notify_all();
+	}
+}
+
+Logger::Statistics Logger::GetStatistics() const {
+	std::lock_guard<std::mutex> lock(fileMutex_);
+	Statistics statistics;
+	statistics.written = written_;
+	statistics.dropped = dropped_.load(std::memory_order_relaxed);
+	statistics.truncated = truncated_.load(std::memory_order_relaxed);
+	statistics.rotations = rotations_;
+	return statistics;
+}
+
+}
@@ -0,0 +1,160 @@
+/**
+ * @file Logger.h
+ * @brief レベル付きのデバッグログ。呼び出し側はリングバッファに書くだけで、ファイルへの書き出しはバックグラウンドで行う
+ *
+ * 以前の print() は1行毎に debuglog.txt を開いて追記して閉じていたため、ポーリングやプロパティ変更の度に
+ * ファイルを開く時間とロック待ちが呼び出し側（ホストのスレッドやワーカー）にかかっていた。
+ * ここでは固定長の行スロットを並べたロックフリーのリングバッファに書式化するだけにし、
+ * 書き出しスレッドがまとめてファイルへ追記する。ファイルは書き出しの度に開いて閉じるので、
+ * 同じフォルダーの標準 / Nano Banana のフィルタが同じファイルに書いても、ローテーションで名前を変えても問題ない。
+ * 1行が長すぎる場合（ヒストリーの JSON など）は切り詰め、ファイルが大きくなったら debuglog.1.txt … へ回す。
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace ComfyUIPlugin {
+
+/// ログのレベル
+enum class LogLevel : int {
+	Trace = 0,	///< ポーリング毎の応答など、調査する時だけ見たいもの
+	Debug,		///< プロパティ変更や HTTP コマンドなど、細かい経過
+	Info,		///< 通常の経過（print() はこのレベル）
+	Warning,
+	Error,
+	Off,
+};
+
+}
+
+/// @brief このレベルより下のログ呼び出しは、コンパイル時に取り除く（引数の評価もしない）
+/// @note 既定ではリリースビルドで Trace を取り除く。ビルド時に -DCOMFYUI_LOG_MIN_LEVEL=0 などで変えられる。
+#ifndef COMFYUI_LOG_MIN_LEVEL
+#if defined(NDEBUG)
+#define COMFYUI_LOG_MIN_LEVEL 1
+#else
+#define COMFYUI_LOG_MIN_LEVEL 0
+#endif
+#endif
+
+#define COMFYUI_LOG(level, ...) \
+	do { \
+		if constexpr (static_cast<int>(level) >= COMFYUI_LOG_MIN_LEVEL) ::ComfyUIPlugin::Logger::Instance().Write(level, __VA_ARGS__); \
+	} while (false)
+#define LOG_TRACE(...) COMFYUI_LOG(::ComfyUIPlugin::LogLevel::Trace, __VA_ARGS__)
+#define LOG_DEBUG(...) COMFYUI_LOG(::ComfyUIPlugin::LogLevel::Debug, __VA_ARGS__)
+#define LOG_INFO(...) COMFYUI_LOG(::ComfyUIPlugin::LogLevel::Info, __VA_ARGS__)
+#define LOG_WARNING(...) COMFYUI_LOG(::ComfyUIPlugin::LogLevel::Warning, __VA_ARGS__)
+#define LOG_ERROR(...) COMFYUI_LOG(::ComfyUIPlugin::LogLevel::Error, __VA_ARGS__)
+
+namespace ComfyUIPlugin {
+
+class Logger {
+public:
+	/// 1行の最大バイト数（これを超える行は切り詰める）
+	static constexpr size_t kLineBytes = 2048;
+	/// リングバッファの行数（2のべき乗）
+	static constexpr size_t kCapacity = 1024;
+	/// 書き出しスレッドが溜まった行を書き出す間隔
+	static constexpr auto kFlushInterval = std::chrono::milliseconds(100);
+
+	/// 統計情報
+	struct Statistics {
+		uint64_t written = 0;		///< ファイルに書いた行数
+		uint64_t dropped = 0;		///< リングバッファが一杯で捨てた行数
+		uint64_t truncated = 0;		///< 切り詰めた行数
+		uint64_t rotations = 0;		///< ローテーションした回数
+	};
+
+	/// このモジュール（DLL）のロガー
+	static Logger& Instance();
+
+	Logger();
+	~Logger();
+	Logger(const Logger&) = delete;
+	Logger& operator=(const Logger&) = delete;
+
+	/// @brief 出力先のファイルを空にして使い始める
+	/// @note 書き出しスレッドを Start() するまでは、1行毎にファイルへ追記する（DLL の読み込み直後や終了処理中）
+	void Open(const std::string& path);
+
+	/// @brief ファイルの大きさの上限と、残す古いファイルの数（0ならローテーションしない）
+	void SetRotation(unsigned long long maxBytes, int files);
+
+	/// 出力するレベルの下限（コンパイル時の COMFYUI_LOG_MIN_LEVEL より下は常に出ない）
+	void SetLevel(LogLevel level) { level_.store(static_cast<int>(level), std::memory_order_relaxed); }
+	LogLevel GetLevel() const { return static_cast<LogLevel>(level_.load(std::memory_order_relaxed)); }
+	bool IsEnabled(LogLevel level) const { return static_cast<int>(level) >= level_.load(std::memory_order_relaxed); }
+
+	/// 書き出しスレッドを開始する
+	void Start();
+	/// @brief 溜まっている行を書き出してから、書き出しスレッドを止める
+	/// @note DLL の解放中にスレッドを join するとデッドロックするので、モジュール終了時に呼ぶ
+	void Stop();
+	/// 呼んだ時点までに書かれた行がファイルに書き出されるまで待つ
+	void Flush();
+
+	/// 1行書く（改行は付ける）
+	void Write(LogLevel level, const char* format, ...);
+	void WriteV(LogLevel level, const char* format, va_list args);
+
+	Statistics GetStatistics() const;
+
+private:
+	struct Slot {
+		std::atomic<size_t> sequence{ 0 };
+		LogLevel level = LogLevel::Info;
+		long long time = 0;		///< 書いた時刻（エポックからのミリ秒）
+		uint32_t length = 0;
+		char text[kLineBytes];
+	};
+
+	/// 書式化してスロットに入れる。切り詰めた場合はtrue
+	static bool Format(Slot& slot, const char* format, va_list args);
+	/// 同期モードでファイルへ1行追記する
+	void WriteDirect(LogLevel level, const char* format, va_list args);
+	/// リングバッファの行を全部ファイルへ書き出す（書き出しスレッドか Stop() から）
+	void Drain();
+	/// 必要ならローテーションしてからファイルを開く
+	FILE* OpenForAppend();
+	void Rotate();
+	void WorkerLoop();
+
+	std::unique_ptr<Slot[]> slots_;
+	alignas(64) std::atomic<size_t> enqueue_{ 0 };
+	alignas(64) std::atomic<size_t> dequeue_{ 0 };
+	std::atomic<int> level_{ static_cast<int>(LogLevel::Info) };
+	std::atomic<bool> running_{ false };
+	/// 書き出しスレッドをすぐに起こしたい（警告以上、またはリングが半分以上溜まった）
+	std::atomic<bool> urgent_{ false };
+	std::atomic<uint64_t> dropped_{ 0 };
+	std::atomic<uint64_t> truncated_{ 0 };
+	uint64_t reportedDrops_ = 0;
+
+	/// ファイルへの書き込み（書き出しスレッドと同期モードの追記）を排他する
+	mutable std::mutex fileMutex_;
+	std::string path_;
+	unsigned long long maxBytes_ = 4ULL * 1024 * 1024;
+	int files_ = 3;
+	uint64_t written_ = 0;
+	uint64_t rotations_ = 0;
+
+	std::mutex wakeMutex_;
+	std::condition_variable wake_;
+	std::condition_variable drained_;
+	bool stop_ = false;
+	bool flushRequested_ = false;
+	std::thread worker_;
+};
+
+}
@@ -0,0 +1,285 @@
+/**
+ * @file Metrics.cpp
+ * @brief セッションをまたいで積算する性能の統計（Prometheus のテキスト形式で保存する）
+ */
+#include "pch.h"
+
+#include "Metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace ComfyUIPlugin {
+
+namespace {
+
+/// 段階の時間のヒストグラムのメトリクス名
+const char* const kStageMetric = "comfyui_plugin_stage_duration_seconds";
+
+/// カウンターとゲージの説明（# HELP に書く）
+const std::pair<const char*, const char*> kHelp[] = {
+	{ "comfyui_plugin_runs_total", "Filter iterations that wrote a generated result to the layer." },
+	{ "comfyui_plugin_uploaded_bytes_total", "Bytes of images uploaded to the ComfyUI server." },
+	{ "comfyui_plugin_downloaded_bytes_total", "Bytes of generated images downloaded from the ComfyUI server." },
+	{ "comfyui_plugin_result_cache_hits_total", "Runs served from the on-disk result cache." },
+	{ "comfyui_plugin_result_cache_misses_total", "Result cache lookups that had to generate." },
+	{ "comfyui_plugin_errors_total", "Failures by kind (upload, submit, execution, timeout, download, decode)." },
+	{ "comfyui_plugin_buffer_acquired_bytes_total", "Bytes of image buffers acquired from the buffer pool, per pipeline stage." },
+	{ "comfyui_plugin_buffer_acquisitions_total", "Image buffers acquired from the buffer pool, per pipeline stage." },
+	{ "comfyui_plugin_buffer_peak_bytes", "Largest image buffer bytes held at once during one run, per pipeline stage (all stages: stage=\"all\")." },
+};
+
+std::string FormatNumber(double value) {
+	char text[32];
+	std::snprintf(text, sizeof(text), "%.17g", value);
+	return text;
+}
+
+/// @brief "name{labels} value" の行を分解する（ラベルの値のエスケープは戻す）
+bool ParseLine(const std::string& line, std::string& name, Metrics::Labels& labels, double& value) {
+	const size_t brace = line.find('{');
+	size_t position = 0;
+	labels.clear();
+	if (brace == std::string::npos) {
+		position = line.find(' ');
+		if (position == std::string::npos) return false;
+		name = line.substr(0, position);
+	} else {
+		name = line.substr(0, brace);
+		position = brace + 1;
+		while (position < line.size() && line[position] != '}') {
+			const size_t equal = line.find("=\"", position);
+			if (equal == std::string::npos) return false;
+			std::string key = line.substr(position, equal - position), text;
+			position = equal + 2;
+			for (; position < line.size() && line[position] != '"'; ++position) {
+				if (line[position] == '\\' && position + 1 < line.size()) {
+					const char next = line[++position];
+					text += next == 'n' ? '\n' : next;
+				} else {
+					text += line[position];
+				}
+			}
+			labels.emplace_back(std::move(key), std::move(text));
+			++position;
+			if (position < line.size() && line[position] == ',') ++position;
+		}
+		++position;
+	}
+	try {
+		value = std::stod(line.substr(position));
+	} catch (const std::exception&) {
+		return false;
+	}
+	return true;
+}
+
+/// ラベルの値（無ければ空文字列）を取り出し、ラベルからは削除する
+std::string TakeLabel(Metrics::Labels& labels, const std::string& key) {
+	for (auto it = labels.begin(); it != labels.end(); ++it) {
+		if (it->first != key) continue;
+		std::string value = it->second;
+		labels.erase(it);
+		return value;
+	}
+	return "";
+}
+
+}
+
+double Metrics::BucketBound(int index) {
+	return kFirstBucketSeconds * std::ldexp(1.0, index);
+}
+
+void Metrics::Histogram::Observe(double seconds) {
+	int index = 0;
+	while (index < kBucketCount && seconds > BucketBound(index)) ++index;
+	++counts[index];
+	++count;
+	sum += seconds;
+}
+
+double Metrics::Histogram::Quantile(double q) const {
+	if (count == 0) return 0.0;
+	const double target = q * static_cast<double>(count);
+	double cumulative = 0.0;
+	for (int index = 0; index <= kBucketCount; ++index) {
+		const double inBucket = static_cast<double>(counts[index]);
+		if (inBucket > 0.0 && cumulative + inBucket >= target) {
+			const double lower = index == 0 ? 0.0 : BucketBound(index - 1);
+			// 上限を超えたバケットは幅が分からないので、下限を返す
+			if (index == kBucketCount) return lower;
+			return lower + (BucketBound(index) - lower) * std::clamp((target - cumulative) / inBucket, 0.0, 1.0);
+		}
+		cumulative += inBucket;
+	}
+	return BucketBound(kBucketCount - 1);
+}
+
+void Metrics::Histogram::Merge(const Histogram& other) {
+	for (size_t i = 0; i < counts.size(); ++i) counts[i] += other.counts[i];
+	count += other.count;
+	sum += other.sum;
+}
+
+std::string Metrics::EscapeLabel(const std::string& value) {
+	std::string escaped;
+	for (const char c : value) {
+		if (c == '\\' || c == '"') escaped += '\\';
+		if (c == '\n') { escaped += "\\n"; continue; }
+		escaped += c;
+	}
+	return escaped;
+}
+
+std::string Metrics::LabelString(const Labels& labels) const {
+	std::string text = "filter=\"" + EscapeLabel(filter_) + "\"";
+	for (const auto& label : labels) text += "," + label.first + "=\"" + EscapeLabel(label.second) + "\"";
+	return text;
+}
+
+void Metrics::Configure(const std::string& path, const std::string& filter) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	path_ = path;
+	filter_ = filter;
+	histograms_.clear();
+	counters_.clear();
+	gauges_.clear();
+	if (!path_.empty()) Load();
+}
+
+bool Metrics::Enabled() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return !path_.empty();
+}
+
+void Metrics::ObserveStage(const std::string& stage, const std::string& templateName, const std::string& server, double seconds) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (path_.empty()) return;
+	histograms_[stage][LabelString({ { "stage", stage }, { "template", templateName }, { "server", server } })].Observe(std::max(seconds, 0.0));
+}
+
+void Metrics::Add(const std::string& name, const Labels& labels, double value) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (path_.empty()) return;
+	counters_[name][LabelString(labels)] += value;
+}
+
+void Metrics::SetMax(const std::string& name, const Labels& labels, double value) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (path_.empty()) return;
+	auto& gauge = gauges_[name].try_emplace(LabelString(labels), value).first->second;
+	gauge = std::max(gauge, value);
+}
+
+bool Metrics::Load() {
+	std::ifstream file(path_, std::ios::binary);
+	if (!file) return false;
+	const std::string bucketName = std::string(kStageMetric) + "_bucket", sumName = std::string(kStageMetric) + "_sum";
+	std::string line, name;
+	Labels labels;
+	double value = 0.0;
+	while (std::getline(file, line)) {
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+		if (line.empty() || line[0] == '#' || !ParseLine(line, name, labels, value)) continue;
+		TakeLabel(labels, "filter");
+		if (name == bucketName) {
+			// バケットは累積の数なので、1つ下のバケットとの差に戻す
+			const std::string le = TakeLabel(labels, "le");
+			Labels stageLabels = labels;
+			auto& histogram = histograms_[TakeLabel(stageLabels, "stage")][LabelString(labels)];
+			int index = kBucketCount;
+			if (le != "+Inf") {
+				try {
+					const double bound = std::stod(le);
+					for (index = 0; index < kBucketCount && std::abs(BucketBound(index) - bound) > bound * 1e-9; ++index) {}
+				} catch (const std::exception&) {
+					continue;
+				}
+				if (index == kBucketCount) continue;
+			}
+			uint64_t below = 0;
+			for (int i = 0; i < index; ++i) below += histogram.counts[i];
+			const auto cumulative = static_cast<uint64_t>(value);
+			histogram.counts[index] = cumulative > below ? cumulative - below : 0;
+			histogram.count = below + histogram.counts[index];
+		} else if (name == sumName) {
+			Labels stageLabels = labels;
+			histograms_[TakeLabel(stageLabels, "stage")][LabelString(labels)].sum = value;
+		} else if (name.size() > 6 && name.compare(name.size() - 6, 6, "_total") == 0) {
+			counters_[name][LabelString(labels)] = value;
+		} else if (name.compare(0, std::string(kStageMetric).size(), kStageMetric) != 0) {
+			gauges_[name][LabelString(labels)] = value;
+		}
+	}
+	return true;
+}
+
+bool Metrics::Save() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (path_.empty()) return false;
+	std::ostringstream text;
+	text << "# HELP " << kStageMetric << " Duration of each stage of a filter run, per template and server.\n";
+	text << "# TYPE " << kStageMetric << " histogram\n";
+	for (const auto& stage : histograms_) {
+		for (const auto& series : stage.second) {
+			const auto& histogram = series.second;
+			uint64_t cumulative = 0;
+			for (int index = 0; index < kBucketCount; ++index) {
+				cumulative += histogram.counts[index];
+				text << kStageMetric << "_bucket{" << series.first << ",le=\"" << FormatNumber(BucketBound(index)) << "\"} " << cumulative << "\n";
+			}
+			text << kStageMetric << "_bucket{" << series.first << ",le=\"+Inf\"} " << histogram.count << "\n";
+			text << kStageMetric << "_sum{" << series.first << "} " << FormatNumber(histogram.sum) << "\n";
+			text << kStageMetric << "_count{" << series.first << "} " << histogram.count << "\n";
+		}
+	}
+	const auto writeFamilies = [&](const std::map<std::string, std::map<std::string, double>>& families, const char* type) {
+		for (const auto& family : families) {
+			const char* help = type;
+			for (const auto& entry : kHelp) if (family.first == entry.first) help = entry.second;
+			text << "# HELP " << family.first << " " << help << "\n";
+			text << "# TYPE " << family.first << " " << type << "\n";
+			for (const auto& series : family.second) text << family.first << "{" << series.first << "} " << FormatNumber(series.second) << "\n";
+		}
+	};
+	writeFamilies(counters_, "counter");
+	writeFamilies(gauges_, "gauge");
+
+	// 収集側が書きかけのファイルを読まないよう、一時ファイルに書いてから置き換える
+	const std::string temporaryPath = path_ + ".tmp";
+	{
+		std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+		if (!file) return false;
+		file << text.str();
+		if (!file.flush()) return false;
+	}
+	std::error_code error;
+	std::filesystem::rename(temporaryPath, path_, error);
+	if (error) {
+		std::filesystem::remove(temporaryPath, error);
+		return false;
+	}
+	return true;
+}
+
+std::vector<std::string> Metrics::Summary() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::vector<std::string> lines;
+	for (const auto& stage : histograms_) {
+		Histogram merged;
+		for (const auto& series : stage.second) merged.Merge(series.second);
+		if (merged.count == 0) continue;
+		char line[256];
+		std::snprintf(line, sizeof(line), "%-12s n=%llu p50 %.2f s, p95 %.2f s, p99 %.2f s (%d series)", stage.first.c_str(), static_cast<unsigned long long>(merged.count),
+			merged.Quantile(0.50), merged.Quantile(0.95), merged.Quantile(0.99), static_cast<int>(stage.second.size()));
+		lines.push_back(line);
+	}
+	return lines;
+}
+
+}
@@ -0,0 +1,84 @@
+/**
+ * @file Metrics.h
+ * @brief セッションをまたいで積算する性能の統計（段階毎の時間のヒストグラム・転送量・キャッシュ・エラーの回数）
+ *
+ * 段階（全体・アップロード・キュー待ち・実行・ダウンロード・書き戻し）の時間は、テンプレートとサーバー毎に
+ * 倍々の幅のバケットを持つヒストグラムに数える。最大値だけを残すゲージ（1回の実行のメモリのピークなど）も持つ。プラグインフォルダーに Prometheus のテキスト形式で保存し、
+ * 次のセッションではそのファイルを読み込んで続きから数える（運用側はこのファイルを収集する）。
+ * 保存は一時ファイルに書いてから名前を変えるので、途中の状態のファイルを読まれることはない。
+ */
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ComfyUIPlugin {
+
+class Metrics {
+public:
+	/// ヒストグラムのバケット数（+Inf を除く）。上限は kFirstBucketSeconds から倍々にする（0.01 秒～約 87 分）
+	static constexpr int kBucketCount = 20;
+	static constexpr double kFirstBucketSeconds = 0.01;
+
+	/// ラベル（名前と値の組）
+	using Labels = std::vector<std::pair<std::string, std::string>>;
+
+	/// ヒストグラム
+	struct Histogram {
+		std::array<uint64_t, kBucketCount + 1> counts{};	///< バケット毎の数（最後は上限を超えたもの）
+		uint64_t count = 0;
+		double sum = 0.0;
+
+		void Observe(double seconds);
+		/// @brief q（0～1）分位点の推定値（バケット内は線形補間）。空なら 0
+		double Quantile(double q) const;
+		void Merge(const Histogram& other);
+	};
+
+	/// バケット index の上限（秒）
+	static double BucketBound(int index);
+
+	/// @brief 保存先と、全ての系列に付ける filter ラベルの値を設定し、保存済みの値を読み込む
+	/// @param path 空なら記録しない
+	void Configure(const std::string& path, const std::string& filter);
+	bool Enabled() const;
+
+	/// 段階の時間を記録する
+	void ObserveStage(const std::string& stage, const std::string& templateName, const std::string& server, double seconds);
+	/// カウンターに加える（name は _total まで含めたメトリクス名）
+	void Add(const std::string& name, const Labels& labels, double value = 1.0);
+	/// ゲージを、これまでの値より大きければ value にする
+	void SetMax(const std::string& name, const Labels& labels, double value);
+
+	/// @brief ファイルに保存する
+	/// @return 保存できなかった場合はfalse
+	bool Save() const;
+
+	/// @brief 段階毎（テンプレート・サーバーをまとめたもの）の回数と p50/p95/p99 を1行ずつ返す
+	std::vector<std::string> Summary() const;
+
+	/// Prometheus のラベルの値としてエスケープする
+	static std::string EscapeLabel(const std::string& value);
+
+private:
+	/// filter ラベルを先頭に付けた、{} の中身の文字列
+	std::string LabelString(const Labels& labels) const;
+	bool Load();
+
+	mutable std::mutex mutex_;
+	std::string path_;
+	std::string filter_;
+	/// 段階名 → ラベルの文字列 → ヒストグラム
+	std::map<std::string, std::map<std::string, Histogram>> histograms_;
+	/// メトリクス名 → ラベルの文字列 → 値
+	std::map<std::string, std::map<std::string, double>> counters_;
+	/// メトリクス名 → ラベルの文字列 → 最大値
+	std::map<std::string, std::map<std::string, double>> gauges_;
+};
+
+}
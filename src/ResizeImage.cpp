@@ -0,0 +1,199 @@
+/**
+ * @file ResizeImage.cpp
+ * @brief 8bit RGB 画像の拡大縮小（Lanczos3）
+ *
+ * 横方向→縦方向の順に1次元のフィルタを掛ける。重みは 14bit の固定小数点で持ち、
+ * 縦方向は行単位の積和なので SSE2/NEON で8画素ずつまとめて計算する。
+ */
+#include "pch.h"
+
+#include "ResizeImage.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define RESIZE_USE_SSE2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RESIZE_USE_NEON 1
+#endif
+
+namespace {
+
+constexpr int kWeightBits = 14;
+constexpr int kWeightOne = 1 << kWeightBits;
+constexpr double kLanczosRadius = 3.0;
+
+/// false なら SIMD の分岐を通らず、スカラーのループだけで計算する
+std::atomic<bool> g_SimdEnabled{ true };
+
+double Lanczos3(double x) {
+	constexpr double kPi = 3.14159265358979323846;
+	x = std::abs(x);
+	if (x < 1e-8) return 1.0;
+	if (x >= kLanczosRadius) return 0.0;
+	const double px = kPi * x;
+	return kLanczosRadius * std::sin(px) * std::sin(px / kLanczosRadius) / (px * px);
+}
+
+/// 出力1画素分のフィルタ（入力の first から weights.size() 画素）
+struct Contribution {
+	int first = 0;
+	std::vector<int> weights;
+};
+
+/// @brief 1方向分のフィルタを作る。範囲外の重みは端の画素に寄せる。
+std::vector<Contribution> MakeContributions(int srcLength, int dstLength) {
+	const double scale = static_cast<double>(srcLength) / dstLength;
+	const double filterScale = std::max(scale, 1.0);
+	const double support = kLanczosRadius * filterScale;
+	std::vector<Contribution> result(static_cast<size_t>(dstLength));
+	std::vector<double> raw;
+	for (int i = 0; i < dstLength; ++i) {
+		const double center = (i + 0.5) * scale - 0.5;
+		const int lo = static_cast<int>(std::floor(center - support)) + 1;
+		const int hi = static_cast<int>(std::floor(center + support));
+		const int first = std::clamp(lo, 0, srcLength - 1);
+		const int last = std::clamp(hi, 0, srcLength - 1);
+		raw.assign(static_cast<size_t>(last - first + 1), 0.0);
+		double total = 0.0;
+		for (int j = lo; j <= hi; ++j) {
+			const double w = Lanczos3((j - center) / filterScale);
+			raw[static_cast<size_t>(std::clamp(j, first, last) - first)] += w;
+			total += w;
+		}
+		auto& contribution = result[static_cast<size_t>(i)];
+		contribution.first = first;
+		contribution.weights.resize(raw.size());
+		int sum = 0;
+		size_t largest = 0;
+		for (size_t k = 0; k < raw.size(); ++k) {
+			contribution.weights[k] = static_cast<int>(std::lround(raw[k] / total * kWeightOne));
+			sum += contribution.weights[k];
+			if (contribution.weights[k] > contribution.weights[largest]) largest = k;
+		}
+		// 丸め誤差は一番大きい重みに寄せて、合計をちょうど 1.0 にする
+		contribution.weights[largest] += kWeightOne - sum;
+	}
+	return result;
+}
+
+inline unsigned char ClampToByte(int value) {
+	value = (value + (kWeightOne >> 1)) >> kWeightBits;
+	return static_cast<unsigned char>(std::clamp(value, 0, 255));
+}
+
+/// 横方向のフィルタを1行に掛ける
+void ResampleRow(const unsigned char* src, unsigned char* dst, const std::vector<Contribution>& contributions) {
+	for (size_t x = 0; x < contributions.size(); ++x) {
+		const auto& contribution = contributions[x];
+		const unsigned char* p = src + static_cast<size_t>(contribution.first) * 3;
+		int r = 0, g = 0, b = 0;
+		for (const int w : contribution.weights) {
+			r += p[0] * w;
+			g += p[1] * w;
+			b += p[2] * w;
+			p += 3;
+		}
+		dst[x * 3 + 0] = ClampToByte(r);
+		dst[x * 3 + 1] = ClampToByte(g);
+		dst[x * 3 + 2] = ClampToByte(b);
+	}
+}
+
+/// 縦方向のフィルタを掛けて1行を作る（rows[k] に weights[k] を掛けて足す。simd が false ならスカラーだけ）
+void ResampleColumn(const unsigned char* const* rows, const int* weights, int taps, unsigned char* dst, size_t length, bool simd) {
+	size_t i = 0;
+#if defined(RESIZE_USE_SSE2)
+	// 2行ずつ16bitに広げて並べ、_mm_madd_epi16 で (a * w0 + b * w1) を32bitで求める
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(kWeightOne >> 1);
+	for (; simd && i + 8 <= length; i += 8) {
+		__m128i sumLow = _mm_setzero_si128(), sumHigh = _mm_setzero_si128();
+		int k = 0;
+		for (; k + 1 < taps; k += 2) {
+			const __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(rows[k] + i)), zero);
+			const __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(rows[k + 1] + i)), zero);
+			const __m128i coefficient = _mm_set1_epi32(static_cast<int>((static_cast<unsigned>(weights[k + 1]) << 16) | (static_cast<unsigned>(weights[k]) & 0xFFFFu)));
+			sumLow = _mm_add_epi32(sumLow, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), coefficient));
+			sumHigh = _mm_add_epi32(sumHigh, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), coefficient));
+		}
+		if (k < taps) {
+			const __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(rows[k] + i)), zero);
+			const __m128i coefficient = _mm_set1_epi32(weights[k] & 0xFFFF);
+			sumLow = _mm_add_epi32(sumLow, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), coefficient));
+			sumHigh = _mm_add_epi32(sumHigh, _mm_madd_epi16(_mm_unpackhi_epi16(a, zero), coefficient));
+		}
+		sumLow = _mm_srai_epi32(_mm_add_epi32(sumLow, round), kWeightBits);
+		sumHigh = _mm_srai_epi32(_mm_add_epi32(sumHigh, round), kWeightBits);
+		const __m128i packed = _mm_packus_epi16(_mm_packs_epi32(sumLow, sumHigh), zero);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + i), packed);
+	}
+#elif defined(RESIZE_USE_NEON)
+	for (; simd && i + 8 <= length; i += 8) {
+		int32x4_t sumLow = vdupq_n_s32(kWeightOne >> 1), sumHigh = vdupq_n_s32(kWeightOne >> 1);
+		for (int k = 0; k < taps; ++k) {
+			const int16x8_t v = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(rows[k] + i)));
+			sumLow = vmlal_n_s16(sumLow, vget_low_s16(v), static_cast<int16_t>(weights[k]));
+			sumHigh = vmlal_n_s16(sumHigh, vget_high_s16(v), static_cast<int16_t>(weights[k]));
+		}
+		const int16x8_t narrowed = vcombine_s16(vqshrn_n_s32(sumLow, kWeightBits), vqshrn_n_s32(sumHigh, kWeightBits));
+		vst1_u8(dst + i, vqmovun_s16(narrowed));
+	}
+#endif
+	for (; i < length; ++i) {
+		int sum = 0;
+		for (int k = 0; k < taps; ++k) sum += rows[k][i] * weights[k];
+		dst[i] = ClampToByte(sum);
+	}
+}
+
+}
+
+namespace ResizeImage {
+
+bool ResizeRgb(const unsigned char* src, int srcWidth, int srcHeight,
+	unsigned char* dst, int dstWidth, int dstHeight, ComfyUIPlugin::BufferPool& pool) {
+	if (!src || !dst || srcWidth <= 0 || srcHeight <= 0 || dstWidth <= 0 || dstHeight <= 0) return false;
+	const size_t srcStride = static_cast<size_t>(srcWidth) * 3;
+	const size_t dstStride = static_cast<size_t>(dstWidth) * 3;
+	if (srcWidth == dstWidth && srcHeight == dstHeight) {
+		std::copy(src, src + srcStride * srcHeight, dst);
+		return true;
+	}
+
+	// 1. 横方向（幅だけ dstWidth にした中間画像を作る）
+	const auto horizontal = MakeContributions(srcWidth, dstWidth);
+	auto intermediate = pool.Acquire(dstStride * srcHeight);
+	if (!intermediate) return false;
+	for (int y = 0; y < srcHeight; ++y) {
+		ResampleRow(src + srcStride * y, intermediate.data() + dstStride * y, horizontal);
+	}
+
+	// 2. 縦方向
+	const auto vertical = MakeContributions(srcHeight, dstHeight);
+	const bool simd = g_SimdEnabled.load(std::memory_order_relaxed);
+	std::vector<const unsigned char*> rows;
+	for (int y = 0; y < dstHeight; ++y) {
+		const auto& contribution = vertical[static_cast<size_t>(y)];
+		const int taps = static_cast<int>(contribution.weights.size());
+		rows.resize(static_cast<size_t>(taps));
+		for (int k = 0; k < taps; ++k) rows[static_cast<size_t>(k)] = intermediate.data() + dstStride * (contribution.first + k);
+		ResampleColumn(rows.data(), contribution.weights.data(), taps, dst + dstStride * y, dstStride, simd);
+	}
+	return true;
+}
+
+bool SetSimdEnabled(bool enabled) {
+	g_SimdEnabled.store(enabled, std::memory_order_relaxed);
+#if defined(RESIZE_USE_SSE2) || defined(RESIZE_USE_NEON)
+	return true;
+#else
+	return false;
+#endif
+}
+
+}
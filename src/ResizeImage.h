@@ -0,0 +1,25 @@
+/**
+ * @file ResizeImage.h
+ * @brief 8bit RGB 画像の拡大縮小（Lanczos3）
+ *
+ * 大きな入力をモデルの画素数の上限に収まるよう縮小して送り、
+ * 入力と異なるサイズで返ってきた生成結果を元のサイズへ戻すために使う。
+ */
+#pragma once
+
+#include "BufferPool.h"
+
+namespace ResizeImage {
+
+/// @brief RGB（3バイト/画素、行間隔は幅×3）の画像を Lanczos3 で拡大縮小する
+/// @param pool 作業用バッファの確保先
+/// @note 縮小時はフィルタの幅を縮小率に合わせて広げるので、面積平均に近いエイリアスの少ない結果になる。
+/// @return 作業用バッファを確保できなかった場合や、サイズが不正な場合は false
+bool ResizeRgb(const unsigned char* src, int srcWidth, int srcHeight,
+	unsigned char* dst, int dstWidth, int dstHeight, ComfyUIPlugin::BufferPool& pool);
+
+/// @brief 縦方向の計算に SSE2/NEON を使うか（既定は使う。ベンチマークで SIMD なしと比べるため）
+/// @return SIMD なしでビルドした場合は false（その場合は enabled にかかわらずスカラーで計算する）
+bool SetSimdEnabled(bool enabled);
+
+}
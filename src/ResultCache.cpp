@@ -0,0 +1,161 @@
+/**
+ * @file ResultCache.cpp
+ * @brief 生成結果をプラグインフォルダーに保存しておき、同じ条件で再実行した場合は生成せずに使うキャッシュ
+ */
+#include "pch.h"
+
+#include "ResultCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+namespace ComfyUIPlugin {
+
+void Fnv1a64::Update(const void* data, size_t bytes) {
+	const auto* p = static_cast<const unsigned char*>(data);
+	uint64_t hash = hash_;
+	for (size_t i = 0; i < bytes; ++i) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	hash_ = hash;
+}
+
+void Fnv1a64::Add(const std::string& text) {
+	const uint64_t length = text.size();
+	Update(&length, sizeof(length));
+	Update(text.data(), text.size());
+}
+
+bool Fnv1a64::AddFile(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file) return false;
+	std::vector<char> chunk(1 << 20);
+	uint64_t length = 0;
+	while (file) {
+		file.read(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+		const auto count = static_cast<size_t>(file.gcount());
+		Update(chunk.data(), count);
+		length += count;
+	}
+	if (file.bad()) return false;
+	Update(&length, sizeof(length));
+	return true;
+}
+
+std::string Fnv1a64::Hex() const {
+	char text[17];
+	std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(hash_));
+	return text;
+}
+
+void ResultCache::Configure(const std::string& directory, unsigned long long maxBytes) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	directory_ = directory;
+	maxBytes_ = maxBytes;
+	entries_.clear();
+	statistics_ = Statistics{};
+	if (maxBytes_ == 0) return;
+
+	// 前回までに保存した結果を読み込む（書き込み途中の .tmp は捨てる）
+	std::error_code error;
+	std::filesystem::create_directories(directory_, error);
+	for (std::filesystem::directory_iterator it(directory_, error), end; !error && it != end; it.increment(error)) {
+		if (!it->is_regular_file(error)) continue;
+		const auto& path = it->path();
+		if (path.extension() == ".tmp") {
+			std::filesystem::remove(path, error);
+			continue;
+		}
+		const auto bytes = it->file_size(error);
+		const auto lastUsed = it->last_write_time(error);
+		if (error) continue;
+		entries_[path.stem().string()] = { path, bytes, lastUsed };
+		statistics_.bytes += bytes;
+	}
+	statistics_.entries = entries_.size();
+	EvictLocked("");
+}
+
+bool ResultCache::Enabled() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return maxBytes_ > 0;
+}
+
+std::string ResultCache::Find(const std::string& key) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (maxBytes_ == 0) return "";
+	const auto it = entries_.find(key);
+	std::error_code error;
+	if (it == entries_.end() || !std::filesystem::exists(it->second.path, error)) {
+		if (it != entries_.end()) {
+			// フォルダーから手で消された場合
+			statistics_.bytes -= it->second.bytes;
+			entries_.erase(it);
+			statistics_.entries = entries_.size();
+		}
+		++statistics_.misses;
+		return "";
+	}
+	it->second.lastUsed = std::filesystem::file_time_type::clock::now();
+	std::filesystem::last_write_time(it->second.path, it->second.lastUsed, error);
+	++statistics_.hits;
+	return it->second.path.string();
+}
+
+bool ResultCache::Store(const std::string& key, const std::string& resultPath) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (maxBytes_ == 0) return false;
+	// 書き込み途中で終了しても壊れた結果を使わないよう、一時ファイルに書いてから名前を変える
+	std::error_code error;
+	const std::filesystem::path source(resultPath);
+	const auto path = directory_ / (key + source.extension().string());
+	auto temporaryPath = path;
+	temporaryPath += ".tmp";
+	if (!std::filesystem::copy_file(source, temporaryPath, std::filesystem::copy_options::overwrite_existing, error)) return false;
+	std::filesystem::rename(temporaryPath, path, error);
+	if (error) {
+		std::filesystem::remove(temporaryPath, error);
+		return false;
+	}
+	const auto bytes = std::filesystem::file_size(path, error);
+	if (error) return false;
+
+	const auto existing = entries_.find(key);
+	if (existing != entries_.end()) {
+		statistics_.bytes -= existing->second.bytes;
+		if (existing->second.path != path) std::filesystem::remove(existing->second.path, error);
+	}
+	entries_[key] = { path, bytes, std::filesystem::file_time_type::clock::now() };
+	statistics_.bytes += bytes;
+	statistics_.entries = entries_.size();
+	++statistics_.stores;
+	EvictLocked(key);
+	return true;
+}
+
+/// 合計が上限以下になるまで、最後に使ってから時間が経ったものから削除する（keep は今保存したものなので残す）
+void ResultCache::EvictLocked(const std::string& keep) {
+	while (statistics_.bytes > maxBytes_) {
+		auto oldest = entries_.end();
+		for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+			if (it->first == keep) continue;
+			if (oldest == entries_.end() || it->second.lastUsed < oldest->second.lastUsed) oldest = it;
+		}
+		if (oldest == entries_.end()) break;
+		std::error_code error;
+		std::filesystem::remove(oldest->second.path, error);
+		statistics_.bytes -= oldest->second.bytes;
+		entries_.erase(oldest);
+		++statistics_.evictions;
+	}
+	statistics_.entries = entries_.size();
+}
+
+ResultCache::Statistics ResultCache::GetStatistics() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return statistics_;
+}
+
+}
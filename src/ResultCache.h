@@ -0,0 +1,89 @@
+/**
+ * @file ResultCache.h
+ * @brief 生成結果をプラグインフォルダーに保存しておき、同じ条件で再実行した場合は生成せずに使うキャッシュ
+ *
+ * キーはマーカーを置換したワークフローと、入力画像・サブ画像の内容のハッシュから作る。
+ * シードが固定のテンプレートなら、Restart や同じ設定での再実行でアップロード・キュー・GPU の時間を丸ごと省ける。
+ * 合計サイズが上限を超えたら、最後に使ってから時間が経ったものから削除する（最終使用時刻はファイルの更新日時で持つ）。
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace ComfyUIPlugin {
+
+/// 64bit FNV-1a ハッシュ
+class Fnv1a64 {
+public:
+	void Update(const void* data, size_t bytes);
+
+	/// 長さも含めて追加する（続けて追加した文字列の区切りが変わると別のハッシュになる）
+	void Add(const std::string& text);
+
+	/// @brief ファイルの内容を追加する
+	/// @return 読めなかった場合はfalse
+	bool AddFile(const std::string& path);
+
+	uint64_t Digest() const { return hash_; }
+
+	/// 16桁の16進数
+	std::string Hex() const;
+
+private:
+	uint64_t hash_ = 14695981039346656037ULL;
+};
+
+class ResultCache {
+public:
+	/// 統計情報（Configure からの累計）
+	struct Statistics {
+		size_t hits = 0;			///< 保存済みの結果を使えた回数
+		size_t misses = 0;			///< 保存済みの結果が無かった回数
+		size_t stores = 0;			///< 結果を保存した回数
+		size_t evictions = 0;		///< 上限を超えて削除した数
+		size_t entries = 0;			///< 保存している結果の数
+		unsigned long long bytes = 0;	///< 保存している結果の合計サイズ
+	};
+
+	ResultCache() = default;
+	ResultCache(const ResultCache&) = delete;
+	ResultCache& operator=(const ResultCache&) = delete;
+
+	/// @brief 保存先と上限を設定し、保存済みの結果を読み込む
+	/// @param directory 保存先のフォルダー（無ければ作る）
+	/// @param maxBytes 合計サイズの上限（0ならキャッシュしない）
+	void Configure(const std::string& directory, unsigned long long maxBytes);
+
+	bool Enabled() const;
+
+	/// @brief key の結果を保存していれば、そのパスを返して最終使用時刻を更新する
+	/// @return 無い場合は空文字列
+	std::string Find(const std::string& key);
+
+	/// @brief resultPath のファイルを key の結果として保存し、上限を超えた分を古いものから削除する
+	bool Store(const std::string& key, const std::string& resultPath);
+
+	Statistics GetStatistics() const;
+
+private:
+	struct Entry {
+		std::filesystem::path path;
+		unsigned long long bytes;
+		std::filesystem::file_time_type lastUsed;
+	};
+
+	void EvictLocked(const std::string& keep);
+
+	mutable std::mutex mutex_;
+	std::filesystem::path directory_;
+	unsigned long long maxBytes_ = 0;
+	std::map<std::string, Entry> entries_;
+	Statistics statistics_;
+};
+
+}
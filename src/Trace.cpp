@@ -0,0 +1,150 @@
+/**
+ * @file Trace.cpp
+ * @brief 1回のフィルタ実行の各段階の時間を記録し、Chrome のトレース形式で書き出す
+ */
+#include "pch.h"
+
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+namespace ComfyUIPlugin {
+
+Trace::Scope::Scope(Trace& trace, const char* name, const char* category)
+	: trace_(trace.Enabled() ? &trace : nullptr), name_(name), category_(category) {
+	if (trace_) start_ = Clock::now();
+}
+
+Trace::Scope::~Scope() {
+	if (trace_) trace_->AddSpan(name_, category_, start_, Clock::now(), args_);
+}
+
+void Trace::Scope::Arg(const char* key, long long value) {
+	if (!trace_) return;
+	args_ += (args_.empty() ? "\"" : ",\"") + Escape(key) + "\":" + std::to_string(value);
+}
+
+void Trace::Scope::Arg(const char* key, const std::string& value) {
+	if (!trace_) return;
+	args_ += (args_.empty() ? "\"" : ",\"") + Escape(key) + "\":\"" + Escape(value) + "\"";
+}
+
+void Trace::Begin() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	spans_.clear();
+	tags_.clear();
+	rows_.clear();
+	origin_ = Clock::now();
+	originEpochMilliseconds_ = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	// 最初の行は Begin を呼んだスレッド（ホストのスレッド）
+	rows_.push_back({ std::this_thread::get_id(), "host", false });
+	enabled_.store(true, std::memory_order_relaxed);
+}
+
+void Trace::SetTag(const std::string& key, const std::string& value) {
+	if (!Enabled()) return;
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto& tag : tags_) {
+		if (tag.first == key) { tag.second = value; return; }
+	}
+	tags_.emplace_back(key, value);
+}
+
+void Trace::AddSpan(const std::string& name, const char* category, Clock::time_point start, Clock::time_point end, const std::string& args, const std::string& thread) {
+	if (!Enabled()) return;
+	std::lock_guard<std::mutex> lock(mutex_);
+	const long long startUs = Microseconds(start);
+	spans_.push_back({ name, category, startUs, std::max(Microseconds(end) - startUs, 0LL), ThreadIndex(thread), args });
+}
+
+void Trace::AddAsyncSpan(const std::string& name, const char* category, Clock::time_point start, Clock::time_point end, const std::string& args) {
+	if (!Enabled()) return;
+	std::lock_guard<std::mutex> lock(mutex_);
+	const long long startUs = Microseconds(start);
+	spans_.push_back({ name, category, startUs, std::max(Microseconds(end) - startUs, 0LL), -1, args });
+}
+
+Trace::Clock::time_point Trace::FromEpochMilliseconds(long long milliseconds) const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return origin_ + std::chrono::milliseconds(milliseconds - originEpochMilliseconds_);
+}
+
+int Trace::ThreadIndex(const std::string& thread) {
+	const auto id = std::this_thread::get_id();
+	for (size_t i = 0; i < rows_.size(); ++i) {
+		if (thread.empty() ? !rows_[i].named && rows_[i].id == id : rows_[i].named && rows_[i].name == thread) return static_cast<int>(i);
+	}
+	if (thread.empty()) rows_.push_back({ id, "worker " + std::to_string(rows_.size()), false });
+	else rows_.push_back({ std::thread::id{}, thread, true });
+	return static_cast<int>(rows_.size() - 1);
+}
+
+long long Trace::Microseconds(Clock::time_point time) const {
+	return std::chrono::duration_cast<std::chrono::microseconds>(time - origin_).count();
+}
+
+size_t Trace::SpanCount() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return spans_.size();
+}
+
+std::string Trace::Escape(const std::string& text) {
+	std::string escaped;
+	escaped.reserve(text.size());
+	for (const char c : text) {
+		switch (c) {
+		case '"': escaped += "\\\""; break;
+		case '\\': escaped += "\\\\"; break;
+		case '\n': escaped += "\\n"; break;
+		case '\r': escaped += "\\r"; break;
+		case '\t': escaped += "\\t"; break;
+		default:
+			if (static_cast<unsigned char>(c) < 0x20) {
+				char code[8];
+				std::snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned>(c));
+				escaped += code;
+			} else {
+				escaped += c;
+			}
+		}
+	}
+	return escaped;
+}
+
+bool Trace::Export(const std::string& path) const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file) return false;
+	file << "{\"displayTimeUnit\":\"ms\",\"otherData\":{";
+	for (size_t i = 0; i < tags_.size(); ++i) file << (i ? "," : "") << '"' << Escape(tags_[i].first) << "\":\"" << Escape(tags_[i].second) << '"';
+	file << "},\n\"traceEvents\":[\n";
+	// プロセス名にタグを並べ、ビューアの左端で何の実行か分かるようにする
+	std::string processName = "ComfyUIPlugin";
+	for (const auto& tag : tags_) processName += " " + tag.second;
+	file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"" << Escape(processName) << "\"}}";
+	for (size_t i = 0; i < rows_.size(); ++i) {
+		file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << (i + 1) << ",\"args\":{\"name\":\"" << Escape(rows_[i].name) << "\"}}";
+		file << ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":" << (i + 1) << ",\"args\":{\"sort_index\":" << i << "}}";
+	}
+	int asyncId = 0;
+	for (const auto& span : spans_) {
+		const std::string name = Escape(span.name);
+		if (span.thread < 0) {
+			// 非同期のスパンは開始と終了の組にする（id 毎に別のトラック）
+			++asyncId;
+			file << ",\n{\"name\":\"" << name << "\",\"cat\":\"" << span.category << "\",\"ph\":\"b\",\"id\":" << asyncId << ",\"ts\":" << span.start
+				<< ",\"pid\":1,\"tid\":1,\"args\":{" << span.args << "}}";
+			file << ",\n{\"name\":\"" << name << "\",\"cat\":\"" << span.category << "\",\"ph\":\"e\",\"id\":" << asyncId << ",\"ts\":" << (span.start + span.duration)
+				<< ",\"pid\":1,\"tid\":1}";
+			continue;
+		}
+		file << ",\n{\"name\":\"" << name << "\",\"cat\":\"" << span.category << "\",\"ph\":\"X\",\"ts\":" << span.start << ",\"dur\":" << span.duration
+			<< ",\"pid\":1,\"tid\":" << (span.thread + 1) << ",\"args\":{" << span.args << "}}";
+	}
+	file << "\n]}\n";
+	return static_cast<bool>(file);
+}
+
+}
@@ -0,0 +1,102 @@
+/**
+ * @file Trace.h
+ * @brief 1回のフィルタ実行の各段階（取得・エンコード・アップロード・キュー待ち・生成・ポーリング・ダウンロード・デコード・書き戻し）の時間を記録し、
+ *        Chrome のトレース形式（chrome://tracing や Perfetto で開ける JSON）で書き出す
+ *
+ * 段階は Scope をスタックに置くだけで、抜けた時に開始と終了の時刻（steady_clock）がスパンとして残る。
+ * ワーカースレッドからも記録でき、スレッド毎に別の行として表示される。
+ * 記録を始めていない Trace（先行アップロードなど）では何もしない。
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ComfyUIPlugin {
+
+class Trace {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	/// 段階の開始から終了までを記録する
+	class Scope {
+	public:
+		Scope(Trace& trace, const char* name, const char* category = "stage");
+		~Scope();
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+		/// スパンに付ける値（トレースビューアの Args に表示される）
+		void Arg(const char* key, long long value);
+		void Arg(const char* key, const std::string& value);
+
+	private:
+		Trace* trace_;
+		const char* name_;
+		const char* category_;
+		Clock::time_point start_;
+		std::string args_;
+	};
+
+	/// 記録を始める（前の記録は消す）
+	void Begin();
+	bool Enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+	/// @brief トレース全体に付ける値（テンプレート名・画像サイズ・サーバーなど）
+	/// @note 値は UTF-8 で渡す
+	void SetTag(const std::string& key, const std::string& value);
+
+	/// @brief スパンを追加する
+	/// @param thread 表示する行（空なら呼び出したスレッド）。サーバー側の処理など、このプロセス外の段階に使う
+	void AddSpan(const std::string& name, const char* category, Clock::time_point start, Clock::time_point end, const std::string& args = "", const std::string& thread = "");
+
+	/// @brief 他のスパンと重なってもよいスパンを追加する（並行してキューで待つプロンプトなど。ビューアでは別のトラックに並ぶ）
+	void AddAsyncSpan(const std::string& name, const char* category, Clock::time_point start, Clock::time_point end, const std::string& args = "");
+
+	/// @brief サーバーの時計（エポックからのミリ秒）を、このトレースの時刻に変換する
+	/// @note サーバーと時計がずれていれば、その分ずれる
+	Clock::time_point FromEpochMilliseconds(long long milliseconds) const;
+
+	/// @brief Chrome のトレース形式で書き出す
+	/// @return 書き出せなかった場合はfalse
+	bool Export(const std::string& path) const;
+
+	size_t SpanCount() const;
+
+	/// JSON の文字列として書けるようにエスケープする
+	static std::string Escape(const std::string& text);
+
+private:
+	struct Span {
+		std::string name;
+		const char* category;
+		long long start;	///< Begin からのマイクロ秒
+		long long duration;
+		int thread;		///< 行の番号。非同期のスパンは -1
+		std::string args;
+	};
+
+	/// 行の番号（呼び出したスレッド、または名前の付いた行）
+	int ThreadIndex(const std::string& thread);
+	long long Microseconds(Clock::time_point time) const;
+
+	std::atomic<bool> enabled_{ false };
+	Clock::time_point origin_{};
+	long long originEpochMilliseconds_ = 0;
+	mutable std::mutex mutex_;
+	std::vector<Span> spans_;
+	std::vector<std::pair<std::string, std::string>> tags_;
+	/// トレースビューアの行（スレッド、または名前で指定した行）
+	struct Row {
+		std::thread::id id;
+		std::string name;
+		bool named;
+	};
+	std::vector<Row> rows_;
+};
+
+}